@@ -0,0 +1,157 @@
+#include "admission.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "util.h"
+
+namespace microshell {
+namespace core {
+
+using namespace std;
+
+const uint64_t AdmissionControl::SAMPLE_INTERVAL_NS;
+
+namespace {
+
+// How long a deferred job waits, at most, unless told otherwise.
+const uint64_t DEFAULT_MAX_DEFERRAL_NS = 60 * 1000 * 1000 * 1000ULL;
+// Memory stalls a tenth of the time mean heavy reclaim (or swapping).
+const double DEFAULT_MEMORY_THRESHOLD = 10;
+// How many decisions the log keeps.
+const size_t MAX_DECISIONS = 32;
+
+// Reads the start of the (small) file at `path' into `buffer'.
+bool read_small_file(const char *path, char *buffer, size_t size) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if(-1 == fd) {
+    return false;
+  }
+  ssize_t length = read(fd, buffer, size - 1);
+  close(fd);
+  if(length <= 0) {
+    return false;
+  }
+  buffer[length] = '\0';
+  return true;
+}
+
+// Reads `some avg10' from the PSI file of `resource', or returns -1.
+double read_psi(const char *resource) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/pressure/%s", resource);
+  char buffer[256];
+  if(!read_small_file(path, buffer, sizeof(buffer))) {
+    return -1;
+  }
+  const char *average = strstr(buffer, "some avg10=");
+  return nullptr == average ? -1 : strtod(average + 11, nullptr);
+}
+
+// Estimates CPU pressure from the 1-minute load average, or returns -1.
+double estimate_cpu_pressure() {
+  char buffer[128];
+  if(!read_small_file("/proc/loadavg", buffer, sizeof(buffer))) {
+    return -1;
+  }
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  double load = strtod(buffer, nullptr) / (cpus > 0 ? cpus : 1);
+  return load <= 1 ? 0 : load >= 2 ? 100 : (load - 1) * 100;
+}
+
+// Checks `value' against `threshold', and describes it in `reason' if it's
+// over.
+bool is_over(const char *name, double value, double threshold,
+             string *reason) {
+  if(threshold <= 0 || value < threshold) {
+    return false;
+  }
+  char buffer[96];
+  snprintf(buffer, sizeof(buffer), "%s %.1f%% >= %g%%", name, value,
+           threshold);
+  *reason = buffer;
+  return true;
+}
+
+}  // namespace
+
+AdmissionControl::AdmissionControl()
+  : pressure { false, -1, -1, -1 },
+    sampled_ns(0),
+    counts { 0, 0, 0 } {
+  reset();
+}
+
+void AdmissionControl::reset() {
+  thresholds = Thresholds { 0, DEFAULT_MEMORY_THRESHOLD, 0 };
+  max_deferral_ns = DEFAULT_MAX_DEFERRAL_NS;
+}
+
+AdmissionControl::Thresholds& AdmissionControl::get_thresholds() {
+  return thresholds;
+}
+
+uint64_t AdmissionControl::get_max_deferral_ns() const {
+  return max_deferral_ns;
+}
+
+void AdmissionControl::set_max_deferral_ns(uint64_t max_deferral_ns) {
+  this->max_deferral_ns = max_deferral_ns;
+}
+
+bool AdmissionControl::admit(string *reason) {
+  if(thresholds.cpu <= 0 && thresholds.memory <= 0 && thresholds.io <= 0) {
+    return true;
+  }
+  const Pressure& current = sample();
+  return !is_over("memory", current.memory, thresholds.memory, reason)
+      && !is_over("io", current.io, thresholds.io, reason)
+      && !is_over("cpu", current.cpu, thresholds.cpu, reason);
+}
+
+const Pressure& AdmissionControl::sample() {
+  uint64_t now = util::monotonic_ns();
+  if(0 != sampled_ns && now - sampled_ns < SAMPLE_INTERVAL_NS) {
+    return pressure;
+  }
+  sampled_ns = now;
+
+  pressure.cpu = read_psi("cpu");
+  pressure.from_psi = pressure.cpu >= 0;
+  if(pressure.from_psi) {
+    pressure.memory = read_psi("memory");
+    pressure.io = read_psi("io");
+  }
+  else {
+    pressure.cpu = estimate_cpu_pressure();
+  }
+  return pressure;
+}
+
+void AdmissionControl::record(const string& job, Decision::Outcome outcome,
+                              const string& reason) {
+  ++counts[static_cast<int>(outcome)];
+  if(decisions.size() >= MAX_DECISIONS) {
+    decisions.pop_front();
+  }
+  decisions.push_back(Decision { util::monotonic_ns(), job, outcome,
+                                 reason });
+}
+
+const deque<AdmissionControl::Decision>&
+AdmissionControl::get_decisions() const {
+  return decisions;
+}
+
+uint64_t AdmissionControl::get_count(Decision::Outcome outcome) const {
+  return counts[static_cast<int>(outcome)];
+}
+
+}  // namespace core
+}  // namespace microshell
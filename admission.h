@@ -0,0 +1,98 @@
+#ifndef MICROSHELL_CORE_ADMISSION_H
+#define MICROSHELL_CORE_ADMISSION_H
+
+#include <cstdint>
+#include <deque>
+#include <string>
+
+namespace microshell {
+namespace core {
+
+// How loaded the host is, in percent: the share of the last ten seconds in
+// which some task was stalled waiting for the resource (PSI `some avg10').
+struct Pressure {
+  // Whether the readings come from /proc/pressure.  Without PSI, CPU
+  // pressure is estimated from /proc/loadavg, as the share of the
+  // runnable tasks over the number of CPUs (e.g. a load of 1.5 per CPU is
+  // 50%), and memory and I/O pressure are unknown (-1).
+  bool from_psi;
+  double cpu;
+  double memory;
+  double io;
+};
+
+// Decides whether new background jobs and parallel (e.g. `dag') jobs may
+// start, so that a script can't push a shared host into swap or thrashing
+// by starting work regardless of how loaded it is.  The readings are
+// refreshed at most every `SAMPLE_INTERVAL_NS'.
+//
+// Callers which are refused defer the job (see `Shell::defer_background_job')
+// or run fewer at a time, and ask again later.  Every decision is kept in a
+// short log, for the `admit' builtin.
+class AdmissionControl {
+public:
+  static const uint64_t SAMPLE_INTERVAL_NS = 250 * 1000 * 1000ULL;
+
+  // Pressure (in percent) at or above which jobs are held back.  0 turns a
+  // check off.
+  struct Thresholds {
+    double cpu;
+    double memory;
+    double io;
+  };
+
+  struct Decision {
+    enum class Outcome {
+      ADMITTED,
+      DEFERRED,
+      // Started although over a threshold, after waiting for too long.
+      FORCED
+    };
+
+    uint64_t time_ns;
+    std::string job;
+    Outcome outcome;
+    // The exceeded threshold, e.g. `memory 31.5% >= 10%'.
+    std::string reason;
+  };
+
+  AdmissionControl();
+
+  // Restores the default settings, under which only memory pressure is
+  // checked.
+  void reset();
+
+  Thresholds& get_thresholds();
+  // How long a job may be deferred before it is started anyway.
+  uint64_t get_max_deferral_ns() const;
+  void set_max_deferral_ns(uint64_t max_deferral_ns);
+
+  // Whether a job may start now.  If not, `reason' says why.
+  bool admit(std::string *reason);
+
+  // The latest readings (refreshed if they're older than the interval).
+  const Pressure& sample();
+
+  // Logs a decision about `job'.
+  void record(const std::string& job, Decision::Outcome outcome,
+              const std::string& reason);
+  // Oldest first.
+  const std::deque<Decision>& get_decisions() const;
+  uint64_t get_count(Decision::Outcome outcome) const;
+
+private:
+  Thresholds thresholds;
+  uint64_t max_deferral_ns;
+
+  Pressure pressure;
+  // When `pressure' was read, or 0.
+  uint64_t sampled_ns;
+
+  std::deque<Decision> decisions;
+  uint64_t counts[3];
+};
+
+}  // namespace core
+}  // namespace microshell
+
+#endif  // MICROSHELL_CORE_ADMISSION_H
@@ -0,0 +1,94 @@
+#include "allocation_counter.h"
+
+#include <cstdlib>
+#include <new>
+
+namespace microshell {
+namespace core {
+
+namespace {
+
+// Plain data, so that it's usable before any constructor runs (static
+// initializers allocate too).
+thread_local AllocationCounts counts = { 0, 0, 0 };
+
+}  // namespace
+
+bool is_counting_allocations() {
+#ifdef USH_ALLOCATION_COUNTING
+  return true;
+#else
+  return false;
+#endif
+}
+
+AllocationCounts get_allocation_counts() {
+  return counts;
+}
+
+#ifdef USH_ALLOCATION_COUNTING
+
+namespace {
+
+void* counted_allocate(std::size_t size) {
+  ++counts.allocations;
+  counts.bytes += size;
+  return std::malloc(0 == size ? 1 : size);
+}
+
+void counted_free(void *pointer) {
+  if(nullptr != pointer) {
+    ++counts.deallocations;
+    std::free(pointer);
+  }
+}
+
+}  // namespace
+
+#endif  // USH_ALLOCATION_COUNTING
+
+}  // namespace core
+}  // namespace microshell
+
+#ifdef USH_ALLOCATION_COUNTING
+
+using microshell::core::counted_allocate;
+using microshell::core::counted_free;
+
+void* operator new(std::size_t size) {
+  void *pointer = counted_allocate(size);
+  if(nullptr == pointer) {
+    throw std::bad_alloc();
+  }
+  return pointer;
+}
+
+void* operator new[](std::size_t size) {
+  return operator new(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+  return counted_allocate(size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+  return counted_allocate(size);
+}
+
+void operator delete(void *pointer) noexcept {
+  counted_free(pointer);
+}
+
+void operator delete[](void *pointer) noexcept {
+  counted_free(pointer);
+}
+
+void operator delete(void *pointer, const std::nothrow_t&) noexcept {
+  counted_free(pointer);
+}
+
+void operator delete[](void *pointer, const std::nothrow_t&) noexcept {
+  counted_free(pointer);
+}
+
+#endif  // USH_ALLOCATION_COUNTING
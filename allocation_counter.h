@@ -0,0 +1,29 @@
+#ifndef MICROSHELL_CORE_ALLOCATION_COUNTER_H
+#define MICROSHELL_CORE_ALLOCATION_COUNTER_H
+
+#include <cstdint>
+
+namespace microshell {
+namespace core {
+
+// What a thread has allocated through `operator new' since it started.
+struct AllocationCounts {
+  uint64_t allocations;
+  uint64_t deallocations;
+  uint64_t bytes;
+};
+
+// Counting is opt-in: builds with `USH_ALLOCATION_COUNTING' defined (see
+// `make alloc-shell') replace the global `operator new' and `operator
+// delete' with versions that count, per thread, before going to `malloc'.
+// Other builds count nothing.
+bool is_counting_allocations();
+
+// The calling thread's counts.  Meant to be sampled before and after a piece
+// of work; other threads (e.g. the prompt's) don't disturb the difference.
+AllocationCounts get_allocation_counts();
+
+}  // namespace core
+}  // namespace microshell
+
+#endif  // MICROSHELL_CORE_ALLOCATION_COUNTER_H
@@ -0,0 +1,733 @@
+#include "arithmetic.h"
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+
+#include "shell.h"
+
+namespace microshell {
+namespace core {
+
+using namespace std;
+
+namespace {
+
+// How many distinct expressions `parse_cached' keeps around.
+const size_t CACHE_CAPACITY = 256;
+
+// How deeply variables whose values are expressions themselves may nest.
+const int MAX_EVALUATION_DEPTH = 64;
+
+// How deeply an expression may nest (parentheses, unary operators, operands
+// of right-hand sides...), like in bash.
+const int MAX_NESTING_DEPTH = 1024;
+
+bool is_name_start(char c) {
+  return isalpha(static_cast<unsigned char>(c)) || '_' == c;
+}
+
+bool is_name_char(char c) {
+  return isalnum(static_cast<unsigned char>(c)) || '_' == c;
+}
+
+// Value of `c' as a digit in bases up to 64: 0-9, a-z, A-Z, `@', `_'.  Up to
+// base 36, letters are case-insensitive.
+int digit_value(char c, int base) {
+  if(isdigit(static_cast<unsigned char>(c))) {
+    return c - '0';
+  }
+  if(c >= 'a' && c <= 'z') {
+    return c - 'a' + 10;
+  }
+  if(c >= 'A' && c <= 'Z') {
+    return base <= 36 ? c - 'A' + 10 : c - 'A' + 36;
+  }
+  if('@' == c) {
+    return 62;
+  }
+  if('_' == c) {
+    return 63;
+  }
+  return 64;
+}
+
+bool parse_digits(const string& text, size_t start, int base,
+                  int64_t *value) {
+  if(start >= text.length()) {
+    return false;
+  }
+  uint64_t result = 0;
+  for(size_t i = start; i < text.length(); ++i) {
+    int digit = digit_value(text[i], base);
+    if(digit >= base) {
+      return false;
+    }
+    result = result * base + digit;
+  }
+  *value = static_cast<int64_t>(result);
+  return true;
+}
+
+// The operators are matched longest-first.
+const char *OPERATORS[] = {
+  "<<=", ">>=", "**", "++", "--", "<<", ">>", "<=", ">=", "==", "!=", "&&",
+  "||", "+=", "-=", "*=", "/=", "%=", "&=", "^=", "|=", "+", "-", "*", "/",
+  "%", "<", ">", "&", "^", "|", "!", "~", "=", "?", ":", ",", "(", ")"
+};
+
+}  // namespace
+
+class ArithmeticExpression::Parser {
+public:
+  Parser(const string& text, ArithmeticExpression *expression)
+    : text(text), pos(0), depth(0), expression(expression) { }
+
+  bool parse(string *error) {
+    if(!tokenize()) {
+      *error = this->error;
+      return false;
+    }
+
+    int root;
+    if(!parse_comma(&root)) {
+      *error = this->error;
+      return false;
+    }
+    if(index < tokens.size()) {
+      *error = "syntax error in expression (error token is `"
+               + tokens[index].text + "')";
+      return false;
+    }
+    expression->root = root;
+    return true;
+  }
+
+private:
+  struct Token {
+    enum class Type { NUMBER, NAME, OPERATOR } type;
+    string text;
+    int64_t value;
+  };
+
+  bool tokenize() {
+    while(pos < text.length()) {
+      char c = text[pos];
+      if(isspace(static_cast<unsigned char>(c))) {
+        ++pos;
+        continue;
+      }
+
+      if(isdigit(static_cast<unsigned char>(c))) {
+        size_t start = pos;
+        while(pos < text.length()
+              && (is_name_char(text[pos]) || '#' == text[pos]
+                  || '@' == text[pos])) {
+          ++pos;
+        }
+        string literal = text.substr(start, pos - start);
+        int64_t value;
+        if(!ArithmeticExpression::parse_number(literal, &value)) {
+          error = "value too great for base (error token is `" + literal
+                  + "')";
+          return false;
+        }
+        tokens.push_back(Token { Token::Type::NUMBER, literal, value });
+        continue;
+      }
+
+      if(is_name_start(c)) {
+        size_t start = pos;
+        while(pos < text.length() && is_name_char(text[pos])) {
+          ++pos;
+        }
+        tokens.push_back(Token { Token::Type::NAME,
+                                 text.substr(start, pos - start), 0 });
+        continue;
+      }
+
+      bool matched = false;
+      for(const char *op : OPERATORS) {
+        size_t length = strlen(op);
+        if(0 == text.compare(pos, length, op)) {
+          tokens.push_back(Token { Token::Type::OPERATOR, op, 0 });
+          pos += length;
+          matched = true;
+          break;
+        }
+      }
+      if(!matched) {
+        error = "syntax error: invalid arithmetic operator (error token is `"
+                + text.substr(pos) + "')";
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool at_operator(const char *op) const {
+    return index < tokens.size()
+        && Token::Type::OPERATOR == tokens[index].type
+        && tokens[index].text == op;
+  }
+
+  bool fail_expected_operand() {
+    if(index < tokens.size()) {
+      error = "syntax error: operand expected (error token is `"
+              + tokens[index].text + "')";
+    }
+    else {
+      error = "syntax error: operand expected";
+    }
+    return false;
+  }
+
+  int add(Node::Kind kind, Op op = Op::NONE, int left = -1, int right = -1,
+          int third = -1) {
+    expression->nodes.push_back(Node { kind, op, 0, "", left, right, third });
+    return static_cast<int>(expression->nodes.size() - 1);
+  }
+
+  // Runs `parse' one level deeper, failing past `MAX_NESTING_DEPTH' rather
+  // than recursing until the stack runs out.
+  template<class Parse>
+  bool nested(Parse parse) {
+    if(depth >= MAX_NESTING_DEPTH) {
+      error = "expression nested too deeply";
+      return false;
+    }
+    ++depth;
+    bool parsed = parse();
+    --depth;
+    return parsed;
+  }
+
+  bool parse_comma(int *node) {
+    if(!parse_assignment(node)) {
+      return false;
+    }
+    while(at_operator(",")) {
+      ++index;
+      int right;
+      if(!parse_assignment(&right)) {
+        return false;
+      }
+      *node = add(Node::Kind::COMMA, Op::NONE, *node, right);
+    }
+    return true;
+  }
+
+  // Whether `op' is an assignment operator.  If so, `arithmetic' is set to
+  // the operator it combines with (`NONE' for plain `=').
+  static bool is_assignment(const string& op, Op *arithmetic) {
+    static const map<string, Op> ops = {
+      { "=", Op::NONE }, { "+=", Op::ADD }, { "-=", Op::SUBTRACT },
+      { "*=", Op::MULTIPLY }, { "/=", Op::DIVIDE }, { "%=", Op::MODULO },
+      { "<<=", Op::SHIFT_LEFT }, { ">>=", Op::SHIFT_RIGHT },
+      { "&=", Op::BIT_AND }, { "^=", Op::BIT_XOR }, { "|=", Op::BIT_OR }
+    };
+    auto it = ops.find(op);
+    if(ops.end() == it) {
+      return false;
+    }
+    *arithmetic = it->second;
+    return true;
+  }
+
+  bool parse_assignment(int *node) {
+    if(index + 1 < tokens.size()
+       && Token::Type::NAME == tokens[index].type
+       && Token::Type::OPERATOR == tokens[index + 1].type) {
+      Op op;
+      if(is_assignment(tokens[index + 1].text, &op)) {
+        string name = tokens[index].text;
+        index += 2;
+        int value;
+        if(!nested([&] { return parse_assignment(&value); })) {
+          return false;
+        }
+        *node = add(Node::Kind::ASSIGN, op, value);
+        expression->nodes[*node].name = name;
+        return true;
+      }
+    }
+    return parse_conditional(node);
+  }
+
+  bool parse_conditional(int *node) {
+    if(!parse_binary(1, node)) {
+      return false;
+    }
+    if(!at_operator("?")) {
+      return true;
+    }
+    ++index;
+
+    int if_true, if_false;
+    if(!nested([&] { return parse_comma(&if_true); })) {
+      return false;
+    }
+    if(!at_operator(":")) {
+      error = "syntax error: `:' expected for conditional expression";
+      return false;
+    }
+    ++index;
+    if(!nested([&] { return parse_conditional(&if_false); })) {
+      return false;
+    }
+    *node = add(Node::Kind::CONDITIONAL, Op::NONE, *node, if_true, if_false);
+    return true;
+  }
+
+  // Returns the precedence of the binary operator at the current position,
+  // or 0 if there is none.
+  int binary_precedence(Op *op) const {
+    static const map<string, pair<Op, int>> ops = {
+      { "||", { Op::LOGICAL_OR, 1 } }, { "&&", { Op::LOGICAL_AND, 2 } },
+      { "|", { Op::BIT_OR, 3 } }, { "^", { Op::BIT_XOR, 4 } },
+      { "&", { Op::BIT_AND, 5 } },
+      { "==", { Op::EQUAL, 6 } }, { "!=", { Op::NOT_EQUAL, 6 } },
+      { "<", { Op::LESS, 7 } }, { "<=", { Op::LESS_EQUAL, 7 } },
+      { ">", { Op::GREATER, 7 } }, { ">=", { Op::GREATER_EQUAL, 7 } },
+      { "<<", { Op::SHIFT_LEFT, 8 } }, { ">>", { Op::SHIFT_RIGHT, 8 } },
+      { "+", { Op::ADD, 9 } }, { "-", { Op::SUBTRACT, 9 } },
+      { "*", { Op::MULTIPLY, 10 } }, { "/", { Op::DIVIDE, 10 } },
+      { "%", { Op::MODULO, 10 } }, { "**", { Op::POWER, 11 } }
+    };
+    if(index >= tokens.size()
+       || Token::Type::OPERATOR != tokens[index].type) {
+      return 0;
+    }
+    auto it = ops.find(tokens[index].text);
+    if(ops.end() == it) {
+      return 0;
+    }
+    *op = it->second.first;
+    return it->second.second;
+  }
+
+  // Precedence climbing over the binary operators.  `**' is the only
+  // right-associative one.
+  bool parse_binary(int min_precedence, int *node) {
+    if(!parse_unary(node)) {
+      return false;
+    }
+
+    Op op;
+    int precedence;
+    while((precedence = binary_precedence(&op)) >= min_precedence
+          && precedence > 0) {
+      ++index;
+      int right;
+      int next_min = Op::POWER == op ? precedence : precedence + 1;
+      if(!nested([&] { return parse_binary(next_min, &right); })) {
+        return false;
+      }
+      *node = add(Node::Kind::BINARY, op, *node, right);
+    }
+    return true;
+  }
+
+  bool parse_unary(int *node) {
+    static const map<string, Op> ops = {
+      { "+", Op::PLUS }, { "-", Op::NEGATE }, { "!", Op::LOGICAL_NOT },
+      { "~", Op::BIT_NOT }
+    };
+
+    if(at_operator("++") || at_operator("--")) {
+      bool increment = at_operator("++");
+      ++index;
+      if(index >= tokens.size() || Token::Type::NAME != tokens[index].type) {
+        error = "syntax error: variable expected after `"
+                + string(increment ? "++" : "--") + "'";
+        return false;
+      }
+      *node = add(increment ? Node::Kind::PRE_INCREMENT
+                            : Node::Kind::PRE_DECREMENT);
+      expression->nodes[*node].name = tokens[index++].text;
+      return true;
+    }
+
+    if(index < tokens.size() && Token::Type::OPERATOR == tokens[index].type) {
+      auto it = ops.find(tokens[index].text);
+      if(ops.end() != it) {
+        ++index;
+        int operand;
+        if(!nested([&] { return parse_unary(&operand); })) {
+          return false;
+        }
+        *node = add(Node::Kind::UNARY, it->second, operand);
+        return true;
+      }
+    }
+
+    return parse_postfix(node);
+  }
+
+  bool parse_postfix(int *node) {
+    if(index >= tokens.size()) {
+      return fail_expected_operand();
+    }
+
+    const Token& token = tokens[index];
+    if(Token::Type::NUMBER == token.type) {
+      ++index;
+      *node = add(Node::Kind::NUMBER);
+      expression->nodes[*node].value = token.value;
+      return true;
+    }
+
+    if(Token::Type::NAME == token.type) {
+      ++index;
+      Node::Kind kind = Node::Kind::VARIABLE;
+      if(at_operator("++")) {
+        kind = Node::Kind::POST_INCREMENT;
+        ++index;
+      }
+      else if(at_operator("--")) {
+        kind = Node::Kind::POST_DECREMENT;
+        ++index;
+      }
+      *node = add(kind);
+      expression->nodes[*node].name = token.text;
+      return true;
+    }
+
+    if(at_operator("(")) {
+      ++index;
+      if(!nested([&] { return parse_comma(node); })) {
+        return false;
+      }
+      if(!at_operator(")")) {
+        error = "syntax error: missing `)'";
+        return false;
+      }
+      ++index;
+      return true;
+    }
+
+    return fail_expected_operand();
+  }
+
+  const string& text;
+  size_t pos;
+  vector<Token> tokens;
+  size_t index = 0;
+  int depth;
+  string error;
+  ArithmeticExpression *expression;
+};
+
+class ArithmeticExpression::Evaluator {
+public:
+  Evaluator(const ArithmeticExpression& expression, Shell *shell, int depth)
+    : expression(expression), shell(shell), depth(depth) { }
+
+  bool evaluate(int index, int64_t *result) {
+    const Node& node = expression.nodes[index];
+    switch(node.kind) {
+      case Node::Kind::NUMBER:
+        *result = node.value;
+        return true;
+
+      case Node::Kind::VARIABLE:
+        return read_variable(node.name, result);
+
+      case Node::Kind::UNARY: {
+        int64_t operand;
+        if(!evaluate(node.left, &operand)) {
+          return false;
+        }
+        switch(node.op) {
+          case Op::NEGATE:
+            *result = static_cast<int64_t>(0 - static_cast<uint64_t>(operand));
+            break;
+          case Op::LOGICAL_NOT: *result = !operand; break;
+          case Op::BIT_NOT:     *result = ~operand; break;
+          default:              *result = operand; break;
+        }
+        return true;
+      }
+
+      case Node::Kind::BINARY:
+      case Node::Kind::COMMA:
+        return evaluate_chain(index, result);
+
+      case Node::Kind::CONDITIONAL: {
+        int64_t condition;
+        if(!evaluate(node.left, &condition)) {
+          return false;
+        }
+        return evaluate(condition ? node.right : node.third, result);
+      }
+
+      case Node::Kind::ASSIGN: {
+        int64_t value;
+        if(!evaluate(node.left, &value)) {
+          return false;
+        }
+        if(Op::NONE != node.op) {
+          int64_t current;
+          if(!read_variable(node.name, &current)
+             || !apply(node.op, current, value, &value)) {
+            return false;
+          }
+        }
+        shell->set_variable(node.name, to_string(value));
+        *result = value;
+        return true;
+      }
+
+      case Node::Kind::PRE_INCREMENT:
+      case Node::Kind::PRE_DECREMENT:
+      case Node::Kind::POST_INCREMENT:
+      case Node::Kind::POST_DECREMENT: {
+        int64_t current;
+        if(!read_variable(node.name, &current)) {
+          return false;
+        }
+        bool increment = Node::Kind::PRE_INCREMENT == node.kind
+                         || Node::Kind::POST_INCREMENT == node.kind;
+        uint64_t delta = increment ? 1 : static_cast<uint64_t>(-1);
+        int64_t updated =
+          static_cast<int64_t>(static_cast<uint64_t>(current) + delta);
+        shell->set_variable(node.name, to_string(updated));
+        bool is_pre = Node::Kind::PRE_INCREMENT == node.kind
+                      || Node::Kind::PRE_DECREMENT == node.kind;
+        *result = is_pre ? updated : current;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  string error;
+
+private:
+  // Evaluates a chain of left-associative operators (e.g. `1 + 2 + 3',
+  // which nests to the left) from the bottom up, so that long chains don't
+  // take as many levels of recursion.
+  bool evaluate_chain(int index, int64_t *result) {
+    size_t base = chain.size();
+    while(Node::Kind::BINARY == expression.nodes[index].kind
+          || Node::Kind::COMMA == expression.nodes[index].kind) {
+      chain.push_back(index);
+      index = expression.nodes[index].left;
+    }
+    bool ok = evaluate(index, result);
+    while(ok && chain.size() > base) {
+      const Node& node = expression.nodes[chain.back()];
+      chain.pop_back();
+      ok = apply_right(node, result);
+    }
+    chain.resize(base);
+    return ok;
+  }
+
+  // Combines `*value', the value of the left operand of `node', with its
+  // right one.
+  bool apply_right(const Node& node, int64_t *value) {
+    if(Node::Kind::COMMA == node.kind) {
+      return evaluate(node.right, value);
+    }
+    // `&&' and `||' short-circuit.
+    int64_t left = *value;
+    if(Op::LOGICAL_AND == node.op && !left) {
+      *value = 0;
+      return true;
+    }
+    if(Op::LOGICAL_OR == node.op && left) {
+      *value = 1;
+      return true;
+    }
+    int64_t right;
+    if(!evaluate(node.right, &right)) {
+      return false;
+    }
+    return apply(node.op, left, right, value);
+  }
+
+  // Variables may hold numbers or, like in bash, whole expressions.
+  bool read_variable(const string& name, int64_t *value) {
+    string text = shell->get_variable(name);
+    size_t start = text.find_first_not_of(" \t\n");
+    if(string::npos == start) {
+      *value = 0;
+      return true;
+    }
+    text = text.substr(start, text.find_last_not_of(" \t\n") - start + 1);
+
+    bool negative = '-' == text[0];
+    if(ArithmeticExpression::parse_number(negative ? text.substr(1) : text,
+                                          value)) {
+      if(negative) {
+        *value = static_cast<int64_t>(0 - static_cast<uint64_t>(*value));
+      }
+      return true;
+    }
+
+    if(depth >= MAX_EVALUATION_DEPTH) {
+      error = name + ": expression recursion level exceeded";
+      return false;
+    }
+    shared_ptr<const ArithmeticExpression> nested =
+      ArithmeticExpression::parse_cached(text, &error);
+    if(!nested) {
+      return false;
+    }
+    Evaluator evaluator(*nested, shell, depth + 1);
+    if(!evaluator.evaluate(nested->root, value)) {
+      error = evaluator.error;
+      return false;
+    }
+    return true;
+  }
+
+  bool apply(Op op, int64_t left, int64_t right, int64_t *result) {
+    uint64_t ul = static_cast<uint64_t>(left);
+    uint64_t ur = static_cast<uint64_t>(right);
+    switch(op) {
+      case Op::LOGICAL_OR:    *result = left || right; break;
+      case Op::LOGICAL_AND:   *result = left && right; break;
+      case Op::BIT_OR:        *result = left | right; break;
+      case Op::BIT_XOR:       *result = left ^ right; break;
+      case Op::BIT_AND:       *result = left & right; break;
+      case Op::EQUAL:         *result = left == right; break;
+      case Op::NOT_EQUAL:     *result = left != right; break;
+      case Op::LESS:          *result = left < right; break;
+      case Op::LESS_EQUAL:    *result = left <= right; break;
+      case Op::GREATER:       *result = left > right; break;
+      case Op::GREATER_EQUAL: *result = left >= right; break;
+      case Op::SHIFT_LEFT:
+        *result = static_cast<int64_t>(ul << (ur & 63));
+        break;
+      case Op::SHIFT_RIGHT:   *result = left >> (ur & 63); break;
+      // Two's complement wrap-around instead of undefined behavior.
+      case Op::ADD:      *result = static_cast<int64_t>(ul + ur); break;
+      case Op::SUBTRACT: *result = static_cast<int64_t>(ul - ur); break;
+      case Op::MULTIPLY: *result = static_cast<int64_t>(ul * ur); break;
+      case Op::DIVIDE:
+      case Op::MODULO:
+        if(0 == right) {
+          error = "division by 0";
+          return false;
+        }
+        if(-1 == right) {
+          // Avoids trapping on INT64_MIN / -1.
+          *result = Op::DIVIDE == op
+                    ? static_cast<int64_t>(0 - ul) : 0;
+        }
+        else {
+          *result = Op::DIVIDE == op ? left / right : left % right;
+        }
+        break;
+      case Op::POWER: {
+        if(right < 0) {
+          error = "exponent less than 0";
+          return false;
+        }
+        uint64_t power = 1;
+        uint64_t base = ul;
+        for(uint64_t exponent = ur; exponent > 0; exponent >>= 1) {
+          if(exponent & 1) {
+            power *= base;
+          }
+          base *= base;
+        }
+        *result = static_cast<int64_t>(power);
+        break;
+      }
+      default:
+        error = "invalid operator";
+        return false;
+    }
+    return true;
+  }
+
+  const ArithmeticExpression& expression;
+  Shell *shell;
+  int depth;
+  // The operators `evaluate_chain' still has to apply, innermost last.
+  vector<int> chain;
+};
+
+shared_ptr<const ArithmeticExpression> ArithmeticExpression::parse(
+    const string& text, string *error) {
+  shared_ptr<ArithmeticExpression> expression =
+    make_shared<ArithmeticExpression>();
+  // An empty expression evaluates to 0.
+  if(string::npos == text.find_first_not_of(" \t\n")) {
+    expression->nodes.push_back(Node { Node::Kind::NUMBER, Op::NONE, 0, "",
+                                       -1, -1, -1 });
+    expression->root = 0;
+    return expression;
+  }
+
+  Parser parser(text, expression.get());
+  if(!parser.parse(error)) {
+    return nullptr;
+  }
+  return expression;
+}
+
+shared_ptr<const ArithmeticExpression> ArithmeticExpression::parse_cached(
+    const string& text, string *error) {
+  static map<string, shared_ptr<const ArithmeticExpression>> cache;
+
+  auto it = cache.find(text);
+  if(cache.end() != it) {
+    return it->second;
+  }
+
+  shared_ptr<const ArithmeticExpression> expression = parse(text, error);
+  if(expression) {
+    // Crude, but the working set of a script is usually tiny.
+    if(cache.size() >= CACHE_CAPACITY) {
+      cache.clear();
+    }
+    cache[text] = expression;
+  }
+  return expression;
+}
+
+bool ArithmeticExpression::evaluate(Shell *shell, int64_t *result,
+                                    string *error) const {
+  Evaluator evaluator(*this, shell, 0);
+  if(!evaluator.evaluate(root, result)) {
+    *error = evaluator.error;
+    return false;
+  }
+  return true;
+}
+
+bool ArithmeticExpression::parse_number(const string& text, int64_t *value) {
+  if(text.empty() || !isdigit(static_cast<unsigned char>(text[0]))) {
+    return false;
+  }
+
+  size_t hash = text.find('#');
+  if(string::npos != hash) {
+    int64_t base;
+    if(!parse_digits(text.substr(0, hash), 0, 10, &base)
+       || base < 2 || base > 64) {
+      return false;
+    }
+    return parse_digits(text, hash + 1, static_cast<int>(base), value);
+  }
+
+  if(text.length() > 1 && '0' == text[0]) {
+    if('x' == text[1] || 'X' == text[1]) {
+      return parse_digits(text, 2, 16, value);
+    }
+    return parse_digits(text, 1, 8, value);
+  }
+  return parse_digits(text, 0, 10, value);
+}
+
+}  // namespace core
+}  // namespace microshell
@@ -0,0 +1,79 @@
+#ifndef MICROSHELL_CORE_ARITHMETIC_H
+#define MICROSHELL_CORE_ARITHMETIC_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace microshell {
+namespace core {
+
+class Shell;
+
+// A parsed arithmetic expression, as used by `$(( ))' and `let'.  Supports
+// 64-bit integers written in decimal, octal (`017'), hex (`0x1f') or any
+// base up to 64 (`2#101'), shell variables, and the C operators: unary
+// `+ - ! ~', pre/post `++ --', `**', `* / %', `+ -', `<< >>', comparisons,
+// `& ^ |', `&& ||', `?:', assignments (`=', `+=', ...) and `,'.
+//
+// An expression is parsed once and then evaluated any number of times, so
+// arithmetic in a loop body costs no parsing after the first iteration.
+class ArithmeticExpression {
+public:
+  // Returns null and fills in `error' on syntax errors.
+  static std::shared_ptr<const ArithmeticExpression> parse(
+    const std::string& text, std::string *error);
+
+  // Same as `parse', but goes through a bounded cache keyed by `text'.  Meant
+  // for expressions only known at run time (e.g. `let' arguments).
+  static std::shared_ptr<const ArithmeticExpression> parse_cached(
+    const std::string& text, std::string *error);
+
+  // Evaluates the expression, reading and assigning variables through
+  // `shell'.  Returns false and fills in `error' on failure (e.g. division
+  // by zero).
+  bool evaluate(Shell *shell, int64_t *result, std::string *error) const;
+
+  // Parses `text' as an integer literal in any of the supported notations.
+  static bool parse_number(const std::string& text, int64_t *value);
+
+private:
+  enum class Op : uint8_t {
+    NONE,
+    // Binary arithmetic, in increasing order of precedence.
+    LOGICAL_OR, LOGICAL_AND, BIT_OR, BIT_XOR, BIT_AND,
+    EQUAL, NOT_EQUAL, LESS, LESS_EQUAL, GREATER, GREATER_EQUAL,
+    SHIFT_LEFT, SHIFT_RIGHT, ADD, SUBTRACT, MULTIPLY, DIVIDE, MODULO, POWER,
+    // Unary.
+    PLUS, NEGATE, LOGICAL_NOT, BIT_NOT
+  };
+
+  struct Node {
+    enum class Kind : uint8_t {
+      NUMBER, VARIABLE, UNARY, BINARY, CONDITIONAL, ASSIGN,
+      PRE_INCREMENT, PRE_DECREMENT, POST_INCREMENT, POST_DECREMENT, COMMA
+    };
+
+    Kind kind;
+    // The operator of UNARY and BINARY nodes, and of compound assignments.
+    Op op;
+    int64_t value;
+    std::string name;
+    // Operand node indices (-1 if unused).
+    int left;
+    int right;
+    int third;
+  };
+
+  class Parser;
+  class Evaluator;
+
+  std::vector<Node> nodes;
+  int root;
+};
+
+}  // namespace core
+}  // namespace microshell
+
+#endif  // MICROSHELL_CORE_ARITHMETIC_H
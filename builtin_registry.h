@@ -28,6 +28,12 @@ public:
     return builtins.end() != builtins.find(builtin_name);
   }
 
+  // Returns the factory registered under `builtin_name', or null.
+  shared_ptr<BuiltinFactory> get_factory(const string& builtin_name) {
+    auto it = builtins.find(builtin_name);
+    return builtins.end() == it ? nullptr : it->second;
+  }
+
   shared_ptr<BuiltinCommand> build(const vector<string>& argv) {
     return builtins[argv[0]]->build(argv);
   }
@@ -0,0 +1,159 @@
+#ifndef MICROSHELL_CORE_BYTECODE_H
+#define MICROSHELL_CORE_BYTECODE_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace microshell {
+namespace core {
+
+class ArithmeticExpression;
+class BuiltinFactory;
+struct Program;
+struct Word;
+
+// A piece of a word, as written in the source, with quotes already removed.
+struct WordPart {
+  enum class Kind : uint8_t {
+    // Text which is used as-is.
+    LITERAL,
+    // `$name', `${name}' or a special parameter such as `$?' or `$1'.
+    VARIABLE,
+    // A leading unquoted `~', i.e. the user's home directory.
+    TILDE,
+    // `$(( expression ))'.
+    ARITHMETIC,
+    // `<(list)': the path of a pipe from which the output of `list', run
+    // alongside the command, can be read.
+    PROCESS_INPUT,
+    // `>(list)': the path of a pipe into `list''s standard input.
+    PROCESS_OUTPUT
+  };
+
+  Kind kind;
+  std::string text;
+
+  // For ARITHMETIC parts: the expression, parsed at compile time, unless it
+  // contains expansions itself (e.g. `$(( $x + 1 ))').  Then `inner' holds
+  // the lexed expression text, which is expanded and parsed (through a
+  // cache) at run time.
+  std::shared_ptr<const ArithmeticExpression> expression;
+  std::shared_ptr<const Word> inner;
+
+  // For PROCESS_INPUT and PROCESS_OUTPUT parts: the list, compiled.  `text'
+  // holds its source.
+  std::shared_ptr<const Program> program;
+};
+
+// A single word of a command.  Words without any expansions are constant:
+// they are resolved once, at compile time, and `literal' holds their final
+// value, so running them again (e.g. in a loop) costs nothing.
+struct Word {
+  std::vector<WordPart> parts;
+
+  // No expansions at all.  `literal' is only valid for constant words.
+  bool is_constant = true;
+  std::string literal;
+
+  // Constant and not quoted in any way.  Reserved words (`if', `done', etc.)
+  // are only recognized in plain words.
+  bool is_plain = true;
+
+  // How many characters at the start of the word were neither quoted nor
+  // escaped.  Used to recognize assignments (`NAME=value').
+  size_t unquoted_prefix = 0;
+
+  // Whether the word is exactly `$@' or `"$@"', which expands to one field
+  // per positional parameter.
+  bool is_all_positionals = false;
+};
+
+// Where a command's standard input comes from.
+struct Redirection {
+  enum class Kind : uint8_t {
+    // `<<DELIMITER' (or `<<-'): `word' is the body.
+    HERE_DOCUMENT,
+    // `<<< word': the word plus a newline.
+    HERE_STRING
+  };
+
+  Kind kind;
+  Word word;
+};
+
+// A simple command: optional variable assignments followed by words, and
+// any redirections among them.
+struct SimpleCommandCode {
+  std::vector<std::pair<std::string, Word>> assignments;
+  std::vector<Word> words;
+  std::vector<Redirection> redirections;
+
+  // Cached builtin and binary lookups for commands whose name is constant,
+  // so that hot loops don't go through the builtin registry or search PATH
+  // every time.  Only valid while `resolved_generation' matches the shell's
+  // resolution generation.
+  mutable uint64_t resolved_generation = 0;
+  mutable std::shared_ptr<BuiltinFactory> builtin;
+  mutable std::string binary_path;
+};
+
+// Bump whenever the structures in this file (or their meaning) change, so
+// that compiled scripts cached on disk (see `ScriptCache') are recompiled.
+const uint32_t BYTECODE_FORMAT_VERSION = 2;
+
+enum class OpCode : uint8_t {
+  // Run simple command `commands[a]' and set `$?'.
+  RUN,
+  // Unconditionally continue at `a'.
+  JUMP,
+  // Continue at `a' if `$?' is nonzero.
+  JUMP_IF_FALSE,
+  // Continue at `a' if `$?' is zero.
+  JUMP_IF_TRUE,
+  // Logically negate `$?' (`! cmd').
+  NOT,
+  // Set `$?' to `a'.
+  SET_STATUS,
+  // Expand `word_lists[a]' (or the positional parameters if `a' is -1) and
+  // push the result as a new innermost `for' loop.
+  FOR_BEGIN,
+  // Assign the next value of the innermost `for' loop to the variable
+  // `names[a]'.  If there are no values left, pop the loop and continue at
+  // `b'.
+  FOR_NEXT,
+  // Pop the innermost `for' loop (used by `break' and `continue').
+  FOR_POP,
+  // Define function `names[a]' with the body `functions[b]'.
+  DEFINE_FUNCTION,
+  // Run `jobs[b]' in the background, as a new job described by `names[a]'.
+  BACKGROUND,
+  // Stop executing the current program.  If `a' is not -1, `$?' is set to
+  // the numeric value of `word_lists[a][0]' first.
+  LEAVE
+};
+
+struct Instruction {
+  OpCode op;
+  int32_t a;
+  int32_t b;
+};
+
+// The compiled form of a piece of shell code: a flat instruction stream plus
+// the tables its operands index into.
+struct Program {
+  std::vector<Instruction> code;
+  std::vector<SimpleCommandCode> commands;
+  std::vector<std::vector<Word>> word_lists;
+  std::vector<std::string> names;
+  std::vector<std::shared_ptr<const Program>> functions;
+  // The bodies of `&' jobs.
+  std::vector<std::shared_ptr<const Program>> jobs;
+};
+
+}  // namespace core
+}  // namespace microshell
+
+#endif  // MICROSHELL_CORE_BYTECODE_H
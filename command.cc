@@ -2,6 +2,7 @@
 #include <memory>
 #include <vector>
 
+#include <cerrno>
 #include <cstring>
 
 #include <signal.h>
@@ -9,8 +10,11 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "allocation_counter.h"
+#include "arithmetic.h"
 #include "builtin_registry.h"
 #include "command.h"
+#include "compiler.h"
 #include "shell.h"
 #include "util.h"
 
@@ -36,8 +40,25 @@ int DiskCommand::invoke(Shell *shell) {
   shell->out("Invoking program [" + argv[0] + "] with args [" +
               comma_args + "]");
   //signal(SIGCHLD, handle_sigchld);
+  // Pick the policy in the parent, so that round-robin spreading advances
+  // from one job to the next.
+  SpawnPolicy policy = has_spawn_policy ? spawn_policy.next()
+                                        : shell->get_spawn_policy().next();
+  // Only rebuilt if an exported variable changed since the last spawn.
+  Environment& environment = shell->get_environment();
+  Stats& stats = shell->get_stats();
+  uint64_t rebuilds = environment.get_rebuild_count();
+  char **envp = environment.get_envp();
+  stats.environment_rebuilds += environment.get_rebuild_count() - rebuilds;
+
+  ++stats.externals;
+  uint64_t fork_start = util::monotonic_ns();
   pid_t child_pid = fork();
+  if(0 != child_pid) {
+    stats.fork_time.record(util::monotonic_ns() - fork_start);
+  }
   if(-1 == child_pid) {
+    ++stats.spawn_failures;
     // TODO(andrei) Shell::perror().
     shell->eout("Could not crete a child to run the command. "
                 "OS says [" + string(strerror(errno)) + "]. errno = " +
@@ -45,7 +66,7 @@ int DiskCommand::invoke(Shell *shell) {
     return -1;
   }
   else if(0 == child_pid) {
-    this->handle_child(shell);
+    this->handle_child(shell, policy, envp);
     // No return, the child will just 'exec' or 'exit' (on error).
   }
 
@@ -54,15 +75,46 @@ int DiskCommand::invoke(Shell *shell) {
 
 int DiskCommand::handle_parent(Shell *shell, pid_t child_pid) {
   shell->out("Spawned child. Waiting for child to terminate.");
-  return shell->wait_child(child_pid);
+  return shell->wait_child(child_pid,
+                           util::merge_with(argv.begin(), argv.end(), " "));
+}
+
+void DiskCommand::set_spawn_policy(const SpawnPolicy& policy) {
+  spawn_policy = policy;
+  has_spawn_policy = true;
+}
+
+void DiskCommand::exec(Shell *shell) {
+  SpawnPolicy policy = has_spawn_policy ? spawn_policy.next()
+                                        : shell->get_spawn_policy().next();
+  this->handle_child(shell, policy, shell->get_environment().get_envp());
+}
+
+void DiskCommand::redirect(int fd, int source) {
+  redirections.push_back(make_pair(fd, source));
 }
 
-void DiskCommand::handle_child(Shell *shell) {
+void DiskCommand::handle_child(Shell *shell, const SpawnPolicy& policy,
+                               char **envp) {
+  for(const auto& redirection : redirections) {
+    if(-1 == dup2(redirection.second, redirection.first)) {
+      shell->eout("Failed to redirect file descriptor "
+                  + to_string(redirection.first) + ". OS says ["
+                  + string(strerror(errno)) + "].");
+      exit(-1);
+    }
+  }
+
+  string policy_error;
+  if(!policy.apply(&policy_error)) {
+    shell->eout("Failed to apply spawn policy: " + policy_error);
+    shell->eout("Terminating child.");
+    exit(-1);
+  }
+
   char **argv = util::get_raw_array(this->argv);
-  // TODO(andrei) Pass environment to child, while ensuring no shenanigans can
-  // take place (no Shellshock risk).
-  char **parent_env = nullptr; //environ;
-  execve(argv[0], argv, parent_env);
+  // The shell's exported variables, not `environ' (see `Environment').
+  execve(argv[0], argv, envp);
   // Note: 'execve' doesn't return if it's successful.
   shell->eout("Failed to 'execve'. OS says [" + string(strerror(errno))
                + "]. errno = " + to_string(errno));
@@ -70,6 +122,10 @@ void DiskCommand::handle_child(Shell *shell) {
   exit(-1);
 }
 
+int AsyncBuiltinCommand::invoke(Shell *shell) {
+  return shell->get_event_loop().run(this);
+}
+
 int ExitBuiltin::invoke(Shell *shell) {
   shell->out("Bye!");
   shell->exit();
@@ -85,27 +141,345 @@ REGISTER_BUILTIN(PwdBuiltin, pwd);
 
 int CdBuiltin::invoke(Shell *shell) {
   if(argv.size() > 1) {
-    string dir = argv[1];
-    // TODO(andrei) Centralized code to resolve path.
-    // Example: shell->resolve(path)
-    // Figures out if path is relative or absolute, resolves ~, .. etc.
-    string full_path = util::merge_paths(shell->get_working_directory(), dir);
-    if(util::is_directory(full_path)) {
-      shell->set_working_directory(full_path);
-      return 1;
+    const string& dir = argv[1];
+    if(util::is_directory_at(shell->get_working_directory_fd(), dir)
+       && shell->set_working_directory(dir)) {
+      return 0;
     }
     else {
       shell->eout("cd: no such directory: " + dir);
-      return 0;
+      return 1;
     }
   }
 
-  // TODO(andrei) Proper tilde expansion and home folder lookup.
-  shell->set_working_directory("~");
-  return 1;
+  return shell->set_working_directory(shell->get_home_directory()) ? 0 : 1;
 }
 REGISTER_BUILTIN(CdBuiltin, cd);
 
+int ExportBuiltin::invoke(Shell *shell) {
+  bool unexport = argv.size() > 1 && "-n" == argv[1];
+  size_t first = unexport ? 2 : 1;
+
+  if(first >= argv.size()) {
+    for(const auto& variable : shell->get_environment().get_variables()) {
+      shell->out("export " + variable.first + "=\"" + variable.second + "\"");
+    }
+    return 0;
+  }
+
+  int status = 0;
+  for(size_t i = first; i < argv.size(); ++i) {
+    const string& arg = argv[i];
+    size_t equals = arg.find('=');
+    string name = arg.substr(0, equals);
+    if(!Compiler::is_valid_name(name)) {
+      shell->eout("export: `" + arg + "': not a valid identifier");
+      status = 1;
+      continue;
+    }
+
+    if(string::npos != equals) {
+      shell->set_variable(name, arg.substr(equals + 1));
+    }
+    if(unexport) {
+      shell->unexport_variable(name);
+    }
+    else {
+      shell->export_variable(name);
+    }
+  }
+  return status;
+}
+REGISTER_BUILTIN(ExportBuiltin, export);
+
+int UnsetBuiltin::invoke(Shell *shell) {
+  for(size_t i = 1; i < argv.size(); ++i) {
+    shell->unset_variable(argv[i]);
+  }
+  return 0;
+}
+REGISTER_BUILTIN(UnsetBuiltin, unset);
+
+int StatsBuiltin::invoke(Shell *shell) {
+  Stats& stats = shell->get_stats();
+  bool json = false;
+  for(size_t i = 1; i < argv.size(); ++i) {
+    const string& arg = argv[i];
+    if("-j" == arg) {
+      json = true;
+    }
+    else if("-r" == arg) {
+      stats.reset();
+      return 0;
+    }
+    else if("-e" == arg && i + 1 < argv.size()) {
+      const string& format = argv[++i];
+      if("text" != format && "json" != format && "off" != format) {
+        shell->eout("stats: unknown format: " + format);
+        return 1;
+      }
+      shell->set_stats_at_exit("off" == format ? "" : format);
+      return 0;
+    }
+    else {
+      shell->eout("stats: usage: stats [-j] [-r] [-e text|json|off]");
+      return 1;
+    }
+  }
+
+  shell->out(json ? stats.to_json() : stats.to_text());
+  return 0;
+}
+REGISTER_BUILTIN(StatsBuiltin, stats);
+
+int HashBuiltin::invoke(Shell *shell) {
+  CommandCache& cache = shell->get_command_cache();
+  if(argv.size() > 1) {
+    if("-r" != argv[1]) {
+      shell->eout("hash: usage: hash [-r]");
+      return 1;
+    }
+    cache.clear();
+    shell->invalidate_resolutions();
+    return 0;
+  }
+
+  uint64_t lookups = cache.get_hits() + cache.get_misses();
+  uint64_t hit_rate = 0 == lookups ? 0 : 100 * cache.get_hits() / lookups;
+  shell->out("command cache: " + to_string(cache.size()) + "/"
+             + to_string(cache.get_capacity()) + " entries, "
+             + to_string(cache.get_hits()) + " hits, "
+             + to_string(cache.get_misses()) + " misses ("
+             + to_string(hit_rate) + "% hit rate)");
+  return 0;
+}
+REGISTER_BUILTIN(HashBuiltin, hash);
+
+namespace {
+
+string describe_allocations(const AllocationCounts& counts) {
+  return to_string(counts.allocations) + " allocations, "
+    + to_string(counts.deallocations) + " frees, "
+    + to_string(counts.bytes) + " bytes";
+}
+
+}  // namespace
+
+int AllocBuiltin::invoke(Shell *shell) {
+  if(!is_counting_allocations()) {
+    shell->eout("alloc: not counting; build with `make alloc-shell'");
+    return 1;
+  }
+  if(1 == argv.size()) {
+    shell->out("alloc: " + describe_allocations(get_allocation_counts()));
+    return 0;
+  }
+
+  bool parse_only = "-p" == argv[1];
+  vector<string> command_argv(argv.begin() + (parse_only ? 2 : 1),
+                              argv.end());
+  if(command_argv.empty()) {
+    shell->eout("alloc: usage: alloc [[-p] COMMAND...]");
+    return 1;
+  }
+
+  // Everything from here to the second sample is measured, so the text to
+  // compile is put together up front.
+  string text = parse_only ? util::merge_with(command_argv.begin(),
+                                              command_argv.end(), " ")
+                           : "";
+  int status = 0;
+  AllocationCounts before = get_allocation_counts();
+  if(parse_only) {
+    shared_ptr<Program> program;
+    string error;
+    if(Compiler::Result::OK != Compiler::compile(text, &program, &error)) {
+      status = 1;
+    }
+  }
+  else {
+    shared_ptr<Command> command;
+    string error;
+    if(shell->build_command(command_argv, command, &error)) {
+      status = command->invoke(shell);
+    }
+    else {
+      shell->eout("alloc: " + error);
+      status = 127;
+    }
+  }
+  AllocationCounts after = get_allocation_counts();
+
+  AllocationCounts used = {
+    after.allocations - before.allocations,
+    after.deallocations - before.deallocations,
+    after.bytes - before.bytes
+  };
+  shell->out("alloc: " + describe_allocations(used));
+  return status;
+}
+REGISTER_BUILTIN(AllocBuiltin, alloc);
+
+int LetBuiltin::invoke(Shell *shell) {
+  if(argv.size() < 2) {
+    shell->eout("let: expression expected");
+    return 1;
+  }
+
+  int64_t value = 0;
+  for(size_t i = 1; i < argv.size(); ++i) {
+    string error;
+    shared_ptr<const ArithmeticExpression> expression =
+      ArithmeticExpression::parse_cached(argv[i], &error);
+    if(!expression || !expression->evaluate(shell, &value, &error)) {
+      shell->eout("let: " + argv[i] + ": " + error);
+      return 1;
+    }
+  }
+  return 0 != value ? 0 : 1;
+}
+REGISTER_BUILTIN(LetBuiltin, let);
+
+namespace {
+
+bool is_blank(char c) {
+  return ' ' == c || '\t' == c;
+}
+
+// Assigns the fields of `line' to `names' (see `ReadBuiltin').  Characters
+// flagged in `literal' (if given) were escaped, and never separate fields.
+void assign_fields(Shell *shell, const vector<string>& names,
+                   const char *line, size_t length,
+                   const vector<bool> *literal) {
+  auto blank = [&](size_t i) {
+    return is_blank(line[i]) && (nullptr == literal || !(*literal)[i]);
+  };
+
+  size_t position = 0;
+  for(size_t i = 0; i < names.size(); ++i) {
+    while(position < length && blank(position)) {
+      ++position;
+    }
+    size_t end = position;
+    if(i + 1 < names.size()) {
+      while(end < length && !blank(end)) {
+        ++end;
+      }
+    }
+    else {
+      end = length;
+      while(end > position && blank(end - 1)) {
+        --end;
+      }
+    }
+    shell->set_variable(names[i], line + position, end - position);
+    position = end;
+  }
+}
+
+}  // namespace
+
+bool ReadBuiltin::parse(Shell *shell, int *status) {
+  size_t first = 1;
+  for(; first < argv.size() && '-' == argv[first][0]; ++first) {
+    if("--" == argv[first]) {
+      ++first;
+      break;
+    }
+    if("-r" != argv[first]) {
+      shell->eout("read: usage: read [-r] [NAME...]");
+      *status = 2;
+      return false;
+    }
+    raw = true;
+  }
+  names.assign(argv.begin() + first, argv.end());
+  for(const string& name : names) {
+    if(!Compiler::is_valid_name(name)) {
+      shell->eout("read: `" + name + "': not a valid identifier");
+      *status = 1;
+      return false;
+    }
+  }
+  // Without names, the line is stored as is.
+  split = !names.empty();
+  if(!split) {
+    names.push_back("REPLY");
+  }
+  return true;
+}
+
+EventLoop::Await ReadBuiltin::resume(Shell *shell, short) {
+  if(!parsed) {
+    int status;
+    if(!parse(shell, &status)) {
+      return EventLoop::Await::finish(status);
+    }
+    parsed = true;
+  }
+
+  InputBuffer& input = shell->get_input_buffer();
+  const char *line;
+  size_t length;
+  while(true) {
+    if(!input.read_line(STDIN_FILENO, &line, &length, &complete, false)) {
+      if(EAGAIN == errno) {
+        // Nothing is lost: the next call picks up from here.
+        return EventLoop::Await::readable(STDIN_FILENO);
+      }
+      if(escaped) {
+        // The line ended in a backslash, and then the input did.
+        break;
+      }
+      if(0 != errno) {
+        shell->eout("read: " + string(strerror(errno)));
+      }
+      assign_fields(shell, names, "", 0, nullptr);
+      return EventLoop::Await::finish(1);
+    }
+
+    // Most lines have nothing to unescape, and go straight from the buffer
+    // into the variables.
+    if(!escaped && (raw || nullptr == memchr(line, '\\', length))) {
+      if(split) {
+        assign_fields(shell, names, line, length, nullptr);
+      }
+      else {
+        shell->set_variable(names[0], line, length);
+      }
+      return EventLoop::Await::finish(complete ? 0 : 1);
+    }
+
+    escaped = true;
+    bool joined = false;
+    for(size_t i = 0; i < length; ++i) {
+      if('\\' != line[i]) {
+        text.push_back(line[i]);
+        literal.push_back(false);
+      }
+      else if(i + 1 < length) {
+        text.push_back(line[++i]);
+        literal.push_back(true);
+      }
+      else {
+        // A trailing backslash joins the next line.
+        joined = complete;
+      }
+    }
+    if(!joined) {
+      break;
+    }
+  }
+  if(split) {
+    assign_fields(shell, names, text.data(), text.size(), &literal);
+  }
+  else {
+    shell->set_variable(names[0], text);
+  }
+  return EventLoop::Await::finish(complete ? 0 : 1);
+}
+REGISTER_BUILTIN(ReadBuiltin, read);
+
 BuiltinRegistry* BuiltinRegistry::_instance = nullptr;
 
 }  // namespace core
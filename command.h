@@ -5,11 +5,14 @@
 #include <map>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <sys/types.h>
 
 #include "builtin_factory.h"
+#include "event_loop.h"
+#include "spawn_policy.h"
 
 namespace microshell {
 namespace core {
@@ -57,9 +60,26 @@ public:
   DiskCommand(const DiskCommand* other) : DiskCommand(*other) { };
   int invoke(Shell *shell);
 
+  // Overrides the shell-wide spawn policy for this command only (e.g. when
+  // it is run through the `sched' prefix builtin).
+  void set_spawn_policy(const SpawnPolicy& policy);
+
+  // Makes `fd' in the child a copy of `source' (which the caller keeps
+  // ownership of).  Applied in the order given, right before `exec'.
+  void redirect(int fd, int source);
+
+  // Replaces the current process with the command, without forking (e.g.
+  // in a background job which has nothing else to do).  Only returns--with
+  // the process terminated--on error.
+  void exec(Shell *shell);
+
 private:
   int handle_parent(Shell *shell, pid_t child_pid);
-  void handle_child(Shell *shell);
+  void handle_child(Shell *shell, const SpawnPolicy& policy, char **envp);
+
+  SpawnPolicy spawn_policy;
+  bool has_spawn_policy = false;
+  vector<pair<int, int>> redirections;
 };
 
 class BuiltinCommand : public SimpleCommand {
@@ -68,6 +88,18 @@ public:
   virtual string get_name() const = 0;
 };
 
+// A builtin which may have to wait--for input, a child or some time to
+// pass--without holding up the rest of the shell.  Rather than `invoke()',
+// it implements `resume()', running as a task on the shell's event loop
+// (see `EventLoop'), which runs other tasks whenever it waits.
+class AsyncBuiltinCommand : public BuiltinCommand, public EventLoop::Task {
+public:
+  using BuiltinCommand::BuiltinCommand;
+
+  // Runs the builtin until it's done.
+  int invoke(Shell *shell) override;
+};
+
 DECLARE_BUILTIN(Exit);
 
 class PwdBuiltin : public BuiltinCommand {
@@ -86,6 +118,94 @@ class CdBuiltin : public BuiltinCommand {
     string get_name() const { return "cd"; }
 };
 
+// Marks variables (optionally assigning them first) to be passed on to
+// children, or, with `-n', stops passing them on.  Lists the environment if
+// called without arguments.
+class ExportBuiltin : public BuiltinCommand {
+  public:
+    using BuiltinCommand::BuiltinCommand;
+    ExportBuiltin(const ExportBuiltin* other) : ExportBuiltin(*other) { };
+    int invoke(Shell *shell);
+    string get_name() const { return "export"; }
+};
+
+class UnsetBuiltin : public BuiltinCommand {
+  public:
+    using BuiltinCommand::BuiltinCommand;
+    UnsetBuiltin(const UnsetBuiltin* other) : UnsetBuiltin(*other) { };
+    int invoke(Shell *shell);
+    string get_name() const { return "unset"; }
+};
+
+// Prints the shell's hot-path counters and latency histograms as text or,
+// with `-j', as JSON.  `-r' resets them; `-e FORMAT' dumps them to standard
+// error when the shell terminates.
+class StatsBuiltin : public BuiltinCommand {
+  public:
+    using BuiltinCommand::BuiltinCommand;
+    StatsBuiltin(const StatsBuiltin* other) : StatsBuiltin(*other) { };
+    int invoke(Shell *shell);
+    string get_name() const { return "stats"; }
+};
+
+// Reports what the shell allocates (see `allocation_counter.h'): while
+// building and running the given command, while compiling the text given
+// with `-p', or, without arguments, in total.
+class AllocBuiltin : public BuiltinCommand {
+  public:
+    using BuiltinCommand::BuiltinCommand;
+    AllocBuiltin(const AllocBuiltin* other) : AllocBuiltin(*other) { };
+    int invoke(Shell *shell);
+    string get_name() const { return "alloc"; }
+};
+
+// Reports on (or, with `-r', clears) the shell's cache of compiled commands
+// and resolved command names.
+class HashBuiltin : public BuiltinCommand {
+  public:
+    using BuiltinCommand::BuiltinCommand;
+    HashBuiltin(const HashBuiltin* other) : HashBuiltin(*other) { };
+    int invoke(Shell *shell);
+    string get_name() const { return "hash"; }
+};
+
+// Evaluates every argument as an arithmetic expression (see
+// `ArithmeticExpression').  Succeeds if the last one is nonzero.
+class LetBuiltin : public BuiltinCommand {
+  public:
+    using BuiltinCommand::BuiltinCommand;
+    LetBuiltin(const LetBuiltin* other) : LetBuiltin(*other) { };
+    int invoke(Shell *shell);
+    string get_name() const { return "let"; }
+};
+
+// Reads a line from standard input and splits it into fields, one per NAME
+// (the last one taking the rest of the line), or stores it in `REPLY'.
+// Backslashes escape the next character, and join lines, unless `-r' is
+// given.  Fails at the end of input.  Reads ahead through the shell's
+// `InputBuffer', and waits for input on the event loop.
+class ReadBuiltin : public AsyncBuiltinCommand {
+  public:
+    using AsyncBuiltinCommand::AsyncBuiltinCommand;
+    ReadBuiltin(const ReadBuiltin* other) : ReadBuiltin(*other) { };
+    EventLoop::Await resume(Shell *shell, short revents) override;
+    string get_name() const { return "read"; }
+
+  private:
+    // Parses the arguments.  Returns false (with `status' set) on error.
+    bool parse(Shell *shell, int *status);
+
+    bool parsed = false;
+    bool raw = false;
+    bool split = false;
+    vector<string> names;
+    // The line so far, unescaped, if it had backslashes.
+    bool escaped = false;
+    string text;
+    vector<bool> literal;
+    bool complete = false;
+};
+
 }  // namespace core
 }  // namespace microshell
 
@@ -0,0 +1,83 @@
+#include "command_cache.h"
+
+#include <memory>
+#include <string>
+
+namespace microshell {
+namespace core {
+
+using namespace std;
+
+CommandCache::CommandCache(size_t capacity)
+  : capacity(capacity), hits(0), misses(0) { }
+
+shared_ptr<const Program> CommandCache::find(const string& text) {
+  auto it = index.find(text);
+  if(index.end() == it) {
+    ++misses;
+    return nullptr;
+  }
+
+  ++hits;
+  entries.splice(entries.begin(), entries, it->second);
+  return it->second->second;
+}
+
+void CommandCache::insert(const string& text,
+                          shared_ptr<const Program> program) {
+  if(0 == capacity) {
+    return;
+  }
+
+  auto it = index.find(text);
+  if(index.end() != it) {
+    it->second->second = program;
+    entries.splice(entries.begin(), entries, it->second);
+    return;
+  }
+
+  if(entries.size() >= capacity) {
+    index.erase(entries.back().first);
+    entries.pop_back();
+  }
+  entries.emplace_front(text, program);
+  index[text] = entries.begin();
+}
+
+void CommandCache::clear() {
+  entries.clear();
+  index.clear();
+}
+
+size_t CommandCache::size() const {
+  return entries.size();
+}
+
+size_t CommandCache::get_capacity() const {
+  return capacity;
+}
+
+uint64_t CommandCache::get_hits() const {
+  return hits;
+}
+
+uint64_t CommandCache::get_misses() const {
+  return misses;
+}
+
+string CommandCache::normalize(const string& text) {
+  const char *blanks = " \t\n";
+  size_t start = text.find_first_not_of(blanks);
+  if(string::npos == start) {
+    return "";
+  }
+  size_t end = text.find_last_not_of(blanks);
+  // An escaped trailing blank is part of the last word.
+  if('\\' == text[end] && end + 1 < text.length()) {
+    ++end;
+  }
+  return text.substr(start, end - start + 1);
+}
+
+}  // namespace core
+}  // namespace microshell
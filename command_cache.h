@@ -0,0 +1,60 @@
+#ifndef MICROSHELL_CORE_COMMAND_CACHE_H
+#define MICROSHELL_CORE_COMMAND_CACHE_H
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "bytecode.h"
+
+namespace microshell {
+namespace core {
+
+// A bounded, least-recently-used cache mapping command text to its compiled
+// `Program', so that commands repeated from history (or typed again) skip
+// the front end entirely.
+//
+// Programs don't depend on PATH, the working directory or the registered
+// builtins, so entries never go stale.  What does depend on them--the
+// builtin or binary each command resolves to--is cached inside the program
+// and stamped with the shell's resolution generation (see
+// `Shell::get_resolution_generation()').
+class CommandCache {
+public:
+  CommandCache(size_t capacity);
+
+  // Returns the cached program for `text', or null.  Counts a hit or a miss.
+  std::shared_ptr<const Program> find(const std::string& text);
+
+  void insert(const std::string& text, std::shared_ptr<const Program> program);
+
+  void clear();
+
+  size_t size() const;
+  size_t get_capacity() const;
+  uint64_t get_hits() const;
+  uint64_t get_misses() const;
+
+  // Trims unescaped blanks from both ends of `text'.  Anything else may be
+  // significant (e.g. inside quotes).
+  static std::string normalize(const std::string& text);
+
+private:
+  typedef std::list<std::pair<std::string, std::shared_ptr<const Program>>>
+    EntryList;
+
+  size_t capacity;
+  // Most recently used first.
+  EntryList entries;
+  std::unordered_map<std::string, EntryList::iterator> index;
+  uint64_t hits;
+  uint64_t misses;
+};
+
+}  // namespace core
+}  // namespace microshell
+
+#endif  // MICROSHELL_CORE_COMMAND_CACHE_H
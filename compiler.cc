@@ -0,0 +1,1269 @@
+#include "compiler.h"
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cctype>
+#include <cstdlib>
+
+#include "arithmetic.h"
+
+namespace microshell {
+namespace core {
+
+using namespace std;
+
+namespace {
+
+struct Token {
+  enum class Type {
+    WORD,
+    // `;' or a newline.
+    SEPARATOR,
+    AND_IF,
+    OR_IF,
+    PIPE,
+    AMPERSAND,
+    LEFT_PAREN,
+    RIGHT_PAREN,
+    // `<<' or `<<-' and the delimiter; `word' holds the body.
+    HERE_DOCUMENT,
+    // `<<<'.  The word follows as a token of its own.
+    HERE_STRING,
+    END
+  };
+
+  Type type;
+  Word word;
+  // Where the token is in the source: [start, end).
+  size_t start;
+  size_t end;
+};
+
+bool is_name_start(char c) {
+  return isalpha(static_cast<unsigned char>(c)) || '_' == c;
+}
+
+bool is_name_char(char c) {
+  return isalnum(static_cast<unsigned char>(c)) || '_' == c;
+}
+
+// Characters which end an unquoted word.
+bool is_word_boundary(char c) {
+  return ' ' == c || '\t' == c || '\n' == c || ';' == c || '&' == c
+      || '|' == c || '(' == c || ')' == c || '<' == c || '>' == c;
+}
+
+string describe(const Token& token) {
+  switch(token.type) {
+    case Token::Type::WORD:        return token.word.literal;
+    case Token::Type::SEPARATOR:   return "newline or ;";
+    case Token::Type::AND_IF:      return "&&";
+    case Token::Type::OR_IF:       return "||";
+    case Token::Type::PIPE:        return "|";
+    case Token::Type::AMPERSAND:   return "&";
+    case Token::Type::LEFT_PAREN:  return "(";
+    case Token::Type::RIGHT_PAREN: return ")";
+    case Token::Type::HERE_DOCUMENT: return "<<";
+    case Token::Type::HERE_STRING: return "<<<";
+    case Token::Type::END:         return "end of input";
+  }
+  return "?";
+}
+
+// Splits source code into tokens, removing quotes and recording where
+// expansions happen.
+class Lexer {
+public:
+  Lexer(const string& source) : source(source), pos(0) { }
+
+  Compiler::Result tokenize(vector<Token> *tokens, string *error) {
+    while(true) {
+      skip_blanks();
+      if(pos >= source.length()) {
+        // The line with `<<' has to end before its body can start.
+        if(!pending_bodies.empty()) {
+          return Compiler::Result::INCOMPLETE;
+        }
+        tokens->push_back(Token { Token::Type::END, Word(), pos, pos });
+        return Compiler::Result::OK;
+      }
+
+      char c = source[pos];
+      if('#' == c) {
+        while(pos < source.length() && '\n' != source[pos]) {
+          ++pos;
+        }
+        continue;
+      }
+
+      size_t start = pos;
+      if(('<' == c || '>' == c) && !at_process_substitution()) {
+        Compiler::Result result = lex_redirection(tokens, error);
+        if(Compiler::Result::OK != result) {
+          return result;
+        }
+        continue;
+      }
+
+      Token::Type type;
+      if(lex_operator(&type)) {
+        tokens->push_back(Token { type, Word(), start, pos });
+        // Here-document bodies start on the line after their `<<'.
+        if('\n' == c && !pending_bodies.empty()) {
+          Compiler::Result result = lex_here_document_bodies(tokens, error);
+          if(Compiler::Result::OK != result) {
+            return result;
+          }
+        }
+        continue;
+      }
+
+      Token token { Token::Type::WORD, Word(), start, 0 };
+      Compiler::Result result = lex_word(&token.word, error);
+      if(Compiler::Result::OK != result) {
+        return result;
+      }
+      token.end = pos;
+      tokens->push_back(token);
+    }
+  }
+
+private:
+  // A here-document whose body hasn't been read yet.
+  struct PendingBody {
+    size_t token;
+    string delimiter;
+    // `<<-': leading tabs are stripped from each line.
+    bool strip_tabs;
+    // A quoted delimiter turns off expansions in the body.
+    bool literal;
+  };
+
+  Compiler::Result lex_redirection(vector<Token> *tokens, string *error) {
+    size_t start = pos;
+    if(0 == source.compare(pos, 3, "<<<")) {
+      pos += 3;
+      tokens->push_back(Token { Token::Type::HERE_STRING, Word(), start, pos });
+      return Compiler::Result::OK;
+    }
+    if(0 != source.compare(pos, 2, "<<")) {
+      *error = "redirections are not supported yet";
+      return Compiler::Result::ERROR;
+    }
+
+    pos += 2;
+    bool strip_tabs = pos < source.length() && '-' == source[pos];
+    if(strip_tabs) {
+      ++pos;
+    }
+    skip_blanks();
+    if(pos >= source.length() || is_word_boundary(source[pos])) {
+      if(pos >= source.length()) {
+        return Compiler::Result::INCOMPLETE;
+      }
+      *error = "syntax error: missing here-document delimiter";
+      return Compiler::Result::ERROR;
+    }
+
+    Word delimiter;
+    Compiler::Result result = lex_word(&delimiter, error);
+    if(Compiler::Result::OK != result) {
+      return result;
+    }
+    if(!delimiter.is_constant) {
+      *error = "here-document delimiters can't contain expansions";
+      return Compiler::Result::ERROR;
+    }
+
+    pending_bodies.push_back(PendingBody { tokens->size(), delimiter.literal,
+                                           strip_tabs, !delimiter.is_plain });
+    tokens->push_back(Token { Token::Type::HERE_DOCUMENT, Word(), start,
+                              pos });
+    return Compiler::Result::OK;
+  }
+
+  // Reads the bodies of the pending here-documents, in order, each up to
+  // its delimiter line.
+  Compiler::Result lex_here_document_bodies(vector<Token> *tokens,
+                                            string *error) {
+    for(const PendingBody& pending : pending_bodies) {
+      string body;
+      while(true) {
+        if(pos >= source.length()) {
+          return Compiler::Result::INCOMPLETE;
+        }
+        size_t end = source.find('\n', pos);
+        if(string::npos == end) {
+          end = source.length();
+        }
+        size_t start = pos;
+        if(pending.strip_tabs) {
+          while(start < end && '\t' == source[start]) {
+            ++start;
+          }
+        }
+        string line = source.substr(start, end - start);
+        pos = min(end + 1, source.length());
+        if(line == pending.delimiter) {
+          break;
+        }
+        body += line + "\n";
+      }
+
+      Word& word = (*tokens)[pending.token].word;
+      if(pending.literal) {
+        word.parts.push_back(WordPart { WordPart::Kind::LITERAL, body });
+        word.literal = body;
+      }
+      else {
+        Lexer lexer(body);
+        Compiler::Result result = lexer.lex_here_document(&word, error);
+        if(Compiler::Result::OK != result) {
+          return result;
+        }
+      }
+      word.is_plain = false;
+    }
+    pending_bodies.clear();
+    return Compiler::Result::OK;
+  }
+
+  // Lexes the whole source as an unquoted here-document body: like inside
+  // double quotes, except that double quotes themselves aren't special.
+  Compiler::Result lex_here_document(Word *word, string *error) {
+    quoted_seen = false;
+    while(pos < source.length()) {
+      char c = source[pos];
+      if('\\' == c && pos + 1 < source.length()
+         && string::npos != string("$\\`\n").find(source[pos + 1])) {
+        if('\n' != source[pos + 1]) {
+          append_literal(word, string(1, source[pos + 1]), true);
+        }
+        pos += 2;
+      }
+      else if('$' == c) {
+        Compiler::Result result = lex_dollar(word, true, error);
+        if(Compiler::Result::OK != result) {
+          return result;
+        }
+      }
+      else {
+        append_literal(word, string(1, c), true);
+        ++pos;
+      }
+    }
+
+    if(word->parts.empty()) {
+      append_literal(word, "", true);
+    }
+    if(word->is_constant) {
+      word->literal = word->parts[0].text;
+    }
+    return Compiler::Result::OK;
+  }
+
+  void skip_blanks() {
+    while(pos < source.length()) {
+      if(' ' == source[pos] || '\t' == source[pos]) {
+        ++pos;
+      }
+      else if('\\' == source[pos] && pos + 1 < source.length()
+              && '\n' == source[pos + 1]) {
+        pos += 2;
+      }
+      else {
+        break;
+      }
+    }
+  }
+
+  bool lex_operator(Token::Type *type) {
+    char c = source[pos];
+    char next = pos + 1 < source.length() ? source[pos + 1] : '\0';
+    switch(c) {
+      case '\n':
+      case ';':
+        *type = Token::Type::SEPARATOR;
+        pos += 1;
+        return true;
+      case '&':
+        *type = '&' == next ? Token::Type::AND_IF : Token::Type::AMPERSAND;
+        pos += '&' == next ? 2 : 1;
+        return true;
+      case '|':
+        *type = '|' == next ? Token::Type::OR_IF : Token::Type::PIPE;
+        pos += '|' == next ? 2 : 1;
+        return true;
+      case '(':
+        *type = Token::Type::LEFT_PAREN;
+        pos += 1;
+        return true;
+      case ')':
+        *type = Token::Type::RIGHT_PAREN;
+        pos += 1;
+        return true;
+    }
+    return false;
+  }
+
+  void append_literal(Word *word, const string& text, bool quoted) {
+    if(!word->parts.empty()
+       && WordPart::Kind::LITERAL == word->parts.back().kind) {
+      word->parts.back().text += text;
+    }
+    else {
+      word->parts.push_back(WordPart { WordPart::Kind::LITERAL, text });
+    }
+
+    if(quoted) {
+      word->is_plain = false;
+      quoted_seen = true;
+    }
+    else if(!quoted_seen) {
+      word->unquoted_prefix += text.length();
+    }
+  }
+
+  void append_expansion(Word *word, WordPart::Kind kind, const string& text) {
+    word->parts.push_back(WordPart { kind, text });
+    word->is_constant = false;
+    word->is_plain = false;
+    quoted_seen = true;
+  }
+
+  // Lexes a `$' expansion starting at `pos'.  Appends a literal `$' if what
+  // follows isn't a valid expansion.
+  Compiler::Result lex_dollar(Word *word, bool quoted, string *error) {
+    ++pos;
+    if(pos >= source.length()) {
+      append_literal(word, "$", quoted);
+      return Compiler::Result::OK;
+    }
+
+    char c = source[pos];
+    if('{' == c) {
+      size_t close = source.find('}', pos);
+      if(string::npos == close) {
+        return Compiler::Result::INCOMPLETE;
+      }
+      string name = source.substr(pos + 1, close - pos - 1);
+      if(!Compiler::is_valid_name(name) && !is_special_parameter(name)) {
+        *error = "bad substitution: ${" + name + "}";
+        return Compiler::Result::ERROR;
+      }
+      append_expansion(word, WordPart::Kind::VARIABLE, name);
+      pos = close + 1;
+    }
+    else if('(' == c && pos + 1 < source.length() && '(' == source[pos + 1]) {
+      return lex_arithmetic(word, error);
+    }
+    else if('(' == c) {
+      *error = "command substitution is not supported yet";
+      return Compiler::Result::ERROR;
+    }
+    else if(is_name_start(c)) {
+      size_t start = pos;
+      while(pos < source.length() && is_name_char(source[pos])) {
+        ++pos;
+      }
+      append_expansion(word, WordPart::Kind::VARIABLE,
+                       source.substr(start, pos - start));
+    }
+    else if(is_special_parameter(string(1, c))) {
+      append_expansion(word, WordPart::Kind::VARIABLE, string(1, c));
+      ++pos;
+    }
+    else {
+      append_literal(word, "$", quoted);
+    }
+    return Compiler::Result::OK;
+  }
+
+  // Lexes the rest of `$(( ... ))', with `pos' on the first `('.
+  Compiler::Result lex_arithmetic(Word *word, string *error) {
+    size_t start = pos + 2;
+    size_t end = start;
+    int depth = 0;
+    while(true) {
+      if(end >= source.length()) {
+        return Compiler::Result::INCOMPLETE;
+      }
+      if('(' == source[end]) {
+        ++depth;
+      }
+      else if(')' == source[end]) {
+        if(0 == depth && end + 1 < source.length() && ')' == source[end + 1]) {
+          break;
+        }
+        if(0 == depth && end + 1 >= source.length()) {
+          return Compiler::Result::INCOMPLETE;
+        }
+        --depth;
+      }
+      ++end;
+    }
+
+    string text = source.substr(start, end - start);
+    append_expansion(word, WordPart::Kind::ARITHMETIC, text);
+    WordPart& part = word->parts.back();
+    if(string::npos == text.find_first_of("$\\\"'")) {
+      part.expression = ArithmeticExpression::parse(text, error);
+      if(!part.expression) {
+        *error = "$((" + text + ")): " + *error;
+        return Compiler::Result::ERROR;
+      }
+    }
+    else {
+      shared_ptr<Word> inner = make_shared<Word>();
+      Lexer lexer(text);
+      Compiler::Result result = lexer.lex_embedded(inner.get(), error);
+      if(Compiler::Result::OK != result) {
+        return result;
+      }
+      part.inner = inner;
+    }
+
+    pos = end + 2;
+    return Compiler::Result::OK;
+  }
+
+  // Lexes the whole source as if it were inside double quotes.
+  Compiler::Result lex_embedded(Word *word, string *error) {
+    quoted_seen = false;
+    while(pos < source.length()) {
+      char c = source[pos];
+      if('\\' == c && pos + 1 < source.length()
+         && string::npos != string("$\"\\`").find(source[pos + 1])) {
+        append_literal(word, string(1, source[pos + 1]), true);
+        pos += 2;
+      }
+      else if('$' == c) {
+        Compiler::Result result = lex_dollar(word, true, error);
+        if(Compiler::Result::OK != result) {
+          return result;
+        }
+      }
+      else if('"' != c) {
+        append_literal(word, string(1, c), true);
+        ++pos;
+      }
+      else {
+        ++pos;
+      }
+    }
+
+    if(word->parts.empty()) {
+      append_literal(word, "", true);
+    }
+    if(word->is_constant) {
+      word->literal = word->parts[0].text;
+    }
+    return Compiler::Result::OK;
+  }
+
+  static bool is_special_parameter(const string& name) {
+    if(name.empty()) {
+      return false;
+    }
+    if(1 == name.length() && string::npos != string("?#@*$!0").find(name)) {
+      return true;
+    }
+    for(char c : name) {
+      if(!isdigit(static_cast<unsigned char>(c))) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  Compiler::Result lex_word(Word *word, string *error) {
+    quoted_seen = false;
+    size_t start = pos;
+
+    // A leading `~' is only special when it stands for the whole home
+    // directory (`~' or `~/...').
+    if('~' == source[pos]
+       && (pos + 1 >= source.length() || '/' == source[pos + 1]
+           || is_word_boundary(source[pos + 1]))) {
+      append_expansion(word, WordPart::Kind::TILDE, "");
+      ++pos;
+    }
+
+    while(pos < source.length()) {
+      char c = source[pos];
+      if(at_process_substitution()) {
+        Compiler::Result result = lex_process_substitution(word, error);
+        if(Compiler::Result::OK != result) {
+          return result;
+        }
+        continue;
+      }
+      if(is_word_boundary(c)) {
+        break;
+      }
+      if('\'' == c) {
+        size_t close = source.find('\'', pos + 1);
+        if(string::npos == close) {
+          return Compiler::Result::INCOMPLETE;
+        }
+        append_literal(word, source.substr(pos + 1, close - pos - 1), true);
+        pos = close + 1;
+      }
+      else if('"' == c) {
+        Compiler::Result result = lex_double_quoted(word, error);
+        if(Compiler::Result::OK != result) {
+          return result;
+        }
+      }
+      else if('\\' == c) {
+        if(pos + 1 >= source.length()) {
+          return Compiler::Result::INCOMPLETE;
+        }
+        if('\n' != source[pos + 1]) {
+          append_literal(word, string(1, source[pos + 1]), true);
+        }
+        pos += 2;
+      }
+      else if('$' == c) {
+        Compiler::Result result = lex_dollar(word, false, error);
+        if(Compiler::Result::OK != result) {
+          return result;
+        }
+      }
+      else {
+        append_literal(word, string(1, c), false);
+        ++pos;
+      }
+    }
+
+    // E.g. `""' is still a (empty) word.
+    if(word->parts.empty()) {
+      append_literal(word, "", pos > start);
+    }
+
+    word->is_all_positionals =
+      1 == word->parts.size()
+      && WordPart::Kind::VARIABLE == word->parts[0].kind
+      && "@" == word->parts[0].text;
+
+    if(word->is_constant) {
+      word->literal = word->parts[0].text;
+    }
+    return Compiler::Result::OK;
+  }
+
+  // `<(' or `>(', which start a process substitution even in the middle of
+  // a word (e.g. `--file=<(list)').
+  bool at_process_substitution() const {
+    return ('<' == source[pos] || '>' == source[pos])
+        && pos + 1 < source.length() && '(' == source[pos + 1];
+  }
+
+  // Lexes `<(list)' or `>(list)', with `pos' on the `<' or `>', and
+  // compiles `list'.
+  Compiler::Result lex_process_substitution(Word *word, string *error) {
+    WordPart::Kind kind = '<' == source[pos] ? WordPart::Kind::PROCESS_INPUT
+                                             : WordPart::Kind::PROCESS_OUTPUT;
+    size_t start = pos + 2;
+    size_t end = start;
+    int depth = 0;
+    while(true) {
+      if(end >= source.length()) {
+        return Compiler::Result::INCOMPLETE;
+      }
+      char c = source[end];
+      if('\\' == c) {
+        ++end;
+      }
+      else if('\'' == c || '"' == c) {
+        // Skip over the quoted text.
+        for(++end; end < source.length() && c != source[end]; ++end) {
+          if('"' == c && '\\' == source[end]) {
+            ++end;
+          }
+        }
+      }
+      else if('(' == c) {
+        ++depth;
+      }
+      else if(')' == c) {
+        if(0 == depth) {
+          break;
+        }
+        --depth;
+      }
+      ++end;
+    }
+
+    string text = source.substr(start, end - start);
+    shared_ptr<Program> program;
+    Compiler::Result result = Compiler::compile(text, &program, error);
+    if(Compiler::Result::OK != result) {
+      *error = string(1, source[pos]) + "(" + text + "): "
+        + (Compiler::Result::INCOMPLETE == result
+           ? "syntax error near unexpected token `)'" : *error);
+      return Compiler::Result::ERROR;
+    }
+    append_expansion(word, kind, text);
+    word->parts.back().program = program;
+    pos = end + 1;
+    return Compiler::Result::OK;
+  }
+
+  Compiler::Result lex_double_quoted(Word *word, string *error) {
+    ++pos;
+    // Make sure `""' still produces a part.
+    append_literal(word, "", true);
+    while(pos < source.length() && '"' != source[pos]) {
+      char c = source[pos];
+      if('\\' == c && pos + 1 < source.length()
+         && string::npos != string("$\"\\`\n").find(source[pos + 1])) {
+        if('\n' != source[pos + 1]) {
+          append_literal(word, string(1, source[pos + 1]), true);
+        }
+        pos += 2;
+      }
+      else if('$' == c) {
+        Compiler::Result result = lex_dollar(word, true, error);
+        if(Compiler::Result::OK != result) {
+          return result;
+        }
+      }
+      else {
+        append_literal(word, string(1, c), true);
+        ++pos;
+      }
+    }
+
+    if(pos >= source.length()) {
+      return Compiler::Result::INCOMPLETE;
+    }
+    ++pos;
+    return Compiler::Result::OK;
+  }
+
+  const string& source;
+  size_t pos;
+  // Whether anything quoted (or expanded) has been seen in the current word.
+  bool quoted_seen;
+  vector<PendingBody> pending_bodies;
+};
+
+// A recursive descent parser which emits code as it goes, back-patching
+// jump targets once they are known.
+class Parser {
+public:
+  Parser(const string& source, const vector<Token>& tokens)
+    : source(source), tokens(tokens), pos(0), result(Compiler::Result::OK),
+      program(make_shared<Program>()) { }
+
+  Compiler::Result parse(shared_ptr<Program> *out, string *error) {
+    if(parse_list({}) && !at(Token::Type::END)) {
+      fail_unexpected();
+    }
+    if(Compiler::Result::OK == result) {
+      emit(OpCode::LEAVE, -1);
+      *out = program;
+    }
+    *error = this->error;
+    return result;
+  }
+
+private:
+  struct Loop {
+    bool is_for;
+    int32_t continue_target;
+    vector<size_t> break_patches;
+  };
+
+  const Token& peek() const {
+    return tokens[pos];
+  }
+
+  bool at(Token::Type type) const {
+    return type == peek().type;
+  }
+
+  bool at_reserved(const string& word) const {
+    return at(Token::Type::WORD) && peek().word.is_plain
+        && word == peek().word.literal;
+  }
+
+  bool at_any_reserved(const vector<string>& words) const {
+    for(const string& word : words) {
+      if(at_reserved(word)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool fail(const string& message) {
+    if(Compiler::Result::OK == result) {
+      result = Compiler::Result::ERROR;
+      error = message;
+    }
+    return false;
+  }
+
+  bool fail_unexpected() {
+    if(at(Token::Type::END)) {
+      if(Compiler::Result::OK == result) {
+        result = Compiler::Result::INCOMPLETE;
+      }
+      return false;
+    }
+    return fail("syntax error near unexpected token `" + describe(peek())
+                + "'");
+  }
+
+  bool expect_reserved(const string& word) {
+    if(!at_reserved(word)) {
+      return fail_unexpected();
+    }
+    ++pos;
+    return true;
+  }
+
+  void skip_separators() {
+    while(at(Token::Type::SEPARATOR)) {
+      ++pos;
+    }
+  }
+
+  int32_t here() const {
+    return static_cast<int32_t>(program->code.size());
+  }
+
+  size_t emit(OpCode op, int32_t a = 0, int32_t b = 0) {
+    program->code.push_back(Instruction { op, a, b });
+    return program->code.size() - 1;
+  }
+
+  void patch(size_t instruction, int32_t target) {
+    Instruction& insn = program->code[instruction];
+    if(OpCode::FOR_NEXT == insn.op) {
+      insn.b = target;
+    }
+    else {
+      insn.a = target;
+    }
+  }
+
+  int32_t add_name(const string& name) {
+    program->names.push_back(name);
+    return static_cast<int32_t>(program->names.size() - 1);
+  }
+
+  int32_t add_word_list(const vector<Word>& words) {
+    program->word_lists.push_back(words);
+    return static_cast<int32_t>(program->word_lists.size() - 1);
+  }
+
+  // Parses commands until one of the reserved words in `terminators' shows
+  // up in command position (or the input ends, if there are none).  Fails
+  // on empty lists, unless parsing the top level.
+  bool parse_list(const vector<string>& terminators) {
+    skip_separators();
+    size_t count = 0;
+    while(true) {
+      if(at(Token::Type::END)) {
+        if(terminators.empty()) {
+          return true;
+        }
+        return fail_unexpected();
+      }
+      if(!terminators.empty() && at_any_reserved(terminators)) {
+        if(0 == count) {
+          return fail_unexpected();
+        }
+        return true;
+      }
+
+      bool background = false;
+      if(!parse_and_or_or_background(&background)) {
+        return false;
+      }
+      ++count;
+
+      if(at(Token::Type::SEPARATOR)) {
+        skip_separators();
+      }
+      // `&' separates commands, too.
+      else if(background || at(Token::Type::END)
+              || (!terminators.empty() && at_any_reserved(terminators))) {
+        continue;
+      }
+      else {
+        return fail_unexpected();
+      }
+    }
+  }
+
+  // Parses an and-or list, which runs as a background job if it is followed
+  // by `&'.  That only becomes clear at the end, so the list is then parsed
+  // again, into a program of its own, and the code emitted the first time
+  // around is dropped.
+  bool parse_and_or_or_background(bool *background) {
+    size_t first = pos;
+    size_t code_size = program->code.size();
+    vector<Loop> saved_loops = loops;
+    if(!parse_and_or()) {
+      return false;
+    }
+    if(!at(Token::Type::AMPERSAND)) {
+      return true;
+    }
+
+    size_t last = pos;
+    pos = first;
+    program->code.resize(code_size);
+    loops.swap(saved_loops);
+    // As with functions, the job can't `break' out of the shell's loops.
+    shared_ptr<Program> outer = program;
+    vector<Loop> outer_loops;
+    outer_loops.swap(loops);
+    program = make_shared<Program>();
+    bool ok = parse_and_or();
+    emit(OpCode::LEAVE, -1);
+    shared_ptr<Program> job = program;
+    program = outer;
+    loops.swap(outer_loops);
+    if(!ok) {
+      return false;
+    }
+
+    ++pos;
+    *background = true;
+    program->jobs.push_back(job);
+    emit(OpCode::BACKGROUND,
+         add_name(source.substr(tokens[first].start,
+                                tokens[last - 1].end - tokens[first].start)),
+         static_cast<int32_t>(program->jobs.size() - 1));
+    return true;
+  }
+
+  bool parse_and_or() {
+    if(!parse_pipeline()) {
+      return false;
+    }
+
+    while(at(Token::Type::AND_IF) || at(Token::Type::OR_IF)) {
+      OpCode op = at(Token::Type::AND_IF) ? OpCode::JUMP_IF_FALSE
+                                          : OpCode::JUMP_IF_TRUE;
+      ++pos;
+      size_t jump = emit(op);
+      skip_separators();
+      if(!parse_pipeline()) {
+        return false;
+      }
+      patch(jump, here());
+    }
+    return true;
+  }
+
+  bool parse_pipeline() {
+    bool negate = false;
+    if(at_reserved("!")) {
+      negate = true;
+      ++pos;
+    }
+
+    if(!parse_command()) {
+      return false;
+    }
+
+    if(at(Token::Type::PIPE)) {
+      return fail("pipelines are not supported yet");
+    }
+
+    if(negate) {
+      emit(OpCode::NOT);
+    }
+    return true;
+  }
+
+  bool at_redirection() const {
+    return at(Token::Type::HERE_DOCUMENT) || at(Token::Type::HERE_STRING);
+  }
+
+  bool parse_command() {
+    if(at_redirection()) {
+      return parse_simple_command();
+    }
+    if(!at(Token::Type::WORD)) {
+      return fail_unexpected();
+    }
+
+    if(at_reserved("if")) {
+      return parse_if();
+    }
+    if(at_reserved("while") || at_reserved("until")) {
+      return parse_loop();
+    }
+    if(at_reserved("for")) {
+      return parse_for();
+    }
+    if(at_reserved("{")) {
+      return parse_group();
+    }
+    if(at_reserved("function")) {
+      ++pos;
+      return parse_function();
+    }
+    if(at_reserved("break") || at_reserved("continue")) {
+      return parse_break_continue();
+    }
+    if(at_reserved("return")) {
+      return parse_return();
+    }
+    if(at_any_reserved({ "then", "elif", "else", "fi", "do", "done", "}",
+                         "in" })) {
+      return fail_unexpected();
+    }
+    if(pos + 1 < tokens.size()
+       && Token::Type::LEFT_PAREN == tokens[pos + 1].type) {
+      return parse_function();
+    }
+
+    return parse_simple_command();
+  }
+
+  bool parse_if() {
+    vector<size_t> end_patches;
+    ++pos;
+    while(true) {
+      if(!parse_list({ "then" }) || !expect_reserved("then")) {
+        return false;
+      }
+      size_t skip = emit(OpCode::JUMP_IF_FALSE);
+      if(!parse_list({ "elif", "else", "fi" })) {
+        return false;
+      }
+      end_patches.push_back(emit(OpCode::JUMP));
+      patch(skip, here());
+
+      if(!at_reserved("elif")) {
+        break;
+      }
+      ++pos;
+    }
+
+    if(at_reserved("else")) {
+      ++pos;
+      if(!parse_list({ "fi" })) {
+        return false;
+      }
+    }
+    else {
+      // No branch was taken.
+      emit(OpCode::SET_STATUS, 0);
+    }
+
+    if(!expect_reserved("fi")) {
+      return false;
+    }
+    for(size_t jump : end_patches) {
+      patch(jump, here());
+    }
+    return true;
+  }
+
+  bool parse_loop() {
+    bool is_until = at_reserved("until");
+    ++pos;
+
+    int32_t top = here();
+    if(!parse_list({ "do" }) || !expect_reserved("do")) {
+      return false;
+    }
+    size_t exit = emit(is_until ? OpCode::JUMP_IF_TRUE
+                                : OpCode::JUMP_IF_FALSE);
+
+    loops.push_back(Loop { false, top, {} });
+    if(!parse_list({ "done" }) || !expect_reserved("done")) {
+      return false;
+    }
+    emit(OpCode::JUMP, top);
+    patch(exit, here());
+    emit(OpCode::SET_STATUS, 0);
+    close_loop();
+    return true;
+  }
+
+  bool parse_for() {
+    ++pos;
+    if(!at(Token::Type::WORD) || !peek().word.is_plain
+       || !Compiler::is_valid_name(peek().word.literal)) {
+      if(at(Token::Type::WORD)) {
+        return fail("`" + describe(peek()) + "' is not a valid identifier");
+      }
+      return fail_unexpected();
+    }
+    int32_t name = add_name(peek().word.literal);
+    ++pos;
+
+    // Without `in', loop over the positional parameters.
+    int32_t list = -1;
+    while(at(Token::Type::SEPARATOR)) {
+      ++pos;
+    }
+    if(at_reserved("in")) {
+      ++pos;
+      vector<Word> words;
+      while(at(Token::Type::WORD)) {
+        words.push_back(peek().word);
+        ++pos;
+      }
+      list = add_word_list(words);
+      if(!at(Token::Type::SEPARATOR)) {
+        return fail_unexpected();
+      }
+      skip_separators();
+    }
+
+    if(!expect_reserved("do")) {
+      return false;
+    }
+
+    emit(OpCode::FOR_BEGIN, list);
+    int32_t top = here();
+    size_t next = emit(OpCode::FOR_NEXT, name);
+    loops.push_back(Loop { true, top, {} });
+    if(!parse_list({ "done" }) || !expect_reserved("done")) {
+      return false;
+    }
+    emit(OpCode::JUMP, top);
+    patch(next, here());
+    close_loop();
+    return true;
+  }
+
+  void close_loop() {
+    for(size_t jump : loops.back().break_patches) {
+      patch(jump, here());
+    }
+    loops.pop_back();
+  }
+
+  bool parse_group() {
+    ++pos;
+    return parse_list({ "}" }) && expect_reserved("}");
+  }
+
+  bool parse_function() {
+    if(!at(Token::Type::WORD) || !peek().word.is_plain
+       || !Compiler::is_valid_name(peek().word.literal)) {
+      return fail_unexpected();
+    }
+    string name = peek().word.literal;
+    ++pos;
+
+    if(at(Token::Type::LEFT_PAREN)) {
+      ++pos;
+      if(!at(Token::Type::RIGHT_PAREN)) {
+        return fail_unexpected();
+      }
+      ++pos;
+    }
+    skip_separators();
+
+    if(!at_any_reserved({ "{", "if", "while", "until", "for" })) {
+      return fail_unexpected();
+    }
+
+    // The body is compiled into a program of its own.  Loops don't extend
+    // into it: `break' in a function can't leave the caller's loop.
+    shared_ptr<Program> outer = program;
+    vector<Loop> outer_loops;
+    outer_loops.swap(loops);
+    program = make_shared<Program>();
+    bool ok = parse_command();
+    emit(OpCode::LEAVE, -1);
+    shared_ptr<Program> body = program;
+    program = outer;
+    loops.swap(outer_loops);
+    if(!ok) {
+      return false;
+    }
+
+    program->functions.push_back(body);
+    emit(OpCode::DEFINE_FUNCTION, add_name(name),
+         static_cast<int32_t>(program->functions.size() - 1));
+    return true;
+  }
+
+  // Reads the optional numeric argument of `break', `continue' and
+  // `return'.
+  bool parse_optional_argument(vector<Word> *words) {
+    ++pos;
+    while(at(Token::Type::WORD)) {
+      words->push_back(peek().word);
+      ++pos;
+    }
+    if(words->size() > 1) {
+      return fail("too many arguments");
+    }
+    return true;
+  }
+
+  bool parse_break_continue() {
+    bool is_break = at_reserved("break");
+    string keyword = is_break ? "break" : "continue";
+    vector<Word> words;
+    if(!parse_optional_argument(&words)) {
+      return false;
+    }
+
+    long levels = 1;
+    if(!words.empty()) {
+      char *end;
+      levels = words[0].is_constant
+               ? strtol(words[0].literal.c_str(), &end, 10) : 0;
+      if(!words[0].is_constant || '\0' != *end || levels < 1) {
+        return fail(keyword + ": loop count must be a positive integer");
+      }
+    }
+    if(loops.empty()) {
+      return fail(keyword + ": only meaningful in a loop");
+    }
+    if(static_cast<size_t>(levels) > loops.size()) {
+      levels = loops.size();
+    }
+
+    // Leave every `for' loop that is exited completely.
+    size_t target = loops.size() - levels;
+    for(size_t i = loops.size(); i-- > target; ) {
+      if(loops[i].is_for && (is_break || i != target)) {
+        emit(OpCode::FOR_POP);
+      }
+    }
+
+    if(is_break) {
+      loops[target].break_patches.push_back(emit(OpCode::JUMP));
+    }
+    else {
+      emit(OpCode::JUMP, loops[target].continue_target);
+    }
+    return true;
+  }
+
+  bool parse_return() {
+    vector<Word> words;
+    if(!parse_optional_argument(&words)) {
+      return false;
+    }
+    emit(OpCode::LEAVE, words.empty() ? -1 : add_word_list(words));
+    return true;
+  }
+
+  // Splits `NAME=value' into its parts.  Only the unquoted start of a word
+  // may form the `NAME='.
+  static bool split_assignment(const Word& word, string *name, Word *value) {
+    if(word.parts.empty() || WordPart::Kind::LITERAL != word.parts[0].kind) {
+      return false;
+    }
+    const string& text = word.parts[0].text;
+    size_t equals = text.find('=');
+    if(string::npos == equals || equals >= word.unquoted_prefix
+       || !Compiler::is_valid_name(text.substr(0, equals))) {
+      return false;
+    }
+
+    *name = text.substr(0, equals);
+    *value = word;
+    value->parts[0].text = text.substr(equals + 1);
+    value->unquoted_prefix = 0;
+    value->is_plain = false;
+    value->is_all_positionals = false;
+    if(value->is_constant) {
+      value->literal = value->parts[0].text;
+    }
+    return true;
+  }
+
+  bool parse_simple_command() {
+    SimpleCommandCode command;
+    while(at(Token::Type::WORD) || at_redirection()) {
+      if(at(Token::Type::HERE_DOCUMENT)) {
+        command.redirections.push_back(
+          Redirection { Redirection::Kind::HERE_DOCUMENT, peek().word });
+        ++pos;
+        continue;
+      }
+      if(at(Token::Type::HERE_STRING)) {
+        ++pos;
+        if(!at(Token::Type::WORD)) {
+          return fail_unexpected();
+        }
+        command.redirections.push_back(
+          Redirection { Redirection::Kind::HERE_STRING, peek().word });
+        ++pos;
+        continue;
+      }
+
+      string name;
+      Word value;
+      if(command.words.empty()
+         && split_assignment(peek().word, &name, &value)) {
+        command.assignments.emplace_back(name, value);
+      }
+      else {
+        command.words.push_back(peek().word);
+      }
+      ++pos;
+    }
+
+    if(at(Token::Type::LEFT_PAREN) || at(Token::Type::RIGHT_PAREN)) {
+      return fail_unexpected();
+    }
+
+    program->commands.push_back(command);
+    emit(OpCode::RUN, static_cast<int32_t>(program->commands.size() - 1));
+    return true;
+  }
+
+  const string& source;
+  const vector<Token>& tokens;
+  size_t pos;
+  Compiler::Result result;
+  string error;
+  // The program currently being emitted (a function body, while compiling
+  // one).
+  shared_ptr<Program> program;
+  vector<Loop> loops;
+};
+
+}  // namespace
+
+Compiler::Result Compiler::compile(const string& source,
+                                   shared_ptr<Program> *program,
+                                   string *error) {
+  vector<Token> tokens;
+  Lexer lexer(source);
+  Result result = lexer.tokenize(&tokens, error);
+  if(Result::OK != result) {
+    return result;
+  }
+
+  Parser parser(source, tokens);
+  return parser.parse(program, error);
+}
+
+bool Compiler::is_valid_name(const string& name) {
+  if(name.empty() || !is_name_start(name[0])) {
+    return false;
+  }
+  for(char c : name) {
+    if(!is_name_char(c)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace core
+}  // namespace microshell
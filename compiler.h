@@ -0,0 +1,40 @@
+#ifndef MICROSHELL_CORE_COMPILER_H
+#define MICROSHELL_CORE_COMPILER_H
+
+#include <memory>
+#include <string>
+
+#include "bytecode.h"
+
+namespace microshell {
+namespace core {
+
+// Translates shell source code (simple commands, `&&'/`||' lists, `!',
+// `if', `while', `until', `for', `{ ...; }' groups, functions, `&'
+// background jobs, here-documents, here-strings and process substitutions)
+// into a `Program' for the `VirtualMachine'.  Source is tokenized exactly
+// once; running the result never looks at the text again.
+class Compiler {
+public:
+  enum class Result {
+    OK,
+    // The source ended in the middle of a construct (e.g. an open `while' or
+    // quote).  An interactive caller should read more input and try again.
+    INCOMPLETE,
+    ERROR
+  };
+
+  // Compiles `source'.  On success, `program' holds the result; on error,
+  // `error' holds a human-readable description.
+  static Result compile(const std::string& source,
+                        std::shared_ptr<Program> *program,
+                        std::string *error);
+
+  // Whether `name' is a valid variable (or function) name.
+  static bool is_valid_name(const std::string& name);
+};
+
+}  // namespace core
+}  // namespace microshell
+
+#endif  // MICROSHELL_CORE_COMPILER_H
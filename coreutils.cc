@@ -0,0 +1,605 @@
+#include "coreutils.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "shell.h"
+#include "util.h"
+
+// Helper macro for instantiating builtin factories.
+#define _(name, type) (std::make_shared<TypedBuiltinFactory<type>>(TypedBuiltinFactory<type>(name)))
+
+namespace microshell {
+namespace modules {
+namespace coreutils {
+
+using namespace std;
+using namespace microshell::core;
+
+namespace {
+
+// Exit status of `test' on malformed expressions.
+const int TEST_ERROR = 2;
+
+// Writes `text' straight to standard output.  Anything still sitting in the
+// shell's own stream buffers goes first, so the ordering stays intact.
+int emit(Shell *shell, const string& text) {
+  cout.flush();
+  if(!util::write_all(STDOUT_FILENO, text)) {
+    shell->eout("write error: " + string(strerror(errno)));
+    return 1;
+  }
+  return 0;
+}
+
+// Appends the character(s) encoded by the backslash escape at `text[*i]'
+// (pointing at the backslash) to `out', and advances `*i' past it.  In
+// `echo' mode octal escapes are written `\0nnn', in `printf' mode `\nnn'.
+// Returns false on `\c', meaning ``produce no further output''.
+bool append_escape(const string& text, size_t *i, bool echo_mode,
+                   string *out) {
+  size_t pos = *i + 1;
+  if(pos >= text.length()) {
+    out->push_back('\\');
+    *i = pos;
+    return true;
+  }
+
+  char c = text[pos++];
+  switch(c) {
+    case '\\': out->push_back('\\'); break;
+    case 'a':  out->push_back('\a'); break;
+    case 'b':  out->push_back('\b'); break;
+    case 'e':  out->push_back('\033'); break;
+    case 'f':  out->push_back('\f'); break;
+    case 'n':  out->push_back('\n'); break;
+    case 'r':  out->push_back('\r'); break;
+    case 't':  out->push_back('\t'); break;
+    case 'v':  out->push_back('\v'); break;
+    case 'c':
+      *i = pos;
+      return false;
+    case 'x': {
+      int value = 0, digits = 0;
+      while(digits < 2 && pos < text.length()
+            && isxdigit(static_cast<unsigned char>(text[pos]))) {
+        unsigned char h = text[pos++];
+        value = value * 16 + (isdigit(h) ? h - '0' : (tolower(h) - 'a' + 10));
+        ++digits;
+      }
+      if(0 == digits) {
+        out->append("\\x");
+      }
+      else {
+        out->push_back(static_cast<char>(value));
+      }
+      break;
+    }
+    default:
+      if(c >= '0' && c <= '7' && (!echo_mode || '0' == c)) {
+        // In echo mode, the leading `0' doesn't count towards the digits.
+        int value = echo_mode ? 0 : c - '0';
+        int digits = echo_mode ? 0 : 1;
+        while(digits < 3 && pos < text.length()
+              && text[pos] >= '0' && text[pos] <= '7') {
+          value = value * 8 + (text[pos++] - '0');
+          ++digits;
+        }
+        out->push_back(static_cast<char>(value));
+      }
+      else {
+        out->push_back('\\');
+        out->push_back(c);
+      }
+  }
+  *i = pos;
+  return true;
+}
+
+// Parses a numeric `printf' argument.  Like in other shells, `'c' and `"c'
+// stand for the character code of `c'.
+bool parse_printf_number(const string& text, long long *value) {
+  if(text.length() >= 2 && ('\'' == text[0] || '"' == text[0])) {
+    *value = static_cast<unsigned char>(text[1]);
+    return true;
+  }
+  if(text.empty()) {
+    *value = 0;
+    return true;
+  }
+  char *end;
+  errno = 0;
+  *value = strtoll(text.c_str(), &end, 0);
+  return 0 == errno && '\0' == *end;
+}
+
+// Recursive descent evaluator for `test' expressions:
+//
+//   expr    := and ( -o and )*
+//   and     := not ( -a not )*
+//   not     := ! not | primary
+//   primary := ( expr ) | UNARY arg | arg BINARY arg | arg
+class TestEvaluator {
+public:
+  TestEvaluator(Shell *shell, const vector<string>& args)
+    : shell(shell), args(args), pos(0) { }
+
+  // Returns 0 (true), 1 (false) or `TEST_ERROR'.
+  int run() {
+    if(args.empty()) {
+      return 1;
+    }
+
+    bool result;
+    if(!parse_or(&result)) {
+      return TEST_ERROR;
+    }
+    if(pos < args.size()) {
+      error = "unexpected argument `" + args[pos] + "'";
+      return TEST_ERROR;
+    }
+    return result ? 0 : 1;
+  }
+
+  string error;
+
+private:
+  bool at(const char *token) const {
+    return pos < args.size() && args[pos] == token;
+  }
+
+  bool parse_or(bool *result) {
+    if(!parse_and(result)) {
+      return false;
+    }
+    while(at("-o")) {
+      ++pos;
+      bool right;
+      if(!parse_and(&right)) {
+        return false;
+      }
+      *result = *result || right;
+    }
+    return true;
+  }
+
+  bool parse_and(bool *result) {
+    if(!parse_not(result)) {
+      return false;
+    }
+    while(at("-a")) {
+      ++pos;
+      bool right;
+      if(!parse_not(&right)) {
+        return false;
+      }
+      *result = *result && right;
+    }
+    return true;
+  }
+
+  bool parse_not(bool *result) {
+    // A lone `!' is just a non-empty string.
+    if(at("!") && pos + 1 < args.size()) {
+      ++pos;
+      if(!parse_not(result)) {
+        return false;
+      }
+      *result = !*result;
+      return true;
+    }
+    return parse_primary(result);
+  }
+
+  static bool is_binary_operator(const string& op) {
+    static const char *ops[] = {
+      "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge",
+      "-nt", "-ot", "-ef"
+    };
+    for(const char *candidate : ops) {
+      if(op == candidate) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static bool is_unary_operator(const string& op) {
+    return 2 == op.length() && '-' == op[0]
+        && string::npos != string("bcdefghknprsuwxzGLOS").find(op[1]);
+  }
+
+  bool parse_primary(bool *result) {
+    if(pos >= args.size()) {
+      error = "argument expected";
+      return false;
+    }
+
+    // Binary operators take precedence, so that e.g. `test -f = -f' works.
+    if(pos + 2 < args.size() && is_binary_operator(args[pos + 1])) {
+      const string& left = args[pos];
+      const string& op = args[pos + 1];
+      const string& right = args[pos + 2];
+      pos += 3;
+      return binary(left, op, right, result);
+    }
+
+    if(at("(")) {
+      ++pos;
+      if(!parse_or(result)) {
+        return false;
+      }
+      if(!at(")")) {
+        error = "`)' expected";
+        return false;
+      }
+      ++pos;
+      return true;
+    }
+
+    if(is_unary_operator(args[pos]) && pos + 1 < args.size()) {
+      const string& op = args[pos];
+      const string& operand = args[pos + 1];
+      pos += 2;
+      return unary(op, operand, result);
+    }
+
+    *result = !args[pos++].empty();
+    return true;
+  }
+
+  bool parse_integer(const string& text, long long *value) {
+    char *end;
+    errno = 0;
+    *value = strtoll(text.c_str(), &end, 10);
+    if(text.empty() || '\0' != *end || 0 != errno) {
+      error = "integer expression expected: " + text;
+      return false;
+    }
+    return true;
+  }
+
+  // Every file test costs exactly one syscall, relative to the shell's
+  // working directory handle.
+  bool stat_file(const string& path, struct stat *st, bool follow = true) {
+    return 0 == fstatat(shell->get_working_directory_fd(), path.c_str(), st,
+                        follow ? 0 : AT_SYMLINK_NOFOLLOW);
+  }
+
+  bool unary(const string& op, const string& operand, bool *result) {
+    char test = op[1];
+    if('n' == test || 'z' == test) {
+      *result = ('n' == test) != operand.empty();
+      return true;
+    }
+    if('t' == test) {
+      long long fd;
+      if(!parse_integer(operand, &fd)) {
+        return false;
+      }
+      *result = isatty(static_cast<int>(fd));
+      return true;
+    }
+    if('r' == test || 'w' == test || 'x' == test) {
+      int mode = 'r' == test ? R_OK : ('w' == test ? W_OK : X_OK);
+      *result = 0 == faccessat(shell->get_working_directory_fd(),
+                               operand.c_str(), mode, AT_EACCESS);
+      return true;
+    }
+
+    struct stat st;
+    bool is_link_test = 'h' == test || 'L' == test;
+    if(!stat_file(operand, &st, !is_link_test)) {
+      *result = false;
+      return true;
+    }
+
+    switch(test) {
+      case 'e': *result = true; break;
+      case 'f': *result = S_ISREG(st.st_mode); break;
+      case 'd': *result = S_ISDIR(st.st_mode); break;
+      case 'b': *result = S_ISBLK(st.st_mode); break;
+      case 'c': *result = S_ISCHR(st.st_mode); break;
+      case 'p': *result = S_ISFIFO(st.st_mode); break;
+      case 'S': *result = S_ISSOCK(st.st_mode); break;
+      case 'h':
+      case 'L': *result = S_ISLNK(st.st_mode); break;
+      case 's': *result = st.st_size > 0; break;
+      case 'g': *result = 0 != (st.st_mode & S_ISGID); break;
+      case 'u': *result = 0 != (st.st_mode & S_ISUID); break;
+      case 'k': *result = 0 != (st.st_mode & S_ISVTX); break;
+      case 'O': *result = st.st_uid == geteuid(); break;
+      case 'G': *result = st.st_gid == getegid(); break;
+      default:
+        error = "unknown unary operator " + op;
+        return false;
+    }
+    return true;
+  }
+
+  bool binary(const string& left, const string& op, const string& right,
+              bool *result) {
+    if("=" == op || "==" == op) {
+      *result = left == right;
+      return true;
+    }
+    if("!=" == op) {
+      *result = left != right;
+      return true;
+    }
+    if("<" == op || ">" == op) {
+      *result = "<" == op ? left < right : left > right;
+      return true;
+    }
+
+    if("-nt" == op || "-ot" == op || "-ef" == op) {
+      struct stat a, b;
+      bool has_a = stat_file(left, &a), has_b = stat_file(right, &b);
+      if("-ef" == op) {
+        *result = has_a && has_b && a.st_dev == b.st_dev
+                  && a.st_ino == b.st_ino;
+      }
+      else {
+        // A missing file is older than any existing one.
+        bool newer = has_a && (!has_b || a.st_mtim.tv_sec > b.st_mtim.tv_sec
+                                || (a.st_mtim.tv_sec == b.st_mtim.tv_sec
+                                    && a.st_mtim.tv_nsec > b.st_mtim.tv_nsec));
+        bool older = has_b && (!has_a || b.st_mtim.tv_sec > a.st_mtim.tv_sec
+                                || (b.st_mtim.tv_sec == a.st_mtim.tv_sec
+                                    && b.st_mtim.tv_nsec > a.st_mtim.tv_nsec));
+        *result = "-nt" == op ? newer : older;
+      }
+      return true;
+    }
+
+    long long a, b;
+    if(!parse_integer(left, &a) || !parse_integer(right, &b)) {
+      return false;
+    }
+    if("-eq" == op)      *result = a == b;
+    else if("-ne" == op) *result = a != b;
+    else if("-lt" == op) *result = a < b;
+    else if("-le" == op) *result = a <= b;
+    else if("-gt" == op) *result = a > b;
+    else                 *result = a >= b;
+    return true;
+  }
+
+  Shell *shell;
+  const vector<string>& args;
+  size_t pos;
+};
+
+}  // namespace
+
+void Coreutils::initialize(const Shell&) {
+}
+
+vector<shared_ptr<BuiltinFactory>> Coreutils::get_builtins() {
+  return vector<shared_ptr<BuiltinFactory>> {
+    _("[", TestBuiltin),
+    _("cut", CutBuiltin),
+    _("echo", EchoBuiltin),
+    _("false", FalseBuiltin),
+    _("grep", GrepBuiltin),
+    _("head", HeadBuiltin),
+    _("printf", PrintfBuiltin),
+    _("test", TestBuiltin),
+    _("true", TrueBuiltin),
+    _("wc", WcBuiltin)
+  };
+}
+
+int EchoBuiltin::invoke(Shell *shell) {
+  bool newline = true;
+  bool escapes = false;
+
+  // Leading arguments made up only of `n', `e' and `E' flags are options.
+  size_t i = 1;
+  for(; i < argv.size(); ++i) {
+    const string& arg = argv[i];
+    if(arg.length() < 2 || '-' != arg[0]
+       || string::npos != arg.find_first_not_of("neE", 1)) {
+      break;
+    }
+    for(size_t j = 1; j < arg.length(); ++j) {
+      if('n' == arg[j]) {
+        newline = false;
+      }
+      else {
+        escapes = 'e' == arg[j];
+      }
+    }
+  }
+
+  string out;
+  for(size_t first = i; i < argv.size(); ++i) {
+    if(i > first) {
+      out.push_back(' ');
+    }
+    const string& arg = argv[i];
+    if(!escapes) {
+      out += arg;
+      continue;
+    }
+    for(size_t j = 0; j < arg.length(); ) {
+      if('\\' != arg[j]) {
+        out.push_back(arg[j++]);
+      }
+      else if(!append_escape(arg, &j, true, &out)) {
+        return emit(shell, out);
+      }
+    }
+  }
+
+  if(newline) {
+    out.push_back('\n');
+  }
+  return emit(shell, out);
+}
+
+int FalseBuiltin::invoke(Shell *) {
+  return 1;
+}
+
+int PrintfBuiltin::invoke(Shell *shell) {
+  if(argv.size() < 2) {
+    shell->eout("printf: usage: printf format [arguments]");
+    return 2;
+  }
+
+  const string& format = argv[1];
+  size_t next_arg = 2;
+  int status = 0;
+  string out;
+
+  // The format is reused for as long as there are arguments left.
+  do {
+    size_t first_arg = next_arg;
+    for(size_t i = 0; i < format.length(); ) {
+      char c = format[i];
+      if('\\' == c) {
+        if(!append_escape(format, &i, false, &out)) {
+          return emit(shell, out) | status;
+        }
+        continue;
+      }
+      if('%' != c) {
+        out.push_back(c);
+        ++i;
+        continue;
+      }
+
+      // %[flags][width][.precision]conversion
+      size_t start = i++;
+      while(i < format.length() && string::npos != string("-+ #0").find(format[i])) {
+        ++i;
+      }
+      while(i < format.length()
+            && isdigit(static_cast<unsigned char>(format[i]))) {
+        ++i;
+      }
+      if(i < format.length() && '.' == format[i]) {
+        ++i;
+        while(i < format.length()
+              && isdigit(static_cast<unsigned char>(format[i]))) {
+          ++i;
+        }
+      }
+      if(i >= format.length()) {
+        shell->eout("printf: missing format character");
+        return 1;
+      }
+
+      char conversion = format[i++];
+      string spec = format.substr(start, i - start - 1);
+      if('%' == conversion) {
+        out.push_back('%');
+        continue;
+      }
+
+      string arg = next_arg < argv.size() ? argv[next_arg++] : "";
+      char buffer[128];
+      switch(conversion) {
+        case 's':
+        case 'b': {
+          string value = arg;
+          if('b' == conversion) {
+            value.clear();
+            for(size_t j = 0; j < arg.length(); ) {
+              if('\\' != arg[j]) {
+                value.push_back(arg[j++]);
+              }
+              else if(!append_escape(arg, &j, true, &value)) {
+                out += value;
+                return emit(shell, out) | status;
+              }
+            }
+          }
+          // Let snprintf handle width and precision, but not the (possibly
+          // huge) string itself.
+          if(1 == spec.length()) {
+            out += value;
+          }
+          else {
+            int needed = snprintf(nullptr, 0, (spec + "s").c_str(),
+                                  value.c_str());
+            vector<char> formatted(needed + 1);
+            snprintf(formatted.data(), formatted.size(), (spec + "s").c_str(),
+                     value.c_str());
+            out.append(formatted.data(), needed);
+          }
+          break;
+        }
+        case 'c':
+          if(!arg.empty()) {
+            out.push_back(arg[0]);
+          }
+          break;
+        case 'd':
+        case 'i':
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X': {
+          long long value;
+          if(!parse_printf_number(arg, &value)) {
+            shell->eout("printf: " + arg + ": invalid number");
+            status = 1;
+          }
+          snprintf(buffer, sizeof(buffer),
+                   (spec + "ll" + string(1, conversion)).c_str(), value);
+          out += buffer;
+          break;
+        }
+        default:
+          shell->eout("printf: %" + string(1, conversion)
+                      + ": invalid format character");
+          return 1;
+      }
+    }
+
+    // Stop if the format didn't consume anything.
+    if(next_arg == first_arg) {
+      break;
+    }
+  } while(next_arg < argv.size());
+
+  return emit(shell, out) | status;
+}
+
+int TestBuiltin::invoke(Shell *shell) {
+  vector<string> args(argv.begin() + 1, argv.end());
+  if("[" == argv[0]) {
+    if(args.empty() || "]" != args.back()) {
+      shell->eout("[: missing `]'");
+      return TEST_ERROR;
+    }
+    args.pop_back();
+  }
+
+  TestEvaluator evaluator(shell, args);
+  int status = evaluator.run();
+  if(TEST_ERROR == status) {
+    shell->eout(argv[0] + ": " + evaluator.error);
+  }
+  return status;
+}
+
+int TrueBuiltin::invoke(Shell *) {
+  return 0;
+}
+
+}   // namespace coreutils
+}   // namespace modules
+}   // namespace microshell
@@ -0,0 +1,62 @@
+#ifndef MICROSHELL_MODULES_COREUTILS_COREUTILS_H
+#define MICROSHELL_MODULES_COREUTILS_COREUTILS_H
+
+#include <memory>
+#include <vector>
+
+#include "command.h"
+#include "shell.h"
+#include "shell_module.h"
+
+namespace microshell {
+namespace modules {
+namespace coreutils {
+
+/**
+ * In-process versions of the small utilities scripts call all the time, so
+ * that they don't cost a fork and exec each.  Output is assembled in memory
+ * and written to standard output with a single `write'.
+ *
+ * Provides builtins:
+ *    - echo [-neE] [ARGS...]
+ *    - printf FORMAT [ARGS...]
+ *    - test EXPRESSION / [ EXPRESSION ]
+ *    - true
+ *    - false
+ *
+ * and the line-oriented filters (see `text_filters.cc'), which read large
+ * blocks and write straight to standard output:
+ *
+ *    - grep [-FvcnqsHh] PATTERN [FILE...]
+ *
+ *      Fixed strings only: with `-F', or a pattern without special
+ *      characters.
+ *    - wc [-lwc] [FILE...]
+ *    - head [-n LINES | -c BYTES | -LINES] [FILE...]
+ *    - cut -f LIST [-d DELIM] [-s] [FILE...]
+ *    - cut -b LIST / -c LIST [FILE...]
+ *
+ *      Other options (and e.g. regular expressions) are handed to the
+ *      external tool of the same name.
+ */
+class Coreutils : public microshell::core::ShellModule {
+public:
+  void initialize(const microshell::core::Shell&) override;
+  std::vector<std::shared_ptr<microshell::core::BuiltinFactory>> get_builtins() override;
+};
+
+DECLARE_BUILTIN(Cut);
+DECLARE_BUILTIN(Echo);
+DECLARE_BUILTIN(False);
+DECLARE_BUILTIN(Grep);
+DECLARE_BUILTIN(Head);
+DECLARE_BUILTIN(Printf);
+DECLARE_BUILTIN(Test);
+DECLARE_BUILTIN(True);
+DECLARE_BUILTIN(Wc);
+
+}   // namespace coreutils
+}   // namespace modules
+}   // namespace microshell
+
+#endif  // MICROSHELL_MODULES_COREUTILS_COREUTILS_H
@@ -0,0 +1,591 @@
+#include "dag.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "compiler.h"
+#include "shell.h"
+#include "util.h"
+#include "vm.h"
+
+namespace microshell {
+namespace modules {
+namespace dag {
+
+using namespace microshell::core;
+using namespace std;
+
+namespace {
+
+// How often running targets are checked on when their exits can't be
+// polled for (kernels without `pidfd_open').
+const int FALLBACK_POLL_INTERVAL_MS = 10;
+
+struct Node {
+  enum class State {
+    WAITING,
+    RUNNING,
+    DONE,
+    FAILED,
+    SKIPPED
+  };
+
+  string name;
+  vector<string> dependency_names;
+  // Where the target was defined, for error messages.
+  size_t line;
+  string source;
+  shared_ptr<const Program> program;
+
+  vector<size_t> dependents;
+  // Dependencies which haven't finished yet.
+  size_t pending;
+  // How many targets the longest chain starting here has.  The scheduler
+  // starts the tallest ready target first.
+  size_t height;
+
+  State state;
+  pid_t pid;
+  int pidfd;
+  int status;
+  uint64_t start_ns;
+  uint64_t wall_ns;
+  struct rusage usage;
+};
+
+bool is_blank(const string& line) {
+  return string::npos == line.find_first_not_of(" \t");
+}
+
+// Parses the graph description (see `dag.h').  Returns false and fills in
+// `error' if it's malformed.
+bool parse_graph(const string& text, vector<Node> *nodes, string *error) {
+  vector<string> lines = util::split(text, '\n');
+  for(size_t i = 0; i < lines.size(); ++i) {
+    const string& line = lines[i];
+    if(is_blank(line) || '#' == line[line.find_first_not_of(" \t")]) {
+      continue;
+    }
+
+    if(' ' == line[0] || '\t' == line[0]) {
+      if(nodes->empty()) {
+        *error = "line " + to_string(i + 1) + ": command outside a target";
+        return false;
+      }
+      nodes->back().source += line + "\n";
+      continue;
+    }
+
+    size_t colon = line.find(':');
+    string name = colon == string::npos ? "" : line.substr(0, colon);
+    name.erase(name.find_last_not_of(" \t") + 1);
+    if(name.empty() || string::npos != name.find_first_of(" \t")) {
+      *error = "line " + to_string(i + 1)
+        + ": expected `TARGET: [DEPENDENCY...]'";
+      return false;
+    }
+
+    Node node = Node();
+    node.name = name;
+    node.line = i + 1;
+    node.pidfd = -1;
+    for(const string& word : util::split(line.substr(colon + 1), ' ')) {
+      for(const string& dependency : util::split(word, '\t')) {
+        if(!dependency.empty()) {
+          node.dependency_names.push_back(dependency);
+        }
+      }
+    }
+    nodes->push_back(node);
+  }
+  return true;
+}
+
+// Links every target to its dependencies, compiles the commands and works
+// out the scheduling priorities.
+bool build_graph(vector<Node> *nodes, string *error) {
+  map<string, size_t> index;
+  for(size_t i = 0; i < nodes->size(); ++i) {
+    if(!index.insert(make_pair((*nodes)[i].name, i)).second) {
+      *error = "line " + to_string((*nodes)[i].line) + ": target `"
+        + (*nodes)[i].name + "' defined twice";
+      return false;
+    }
+  }
+
+  for(size_t i = 0; i < nodes->size(); ++i) {
+    Node& node = (*nodes)[i];
+    for(const string& name : node.dependency_names) {
+      auto it = index.find(name);
+      if(index.end() == it) {
+        *error = node.name + ": unknown dependency `" + name + "'";
+        return false;
+      }
+      (*nodes)[it->second].dependents.push_back(i);
+      ++node.pending;
+    }
+
+    if(!is_blank(node.source)) {
+      shared_ptr<Program> program;
+      string compile_error;
+      if(Compiler::Result::OK
+         != Compiler::compile(node.source, &program, &compile_error)) {
+        *error = node.name + ": " + (compile_error.empty()
+          ? "syntax error: unexpected end of input" : compile_error);
+        return false;
+      }
+      node.program = program;
+    }
+  }
+
+  // Kahn's algorithm gives a topological order (or finds a cycle); heights
+  // are then filled in from the sinks up.
+  vector<size_t> order;
+  vector<size_t> pending(nodes->size());
+  for(size_t i = 0; i < nodes->size(); ++i) {
+    pending[i] = (*nodes)[i].pending;
+    if(0 == pending[i]) {
+      order.push_back(i);
+    }
+  }
+  for(size_t next = 0; next < order.size(); ++next) {
+    for(size_t dependent : (*nodes)[order[next]].dependents) {
+      if(0 == --pending[dependent]) {
+        order.push_back(dependent);
+      }
+    }
+  }
+  if(order.size() != nodes->size()) {
+    for(size_t i = 0; i < nodes->size(); ++i) {
+      if(0 != pending[i]) {
+        *error = "dependency cycle through `" + (*nodes)[i].name + "'";
+        return false;
+      }
+    }
+  }
+
+  for(auto it = order.rbegin(); it != order.rend(); ++it) {
+    Node& node = (*nodes)[*it];
+    node.height = 1;
+    for(size_t dependent : node.dependents) {
+      node.height = max(node.height, 1 + (*nodes)[dependent].height);
+    }
+  }
+  return true;
+}
+
+int open_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+  return static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+#else
+  return -1;
+#endif
+}
+
+double to_seconds(const struct timeval& time) {
+  return time.tv_sec + time.tv_usec / 1e6;
+}
+
+string format_bytes(uint64_t bytes) {
+  const char *units = "BKMGT";
+  double value = bytes;
+  int unit = 0;
+  while(value >= 1024 && unit < 4) {
+    value /= 1024;
+    ++unit;
+  }
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), unit ? "%.1f%c" : "%.0f%c", value,
+           units[unit]);
+  return buffer;
+}
+
+// Runs a graph with at most `workers' commands at once.  Under a jobserver
+// (see `Jobserver'), every running target holds a slot as well.
+class Scheduler {
+public:
+  Scheduler(Shell *shell, vector<Node> *nodes, size_t workers)
+    : shell(shell), nodes(*nodes), workers(workers), running(0),
+      failure(-1), throttled(false), throttles(0), waiting_for_slot(false) {
+    for(size_t i = 0; i < this->nodes.size(); ++i) {
+      if(0 == this->nodes[i].pending) {
+        ready.push(i);
+      }
+    }
+  }
+
+  // Returns 0, or the status of the first target which failed.
+  int run() {
+    while(true) {
+      waiting_for_slot = false;
+      while(-1 == failure && running < workers && !ready.empty()) {
+        // While the host is under pressure, only one target runs at a time.
+        if((running > 0 && !may_start()) || !take_slot()) {
+          break;
+        }
+        size_t next = ready.top();
+        ready.pop();
+        size_t was_running = running;
+        start(next);
+        if(running == was_running) {
+          shell->get_jobserver().release();
+        }
+      }
+      if(0 == running && !waiting_for_slot) {
+        break;
+      }
+      reap();
+    }
+
+    for(Node& node : nodes) {
+      if(Node::State::WAITING == node.state) {
+        node.state = Node::State::SKIPPED;
+      }
+    }
+    return -1 == failure ? 0 : nodes[failure].status;
+  }
+
+  // How many times admission control held targets back.
+  size_t get_throttles() const {
+    return throttles;
+  }
+
+private:
+  // Orders the ready queue: taller first, then the one more targets wait
+  // for, then the one defined first.
+  struct Priority {
+    const vector<Node> *nodes;
+
+    bool operator()(size_t a, size_t b) const {
+      const Node& x = (*nodes)[a];
+      const Node& y = (*nodes)[b];
+      if(x.height != y.height) {
+        return x.height < y.height;
+      }
+      if(x.dependents.size() != y.dependents.size()) {
+        return x.dependents.size() < y.dependents.size();
+      }
+      return a > b;
+    }
+  };
+
+  // Asks admission control whether another target may start, and logs
+  // when it starts holding them back.
+  bool may_start() {
+    AdmissionControl& admission = shell->get_admission_control();
+    string reason;
+    if(admission.admit(&reason)) {
+      throttled = false;
+      return true;
+    }
+    if(!throttled) {
+      throttled = true;
+      ++throttles;
+      admission.record("dag: " + nodes[ready.top()].name,
+                       AdmissionControl::Decision::Outcome::DEFERRED, reason);
+    }
+    return false;
+  }
+
+  bool take_slot() {
+    waiting_for_slot = !shell->take_job_slot();
+    return !waiting_for_slot;
+  }
+
+  void start(size_t index) {
+    Node& node = nodes[index];
+    node.start_ns = util::monotonic_ns();
+    if(!node.program) {
+      finish(index, 0);
+      return;
+    }
+
+    // Picked here, so that round-robin spreading advances from one target
+    // to the next.
+    SpawnPolicy policy = shell->get_spawn_policy().next();
+
+    // Don't let the child inherit (and print) buffered output.
+    cout.flush();
+    cerr.flush();
+    Stats& stats = shell->get_stats();
+    ++stats.externals;
+    uint64_t fork_start = util::monotonic_ns();
+    pid_t pid = fork();
+    if(-1 == pid) {
+      ++stats.spawn_failures;
+      shell->eout("dag: " + node.name + ": could not start: "
+                  + strerror(errno));
+      finish(index, 126);
+      return;
+    }
+    if(0 == pid) {
+      // The jobs' output and the shell's tasks stay with the shell.
+      shell->get_jobs().get_output().release();
+      shell->get_event_loop().release();
+      shell->get_spawn_policy() = policy;
+      // The shell's handlers only take note of C-c and C-z, which would
+      // leave the target going on with its next command.
+      signal(SIGINT, SIG_DFL);
+      signal(SIGTSTP, SIG_DFL);
+      CompiledCommand command(node.program);
+      int status = command.invoke(shell);
+      cout.flush();
+      cerr.flush();
+      shell->get_jobserver().release_all();
+      _exit(status & 0xFF);
+    }
+    stats.fork_time.record(util::monotonic_ns() - fork_start);
+
+    node.state = Node::State::RUNNING;
+    node.pid = pid;
+    node.pidfd = open_pidfd(pid);
+    ++running;
+  }
+
+  // Waits until at least one running target exits, and finishes those
+  // which did.
+  void reap() {
+    vector<struct pollfd> fds;
+    bool fallback = false;
+    for(const Node& node : nodes) {
+      if(Node::State::RUNNING != node.state) {
+        continue;
+      }
+      if(-1 == node.pidfd) {
+        fallback = true;
+      }
+      else {
+        fds.push_back(pollfd { node.pidfd, POLLIN, 0 });
+      }
+    }
+    // A token showing up means a slot may be free.  It's taken by whoever
+    // gets to it first, though, and the shell's own jobs give theirs back
+    // without one showing up, so this is reconsidered every so often too.
+    if(waiting_for_slot) {
+      fds.push_back(pollfd { shell->get_jobserver().get_fd(), POLLIN, 0 });
+    }
+    // Held back targets are reconsidered as often as the pressure readings
+    // change.  Interrupted polls just fall through to the checks below.
+    int timeout = fallback ? FALLBACK_POLL_INTERVAL_MS
+      : throttled || waiting_for_slot
+        ? AdmissionControl::SAMPLE_INTERVAL_NS / 1000000 : -1;
+    poll(fds.data(), fds.size(), timeout);
+
+    for(size_t i = 0; i < nodes.size(); ++i) {
+      Node& node = nodes[i];
+      if(Node::State::RUNNING != node.state) {
+        continue;
+      }
+      int status;
+      pid_t ret = wait4(node.pid, &status, WNOHANG, &node.usage);
+      if(ret != node.pid) {
+        continue;
+      }
+      if(-1 != node.pidfd) {
+        close(node.pidfd);
+        node.pidfd = -1;
+      }
+      --running;
+      shell->get_jobserver().release();
+      shell->get_stats().wait_time.record(util::monotonic_ns()
+                                          - node.start_ns);
+      finish(i, WIFEXITED(status) ? WEXITSTATUS(status)
+                                  : 128 + WTERMSIG(status));
+    }
+  }
+
+  void finish(size_t index, int status) {
+    Node& node = nodes[index];
+    node.wall_ns = util::monotonic_ns() - node.start_ns;
+    node.status = status;
+    if(0 != status) {
+      node.state = Node::State::FAILED;
+      if(-1 == failure) {
+        failure = static_cast<int>(index);
+        shell->eout("dag: " + node.name + " failed (status "
+                    + to_string(status) + "); not starting anything else");
+      }
+      return;
+    }
+
+    node.state = Node::State::DONE;
+    for(size_t dependent : node.dependents) {
+      if(0 == --nodes[dependent].pending) {
+        ready.push(dependent);
+      }
+    }
+  }
+
+  Shell *shell;
+  vector<Node>& nodes;
+  size_t workers;
+  size_t running;
+  int failure;
+  // Whether targets are being held back right now.
+  bool throttled;
+  size_t throttles;
+  // Whether the next target waits for a jobserver slot.
+  bool waiting_for_slot;
+  priority_queue<size_t, vector<size_t>, Priority> ready {
+    Priority { &nodes }
+  };
+};
+
+string describe_state(const Node& node) {
+  switch(node.state) {
+    case Node::State::DONE:    return "done";
+    case Node::State::FAILED:  return "exit " + to_string(node.status);
+    case Node::State::SKIPPED: return "skipped";
+    default:                   return "?";
+  }
+}
+
+void report(Shell *shell, const vector<Node>& nodes, uint64_t wall_ns,
+            size_t throttles) {
+  size_t width = 6;
+  for(const Node& node : nodes) {
+    width = max(width, node.name.length());
+  }
+
+  char line[512];
+  snprintf(line, sizeof(line), "%-*s %-8s %8s %8s %8s %8s", (int) width,
+           "TARGET", "STATUS", "WALL", "USER", "SYS", "MAXRSS");
+  shell->out(line);
+  for(const Node& node : nodes) {
+    if(Node::State::SKIPPED == node.state) {
+      snprintf(line, sizeof(line), "%-*s %s", (int) width,
+               node.name.c_str(), "skipped");
+    }
+    else {
+      bool ran = node.program && 0 != node.pid;
+      snprintf(line, sizeof(line), "%-*s %-8s %7.2fs %7.2fs %7.2fs %8s",
+               (int) width, node.name.c_str(), describe_state(node).c_str(),
+               node.wall_ns / 1e9,
+               ran ? to_seconds(node.usage.ru_utime) : 0.0,
+               ran ? to_seconds(node.usage.ru_stime) : 0.0,
+               ran ? format_bytes(node.usage.ru_maxrss * 1024ULL).c_str()
+                   : "-");
+    }
+    shell->out(line);
+  }
+  snprintf(line, sizeof(line), "%-*s %-8s %7.2fs", (int) width, "(total)",
+           "", wall_ns / 1e9);
+  shell->out(line);
+  if(throttles > 0) {
+    shell->out("(held back by admission control " + to_string(throttles)
+               + " time(s); see `admit -l')");
+  }
+}
+
+bool read_all(int fd, string *text) {
+  char buffer[4096];
+  while(true) {
+    ssize_t count = read(fd, buffer, sizeof(buffer));
+    if(count < 0 && EINTR == errno) {
+      continue;
+    }
+    if(count < 0) {
+      return false;
+    }
+    if(0 == count) {
+      return true;
+    }
+    text->append(buffer, count);
+  }
+}
+
+}  // namespace
+
+void Dag::initialize(const Shell&) {
+}
+
+vector<shared_ptr<BuiltinFactory>> Dag::get_builtins() {
+  return vector<shared_ptr<BuiltinFactory>> {
+    make_shared<TypedBuiltinFactory<DagBuiltin>>(
+      TypedBuiltinFactory<DagBuiltin>("dag")
+    )
+  };
+}
+
+int DagBuiltin::invoke(Shell *shell) {
+  long workers = sysconf(_SC_NPROCESSORS_ONLN);
+  string path;
+  for(size_t i = 1; i < argv.size(); ++i) {
+    const string& arg = argv[i];
+    if("-j" == arg && i + 1 < argv.size()) {
+      char *end;
+      workers = strtol(argv[++i].c_str(), &end, 10);
+      if(argv[i].empty() || '\0' != *end || workers < 1) {
+        shell->eout("dag: invalid number of jobs: " + argv[i]);
+        return 2;
+      }
+    }
+    else if(path.empty() && ("-" == arg || '-' != arg[0])) {
+      path = arg;
+    }
+    else {
+      shell->eout("dag: usage: dag [-j JOBS] [FILE]");
+      return 2;
+    }
+  }
+
+  string text;
+  if(path.empty() || "-" == path) {
+    if(!read_all(STDIN_FILENO, &text)) {
+      shell->eout("dag: cannot read standard input: "
+                  + string(strerror(errno)));
+      return 2;
+    }
+  }
+  else {
+    ifstream in(shell->resolve_path(path));
+    if(!in) {
+      shell->eout("dag: cannot open [" + path + "]");
+      return 2;
+    }
+    text.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+  }
+
+  vector<Node> nodes;
+  string error;
+  if(!parse_graph(text, &nodes, &error) || !build_graph(&nodes, &error)) {
+    shell->eout("dag: " + error);
+    return 2;
+  }
+
+  // C-c should stop the targets (which get it too), not the shell.
+  bool was_waiting = shell->get_waiting_for_child();
+  shell->set_waiting_for_child(true);
+  uint64_t start = util::monotonic_ns();
+  Scheduler scheduler(shell, &nodes, max(1L, workers));
+  int status = scheduler.run();
+  uint64_t wall_ns = util::monotonic_ns() - start;
+  shell->set_waiting_for_child(was_waiting);
+
+  report(shell, nodes, wall_ns, scheduler.get_throttles());
+  return status;
+}
+
+}   // namespace dag
+}   // namespace modules
+}   // namespace microshell
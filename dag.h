@@ -0,0 +1,61 @@
+#ifndef MICROSHELL_MODULES_DAG_DAG_H
+#define MICROSHELL_MODULES_DAG_DAG_H
+
+#include <memory>
+#include <vector>
+
+#include "command.h"
+#include "shell.h"
+#include "shell_module.h"
+
+namespace microshell {
+namespace modules {
+namespace dag {
+
+/**
+ * Runs a graph of dependent commands (e.g. a deploy: build A and B in
+ * parallel, then C once both are done) with a bounded number of workers.
+ *
+ * The graph is read from FILE (or standard input, e.g. a here-document)
+ * and looks like a makefile:
+ *
+ *    # Comments and blank lines are ignored.
+ *    a:
+ *        make -C a
+ *    b:
+ *        make -C b
+ *    c: a b
+ *        ./link a b
+ *
+ * A target line names the target and what it depends on; the indented
+ * lines after it are its command, as shell code.  Targets without one only
+ * group their dependencies.
+ *
+ * Each command runs in a child of the shell.  Among the targets ready to
+ * run, those heading the longest chains of targets left (the critical
+ * path) start first.  While admission control (see `admit') reports the
+ * host under pressure, only one runs at a time.  Under a jobserver (see
+ * `jobserver'), each running target also holds one of its slots.  After
+ * the first failure no other target is started; the ones running are
+ * waited for.  At the end, the wall time, CPU time and peak memory (from
+ * `getrusage') of every target are reported.
+ *
+ * Provides builtins:
+ *    - dag [-j JOBS] [FILE]
+ *
+ *      -j sets how many commands may run at once (by default, one per
+ *      CPU).  Returns 0, or the status of the first failed target.
+ */
+class Dag : public microshell::core::ShellModule {
+public:
+  void initialize(const microshell::core::Shell&) override;
+  std::vector<std::shared_ptr<microshell::core::BuiltinFactory>> get_builtins() override;
+};
+
+DECLARE_BUILTIN(Dag);
+
+}   // namespace dag
+}   // namespace modules
+}   // namespace microshell
+
+#endif  // MICROSHELL_MODULES_DAG_DAG_H
@@ -0,0 +1,76 @@
+#include "environment.h"
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace microshell {
+namespace core {
+
+using namespace std;
+
+Environment::Environment() : dirty(true), rebuild_count(0) { }
+
+void Environment::set(const string& name, const string& value) {
+  auto it = variables.find(name);
+  if(variables.end() != it && it->second == value) {
+    return;
+  }
+  variables[name] = value;
+  dirty = true;
+}
+
+void Environment::remove(const string& name) {
+  if(0 != variables.erase(name)) {
+    dirty = true;
+  }
+}
+
+bool Environment::contains(const string& name) const {
+  return variables.end() != variables.find(name);
+}
+
+const map<string, string>& Environment::get_variables() const {
+  return variables;
+}
+
+char** Environment::get_envp() {
+  if(dirty) {
+    rebuild();
+  }
+  return pointers.data();
+}
+
+uint64_t Environment::get_rebuild_count() const {
+  return rebuild_count;
+}
+
+void Environment::rebuild() {
+  size_t size = 0;
+  for(const auto& variable : variables) {
+    size += variable.first.length() + 1 + variable.second.length() + 1;
+  }
+
+  block.resize(size);
+  pointers.clear();
+  pointers.reserve(variables.size() + 1);
+
+  // `block' doesn't move after the resize above, so pointers into it stay
+  // valid.
+  char *out = block.data();
+  for(const auto& variable : variables) {
+    pointers.push_back(out);
+    out = copy(variable.first.begin(), variable.first.end(), out);
+    *out++ = '=';
+    out = copy(variable.second.begin(), variable.second.end(), out);
+    *out++ = '\0';
+  }
+  pointers.push_back(nullptr);
+
+  dirty = false;
+  ++rebuild_count;
+}
+
+}  // namespace core
+}  // namespace microshell
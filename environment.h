@@ -0,0 +1,50 @@
+#ifndef MICROSHELL_CORE_ENVIRONMENT_H
+#define MICROSHELL_CORE_ENVIRONMENT_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace microshell {
+namespace core {
+
+// The exported subset of the shell's variables, together with a prebuilt
+// `envp' block for `execve'.  The block is a single contiguous buffer of
+// `NAME=value' strings plus a null-terminated pointer array into it, and is
+// only rebuilt when an exported variable changes--spawning a child costs
+// nothing on top of passing the pointer along.
+//
+// Only plain `NAME=value' pairs with valid names are ever exported; the shell
+// never interprets environment values as code, so there is no way to smuggle
+// in function definitions (as with Shellshock).
+class Environment {
+public:
+  Environment();
+
+  void set(const std::string& name, const std::string& value);
+  void remove(const std::string& name);
+  bool contains(const std::string& name) const;
+
+  const std::map<std::string, std::string>& get_variables() const;
+
+  // Returns the null-terminated `envp' block.  Valid until the next change.
+  char** get_envp();
+
+  // How many times the block has been rebuilt.
+  uint64_t get_rebuild_count() const;
+
+private:
+  void rebuild();
+
+  std::map<std::string, std::string> variables;
+  bool dirty;
+  std::vector<char> block;
+  std::vector<char*> pointers;
+  uint64_t rebuild_count;
+};
+
+}  // namespace core
+}  // namespace microshell
+
+#endif  // MICROSHELL_CORE_ENVIRONMENT_H
@@ -0,0 +1,255 @@
+#include "event_loop.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <list>
+#include <memory>
+#include <vector>
+
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "shell.h"
+#include "util.h"
+
+namespace microshell {
+namespace core {
+
+using namespace std;
+
+namespace {
+
+// How often a task waiting for a child is resumed anyway, to look for stops
+// (pidfds only tell about exits), or for exits too, where `pidfd_open(2)'
+// doesn't work.
+const uint64_t CHILD_INTERVAL_NS = 100 * 1000 * 1000ULL;
+const uint64_t CHILD_INTERVAL_WITHOUT_PIDFD_NS = 10 * 1000 * 1000ULL;
+
+int open_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+  return syscall(SYS_pidfd_open, pid, 0);
+#else
+  return -1;
+#endif
+}
+
+// Waits for a child on behalf of `EventLoop::wait_for'.
+class ChildWait : public EventLoop::Task {
+public:
+  ChildWait(pid_t pid, int *status, int options)
+    : pid(pid), status(status), options(options), result(0) { }
+
+  EventLoop::Await resume(Shell *, short) override {
+    result = waitpid(pid, status, options | WNOHANG);
+    return 0 == result ? EventLoop::Await::child(pid)
+                       : EventLoop::Await::finish(0);
+  }
+
+  pid_t get_result() const {
+    return result;
+  }
+
+private:
+  pid_t pid;
+  int *status;
+  int options;
+  pid_t result;
+};
+
+// Waits for a descriptor on behalf of `EventLoop::wait_readable'.
+class ReadableWait : public EventLoop::Task {
+public:
+  explicit ReadableWait(int fd) : fd(fd) { }
+
+  EventLoop::Await resume(Shell *, short revents) override {
+    return 0 != revents ? EventLoop::Await::finish(0)
+                        : EventLoop::Await::readable(fd);
+  }
+
+private:
+  int fd;
+};
+
+}  // namespace
+
+EventLoop::Await EventLoop::Await::finish(int status) {
+  return Await { true, status, -1, 0, 0, 0 };
+}
+
+EventLoop::Await EventLoop::Await::readable(int fd, uint64_t deadline_ns) {
+  return Await { false, 0, fd, POLLIN, 0, deadline_ns };
+}
+
+EventLoop::Await EventLoop::Await::writable(int fd, uint64_t deadline_ns) {
+  return Await { false, 0, fd, POLLOUT, 0, deadline_ns };
+}
+
+EventLoop::Await EventLoop::Await::child(pid_t pid, uint64_t deadline_ns) {
+  return Await { false, 0, -1, 0, pid, deadline_ns };
+}
+
+EventLoop::Await EventLoop::Await::until(uint64_t deadline_ns) {
+  return Await { false, 0, -1, 0, 0, deadline_ns };
+}
+
+EventLoop::EventLoop(Shell *shell) : shell(shell), depth(0) { }
+
+EventLoop::~EventLoop() {
+  release();
+}
+
+int EventLoop::run(Task *task) {
+  entries.push_back(Entry { task, nullptr, Await::until(0), -1, 0, false,
+                            false, 0 });
+  Entry *entry = &entries.back();
+  resume(entry, 0);
+  while(!entry->await.done) {
+    step(-1);
+  }
+  int status = entry->await.status;
+  for(auto it = entries.begin(); it != entries.end(); ++it) {
+    if(&*it == entry) {
+      entries.erase(it);
+      break;
+    }
+  }
+  return status;
+}
+
+void EventLoop::spawn(shared_ptr<Task> task) {
+  entries.push_back(Entry { task.get(), task, Await::until(0), -1, 0, false,
+                            false, 0 });
+  resume(&entries.back(), 0);
+}
+
+void EventLoop::run_ready() {
+  if(is_busy()) {
+    step(0);
+  }
+}
+
+bool EventLoop::is_busy() const {
+  return !entries.empty() || shell->get_jobs().get_output().is_draining();
+}
+
+pid_t EventLoop::wait_for(pid_t pid, int *status, int options) {
+  if(0 != (options & WNOHANG) || !is_busy()) {
+    return waitpid(pid, status, options);
+  }
+  ChildWait wait(pid, status, options);
+  run(&wait);
+  return wait.get_result();
+}
+
+void EventLoop::wait_readable(int fd) {
+  if(!is_busy()) {
+    return;
+  }
+  ReadableWait wait(fd);
+  run(&wait);
+}
+
+void EventLoop::release() {
+  for(Entry& entry : entries) {
+    if(-1 != entry.pidfd) {
+      close(entry.pidfd);
+    }
+  }
+  entries.clear();
+  depth = 0;
+}
+
+void EventLoop::resume(Entry *entry, short revents) {
+  if(-1 != entry->pidfd) {
+    close(entry->pidfd);
+    entry->pidfd = -1;
+  }
+  entry->ready = false;
+  entry->running = true;
+  entry->await = entry->task->resume(shell, revents);
+  entry->running = false;
+
+  const Await& await = entry->await;
+  entry->wake_ns = await.deadline_ns;
+  if(!await.done && 0 != await.pid) {
+    entry->pidfd = open_pidfd(await.pid);
+    uint64_t check = util::monotonic_ns()
+      + (-1 != entry->pidfd ? CHILD_INTERVAL_NS
+                            : CHILD_INTERVAL_WITHOUT_PIDFD_NS);
+    entry->wake_ns = 0 == entry->wake_ns ? check
+                                         : min(entry->wake_ns, check);
+  }
+}
+
+void EventLoop::step(int timeout_ms) {
+  ++depth;
+  polled.clear();
+  polled_entries.clear();
+  uint64_t wake_ns = 0;
+  for(Entry& entry : entries) {
+    entry.ready = false;
+    entry.revents = 0;
+    if(entry.running || entry.await.done) {
+      continue;
+    }
+    if(-1 != entry.await.fd) {
+      polled.push_back(pollfd { entry.await.fd, entry.await.events, 0 });
+      polled_entries.push_back(&entry);
+    }
+    if(-1 != entry.pidfd) {
+      polled.push_back(pollfd { entry.pidfd, POLLIN, 0 });
+      polled_entries.push_back(&entry);
+    }
+    if(0 != entry.wake_ns && (0 == wake_ns || entry.wake_ns < wake_ns)) {
+      wake_ns = entry.wake_ns;
+    }
+  }
+  size_t task_fds = polled.size();
+  JobOutput& output = shell->get_jobs().get_output();
+  output.add_descriptors(&polled);
+
+  if(0 != wake_ns) {
+    uint64_t now = util::monotonic_ns();
+    int until_wake = now >= wake_ns ? 0 : (wake_ns - now + 999999) / 1000000;
+    if(-1 == timeout_ms || until_wake < timeout_ms) {
+      timeout_ms = until_wake;
+    }
+  }
+  if(poll(polled.data(), polled.size(), timeout_ms) > 0) {
+    for(size_t i = 0; i < task_fds; ++i) {
+      Entry *entry = polled_entries[i];
+      if(0 != polled[i].revents) {
+        entry->ready = true;
+        if(polled[i].fd == entry->await.fd) {
+          entry->revents = polled[i].revents;
+        }
+      }
+    }
+    output.read_ready(polled);
+  }
+
+  uint64_t now = util::monotonic_ns();
+  for(Entry& entry : entries) {
+    if(!entry.running && !entry.await.done
+       && (entry.ready || (0 != entry.wake_ns && now >= entry.wake_ns))) {
+      resume(&entry, entry.revents);
+    }
+  }
+
+  if(1 == depth) {
+    for(auto it = entries.begin(); it != entries.end(); ) {
+      if(it->await.done && nullptr != it->owned) {
+        it = entries.erase(it);
+      }
+      else {
+        ++it;
+      }
+    }
+  }
+  --depth;
+}
+
+}  // namespace core
+}  // namespace microshell
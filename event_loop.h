@@ -0,0 +1,130 @@
+#ifndef MICROSHELL_CORE_EVENT_LOOP_H
+#define MICROSHELL_CORE_EVENT_LOOP_H
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <vector>
+
+#include <poll.h>
+#include <sys/types.h>
+
+namespace microshell {
+namespace core {
+
+class Shell;
+
+// Runs the shell's tasks--builtins which have to wait for something (see
+// `AsyncBuiltinCommand'), and the shell's own background chores--in its one
+// thread, so that none of them blocks the others while it waits.
+//
+// A task is a resumable function: each call to `resume()' does what it can
+// without blocking, then returns what it waits for next (an `Await'),
+// keeping whatever it needs to carry on in its members.  The loop resumes it
+// once that happens.  While any task waits, the loop also drains the output
+// of the background jobs (see `JobOutput').
+class EventLoop {
+public:
+  // What a task waits for: any of the conditions set (the first one to
+  // happen resumes it), or nothing, once it's done.
+  struct Await {
+    bool done;
+    // The exit status, once done.
+    int status;
+    // A descriptor to become ready for `events' (`POLLIN', ...), or -1.
+    int fd;
+    short events;
+    // A child to change state (exit, but also stop or continue), or 0.
+    // Stops are only noticed every so often, so the task should check with
+    // `waitpid(WNOHANG)' when resumed.
+    pid_t pid;
+    // A `util::monotonic_ns()' time to pass, or 0.
+    uint64_t deadline_ns;
+
+    static Await finish(int status);
+    static Await readable(int fd, uint64_t deadline_ns = 0);
+    static Await writable(int fd, uint64_t deadline_ns = 0);
+    static Await child(pid_t pid, uint64_t deadline_ns = 0);
+    static Await until(uint64_t deadline_ns);
+  };
+
+  class Task {
+  public:
+    virtual ~Task() { }
+
+    // Carries on from where the previous call left off.  `revents' holds
+    // what happened to the descriptor waited for, or 0 if something else
+    // (or nothing, on the first call) resumed the task.
+    virtual Await resume(Shell *shell, short revents) = 0;
+  };
+
+  EventLoop(Shell *shell);
+  ~EventLoop();
+
+  // Runs `task' until it's done, along with every other task, and returns
+  // its exit status.  May be called from within a task.
+  int run(Task *task);
+
+  // Starts `task', which then runs whenever the loop does, until it's done.
+  void spawn(std::shared_ptr<Task> task);
+
+  // Resumes the tasks which can go on, without blocking.  Cheap when there's
+  // nothing to do; called between commands and while readline is idle.
+  void run_ready();
+
+  // Whether there is anything for `run_ready()' to do: tasks or job output
+  // to drain.
+  bool is_busy() const;
+
+  // `waitpid(pid, status, options)', blocking as long as that would, but
+  // running the loop in the meantime (if it has anything to do).
+  pid_t wait_for(pid_t pid, int *status, int options);
+
+  // Waits until `fd' can be read from, running the loop in the meantime (if
+  // it has anything to do): what a builtin reads may come from a task,
+  // e.g. a here-document fed through a pipe.
+  void wait_readable(int fd);
+
+  // Forgets every task, after a fork: they belong to the parent.
+  void release();
+
+private:
+  struct Entry {
+    Task *task;
+    // Set for spawned tasks, which the loop owns.
+    std::shared_ptr<Task> owned;
+    Await await;
+    // A pidfd for `await.pid', or -1.
+    int pidfd;
+    // When the task is resumed regardless (e.g. to look for a stop).
+    uint64_t wake_ns;
+    // Whether the task is in `resume()' (possibly running the loop).
+    bool running;
+    // What `step()' found.
+    bool ready;
+    short revents;
+  };
+
+  // Resumes `entry', and sets up what it waits for next.
+  void resume(Entry *entry, short revents);
+
+  // Waits for at most `timeout_ms' (-1 for as long as it takes) for a task
+  // to be able to go on, and resumes those which can.
+  void step(int timeout_ms);
+
+  Shell *shell;
+  std::list<Entry> entries;
+  // Nested `step()' calls.  Only the outermost one removes spawned tasks
+  // which are done, so that the others can keep going through `entries'.
+  int depth;
+
+  // Reused between calls.
+  std::vector<struct pollfd> polled;
+  // The task each of the first `polled' descriptors is for.
+  std::vector<Entry*> polled_entries;
+};
+
+}  // namespace core
+}  // namespace microshell
+
+#endif  // MICROSHELL_CORE_EVENT_LOOP_H
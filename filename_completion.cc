@@ -0,0 +1,175 @@
+#include "filename_completion.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "util.h"
+
+namespace microshell {
+namespace core {
+
+using namespace std;
+
+namespace {
+
+// How many directories' listings are kept.
+const size_t MAX_LISTINGS = 4;
+// How much `getdents64' is asked for at a time.
+const size_t BATCH_SIZE = 256 * 1024;
+
+// The kernel's record, which glibc doesn't declare.
+struct LinuxDirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+bool has_input(int fd) {
+  struct pollfd input { fd, POLLIN, 0 };
+  return poll(&input, 1, 0) > 0;
+}
+
+bool same_time(const struct timespec& a, const struct timespec& b) {
+  return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+}  // namespace
+
+FilenameCompletion::FilenameCompletion() : buffer(BATCH_SIZE) { }
+
+FilenameCompletion::~FilenameCompletion() {
+  for(Listing& listing : listings) {
+    close_listing(&listing);
+  }
+}
+
+FilenameCompletion::Status FilenameCompletion::complete(
+    const string& directory, const string& prefix, uint64_t budget_ns,
+    int input_fd, vector<string> *matches) {
+  Listing *listing = get_listing(directory);
+  if(nullptr == listing) {
+    return Status::FAILED;
+  }
+
+  Status status = Status::COMPLETE;
+  uint64_t deadline = util::monotonic_ns() + budget_ns;
+  while(-1 != listing->fd && read_batch(listing)) {
+    if(util::monotonic_ns() >= deadline) {
+      status = Status::PARTIAL;
+      break;
+    }
+    if(-1 != input_fd && has_input(input_fd)) {
+      status = Status::CANCELLED;
+      break;
+    }
+  }
+
+  bool hidden = !prefix.empty() && '.' == prefix[0];
+  const char *names = listing->names.data();
+  size_t count = listing->offsets.size() - 1;
+  for(size_t i = 0; i < count; ++i) {
+    const char *name = names + listing->offsets[i];
+    size_t length = listing->offsets[i + 1] - listing->offsets[i];
+    if(length >= prefix.length()
+       && 0 == memcmp(name, prefix.data(), prefix.length())
+       && (hidden || '.' != name[0])) {
+      matches->emplace_back(name, length);
+    }
+  }
+  return status;
+}
+
+size_t FilenameCompletion::get_listed(const string& directory) const {
+  for(const Listing& listing : listings) {
+    if(directory == listing.directory) {
+      return listing.offsets.size() - 1;
+    }
+  }
+  return 0;
+}
+
+FilenameCompletion::Listing* FilenameCompletion::get_listing(
+    const string& directory) {
+  struct stat info;
+  if(-1 == stat(directory.c_str(), &info) || !S_ISDIR(info.st_mode)) {
+    return nullptr;
+  }
+
+  for(auto it = listings.begin(); it != listings.end(); ++it) {
+    if(directory != it->directory) {
+      continue;
+    }
+    if(same_time(info.st_mtim, it->mtime)) {
+      listings.splice(listings.begin(), listings, it);
+      return &listings.front();
+    }
+    // Entries came or went since; start over.
+    close_listing(&*it);
+    listings.erase(it);
+    break;
+  }
+
+  int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if(-1 == fd) {
+    return nullptr;
+  }
+  while(listings.size() >= MAX_LISTINGS) {
+    close_listing(&listings.back());
+    listings.pop_back();
+  }
+  listings.push_front(Listing());
+  Listing& listing = listings.front();
+  listing.directory = directory;
+  listing.mtime = info.st_mtim;
+  listing.fd = fd;
+  listing.offsets.push_back(0);
+  return &listing;
+}
+
+bool FilenameCompletion::read_batch(Listing *listing) {
+  long length;
+  do {
+    length = syscall(SYS_getdents64, listing->fd, buffer.data(),
+                     buffer.size());
+  } while(-1 == length && EINTR == errno);
+  if(length <= 0) {
+    close_listing(listing);
+    return false;
+  }
+
+  for(long offset = 0; offset < length; ) {
+    const LinuxDirent64 *entry =
+      reinterpret_cast<const LinuxDirent64*>(buffer.data() + offset);
+    offset += entry->d_reclen;
+    const char *name = entry->d_name;
+    if('.' == name[0]
+       && ('\0' == name[1] || ('.' == name[1] && '\0' == name[2]))) {
+      continue;
+    }
+    listing->names.append(name);
+    listing->offsets.push_back(listing->names.size());
+  }
+  return true;
+}
+
+void FilenameCompletion::close_listing(Listing *listing) {
+  if(-1 != listing->fd) {
+    close(listing->fd);
+    listing->fd = -1;
+  }
+}
+
+}  // namespace core
+}  // namespace microshell
@@ -0,0 +1,78 @@
+#ifndef MICROSHELL_CORE_FILENAME_COMPLETION_H
+#define MICROSHELL_CORE_FILENAME_COMPLETION_H
+
+#include <cstdint>
+#include <list>
+#include <string>
+#include <vector>
+
+#include <time.h>
+
+namespace microshell {
+namespace core {
+
+// Filename completion which copes with directories of millions of entries.
+// Backs the shell's Tab completion.
+//
+// Directories are listed with `getdents64' in large batches, within a time
+// budget per attempt; whatever has been listed when it runs out is matched
+// and the listing picks up where it stopped on the next attempt.  Pending
+// input (the next keystroke) cancels an attempt the same way.  Listings are
+// packed into one buffer each and kept for a few directories, for as long
+// as the directory's modification time doesn't change.
+class FilenameCompletion {
+public:
+  enum class Status {
+    // The whole directory was searched.
+    COMPLETE,
+    // The time budget ran out first; the matches are from part of it.
+    PARTIAL,
+    // Input arrived first; the matches are from part of it.
+    CANCELLED,
+    // The directory couldn't be read.
+    FAILED
+  };
+
+  FilenameCompletion();
+  ~FilenameCompletion();
+
+  // Collects the entries of `directory' (an absolute path) whose names
+  // start with `prefix'.  Hidden entries only match prefixes starting with
+  // `.'.  Gives up after `budget_ns', or as soon as `input_fd' (if not -1)
+  // becomes readable.
+  Status complete(const std::string& directory, const std::string& prefix,
+                  uint64_t budget_ns, int input_fd,
+                  std::vector<std::string> *matches);
+
+  // How many entries of `directory' are known so far.
+  size_t get_listed(const std::string& directory) const;
+
+private:
+  struct Listing {
+    std::string directory;
+    struct timespec mtime;
+    // Open while the listing is incomplete.
+    int fd;
+    // Names back to back; entry `i' spans [offsets[i], offsets[i + 1]).
+    std::string names;
+    std::vector<uint32_t> offsets;
+  };
+
+  // Finds (moving it to the front) or starts the listing of `directory'.
+  Listing* get_listing(const std::string& directory);
+
+  // Reads one batch of entries.  Returns false once the listing is done (or
+  // on error).
+  bool read_batch(Listing *listing);
+
+  void close_listing(Listing *listing);
+
+  // Most recently used first.
+  std::list<Listing> listings;
+  std::vector<char> buffer;
+};
+
+}  // namespace core
+}  // namespace microshell
+
+#endif  // MICROSHELL_CORE_FILENAME_COMPLETION_H
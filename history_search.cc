@@ -0,0 +1,289 @@
+#include "history_search.h"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MICROSHELL_HAVE_X86 1
+#endif
+
+namespace microshell {
+namespace core {
+
+using namespace std;
+
+namespace {
+
+// Scoring weights.  Matches are worth a lot more than history rank, so that
+// a good match of an old command beats a poor match of a recent one.
+const int MATCH_BONUS = 16;
+const int CONSECUTIVE_BONUS = 12;
+const int WORD_START_BONUS = 8;
+const int PREFIX_BONUS = 12;
+const int MAX_GAP_PENALTY = 6;
+const int MAX_RECENCY_BONUS = 12;
+const int MAX_FREQUENCY_BONUS = 8;
+
+inline char fold(char c) {
+  return ('A' <= c && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+}
+
+inline bool is_word_separator(char c) {
+  return ' ' == c || '/' == c || '-' == c || '_' == c || '.' == c
+      || '=' == c || '\t' == c;
+}
+
+inline int log2_floor(uint64_t value) {
+  int result = 0;
+  while(value > 1) {
+    value >>= 1;
+    ++result;
+  }
+  return result;
+}
+
+// Appends to `out' the indices in [begin, end) whose mask contains all the
+// bits of `query'.
+typedef void (*FilterFunction)(const uint64_t*, uint32_t, uint32_t, uint64_t,
+                               vector<uint32_t>*);
+
+void filter_scalar(const uint64_t *masks, uint32_t begin, uint32_t end,
+                   uint64_t query, vector<uint32_t> *out) {
+  for(uint32_t i = begin; i < end; ++i) {
+    if(query == (masks[i] & query)) {
+      out->push_back(i);
+    }
+  }
+}
+
+#ifdef MICROSHELL_HAVE_X86
+// SSE2 has no 64-bit compare, so two masks are compared as four 32-bit
+// halves, and each mask matches only if both of its halves do.
+__attribute__((target("sse2")))
+void filter_sse2(const uint64_t *masks, uint32_t begin, uint32_t end,
+                 uint64_t query, vector<uint32_t> *out) {
+  const __m128i wanted = _mm_set1_epi64x(static_cast<long long>(query));
+  uint32_t i = begin;
+  for(; i + 2 <= end; i += 2) {
+    __m128i block = _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(masks + i));
+    __m128i equal = _mm_cmpeq_epi32(_mm_and_si128(block, wanted), wanted);
+    equal = _mm_and_si128(equal,
+                          _mm_shuffle_epi32(equal, _MM_SHUFFLE(2, 3, 0, 1)));
+    int bits = _mm_movemask_pd(_mm_castsi128_pd(equal));
+    if(bits & 1) out->push_back(i);
+    if(bits & 2) out->push_back(i + 1);
+  }
+  filter_scalar(masks, i, end, query, out);
+}
+
+__attribute__((target("avx2")))
+void filter_avx2(const uint64_t *masks, uint32_t begin, uint32_t end,
+                 uint64_t query, vector<uint32_t> *out) {
+  const __m256i wanted = _mm256_set1_epi64x(static_cast<long long>(query));
+  uint32_t i = begin;
+  for(; i + 4 <= end; i += 4) {
+    __m256i block = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i*>(masks + i));
+    __m256i equal = _mm256_cmpeq_epi64(_mm256_and_si256(block, wanted),
+                                       wanted);
+    int bits = _mm256_movemask_pd(_mm256_castsi256_pd(equal));
+    // Most entries get rejected, so skip the whole block in one go.
+    if(0 == bits) {
+      continue;
+    }
+    if(bits & 1) out->push_back(i);
+    if(bits & 2) out->push_back(i + 1);
+    if(bits & 4) out->push_back(i + 2);
+    if(bits & 8) out->push_back(i + 3);
+  }
+  filter_scalar(masks, i, end, query, out);
+}
+#endif
+
+FilterFunction select_filter(const char **name) {
+#ifdef MICROSHELL_HAVE_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) {
+    *name = "avx2";
+    return filter_avx2;
+  }
+  if(__builtin_cpu_supports("sse2")) {
+    *name = "sse2";
+    return filter_sse2;
+  }
+#endif
+  *name = "scalar";
+  return filter_scalar;
+}
+
+const char *filter_name = nullptr;
+const FilterFunction filter = select_filter(&filter_name);
+
+}  // namespace
+
+HistorySearch::HistorySearch() : sequence(0), has_last(false) {
+  offsets.push_back(0);
+}
+
+const char* HistorySearch::get_filter_implementation() {
+  return filter_name;
+}
+
+uint64_t HistorySearch::char_mask(unsigned char c) {
+  c = static_cast<unsigned char>(fold(static_cast<char>(c)));
+  if('a' <= c && c <= 'z') {
+    return 1ULL << (c - 'a');
+  }
+  if('0' <= c && c <= '9') {
+    return 1ULL << (26 + c - '0');
+  }
+  // Everything else shares the remaining 28 bits.  Collisions only make
+  // the filter less selective, never wrong.
+  return 1ULL << (36 + c % 28);
+}
+
+void HistorySearch::add(const string& command) {
+  ++sequence;
+  auto it = index.find(command);
+  if(index.end() != it) {
+    ++frequency[it->second];
+    last_used[it->second] = sequence;
+    return;
+  }
+
+  uint32_t entry = static_cast<uint32_t>(masks.size());
+  uint64_t mask = 0;
+  for(char c : command) {
+    text.push_back(c);
+    folded.push_back(fold(c));
+    mask |= char_mask(static_cast<unsigned char>(c));
+  }
+  offsets.push_back(static_cast<uint32_t>(text.size()));
+  masks.push_back(mask);
+  frequency.push_back(1);
+  last_used.push_back(sequence);
+  index[command] = entry;
+
+  // The previous candidates don't include the new entry.
+  has_last = false;
+}
+
+string HistorySearch::get(uint32_t entry) const {
+  return string(text.data() + offsets[entry],
+                offsets[entry + 1] - offsets[entry]);
+}
+
+size_t HistorySearch::size() const {
+  return masks.size();
+}
+
+bool HistorySearch::match(uint32_t entry, const string& query,
+                          int *score) const {
+  const char *start = folded.data() + offsets[entry];
+  const char *end = folded.data() + offsets[entry + 1];
+  const char *position = start;
+  const char *previous = nullptr;
+  int result = 0;
+
+  for(char c : query) {
+    const char *found = static_cast<const char*>(
+        memchr(position, c, end - position));
+    if(nullptr == found) {
+      return false;
+    }
+
+    result += MATCH_BONUS;
+    if(start == found) {
+      result += PREFIX_BONUS;
+    }
+    else if(is_word_separator(found[-1])) {
+      result += WORD_START_BONUS;
+    }
+    if(nullptr != previous) {
+      if(found == previous + 1) {
+        result += CONSECUTIVE_BONUS;
+      }
+      else {
+        result -= min(static_cast<int>(found - previous - 1),
+                      MAX_GAP_PENALTY);
+      }
+    }
+
+    previous = found;
+    position = found + 1;
+  }
+
+  // Prefer tighter entries: `make' should rank `make' over `make install'.
+  result -= min(static_cast<int>(end - position), MAX_GAP_PENALTY);
+  *score = result;
+  return true;
+}
+
+int HistorySearch::rank_bonus(uint32_t entry) const {
+  int age = log2_floor(sequence - last_used[entry] + 1);
+  return max(MAX_RECENCY_BONUS - age, 0)
+      + min(2 * log2_floor(frequency[entry]), MAX_FREQUENCY_BONUS);
+}
+
+vector<HistorySearch::Match> HistorySearch::search(const string& query,
+                                                   size_t limit) {
+  string needle;
+  needle.reserve(query.size());
+  uint64_t query_mask = 0;
+  for(char c : query) {
+    needle.push_back(fold(c));
+    query_mask |= char_mask(static_cast<unsigned char>(c));
+  }
+
+  // Candidates must contain every character of the query.  If the query
+  // only grew since last time, its matches are a subset of the previous
+  // ones, so there's no need to look at the whole history again.
+  vector<uint32_t> candidates;
+  if(has_last && 0 == needle.compare(0, last_query.size(), last_query)) {
+    for(uint32_t entry : last_candidates) {
+      if(query_mask == (masks[entry] & query_mask)) {
+        candidates.push_back(entry);
+      }
+    }
+  }
+  else {
+    filter(masks.data(), 0, static_cast<uint32_t>(masks.size()), query_mask,
+           &candidates);
+  }
+
+  vector<Match> matches;
+  vector<uint32_t> matched;
+  for(uint32_t entry : candidates) {
+    int score;
+    if(match(entry, needle, &score)) {
+      matches.push_back(Match{entry, score + rank_bonus(entry)});
+      matched.push_back(entry);
+    }
+  }
+  last_query = needle;
+  last_candidates.swap(matched);
+  has_last = true;
+
+  auto better = [this](const Match& a, const Match& b) {
+    if(a.score != b.score) {
+      return a.score > b.score;
+    }
+    return last_used[a.entry] > last_used[b.entry];
+  };
+  if(matches.size() > limit) {
+    partial_sort(matches.begin(), matches.begin() + limit, matches.end(),
+                 better);
+    matches.resize(limit);
+  }
+  else {
+    sort(matches.begin(), matches.end(), better);
+  }
+  return matches;
+}
+
+}  // namespace core
+}  // namespace microshell
@@ -0,0 +1,77 @@
+#ifndef MICROSHELL_CORE_HISTORY_SEARCH_H
+#define MICROSHELL_CORE_HISTORY_SEARCH_H
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace microshell {
+namespace core {
+
+// Fuzzy search over the command history, ranked by match quality, recency
+// and frequency.  Backs the shell's `C-r' binding.
+//
+// Entries are packed back to back in one buffer (plus a case-folded copy),
+// and every entry carries a 64-bit bitmap of the characters it contains.
+// A query first filters candidates by bitmap--vectorized with AVX2 or SSE2
+// where available, scalar otherwise--and only the survivors get the
+// (comparatively slow) subsequence matching and scoring.  Typing another
+// character only re-examines the previous query's matches.
+class HistorySearch {
+public:
+  struct Match {
+    uint32_t entry;
+    int score;
+  };
+
+  HistorySearch();
+
+  // Records a command.  Repeated commands are stored once, with their
+  // frequency and recency updated.
+  void add(const std::string& command);
+
+  // Returns up to `limit' matches for `query', best first: by how well they
+  // match (tighter entries first), plus a bonus for recent and frequent
+  // commands, with ties going to the most recent.  An empty query matches
+  // everything, ranked the same way (i.e. by length and the bonus).
+  std::vector<Match> search(const std::string& query, size_t limit);
+
+  std::string get(uint32_t entry) const;
+  size_t size() const;
+
+  // Which filtering implementation this CPU gets (`avx2', `sse2' or
+  // `scalar').
+  static const char* get_filter_implementation();
+
+private:
+  static uint64_t char_mask(unsigned char c);
+
+  // Scores `query' (already case-folded) as a subsequence of `entry'.
+  // Returns false if it isn't one.
+  bool match(uint32_t entry, const std::string& query, int *score) const;
+
+  int rank_bonus(uint32_t entry) const;
+
+  // Original and case-folded text of all entries, back to back.  Entry `i'
+  // spans [offsets[i], offsets[i + 1]).
+  std::vector<char> text;
+  std::vector<char> folded;
+  std::vector<uint32_t> offsets;
+  std::vector<uint64_t> masks;
+  std::vector<uint32_t> frequency;
+  // The value of `sequence' when each entry was last used.
+  std::vector<uint64_t> last_used;
+  std::unordered_map<std::string, uint32_t> index;
+  uint64_t sequence;
+
+  // The previous query and the entries it matched, for incremental search.
+  std::string last_query;
+  std::vector<uint32_t> last_candidates;
+  bool has_last;
+};
+
+}  // namespace core
+}  // namespace microshell
+
+#endif  // MICROSHELL_CORE_HISTORY_SEARCH_H
@@ -0,0 +1,142 @@
+#include "input_buffer.h"
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace microshell {
+namespace core {
+
+using namespace std;
+
+namespace {
+
+// How much is read at a time.
+const size_t BLOCK_SIZE = 64 * 1024;
+
+}  // namespace
+
+InputBuffer::InputBuffer() :
+    device(0),
+    inode(0),
+    seekable(false),
+    mtime { 0, 0 },
+    size(0),
+    offset(0),
+    start(0) { }
+
+bool InputBuffer::read_line(int fd, const char **line, size_t *length,
+                            bool *complete, bool block) {
+  struct stat info;
+  if(-1 == fstat(fd, &info)) {
+    return false;
+  }
+  bool regular = S_ISREG(info.st_mode);
+  off_t position = 0;
+  if(regular && -1 == (position = lseek(fd, 0, SEEK_CUR))) {
+    return false;
+  }
+
+  if(info.st_dev != device || info.st_ino != inode || regular != seekable) {
+    reset(info, position);
+  }
+  else if(regular) {
+    // Someone else may have read from (or written to) the file since.
+    if(info.st_mtim.tv_sec != mtime.tv_sec
+       || info.st_mtim.tv_nsec != mtime.tv_nsec || info.st_size != size
+       || position < offset
+       || position > offset + static_cast<off_t>(data.size())) {
+      reset(info, position);
+    }
+    else {
+      start = position - offset;
+    }
+  }
+
+  size_t scanned = start;
+  while(true) {
+    const char *newline = static_cast<const char*>(
+      memchr(data.data() + scanned, '\n', data.size() - scanned));
+    if(nullptr != newline) {
+      *line = data.data() + start;
+      *length = newline - *line;
+      *complete = true;
+      start = newline - data.data() + 1;
+      break;
+    }
+    scanned = data.size();
+
+    // Make room by dropping what has been read, once that's most of it.
+    if(start > 0 && start >= data.size() / 2) {
+      data.erase(0, start);
+      offset += start;
+      scanned -= start;
+      start = 0;
+    }
+    if(!block && !seekable) {
+      struct pollfd input { fd, POLLIN, 0 };
+      if(0 == poll(&input, 1, 0)) {
+        errno = EAGAIN;
+        return false;
+      }
+    }
+    ssize_t count = fill(fd);
+    if(-1 == count) {
+      return false;
+    }
+    if(0 == count) {
+      if(start == data.size()) {
+        errno = 0;
+        return false;
+      }
+      *line = data.data() + start;
+      *length = data.size() - start;
+      *complete = false;
+      start = data.size();
+      break;
+    }
+  }
+
+  if(seekable) {
+    // Hand the rest back.
+    lseek(fd, offset + start, SEEK_SET);
+  }
+  return true;
+}
+
+bool InputBuffer::has_unread(int fd) {
+  struct stat info;
+  return !seekable && start < data.size() && -1 != fstat(fd, &info)
+    && info.st_dev == device && info.st_ino == inode;
+}
+
+void InputBuffer::reset(const struct stat& info, off_t offset) {
+  device = info.st_dev;
+  inode = info.st_ino;
+  seekable = S_ISREG(info.st_mode);
+  mtime = info.st_mtim;
+  size = info.st_size;
+  this->offset = offset;
+  data.clear();
+  start = 0;
+}
+
+ssize_t InputBuffer::fill(int fd) {
+  size_t old_size = data.size();
+  data.resize(old_size + BLOCK_SIZE);
+  ssize_t count;
+  do {
+    count = seekable ? pread(fd, &data[old_size], BLOCK_SIZE,
+                             offset + old_size)
+                     : read(fd, &data[old_size], BLOCK_SIZE);
+  } while(-1 == count && EINTR == errno);
+  data.resize(old_size + (count > 0 ? count : 0));
+  return count;
+}
+
+}  // namespace core
+}  // namespace microshell
@@ -0,0 +1,73 @@
+#ifndef MICROSHELL_CORE_INPUT_BUFFER_H
+#define MICROSHELL_CORE_INPUT_BUFFER_H
+
+#include <cstddef>
+#include <string>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+namespace microshell {
+namespace core {
+
+// Reads lines for the `read' builtin in large blocks rather than a byte at
+// a time, without taking more input than the line from anybody else.
+//
+// On regular files (including here-documents) whatever follows the line is
+// handed back by moving the file offset to right after it, so that the
+// next command--builtin or not--starts there.  The block stays buffered,
+// and is used again as long as the file and the offset still match.
+//
+// Pipes and terminals can't take input back, so the rest of the block is
+// kept for the next `read' from the same pipe; commands run in between
+// (e.g. `cat' inside a `while read' loop) don't see it.  The shell itself
+// does, though, when it reads its commands from the same pipe (see
+// `has_unread()').
+class InputBuffer {
+public:
+  InputBuffer();
+
+  // Reads the next line from `fd'.  On success `*line' (valid until the
+  // next call) holds `*length' bytes, without the newline; `*complete' says
+  // whether there was one (i.e. false for an unterminated last line).
+  // Returns false at end of input, or on error (with `errno' set, and
+  // nonzero).  Unless `block', also returns false (with `errno' set to
+  // `EAGAIN') rather than wait for more input, keeping what it has read so
+  // far for the next call.
+  bool read_line(int fd, const char **line, size_t *length, bool *complete,
+                 bool block = true);
+
+  // Whether some of what was read from the pipe (or terminal) `fd' wasn't
+  // used yet, i.e. whether the next line has to come from `read_line()'.
+  bool has_unread(int fd);
+
+private:
+  // Drops the buffered data, which now belongs to the file `info'
+  // describes, starting at `offset' (for regular files).
+  void reset(const struct stat& info, off_t offset);
+
+  // Appends up to a block to the buffered data.  Returns how much was read
+  // (0 at end of input), or -1 on error.
+  ssize_t fill(int fd);
+
+  // Identifies the file the data came from.
+  dev_t device;
+  ino_t inode;
+  // Regular files only: when it was last modified, and its size then (so
+  // that a file rewritten in the meantime isn't served from the buffer),
+  // and where in it the data starts.
+  bool seekable;
+  struct timespec mtime;
+  off_t size;
+  off_t offset;
+
+  std::string data;
+  // Where unread data starts.
+  size_t start;
+};
+
+}  // namespace core
+}  // namespace microshell
+
+#endif  // MICROSHELL_CORE_INPUT_BUFFER_H
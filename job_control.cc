@@ -1,6 +1,19 @@
 #include "job_control.h"
 
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
 #include <csignal>
+#include <cstdio>
+#include <cstdlib>
+
+#include <termios.h>
+#include <unistd.h>
+
+#include "job_table.h"
+#include "process_monitor.h"
 
 // Helper macro for instantiating builtin factories.
 #define _(name, type) (std::make_shared<TypedBuiltinFactory<type>>(TypedBuiltinFactory<type>(name)))
@@ -22,7 +35,8 @@ vector<shared_ptr<BuiltinFactory>> JobControl::get_builtins() {
     _("fg", FgBuiltin),
     _("jobs", JobsBuiltin),
     _("kill", KillBuiltin),
-    _("killall", KillallBuiltin)
+    _("killall", KillallBuiltin),
+    _("wait", WaitBuiltin)
   };
 }
 
@@ -38,8 +52,248 @@ int FgBuiltin::invoke(Shell *) {
   return 0;
 }
 
-int JobsBuiltin::invoke(Shell *) {
-  return 0;
+namespace {
+
+// How often `jobs --top' refreshes, unless told otherwise.
+const double DEFAULT_TOP_INTERVAL = 1.0;
+// How many lines of output `jobs -o' shows, unless told otherwise.
+const long DEFAULT_OUTPUT_LINES = 10;
+
+// Kept around between invocations, so that CPU usage is measured since the
+// previous sample, and so that its descriptors are reused.
+ProcessMonitor& get_monitor() {
+  static ProcessMonitor monitor;
+  return monitor;
+}
+
+string describe_state(Job::State state) {
+  switch(state) {
+    case Job::State::DEFERRED: return "Deferred";
+    case Job::State::RUNNING: return "Running";
+    case Job::State::STOPPED: return "Stopped";
+    case Job::State::DONE:    return "Done";
+  }
+  return "?";
+}
+
+string format_bytes(uint64_t bytes) {
+  const char *units = "BKMGT";
+  double value = bytes;
+  int unit = 0;
+  while(value >= 1024 && unit < 4) {
+    value /= 1024;
+    ++unit;
+  }
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), unit ? "%.1f%c" : "%.0f%c", value,
+           units[unit]);
+  return buffer;
+}
+
+// Lists the jobs, and with `detailed', a line per process of each.
+string render_jobs(const vector<Job>& jobs, bool detailed) {
+  string text;
+  vector<ProcessSample> samples;
+  if(detailed) {
+    set<pid_t> leaders;
+    for(const Job& job : jobs) {
+      if(0 != job.pid && Job::State::DONE != job.state) {
+        leaders.insert(job.pid);
+      }
+    }
+    samples = get_monitor().sample(leaders);
+  }
+
+  char line[256];
+  for(const Job& job : jobs) {
+    text += "[" + to_string(job.id) + "]  " + describe_state(job.state)
+      + "\t" + job.command + "\n";
+    if(!detailed || Job::State::DONE == job.state
+       || Job::State::DEFERRED == job.state) {
+      continue;
+    }
+
+    snprintf(line, sizeof(line), "    %7s %s %6s %8s %8s %8s  %s\n",
+             "PID", "S", "CPU%", "RSS", "READ", "WRITE", "NAME");
+    text += line;
+    for(const ProcessSample& sample : samples) {
+      if(sample.pid != job.pid && sample.pgrp != job.pid) {
+        continue;
+      }
+      snprintf(line, sizeof(line), "    %7d %c %6.1f %8s %8s %8s  %s\n",
+               static_cast<int>(sample.pid), sample.state,
+               sample.cpu_percent, format_bytes(sample.rss_bytes).c_str(),
+               sample.has_io ? format_bytes(sample.read_bytes).c_str() : "-",
+               sample.has_io ? format_bytes(sample.write_bytes).c_str() : "-",
+               sample.name.c_str());
+      text += line;
+    }
+  }
+  return text;
+}
+
+bool has_live_jobs(const vector<Job>& jobs) {
+  for(const Job& job : jobs) {
+    if(Job::State::DONE != job.state) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Prints the latest `lines' lines of output of the jobs `ids' (all of those
+// with output kept, if empty), each under a header if there are several.
+int show_output(Shell *shell, const vector<int>& ids, long lines) {
+  JobOutput& output = shell->get_jobs().get_output();
+  vector<int> shown = ids.empty() ? output.get_ids() : ids;
+  int status = 0;
+  string text;
+  for(size_t i = 0; i < shown.size(); ++i) {
+    int id = shown[i];
+    if(!output.peek(id, lines, &text)) {
+      shell->eout("jobs: no output kept for job " + to_string(id));
+      status = 1;
+      continue;
+    }
+    if(shown.size() > 1) {
+      cout << (i > 0 ? "\n" : "") << "==> [" << id << "] "
+           << output.get_command(id) << " <==\n";
+    }
+    cout << text;
+    if(!text.empty() && '\n' != text.back()) {
+      cout << "\n";
+    }
+  }
+  cout << flush;
+  return status;
+}
+
+}  // namespace
+
+EventLoop::Await JobsBuiltin::resume(Shell *shell, short revents) {
+  if(top) {
+    if(on_terminal && 0 != revents) {
+      char key;
+      if(read(STDIN_FILENO, &key, 1) < 0) {
+        // Nothing to do; we're stopping anyway.
+      }
+      return stop_top(0);
+    }
+    return refresh(shell);
+  }
+
+  bool detailed = false;
+  bool show = false;
+  double interval = DEFAULT_TOP_INTERVAL;
+  long count = -1;
+  vector<int> ids;
+
+  for(size_t i = 1; i < argv.size(); ++i) {
+    const string& opt = argv[i];
+    if("-l" == opt) {
+      detailed = true;
+    }
+    else if("--top" == opt) {
+      top = true;
+    }
+    else if("-o" == opt) {
+      show = true;
+    }
+    else if('%' == opt[0]) {
+      char *end;
+      long id = strtol(opt.c_str() + 1, &end, 10);
+      if(opt.size() < 2 || '\0' != *end || id <= 0) {
+        shell->eout("jobs: invalid job: " + opt);
+        return EventLoop::Await::finish(1);
+      }
+      ids.push_back(id);
+    }
+    else if("-d" == opt || "-n" == opt) {
+      if(i + 1 >= argv.size()) {
+        shell->eout("jobs: option requires an argument: " + opt);
+        return EventLoop::Await::finish(1);
+      }
+      const string& value = argv[++i];
+      char *end;
+      bool ok;
+      if("-d" == opt) {
+        interval = strtod(value.c_str(), &end);
+        ok = interval > 0;
+      }
+      else {
+        count = strtol(value.c_str(), &end, 10);
+        ok = count >= 0;
+      }
+      if(!ok || value.empty() || '\0' != *end) {
+        shell->eout("jobs: invalid value for " + opt + ": " + value);
+        return EventLoop::Await::finish(1);
+      }
+    }
+    else {
+      shell->eout("jobs: unknown option: " + opt);
+      return EventLoop::Await::finish(1);
+    }
+  }
+
+  if(!ids.empty() && !show) {
+    shell->eout("jobs: jobs can only be picked with -o");
+    return EventLoop::Await::finish(1);
+  }
+  if(show) {
+    shell->get_jobs().poll();
+    return EventLoop::Await::finish(show_output(
+      shell, ids, count >= 0 ? count : DEFAULT_OUTPUT_LINES));
+  }
+  if(top) {
+    this->interval = interval;
+    this->count = count > 0 ? count : 0;
+    on_terminal = isatty(STDIN_FILENO) && isatty(STDOUT_FILENO);
+    if(on_terminal) {
+      // Any key stops it, not just RET.
+      tcgetattr(STDIN_FILENO, &saved);
+      struct termios raw = saved;
+      raw.c_lflag &= ~(ICANON | ECHO);
+      raw.c_cc[VMIN] = 1;
+      raw.c_cc[VTIME] = 0;
+      tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+    }
+    return refresh(shell);
+  }
+
+  shell->get_jobs().poll();
+  cout << render_jobs(shell->get_jobs().get_jobs(), detailed) << flush;
+  return EventLoop::Await::finish(0);
+}
+
+// Redraws the detailed job list every `interval' seconds, until a key is
+// pressed, `count' refreshes are done (if nonzero) or no job is left.
+EventLoop::Await JobsBuiltin::refresh(Shell *shell) {
+  ++iteration;
+  shell->get_jobs().poll();
+  const vector<Job>& jobs = shell->get_jobs().get_jobs();
+  string screen = render_jobs(jobs, true);
+  if(on_terminal) {
+    screen = "\033[H\033[2J" + screen
+      + "\n(refreshing every " + to_string(interval).substr(0, 4)
+      + "s, press any key to stop)\n";
+  }
+  cout << screen << flush;
+
+  if((count > 0 && iteration >= count) || !has_live_jobs(jobs)) {
+    return stop_top(0);
+  }
+  uint64_t deadline = util::monotonic_ns()
+    + static_cast<uint64_t>(interval * 1000000000);
+  // Off a terminal, don't eat the script's (or pipe's) input.
+  return on_terminal ? EventLoop::Await::readable(STDIN_FILENO, deadline)
+                     : EventLoop::Await::until(deadline);
+}
+
+EventLoop::Await JobsBuiltin::stop_top(int status) {
+  if(on_terminal) {
+    tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+  }
+  return EventLoop::Await::finish(status);
 }
 
 int KillBuiltin::invoke(Shell *) {
@@ -50,8 +304,60 @@ int KillallBuiltin::invoke(Shell *) {
   return 0;
 }
 
-int WaitBuiltin::invoke(Shell *) {
-  return 0;
+EventLoop::Await WaitBuiltin::resume(Shell *shell, short) {
+  JobTable& jobs = shell->get_jobs();
+  // Whatever happened since, it's time to look.
+  shell->start_deferred_jobs();
+  jobs.poll();
+  // Deferred jobs only start once admission control lets them.
+  EventLoop::Await later = EventLoop::Await::until(
+    util::monotonic_ns() + AdmissionControl::SAMPLE_INTERVAL_NS);
+
+  if(1 == argv.size()) {
+    for(const Job& job : jobs.get_jobs()) {
+      if(Job::State::DEFERRED == job.state && !shell->is_exit_requested()) {
+        return later;
+      }
+      if(Job::State::RUNNING == job.state) {
+        return EventLoop::Await::child(job.pid);
+      }
+    }
+    // Like in other shells, waiting for everything forgets about it too.
+    jobs.collect_finished();
+    return EventLoop::Await::finish(0);
+  }
+
+  for(; next < argv.size(); ++next) {
+    const string& arg = argv[next];
+    char *end;
+    bool by_id = '%' == arg[0];
+    long number = strtol(arg.c_str() + (by_id ? 1 : 0), &end, 10);
+    Job *job = nullptr;
+    if(!arg.empty() && '\0' == *end && number > 0) {
+      job = by_id ? jobs.find(number) : jobs.find_by_pid(number);
+    }
+    if(nullptr == job) {
+      shell->eout("wait: no such job: " + arg);
+      status = 127;
+      continue;
+    }
+    if(Job::State::DEFERRED == job->state) {
+      // It only starts once those deferred before it do.
+      if(!shell->is_exit_requested()) {
+        return later;
+      }
+      status = 1;
+      continue;
+    }
+    if(Job::State::RUNNING == job->state) {
+      return EventLoop::Await::child(job->pid);
+    }
+    status = job->status;
+    if(Job::State::DONE == job->state) {
+      jobs.remove(job->id);
+    }
+  }
+  return EventLoop::Await::finish(status);
 }
 
 }   // namespace job_control
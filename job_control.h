@@ -4,6 +4,8 @@
 #include <map>
 #include <string>
 
+#include <termios.h>
+
 #include "command.h"
 #include "shell.h"
 #include "shell_module.h"
@@ -23,9 +25,24 @@ namespace job_control {
  * Provides builtins:
  *    - fg
  *    - bg
- *    - jobs
+ *    - jobs [-l]
+ *    - jobs --top [-d SECONDS] [-n COUNT]
+ *
+ *      Lists the jobs.  With `-l', also shows the state, CPU usage, memory
+ *      and storage I/O of every process in each job, sampled from /proc;
+ *      `--top' keeps refreshing that view until a key is pressed.
+ *    - jobs -o [-n LINES] [%JOB...]
+ *
+ *      Shows the last LINES (10 by default, 0 for all that's kept) lines of
+ *      output of the given jobs (or of all of them), without stopping them.
+ *      Only jobs started with `USH_JOB_OUTPUT=capture' have any (see
+ *      `JobOutput'); it's kept for a while after they finish.
  *    - kill
  *    - killall
+ *    - wait [%JOB|PID...]
+ *
+ *      Waits for the given jobs (or all of them) to finish or stop, and
+ *      returns the status of the last one.
  */
 class JobControl : public microshell::core::ShellModule {
 public:
@@ -36,10 +53,43 @@ public:
 DECLARE_BUILTIN(Bg);
 DECLARE_BUILTIN(Disown);
 DECLARE_BUILTIN(Fg);
-DECLARE_BUILTIN(Jobs);
 DECLARE_BUILTIN(Kill);
 DECLARE_BUILTIN(Killall);
-DECLARE_BUILTIN(Wait);
+
+// Waits for `--top' refreshes and key presses on the event loop.
+class JobsBuiltin : public microshell::core::AsyncBuiltinCommand {
+public:
+  using microshell::core::AsyncBuiltinCommand::AsyncBuiltinCommand;
+  microshell::core::EventLoop::Await resume(microshell::core::Shell *shell,
+                                            short revents) override;
+  std::string get_name() const override { return "jobs"; }
+
+private:
+  // Redraws the `--top' view and says when to do it again.
+  microshell::core::EventLoop::Await refresh(microshell::core::Shell *shell);
+  microshell::core::EventLoop::Await stop_top(int status);
+
+  bool top = false;
+  double interval = 0;
+  long count = 0;
+  long iteration = 0;
+  bool on_terminal = false;
+  struct termios saved;
+};
+
+// Waits for the jobs' children on the event loop, one job at a time.
+class WaitBuiltin : public microshell::core::AsyncBuiltinCommand {
+public:
+  using microshell::core::AsyncBuiltinCommand::AsyncBuiltinCommand;
+  microshell::core::EventLoop::Await resume(microshell::core::Shell *shell,
+                                            short revents) override;
+  std::string get_name() const override { return "wait"; }
+
+private:
+  // The argument being waited for.
+  size_t next = 1;
+  int status = 0;
+};
 
 }   // namespace job_control
 }   // namespace modules
@@ -0,0 +1,279 @@
+#include "job_output.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace microshell {
+namespace core {
+
+using namespace std;
+
+const size_t JobOutput::MEMORY_LIMIT;
+const size_t JobOutput::SPILL_LIMIT;
+
+namespace {
+
+// How much is read at a time.
+const size_t READ_SIZE = 64 * 1024;
+// How many reads a pipe gets per drain, so that a job writing nonstop
+// doesn't keep the shell from everything else.
+const int MAX_READS = 64;
+// How many finished jobs' output is kept (until their ids are reused).
+const size_t MAX_CLOSED = 16;
+
+}  // namespace
+
+JobOutput::JobOutput() : open_pipes(0), polled_start(0) { }
+
+JobOutput::~JobOutput() {
+  for(auto& entry : captures) {
+    close_capture(&entry.second);
+  }
+}
+
+void JobOutput::attach(int id, const string& command, int fd) {
+  discard(id);
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  captures[id] = Capture { command, fd, -1, false, 0, 0, "" };
+  ++open_pipes;
+}
+
+void JobOutput::discard(int id) {
+  auto it = captures.find(id);
+  if(captures.end() == it) {
+    return;
+  }
+  if(-1 != it->second.fd) {
+    --open_pipes;
+  }
+  else {
+    closed.erase(std::find(closed.begin(), closed.end(), id));
+  }
+  close_capture(&it->second);
+  captures.erase(it);
+}
+
+void JobOutput::release() {
+  for(auto& entry : captures) {
+    close_capture(&entry.second);
+  }
+  captures.clear();
+  closed.clear();
+  open_pipes = 0;
+}
+
+bool JobOutput::is_draining() const {
+  return open_pipes > 0;
+}
+
+void JobOutput::drain() {
+  if(0 == open_pipes) {
+    return;
+  }
+  polled.clear();
+  add_descriptors(&polled);
+  if(poll(polled.data(), polled.size(), 0) > 0) {
+    read_ready(polled);
+  }
+}
+
+void JobOutput::add_descriptors(vector<struct pollfd> *fds) {
+  polled_ids.clear();
+  polled_start = fds->size();
+  for(const auto& entry : captures) {
+    if(-1 != entry.second.fd) {
+      fds->push_back(pollfd { entry.second.fd, POLLIN, 0 });
+      polled_ids.push_back(entry.first);
+    }
+  }
+}
+
+void JobOutput::read_ready(const vector<struct pollfd>& fds) {
+  if(buffer.empty()) {
+    buffer.resize(READ_SIZE);
+  }
+  for(size_t i = 0; i < polled_ids.size(); ++i) {
+    if(0 == fds[polled_start + i].revents) {
+      continue;
+    }
+    int id = polled_ids[i];
+    auto it = captures.find(id);
+    if(captures.end() == it || -1 == it->second.fd) {
+      continue;
+    }
+    Capture *capture = &it->second;
+    for(int reads = 0; reads < MAX_READS; ++reads) {
+      ssize_t count = read(capture->fd, &buffer[0], buffer.size());
+      if(count > 0) {
+        append(id, capture, buffer.data(), count);
+        continue;
+      }
+      if(0 == count || (EINTR != errno && EAGAIN != errno)) {
+        close_pipe(id, capture);
+      }
+      if(-1 == count && EINTR == errno) {
+        continue;
+      }
+      break;
+    }
+  }
+}
+
+vector<int> JobOutput::get_ids() const {
+  vector<int> ids;
+  for(const auto& entry : captures) {
+    ids.push_back(entry.first);
+  }
+  return ids;
+}
+
+bool JobOutput::peek(int id, size_t lines, string *text) const {
+  auto it = captures.find(id);
+  if(captures.end() == it) {
+    return false;
+  }
+  const Capture& capture = it->second;
+  size_t capacity = -1 != capture.spill_fd ? SPILL_LIMIT : MEMORY_LIMIT;
+  size_t kept = min<uint64_t>(capture.total - capture.start, capacity);
+  size_t start = (capture.total - kept) % capacity;
+
+  // Unwrap the ring.
+  text->resize(kept);
+  size_t first = min(kept, capacity - start);
+  if(-1 == capture.spill_fd) {
+    memcpy(&(*text)[0], capture.memory.data() + start, first);
+    memcpy(&(*text)[first], capture.memory.data(), kept - first);
+  }
+  else if(pread(capture.spill_fd, &(*text)[0], first, start)
+            != static_cast<ssize_t>(first)
+          || pread(capture.spill_fd, &(*text)[first], kept - first, 0)
+            != static_cast<ssize_t>(kept - first)) {
+    text->clear();
+    return true;
+  }
+
+  size_t from = 0;
+  if(lines > 0) {
+    // Count back from the end, not counting the last line's newline.
+    size_t end = text->size();
+    if(end > 0 && '\n' == (*text)[end - 1]) {
+      --end;
+    }
+    size_t found = 0;
+    while(end > 0 && found < lines) {
+      size_t newline = text->rfind('\n', end - 1);
+      if(string::npos == newline) {
+        end = 0;
+        break;
+      }
+      end = newline;
+      ++found;
+    }
+    from = found < lines ? 0 : end + 1;
+  }
+  if(0 == from && capture.total > kept) {
+    // The first line lost its start to the ring wrapping around.
+    size_t newline = text->find('\n');
+    from = string::npos == newline ? 0 : newline + 1;
+  }
+  text->erase(0, from);
+  return true;
+}
+
+const string& JobOutput::get_command(int id) const {
+  return captures.at(id).command;
+}
+
+uint64_t JobOutput::get_total(int id) const {
+  auto it = captures.find(id);
+  return captures.end() == it ? 0 : it->second.total;
+}
+
+void JobOutput::append(int id, Capture *capture, const char *data,
+                       size_t length) {
+  if(-1 == capture->spill_fd && !capture->spill_failed
+     && capture->total + length > MEMORY_LIMIT) {
+    spill(id, capture);
+  }
+  while(length > 0) {
+    size_t capacity = -1 != capture->spill_fd ? SPILL_LIMIT : MEMORY_LIMIT;
+    if(length > capacity) {
+      capture->total += length - capacity;
+      data += length - capacity;
+      length = capacity;
+    }
+    size_t position = capture->total % capacity;
+    size_t chunk = min(length, capacity - position);
+    if(-1 == capture->spill_fd) {
+      if(capture->memory.size() < position + chunk) {
+        capture->memory.resize(position + chunk);
+      }
+      memcpy(&capture->memory[position], data, chunk);
+    }
+    else if(pwrite(capture->spill_fd, data, chunk, position)
+            != static_cast<ssize_t>(chunk)) {
+      // Out of memory (or over a limit): start over on the heap.
+      close(capture->spill_fd);
+      capture->spill_fd = -1;
+      capture->spill_failed = true;
+      capture->memory.clear();
+      capture->start = capture->total;
+      continue;
+    }
+    capture->total += chunk;
+    data += chunk;
+    length -= chunk;
+  }
+}
+
+void JobOutput::spill(int id, Capture *capture) {
+  string name = "ush-job-" + to_string(id);
+  int fd = memfd_create(name.c_str(), MFD_CLOEXEC);
+  // The file stays sparse: only what gets written takes up memory.  It's
+  // still on the heap until now, so it didn't wrap around yet.
+  if(-1 == fd || -1 == ftruncate(fd, SPILL_LIMIT)
+     || pwrite(fd, capture->memory.data(), capture->memory.size(), 0)
+        != static_cast<ssize_t>(capture->memory.size())) {
+    if(-1 != fd) {
+      close(fd);
+    }
+    capture->spill_failed = true;
+    return;
+  }
+  capture->spill_fd = fd;
+  string().swap(capture->memory);
+}
+
+void JobOutput::close_pipe(int id, Capture *capture) {
+  close(capture->fd);
+  capture->fd = -1;
+  --open_pipes;
+  closed.push_back(id);
+  if(closed.size() > MAX_CLOSED) {
+    discard(closed.front());
+  }
+}
+
+void JobOutput::close_capture(Capture *capture) {
+  if(-1 != capture->fd) {
+    close(capture->fd);
+    capture->fd = -1;
+  }
+  if(-1 != capture->spill_fd) {
+    close(capture->spill_fd);
+    capture->spill_fd = -1;
+  }
+}
+
+}  // namespace core
+}  // namespace microshell
@@ -0,0 +1,111 @@
+#ifndef MICROSHELL_CORE_JOB_OUTPUT_H
+#define MICROSHELL_CORE_JOB_OUTPUT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+
+namespace microshell {
+namespace core {
+
+// The output of background jobs started with `USH_JOB_OUTPUT=capture':
+// rather than writing to the terminal, each such job writes (both standard
+// output and error) to a pipe, which the shell drains into a ring buffer of
+// the job's latest output, for `jobs -o' to show.
+//
+// A ring starts out on the heap.  Once a job writes more than
+// `MEMORY_LIMIT' bytes, it moves to a file in memory (see
+// `memfd_create(2)') holding up to `SPILL_LIMIT' bytes, which the kernel
+// may swap out.  Either way, older output is dropped as newer arrives.
+//
+// Nothing reads the pipes in the background: they're drained whenever the
+// shell gets to it (before each command and prompt, and by the event loop
+// while it waits for children or input), which is often enough to keep the
+// jobs from blocking on them.
+class JobOutput {
+public:
+  static const size_t MEMORY_LIMIT = 16 * 1024;
+  static const size_t SPILL_LIMIT = 1024 * 1024;
+
+  JobOutput();
+  ~JobOutput();
+
+  // Captures what comes out of `fd' (the read end of the pipe) as the
+  // output of job `id', in place of any earlier job which had the same id.
+  void attach(int id, const std::string& command, int fd);
+
+  // Drops the output of job `id'.
+  void discard(int id);
+
+  // Forgets everything without touching the buffers, after a fork: the
+  // child's copies of the descriptors just get closed.
+  void release();
+
+  // Whether any pipe is still open.
+  bool is_draining() const;
+
+  // Reads whatever the pipes have to offer, without blocking.
+  void drain();
+
+  // For polling the pipes along with other descriptors: appends them to
+  // `fds', and then, once polled, reads from those which are ready.
+  void add_descriptors(std::vector<struct pollfd> *fds);
+  void read_ready(const std::vector<struct pollfd>& fds);
+
+  // The ids of the jobs whose output is kept, in order.
+  std::vector<int> get_ids() const;
+
+  // The last `lines' lines (everything kept, with 0) of the output of job
+  // `id'.  Returns false if there is none.
+  bool peek(int id, size_t lines, std::string *text) const;
+
+  const std::string& get_command(int id) const;
+  // How much job `id' has written so far (0 if its output isn't kept).
+  uint64_t get_total(int id) const;
+
+private:
+  struct Capture {
+    std::string command;
+    // The read end of the pipe, until the job (and whatever else inherited
+    // it) closes the other.
+    int fd;
+    // The memory file the ring moved to, or -1 while on the heap.
+    int spill_fd;
+    bool spill_failed;
+    // How much was written in all; the ring holds the end of it, from
+    // `start' on at most.
+    uint64_t total;
+    uint64_t start;
+    std::string memory;
+  };
+
+  void append(int id, Capture *capture, const char *data, size_t length);
+  // Moves the ring of `capture' to a memory file.
+  void spill(int id, Capture *capture);
+  // Stops reading `capture', and keeps its output around for a while.
+  void close_pipe(int id, Capture *capture);
+  static void close_capture(Capture *capture);
+
+  std::map<int, Capture> captures;
+  size_t open_pipes;
+  // Jobs done writing, oldest first.  Only a few are kept.
+  std::deque<int> closed;
+
+  // The jobs whose pipes `add_descriptors()' added, from `polled_start' on.
+  std::vector<int> polled_ids;
+  size_t polled_start;
+
+  // Reused between calls.
+  std::vector<struct pollfd> polled;
+  std::string buffer;
+};
+
+}  // namespace core
+}  // namespace microshell
+
+#endif  // MICROSHELL_CORE_JOB_OUTPUT_H
@@ -0,0 +1,167 @@
+#include "job_table.h"
+
+#include <string>
+#include <vector>
+
+#include <cerrno>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace microshell {
+namespace core {
+
+using namespace std;
+
+namespace {
+
+// Applies a status returned by `waitpid' to `job'.
+void update(Job *job, int status) {
+  if(WIFEXITED(status)) {
+    job->state = Job::State::DONE;
+    job->status = WEXITSTATUS(status);
+  }
+  else if(WIFSIGNALED(status)) {
+    job->state = Job::State::DONE;
+    job->status = 128 + WTERMSIG(status);
+  }
+  else if(WIFSTOPPED(status)) {
+    job->state = Job::State::STOPPED;
+    job->status = 128 + WSTOPSIG(status);
+  }
+  else if(WIFCONTINUED(status)) {
+    job->state = Job::State::RUNNING;
+  }
+}
+
+// Checks on `job' with `waitpid(options)'.
+void check(Job *job, int options) {
+  int status;
+  pid_t ret = waitpid(job->pid, &status, options);
+  if(0 == ret) {
+    return;
+  }
+  if(-1 == ret) {
+    // Somebody else reaped it (e.g. `wait_child').
+    if(ECHILD == errno) {
+      job->state = Job::State::DONE;
+    }
+    return;
+  }
+  update(job, status);
+}
+
+}  // namespace
+
+JobTable::JobTable() : next_id(1) { }
+
+int JobTable::add(pid_t pid, const string& command, Job::State state,
+                  int output) {
+  jobs.push_back(Job { next_id, pid, command, state, 0 });
+  // The output of an earlier job with the same id goes either way.
+  if(-1 != output) {
+    this->output.attach(next_id, command, output);
+  }
+  else {
+    this->output.discard(next_id);
+  }
+  return next_id++;
+}
+
+void JobTable::start(int id, pid_t pid, int output) {
+  Job *job = find(id);
+  if(nullptr != job) {
+    job->pid = pid;
+    job->state = Job::State::RUNNING;
+    if(-1 != output) {
+      this->output.attach(id, job->command, output);
+    }
+  }
+  else if(-1 != output) {
+    close(output);
+  }
+}
+
+void JobTable::adopt(pid_t pid) {
+  // Reaping the earlier ones here keeps a script which never gets to
+  // `poll()' from piling up zombies.
+  reap_adopted();
+  adopted.push_back(pid);
+}
+
+void JobTable::poll() {
+  output.drain();
+  for(Job& job : jobs) {
+    if(Job::State::DONE != job.state && Job::State::DEFERRED != job.state) {
+      check(&job, WNOHANG | WUNTRACED | WCONTINUED);
+    }
+  }
+  reap_adopted();
+}
+
+vector<Job> JobTable::collect_finished() {
+  vector<Job> finished;
+  vector<Job> remaining;
+  for(const Job& job : jobs) {
+    (Job::State::DONE == job.state ? finished : remaining).push_back(job);
+  }
+  jobs.swap(remaining);
+  // Ids are reused once every job is gone, like in other shells.
+  if(jobs.empty()) {
+    next_id = 1;
+  }
+  return finished;
+}
+
+void JobTable::remove(int id) {
+  for(auto it = jobs.begin(); it != jobs.end(); ++it) {
+    if(id == it->id) {
+      jobs.erase(it);
+      break;
+    }
+  }
+  if(jobs.empty()) {
+    next_id = 1;
+  }
+}
+
+Job* JobTable::find(int id) {
+  for(Job& job : jobs) {
+    if(id == job.id) {
+      return &job;
+    }
+  }
+  return nullptr;
+}
+
+Job* JobTable::find_by_pid(pid_t pid) {
+  for(Job& job : jobs) {
+    if(pid == job.pid) {
+      return &job;
+    }
+  }
+  return nullptr;
+}
+
+const vector<Job>& JobTable::get_jobs() const {
+  return jobs;
+}
+
+JobOutput& JobTable::get_output() {
+  return output;
+}
+
+void JobTable::reap_adopted() {
+  size_t kept = 0;
+  for(pid_t pid : adopted) {
+    pid_t ret = waitpid(pid, nullptr, WNOHANG);
+    if(0 == ret || (-1 == ret && EINTR == errno)) {
+      adopted[kept++] = pid;
+    }
+  }
+  adopted.resize(kept);
+}
+
+}  // namespace core
+}  // namespace microshell
@@ -0,0 +1,87 @@
+#ifndef MICROSHELL_CORE_JOB_TABLE_H
+#define MICROSHELL_CORE_JOB_TABLE_H
+
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "job_output.h"
+
+namespace microshell {
+namespace core {
+
+// A job: a background (`&') command, or a foreground one which got
+// stopped.
+struct Job {
+  enum class State {
+    // Held back by admission control (see `AdmissionControl'), and not
+    // started yet.
+    DEFERRED,
+    RUNNING,
+    STOPPED,
+    DONE
+  };
+
+  int id;
+  // The process the shell started for the job (0 while deferred).
+  // Background jobs run in a process group of their own, led by it.
+  pid_t pid;
+  std::string command;
+  State state;
+  // The exit status, once the job is done (128 + N if killed by signal N),
+  // or 128 + N while stopped by signal N.
+  int status;
+};
+
+// The shell's jobs, in the order they were started.
+class JobTable {
+public:
+  JobTable();
+
+  // Registers the job started as `pid' and returns its id (the `N' in
+  // `%N').  If `output' isn't -1, it's the read end of the pipe the job
+  // writes its output to (see `JobOutput').
+  int add(pid_t pid, const std::string& command, Job::State state,
+          int output = -1);
+
+  // Records that deferred job `id' was started as `pid'.
+  void start(int id, pid_t pid, int output = -1);
+
+  // Takes over reaping `pid', a helper process which isn't a job of its
+  // own (e.g. a process substitution): it's never listed or reported, and
+  // just reaped once done, here or by `poll()'.
+  void adopt(pid_t pid);
+
+  // Reaps finished and stopped jobs without blocking, updating their state,
+  // and drains their output.
+  void poll();
+
+  // Removes and returns the jobs which finished since the last call, so
+  // that they are reported exactly once.
+  std::vector<Job> collect_finished();
+
+  // Forgets about job `id' (e.g. once `wait' has reported its status).
+  void remove(int id);
+
+  Job* find(int id);
+  Job* find_by_pid(pid_t pid);
+  const std::vector<Job>& get_jobs() const;
+
+  // The captured output of the jobs (and of a few which are gone).
+  JobOutput& get_output();
+
+private:
+  // Reaps the adopted processes which are done.
+  void reap_adopted();
+
+  std::vector<Job> jobs;
+  std::vector<pid_t> adopted;
+  JobOutput output;
+  int next_id;
+};
+
+}  // namespace core
+}  // namespace microshell
+
+#endif  // MICROSHELL_CORE_JOB_TABLE_H
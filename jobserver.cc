@@ -0,0 +1,278 @@
+#include "jobserver.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace microshell {
+namespace core {
+
+using namespace std;
+
+namespace {
+
+// What make writes as tokens (and reads back as any byte).
+const char TOKEN = '+';
+
+bool starts_with(const string& text, const char *prefix) {
+  return 0 == text.compare(0, strlen(prefix), prefix);
+}
+
+vector<string> split_words(const string& text) {
+  vector<string> words;
+  size_t start = 0;
+  while(start < text.size()) {
+    size_t end = text.find(' ', start);
+    if(string::npos == end) {
+      end = text.size();
+    }
+    if(end > start) {
+      words.push_back(text.substr(start, end - start));
+    }
+    start = end + 1;
+  }
+  return words;
+}
+
+bool is_jobserver_option(const string& word) {
+  return starts_with(word, "--jobserver-auth=")
+    || starts_with(word, "--jobserver-fds=");
+}
+
+// Returns the value of the (last) jobserver option in `makeflags', or "".
+string find_auth(const string& makeflags) {
+  string auth;
+  for(const string& word : split_words(makeflags)) {
+    if(is_jobserver_option(word)) {
+      auth = word.substr(word.find('=') + 1);
+    }
+  }
+  return auth;
+}
+
+bool is_pipe(int fd) {
+  struct stat info;
+  return -1 != fstat(fd, &info) && S_ISFIFO(info.st_mode);
+}
+
+}  // namespace
+
+Jobserver::Jobserver()
+  : mode(Mode::OFF),
+    slots(0),
+    read_fd(-1),
+    write_fd(-1),
+    implicit_taken(false),
+    owner(0) { }
+
+Jobserver::~Jobserver() {
+  disconnect();
+}
+
+bool Jobserver::connect(const string& makeflags, string *error) {
+  string auth = find_auth(makeflags);
+  if(auth.empty()) {
+    return true;
+  }
+  disconnect();
+
+  if(starts_with(auth, "fifo:")) {
+    string path = auth.substr(5);
+    int fd = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    // There's a reader now, so this doesn't block.
+    int out = -1 == fd ? -1 : open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    if(-1 == out) {
+      *error = "could not open " + path + ": " + strerror(errno);
+      if(-1 != fd) {
+        close(fd);
+      }
+      return false;
+    }
+    read_fd = fd;
+    write_fd = out;
+    owned = { fd, out };
+    description = "fifo " + path;
+  }
+  else {
+    int in, out;
+    char end;
+    if(2 != sscanf(auth.c_str(), "%d,%d%c", &in, &out, &end)) {
+      *error = "unsupported jobserver: " + auth;
+      return false;
+    }
+    if(!is_pipe(in) || !is_pipe(out)) {
+      *error = "descriptors " + auth + " aren't open (does the make rule "
+               "running the shell start with `+'?)";
+      return false;
+    }
+    read_fd = open_nonblocking(in);
+    if(-1 == read_fd) {
+      *error = "could not reopen descriptor " + to_string(in) + ": "
+               + strerror(errno);
+      return false;
+    }
+    write_fd = out;
+    owned = { read_fd };
+    description = "fds " + auth;
+  }
+  mode = Mode::CLIENT;
+  owner = getpid();
+  return true;
+}
+
+bool Jobserver::serve(size_t slots, const string& makeflags,
+                      string *exported, string *error) {
+  if(Mode::CLIENT == mode) {
+    *error = "already using the jobserver of " + description;
+    return false;
+  }
+  disconnect();
+
+  // Not close-on-exec: children (e.g. `make') use them as they are.
+  int ends[2];
+  if(-1 == pipe(ends)) {
+    *error = string("could not create a pipe: ") + strerror(errno);
+    return false;
+  }
+  string tokens(slots - 1, TOKEN);
+  int fd = open_nonblocking(ends[0]);
+  if(-1 == fd || write(ends[1], tokens.data(), tokens.size())
+                   != static_cast<ssize_t>(tokens.size())) {
+    *error = string("could not set up the jobserver: ") + strerror(errno);
+    if(-1 != fd) {
+      close(fd);
+    }
+    close(ends[0]);
+    close(ends[1]);
+    return false;
+  }
+
+  mode = Mode::SERVER;
+  this->slots = slots;
+  read_fd = fd;
+  write_fd = ends[1];
+  owned = { fd, ends[0], ends[1] };
+  owner = getpid();
+  string auth = to_string(ends[0]) + "," + to_string(ends[1]);
+  description = "fds " + auth;
+
+  *exported = strip_options(makeflags);
+  if(!exported->empty()) {
+    *exported += " ";
+  }
+  *exported += "-j" + to_string(slots) + " --jobserver-auth=" + auth;
+  return true;
+}
+
+void Jobserver::disconnect() {
+  if(Mode::OFF == mode) {
+    return;
+  }
+  release_all();
+  for(int fd : owned) {
+    close(fd);
+  }
+  owned.clear();
+  mode = Mode::OFF;
+  description.clear();
+  slots = 0;
+  read_fd = -1;
+  write_fd = -1;
+}
+
+Jobserver::Mode Jobserver::get_mode() const {
+  return mode;
+}
+
+const string& Jobserver::get_description() const {
+  return description;
+}
+
+size_t Jobserver::get_slots() const {
+  return slots;
+}
+
+size_t Jobserver::get_taken() const {
+  return tokens.size() + (implicit_taken ? 1 : 0);
+}
+
+bool Jobserver::acquire() {
+  if(Mode::OFF == mode) {
+    return true;
+  }
+  check_owner();
+  if(!implicit_taken) {
+    implicit_taken = true;
+    return true;
+  }
+  char token;
+  ssize_t count;
+  do {
+    count = read(read_fd, &token, 1);
+  } while(-1 == count && EINTR == errno);
+  if(1 != count) {
+    return false;
+  }
+  tokens.push_back(token);
+  return true;
+}
+
+void Jobserver::release() {
+  if(Mode::OFF == mode) {
+    return;
+  }
+  check_owner();
+  if(tokens.empty()) {
+    implicit_taken = false;
+    return;
+  }
+  char token = tokens.back();
+  tokens.pop_back();
+  while(-1 == write(write_fd, &token, 1) && EINTR == errno) { }
+}
+
+void Jobserver::release_all() {
+  check_owner();
+  while(get_taken() > 0) {
+    release();
+  }
+}
+
+int Jobserver::get_fd() const {
+  return read_fd;
+}
+
+string Jobserver::strip_options(const string& makeflags) {
+  string stripped;
+  for(const string& word : split_words(makeflags)) {
+    bool jobs = starts_with(word, "-j")
+      && string::npos == word.find_first_not_of("0123456789", 2);
+    if(!jobs && !is_jobserver_option(word)) {
+      stripped += (stripped.empty() ? "" : " ") + word;
+    }
+  }
+  return stripped;
+}
+
+int Jobserver::open_nonblocking(int fd) {
+  char path[32];
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+  return open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+}
+
+void Jobserver::check_owner() {
+  if(getpid() != owner) {
+    tokens.clear();
+    implicit_taken = false;
+    owner = getpid();
+  }
+}
+
+}  // namespace core
+}  // namespace microshell
@@ -0,0 +1,98 @@
+#ifndef MICROSHELL_CORE_JOBSERVER_H
+#define MICROSHELL_CORE_JOBSERVER_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+namespace microshell {
+namespace core {
+
+// Shares one limit on parallel jobs with GNU make (and anything else which
+// speaks its jobserver protocol), so that `make -j' running ush running
+// `make' (and so on) doesn't run more than the outermost `-j' allows.
+//
+// A jobserver is a pipe (or, since make 4.4, a named one) holding a token
+// per free job slot, which its users read to take a slot and write back to
+// give it up.  Every user also has one implicit slot, which the process
+// which started it took for it.
+//
+// As a client (when `MAKEFLAGS' names a jobserver), the shell takes slots
+// for background jobs and `dag' targets.  As a server (see `serve()'), it
+// makes one of its own, for itself and for the `make's it runs.
+class Jobserver {
+public:
+  enum class Mode {
+    OFF,
+    CLIENT,
+    SERVER
+  };
+
+  Jobserver();
+  ~Jobserver();
+
+  // Joins the jobserver named by `makeflags' (a `MAKEFLAGS' value), if any.
+  // Returns false, with `error' set, if it names one which can't be used
+  // (e.g. because the `make' which ran the shell didn't pass its
+  // descriptors on).
+  bool connect(const std::string& makeflags, std::string *error);
+
+  // Becomes the jobserver for `slots' parallel jobs, and returns in
+  // `exported' the `MAKEFLAGS' value which tells children about it (based
+  // on `makeflags').  Returns false, with `error' set, on failure.
+  bool serve(size_t slots, const std::string& makeflags,
+             std::string *exported, std::string *error);
+
+  // Stops using (or serving) the jobserver, giving back the slots taken.
+  void disconnect();
+
+  Mode get_mode() const;
+  // How the jobserver is reached, e.g. `fds 3,4' or `fifo /tmp/...'.
+  const std::string& get_description() const;
+  // How many slots the jobserver has, when serving.
+  size_t get_slots() const;
+  // How many slots are taken, including the implicit one.
+  size_t get_taken() const;
+
+  // Takes a slot, if one is free right now (always, when off).
+  bool acquire();
+  // Gives back a slot taken with `acquire()'.
+  void release();
+  // Gives back every slot taken (e.g. when the shell exits).
+  void release_all();
+
+  // A descriptor which becomes readable when a slot may be free, or -1.
+  int get_fd() const;
+
+  // `makeflags' without jobserver (and `-j') options.
+  static std::string strip_options(const std::string& makeflags);
+
+private:
+  // Opens a descriptor of our own for reading tokens off the pipe `fd',
+  // which doesn't block (unlike those of everybody else sharing the pipe).
+  static int open_nonblocking(int fd);
+
+  // After a fork, the slots taken belong to the parent.
+  void check_owner();
+
+  Mode mode;
+  std::string description;
+  size_t slots;
+  int read_fd;
+  int write_fd;
+  // Descriptors to close when done (others belong to whoever passed them
+  // on).
+  std::vector<int> owned;
+  // The tokens read, to write back as they were.
+  std::string tokens;
+  bool implicit_taken;
+  // The process which took the slots.
+  pid_t owner;
+};
+
+}  // namespace core
+}  // namespace microshell
+
+#endif  // MICROSHELL_CORE_JOBSERVER_H
@@ -73,6 +73,13 @@ int main(int argc, char **argv) {
   // Enable stack traces on crashes.
   signal(SIGSEGV, handler);
 
-  microshell::core::Shell *shell = microshell::core::Shell::initialize(util::argv_to_strvec(argc, argv));
+  std::vector<std::string> args = util::argv_to_strvec(argc, argv);
+  microshell::core::Shell *shell = microshell::core::Shell::initialize(args);
+  if(args.size() > 1) {
+    // `ush script [args...]'
+    return shell->run_script(
+      args[1], std::vector<std::string>(args.begin() + 2, args.end())
+    );
+  }
   return shell->interactive();
 }
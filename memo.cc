@@ -0,0 +1,449 @@
+#include "memo.h"
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "shell.h"
+#include "util.h"
+
+namespace microshell {
+namespace modules {
+namespace memo {
+
+using namespace microshell::core;
+using namespace std;
+
+namespace {
+
+const uint64_t DEFAULT_STORE_LIMIT = 64ULL << 20;
+const string ENTRY_MAGIC = "ush-memo 1\n";
+const string ENTRY_SUFFIX = ".memo";
+// Commands killed by a signal (e.g. C-c) didn't really finish, so their
+// results aren't stored.
+const int MAX_MEMOIZED_STATUS = 127;
+
+// 64-bit FNV-1a.  Only used to name entries; the full key is stored in the
+// entry and compared on lookup, so collisions are harmless.
+class Hash {
+public:
+  Hash() : value(14695981039346656037ULL) { }
+
+  void add(const char *data, size_t length) {
+    for(size_t i = 0; i < length; ++i) {
+      value ^= static_cast<unsigned char>(data[i]);
+      value *= 1099511628211ULL;
+    }
+  }
+
+  uint64_t get() const {
+    return value;
+  }
+
+private:
+  uint64_t value;
+};
+
+// Appends a length-prefixed field to `key', so that e.g. the arguments
+// `a b' and `ab' can't produce the same key.
+void append_field(const string& field, string *key) {
+  key->append(to_string(field.length()));
+  key->push_back(':');
+  key->append(field);
+}
+
+string hex(uint64_t value) {
+  char buffer[17];
+  snprintf(buffer, sizeof(buffer), "%016llx",
+           static_cast<unsigned long long>(value));
+  return buffer;
+}
+
+bool read_all(int fd, string *data) {
+  char buffer[65536];
+  while(true) {
+    ssize_t count = ::read(fd, buffer, sizeof(buffer));
+    if(-1 == count) {
+      if(EINTR == errno) {
+        continue;
+      }
+      return false;
+    }
+    if(0 == count) {
+      return true;
+    }
+    data->append(buffer, count);
+  }
+}
+
+bool append_file_fingerprint(Shell *shell, const string& name, bool contents,
+                             string *key, string *error) {
+  string path = shell->resolve_path(name);
+  struct stat info;
+  if(-1 == ::stat(path.c_str(), &info)) {
+    *error = name + ": " + strerror(errno);
+    return false;
+  }
+
+  append_field(contents ? "content" : "file", key);
+  append_field(path, key);
+  if(!contents) {
+    append_field(to_string(info.st_size) + " "
+                 + to_string(info.st_mtim.tv_sec) + "."
+                 + to_string(info.st_mtim.tv_nsec), key);
+    return true;
+  }
+
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if(-1 == fd) {
+    *error = name + ": " + strerror(errno);
+    return false;
+  }
+  Hash hash;
+  char buffer[65536];
+  ssize_t count;
+  while((count = ::read(fd, buffer, sizeof(buffer))) != 0) {
+    if(-1 == count) {
+      if(EINTR == errno) {
+        continue;
+      }
+      *error = name + ": " + strerror(errno);
+      ::close(fd);
+      return false;
+    }
+    hash.add(buffer, count);
+  }
+  ::close(fd);
+  append_field(to_string(info.st_size) + " " + hex(hash.get()), key);
+  return true;
+}
+
+string get_store_directory(Shell *shell) {
+  if(shell->is_variable_set("USH_MEMO_DIR")) {
+    return shell->resolve_path(shell->get_variable("USH_MEMO_DIR"));
+  }
+  string cache = shell->get_variable("XDG_CACHE_HOME");
+  if(cache.empty()) {
+    cache = shell->get_home_directory() + "/.cache";
+  }
+  return cache + "/ush/memo";
+}
+
+uint64_t get_store_limit(Shell *shell) {
+  string value = shell->get_variable("USH_MEMO_LIMIT");
+  char *end;
+  unsigned long long limit = strtoull(value.c_str(), &end, 10);
+  if(value.empty() || '\0' != *end) {
+    return DEFAULT_STORE_LIMIT;
+  }
+  return limit;
+}
+
+// Entries are laid out as
+//
+//    ush-memo 1
+//    STATUS KEY_LENGTH OUT_LENGTH ERR_LENGTH
+//    KEY OUT ERR
+bool load_entry(const string& path, const string& key, int *status,
+                string *out, string *err) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if(-1 == fd) {
+    return false;
+  }
+  string data;
+  bool ok = read_all(fd, &data);
+  ::close(fd);
+  if(!ok || 0 != data.compare(0, ENTRY_MAGIC.length(), ENTRY_MAGIC)) {
+    return false;
+  }
+
+  size_t key_length, out_length, err_length;
+  int consumed = 0;
+  if(4 != sscanf(data.c_str() + ENTRY_MAGIC.length(), "%d %zu %zu %zu\n%n",
+                 status, &key_length, &out_length, &err_length, &consumed)
+     || 0 == consumed) {
+    return false;
+  }
+  size_t position = ENTRY_MAGIC.length() + consumed;
+  if(data.length() != position + key_length + out_length + err_length
+     || 0 != data.compare(position, key_length, key)) {
+    return false;
+  }
+  position += key_length;
+  *out = data.substr(position, out_length);
+  *err = data.substr(position + out_length, err_length);
+  return true;
+}
+
+// Opens an unnamed file in `directory' for capturing output.
+int open_scratch_file(const string& directory) {
+  int fd = ::open(directory.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if(-1 != fd) {
+    return fd;
+  }
+
+  // Not every file system supports `O_TMPFILE'.
+  string name = directory + "/.scratch-XXXXXX";
+  vector<char> buffer(name.begin(), name.end());
+  buffer.push_back('\0');
+  fd = ::mkostemp(buffer.data(), O_CLOEXEC);
+  if(-1 != fd) {
+    ::unlink(buffer.data());
+  }
+  return fd;
+}
+
+// Writes the entry to a temporary file first and renames it into place, so
+// that concurrent shells never see half an entry.
+bool store_entry(const string& path, const string& key, int status,
+                 const string& out, const string& err) {
+  string temporary = path + ".tmp." + to_string(::getpid());
+  int fd = ::open(temporary.c_str(),
+                  O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if(-1 == fd) {
+    return false;
+  }
+  string header = ENTRY_MAGIC + to_string(status) + " "
+    + to_string(key.length()) + " " + to_string(out.length()) + " "
+    + to_string(err.length()) + "\n";
+  bool ok = util::write_all(fd, header) && util::write_all(fd, key)
+    && util::write_all(fd, out) && util::write_all(fd, err);
+  ok = (0 == ::close(fd)) && ok;
+  if(!ok || -1 == ::rename(temporary.c_str(), path.c_str())) {
+    ::unlink(temporary.c_str());
+    return false;
+  }
+  return true;
+}
+
+struct StoredEntry {
+  string name;
+  uint64_t size;
+  struct timespec used;
+};
+
+// Removes entries, least recently used first, until the store holds at most
+// `limit' bytes.  A limit of 0 empties it.
+void evict(const string& directory, uint64_t limit) {
+  DIR *dir = ::opendir(directory.c_str());
+  if(nullptr == dir) {
+    return;
+  }
+
+  vector<StoredEntry> entries;
+  uint64_t total = 0;
+  while(struct dirent *item = ::readdir(dir)) {
+    string name(item->d_name);
+    if(name.length() <= ENTRY_SUFFIX.length()
+       || 0 != name.compare(name.length() - ENTRY_SUFFIX.length(),
+                            ENTRY_SUFFIX.length(), ENTRY_SUFFIX)) {
+      continue;
+    }
+    struct stat info;
+    if(0 == ::fstatat(::dirfd(dir), item->d_name, &info, 0)) {
+      entries.push_back(StoredEntry{name, static_cast<uint64_t>(info.st_size),
+                                    info.st_mtim});
+      total += info.st_size;
+    }
+  }
+
+  if(total > limit) {
+    sort(entries.begin(), entries.end(),
+         [](const StoredEntry& a, const StoredEntry& b) {
+           return a.used.tv_sec != b.used.tv_sec
+               ? a.used.tv_sec < b.used.tv_sec
+               : a.used.tv_nsec < b.used.tv_nsec;
+         });
+    for(const StoredEntry& entry : entries) {
+      if(total <= limit) {
+        break;
+      }
+      if(0 == ::unlinkat(::dirfd(dir), entry.name.c_str(), 0)) {
+        total -= entry.size;
+      }
+    }
+  }
+  ::closedir(dir);
+}
+
+// Runs `argv' with its standard output and error going to `out_fd' and
+// `err_fd'.  Disk commands get them as their own descriptors; builtins run
+// in the shell, so its descriptors are swapped out while they do.
+int run_captured(Shell *shell, const vector<string>& argv, int out_fd,
+                 int err_fd, string *error) {
+  shared_ptr<Command> command;
+  if(!shell->build_command(argv, command, error)) {
+    return -1;
+  }
+
+  shared_ptr<DiskCommand> disk_command =
+    dynamic_pointer_cast<DiskCommand>(command);
+  if(disk_command) {
+    disk_command->redirect(STDOUT_FILENO, out_fd);
+    disk_command->redirect(STDERR_FILENO, err_fd);
+    return disk_command->invoke(shell);
+  }
+
+  cout.flush();
+  cerr.flush();
+  int saved_out = ::fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+  int saved_err = ::fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 0);
+  ::dup2(out_fd, STDOUT_FILENO);
+  ::dup2(err_fd, STDERR_FILENO);
+  int status = command->invoke(shell);
+  cout.flush();
+  cerr.flush();
+  ::dup2(saved_out, STDOUT_FILENO);
+  ::dup2(saved_err, STDERR_FILENO);
+  ::close(saved_out);
+  ::close(saved_err);
+  return status;
+}
+
+int replay(const string& out, const string& err) {
+  cout.flush();
+  cerr.flush();
+  util::write_all(STDOUT_FILENO, out);
+  util::write_all(STDERR_FILENO, err);
+  return 0;
+}
+
+}  // namespace
+
+void Memo::initialize(const Shell&) {
+}
+
+vector<shared_ptr<BuiltinFactory>> Memo::get_builtins() {
+  return vector<shared_ptr<BuiltinFactory>> {
+    make_shared<TypedBuiltinFactory<MemoBuiltin>>(
+      TypedBuiltinFactory<MemoBuiltin>("memo")
+    )
+  };
+}
+
+int MemoBuiltin::invoke(Shell *shell) {
+  string directory = get_store_directory(shell);
+  string key;
+  string error;
+
+  size_t i = 1;
+  for(; i < argv.size(); ++i) {
+    const string& opt = argv[i];
+    if("--" == opt) {
+      ++i;
+      break;
+    }
+    if(opt.empty() || '-' != opt[0]) {
+      break;
+    }
+
+    if("-C" == opt) {
+      evict(directory, 0);
+      return 0;
+    }
+
+    if(i + 1 >= argv.size()) {
+      shell->eout("memo: option requires an argument: " + opt);
+      return 1;
+    }
+    const string& value = argv[++i];
+    if("-e" == opt) {
+      append_field("env", &key);
+      append_field(value, &key);
+      append_field(shell->is_variable_set(value)
+                   ? "=" + shell->get_variable(value) : "unset", &key);
+    }
+    else if("-i" == opt || "-I" == opt) {
+      if(!append_file_fingerprint(shell, value, "-I" == opt, &key, &error)) {
+        shell->eout("memo: " + error);
+        return 1;
+      }
+    }
+    else {
+      shell->eout("memo: unknown option: " + opt);
+      return 1;
+    }
+  }
+
+  if(i >= argv.size()) {
+    shell->eout("memo: missing command");
+    return 1;
+  }
+  vector<string> command_argv(argv.begin() + i, argv.end());
+  append_field("cwd", &key);
+  append_field(shell->get_working_directory(), &key);
+  append_field("argv", &key);
+  for(const string& arg : command_argv) {
+    append_field(arg, &key);
+  }
+
+  Hash hash;
+  hash.add(key.data(), key.length());
+  string path = directory + "/" + hex(hash.get()) + ENTRY_SUFFIX;
+
+  int status;
+  string out, err;
+  if(load_entry(path, key, &status, &out, &err)) {
+    // Entries are evicted by modification time, so this marks it as used.
+    ::utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+    replay(out, err);
+    return status;
+  }
+
+  // Without a usable store, just run the command.
+  if(!util::make_directories(directory)) {
+    shell->eout("memo: cannot create [" + directory + "]: " + strerror(errno));
+    shared_ptr<Command> command;
+    if(!shell->build_command(command_argv, command, &error)) {
+      shell->eout("memo: " + error);
+      return 1;
+    }
+    return command->invoke(shell);
+  }
+
+  int out_fd = open_scratch_file(directory);
+  int err_fd = open_scratch_file(directory);
+  if(-1 == out_fd || -1 == err_fd) {
+    shell->eout("memo: cannot create a file in [" + directory + "]: "
+                + strerror(errno));
+    if(-1 != out_fd) ::close(out_fd);
+    if(-1 != err_fd) ::close(err_fd);
+    return 1;
+  }
+
+  status = run_captured(shell, command_argv, out_fd, err_fd, &error);
+  bool captured = ::lseek(out_fd, 0, SEEK_SET) != -1 && read_all(out_fd, &out)
+    && ::lseek(err_fd, 0, SEEK_SET) != -1 && read_all(err_fd, &err);
+  ::close(out_fd);
+  ::close(err_fd);
+  if(!error.empty()) {
+    shell->eout("memo: " + error);
+    return 1;
+  }
+  replay(out, err);
+
+  uint64_t limit = get_store_limit(shell);
+  if(captured && status >= 0 && status <= MAX_MEMOIZED_STATUS
+     && key.length() + out.length() + err.length() <= limit
+     && store_entry(path, key, status, out, err)) {
+    evict(directory, limit);
+  }
+  return status;
+}
+
+}   // namespace memo
+}   // namespace modules
+}   // namespace microshell
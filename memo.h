@@ -0,0 +1,49 @@
+#ifndef MICROSHELL_MODULES_MEMO_MEMO_H
+#define MICROSHELL_MODULES_MEMO_MEMO_H
+
+#include <memory>
+#include <vector>
+
+#include "command.h"
+#include "shell.h"
+#include "shell_module.h"
+
+namespace microshell {
+namespace modules {
+namespace memo {
+
+/**
+ * A small build cache for expensive, deterministic commands (code
+ * generators, metadata queries, ...).  A command's standard output,
+ * standard error and exit status are stored on disk, keyed by its
+ * arguments, the working directory, the given variables and the
+ * fingerprints of the given input files; running it again with the same
+ * key replays them instead.
+ *
+ * Entries live in `$USH_MEMO_DIR' (by default `$XDG_CACHE_HOME/ush/memo',
+ * or `~/.cache/ush/memo').  Once the store grows past `$USH_MEMO_LIMIT'
+ * bytes (64 MiB by default), the least recently used entries are evicted.
+ *
+ * Provides builtins:
+ *    - memo [-e NAME]... [-i FILE]... [-I FILE]... [--] COMMAND [ARGS...]
+ *
+ *      -e adds a variable to the key, -i adds a file by size and
+ *      modification time, and -I by its contents.
+ *
+ *    - memo -C
+ *
+ *      Empties the store.
+ */
+class Memo : public microshell::core::ShellModule {
+public:
+  void initialize(const microshell::core::Shell&) override;
+  std::vector<std::shared_ptr<microshell::core::BuiltinFactory>> get_builtins() override;
+};
+
+DECLARE_BUILTIN(Memo);
+
+}   // namespace memo
+}   // namespace modules
+}   // namespace microshell
+
+#endif  // MICROSHELL_MODULES_MEMO_MEMO_H
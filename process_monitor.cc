@@ -0,0 +1,253 @@
+#include "process_monitor.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "util.h"
+
+namespace microshell {
+namespace modules {
+namespace job_control {
+
+using namespace std;
+
+namespace {
+
+// CPU time is only accounted in clock ticks (usually 10ms), so usage over
+// shorter periods is meaningless; samples closer together than this repeat
+// the previous figure.
+const uint64_t MIN_CPU_INTERVAL_NS = 200000000;
+
+// Large enough for any `stat' or `io' file.
+const size_t READ_BUFFER_SIZE = 4096;
+
+// Reads the whole file behind `fd' from the start.  Proc files are
+// regenerated on every read from offset 0, so the descriptor can be kept
+// open and re-read instead of opened again.
+ssize_t reread(int fd, char *buffer, size_t size) {
+  ssize_t count = pread(fd, buffer, size - 1, 0);
+  if(count >= 0) {
+    buffer[count] = '\0';
+  }
+  return count;
+}
+
+int open_proc_file(pid_t pid, const char *name) {
+  string path = "/proc/" + to_string(pid) + "/" + name;
+  return open(path.c_str(), O_RDONLY | O_CLOEXEC);
+}
+
+double read_uptime_seconds() {
+  char buffer[128];
+  int fd = open("/proc/uptime", O_RDONLY | O_CLOEXEC);
+  if(-1 == fd) {
+    return 0;
+  }
+  ssize_t count = reread(fd, buffer, sizeof(buffer));
+  close(fd);
+  return count > 0 ? strtod(buffer, nullptr) : 0;
+}
+
+}  // namespace
+
+ProcessMonitor::ProcessMonitor()
+  : ticks_per_second(sysconf(_SC_CLK_TCK)),
+    page_size(sysconf(_SC_PAGESIZE)) { }
+
+ProcessMonitor::~ProcessMonitor() {
+  while(!tracked.empty()) {
+    forget(tracked.begin()->first);
+  }
+}
+
+void ProcessMonitor::forget(pid_t pid) {
+  auto it = tracked.find(pid);
+  if(tracked.end() == it) {
+    return;
+  }
+  close(it->second.stat_fd);
+  if(-1 != it->second.io_fd) {
+    close(it->second.io_fd);
+  }
+  tracked.erase(it);
+}
+
+bool ProcessMonitor::read_stat(int fd, ProcessSample *sample,
+                               uint64_t *cpu_ticks,
+                               uint64_t *start_ticks) const {
+  char buffer[READ_BUFFER_SIZE];
+  if(reread(fd, buffer, sizeof(buffer)) <= 0) {
+    return false;
+  }
+
+  // The name is in parentheses and may contain anything, including spaces
+  // and parentheses, so look for the last `)'.
+  char *open = strchr(buffer, '(');
+  char *close = strrchr(buffer, ')');
+  if(nullptr == open || nullptr == close || close < open) {
+    return false;
+  }
+  sample->pid = static_cast<pid_t>(strtol(buffer, nullptr, 10));
+  sample->name.assign(open + 1, close - open - 1);
+
+  // Fields from the 3rd (state) on; see proc(5).
+  vector<char*> fields;
+  char *save;
+  for(char *field = strtok_r(close + 1, " \n", &save); nullptr != field;
+      field = strtok_r(nullptr, " \n", &save)) {
+    fields.push_back(field);
+  }
+  // rss is the 24th field.
+  if(fields.size() < 22) {
+    return false;
+  }
+  sample->state = fields[0][0];
+  sample->pgrp = static_cast<pid_t>(strtol(fields[2], nullptr, 10));
+  *cpu_ticks = strtoull(fields[11], nullptr, 10)
+    + strtoull(fields[12], nullptr, 10);
+  *start_ticks = strtoull(fields[19], nullptr, 10);
+  sample->rss_bytes = strtoull(fields[21], nullptr, 10) * page_size;
+  return true;
+}
+
+bool ProcessMonitor::read_io(int fd, ProcessSample *sample) const {
+  char buffer[READ_BUFFER_SIZE];
+  if(-1 == fd || reread(fd, buffer, sizeof(buffer)) <= 0) {
+    return false;
+  }
+  const char *read_bytes = strstr(buffer, "\nread_bytes: ");
+  const char *write_bytes = strstr(buffer, "\nwrite_bytes: ");
+  if(nullptr == read_bytes || nullptr == write_bytes) {
+    return false;
+  }
+  sample->read_bytes = strtoull(read_bytes + strlen("\nread_bytes: "),
+                                nullptr, 10);
+  sample->write_bytes = strtoull(write_bytes + strlen("\nwrite_bytes: "),
+                                 nullptr, 10);
+  return true;
+}
+
+vector<ProcessSample> ProcessMonitor::sample(const set<pid_t>& leaders) {
+  vector<ProcessSample> samples;
+  DIR *proc = opendir("/proc");
+  if(nullptr == proc) {
+    return samples;
+  }
+
+  uint64_t now = util::monotonic_ns();
+  double uptime = -1;
+  set<pid_t> alive;
+  while(struct dirent *entry = readdir(proc)) {
+    char *end;
+    long value = strtol(entry->d_name, &end, 10);
+    if('\0' != *end || value <= 0) {
+      continue;
+    }
+    pid_t pid = static_cast<pid_t>(value);
+    alive.insert(pid);
+    if(ignored.count(pid)) {
+      continue;
+    }
+
+    auto it = tracked.find(pid);
+    bool is_new = tracked.end() == it;
+    int stat_fd = is_new ? open_proc_file(pid, "stat") : it->second.stat_fd;
+    if(-1 == stat_fd) {
+      continue;
+    }
+
+    ProcessSample sample;
+    uint64_t cpu_ticks, start_ticks;
+    if(!read_stat(stat_fd, &sample, &cpu_ticks, &start_ticks)) {
+      if(is_new) {
+        close(stat_fd);
+      }
+      else {
+        forget(pid);
+      }
+      continue;
+    }
+
+    if(!leaders.count(pid) && !leaders.count(sample.pgrp)) {
+      if(is_new) {
+        close(stat_fd);
+      }
+      else {
+        forget(pid);
+      }
+      ignored.insert(pid);
+      continue;
+    }
+
+    if(is_new) {
+      Tracked fresh { stat_fd, open_proc_file(pid, "io"), 0, 0, 0 };
+      it = tracked.insert(make_pair(pid, fresh)).first;
+    }
+
+    Tracked& state = it->second;
+    if(0 != state.sampled_ns) {
+      if(now - state.sampled_ns >= MIN_CPU_INTERVAL_NS) {
+        state.cpu_percent = 100.0 * (cpu_ticks - state.cpu_ticks)
+          / ticks_per_second / ((now - state.sampled_ns) / 1e9);
+        state.cpu_ticks = cpu_ticks;
+        state.sampled_ns = now;
+      }
+    }
+    else {
+      // First sighting: average over the process's lifetime.
+      if(uptime < 0) {
+        uptime = read_uptime_seconds();
+      }
+      double elapsed = uptime - static_cast<double>(start_ticks)
+        / ticks_per_second;
+      state.cpu_percent = elapsed > 0
+        ? 100.0 * cpu_ticks / ticks_per_second / elapsed : 0;
+      state.cpu_ticks = cpu_ticks;
+      state.sampled_ns = now;
+    }
+    sample.cpu_percent = state.cpu_percent;
+
+    sample.has_io = read_io(state.io_fd, &sample);
+    if(!sample.has_io) {
+      sample.read_bytes = sample.write_bytes = 0;
+    }
+    samples.push_back(sample);
+  }
+  closedir(proc);
+  sort(samples.begin(), samples.end(),
+       [](const ProcessSample& a, const ProcessSample& b) {
+         return a.pid < b.pid;
+       });
+
+  // Drop whatever exited since the last sample.
+  for(auto it = tracked.begin(); it != tracked.end(); ) {
+    pid_t pid = (it++)->first;
+    if(!alive.count(pid)) {
+      forget(pid);
+    }
+  }
+  for(auto it = ignored.begin(); it != ignored.end(); ) {
+    if(alive.count(*it)) {
+      ++it;
+    }
+    else {
+      it = ignored.erase(it);
+    }
+  }
+
+  return samples;
+}
+
+}   // namespace job_control
+}   // namespace modules
+}   // namespace microshell
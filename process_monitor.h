@@ -0,0 +1,78 @@
+#ifndef MICROSHELL_MODULES_JOB_CONTROL_PROCESS_MONITOR_H
+#define MICROSHELL_MODULES_JOB_CONTROL_PROCESS_MONITOR_H
+
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+namespace microshell {
+namespace modules {
+namespace job_control {
+
+struct ProcessSample {
+  pid_t pid;
+  pid_t pgrp;
+  // As in `/proc/<pid>/stat': `R', `S', `T', `Z', etc.
+  char state;
+  std::string name;
+  // Since the previous sample of the same process, or since it started.
+  double cpu_percent;
+  uint64_t rss_bytes;
+  // Storage I/O, from `/proc/<pid>/io'.  Unknown if `has_io' is false
+  // (e.g. the kernel doesn't do I/O accounting).
+  bool has_io;
+  uint64_t read_bytes;
+  uint64_t write_bytes;
+};
+
+// Samples CPU, memory and I/O usage of jobs from /proc.
+//
+// Meant to be called repeatedly (e.g. by `jobs --top'): the `stat' and `io'
+// files of the processes it follows stay open and are simply re-read, and
+// processes found not to belong to any job are remembered, so that a
+// refresh costs one pass over the /proc directory plus one read per file of
+// interest.
+class ProcessMonitor {
+public:
+  ProcessMonitor();
+  ~ProcessMonitor();
+
+  // Samples every process which is either one of `leaders', or in the
+  // process group of one of them.  Results are sorted by pid.
+  std::vector<ProcessSample> sample(const std::set<pid_t>& leaders);
+
+private:
+  struct Tracked {
+    int stat_fd;
+    int io_fd;
+    uint64_t cpu_ticks;
+    uint64_t sampled_ns;
+    double cpu_percent;
+  };
+
+  ProcessMonitor(const ProcessMonitor&) = delete;
+  ProcessMonitor& operator=(const ProcessMonitor&) = delete;
+
+  // Reads and parses `/proc/<pid>/stat' through `fd'.  Returns false if the
+  // process is gone.
+  bool read_stat(int fd, ProcessSample *sample, uint64_t *cpu_ticks,
+                 uint64_t *start_ticks) const;
+  bool read_io(int fd, ProcessSample *sample) const;
+  void forget(pid_t pid);
+
+  std::map<pid_t, Tracked> tracked;
+  // Processes which belong to no job (as of when they were first seen).
+  std::set<pid_t> ignored;
+  long ticks_per_second;
+  long page_size;
+};
+
+}   // namespace job_control
+}   // namespace modules
+}   // namespace microshell
+
+#endif  // MICROSHELL_MODULES_JOB_CONTROL_PROCESS_MONITOR_H
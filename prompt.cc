@@ -0,0 +1,282 @@
+#include "prompt.h"
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cstdio>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "util.h"
+
+namespace microshell {
+namespace core {
+
+using namespace std;
+
+namespace {
+
+// Cached results older than this are recomputed (in the background) even
+// without a change notification, since not every change can be watched.
+const uint64_t MAX_RESULT_AGE_NS = 30000000000ULL;
+
+// Results aren't recomputed on change notifications more often than this,
+// so that e.g. a build writing files doesn't keep the worker busy.
+const uint64_t MIN_REFRESH_INTERVAL_NS = 500000000ULL;
+
+// inotify watches are a limited, per-user resource.
+const size_t MAX_WATCHES = 256;
+
+const uint32_t WATCH_EVENTS = IN_CREATE | IN_DELETE | IN_MODIFY
+  | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB;
+
+// Commands taking at least this long get their duration shown.
+const uint64_t MIN_SHOWN_DURATION_NS = 2000000000ULL;
+
+string make_key(const string& segment, const string& directory) {
+  return segment + '\0' + directory;
+}
+
+string get_key_directory(const string& key) {
+  return key.substr(key.find('\0') + 1);
+}
+
+}  // namespace
+
+Prompt::Prompt()
+  : updated(false), stopping(false), inotify_fd(-1), wake_fd(-1) { }
+
+Prompt::~Prompt() {
+  stop();
+}
+
+void Prompt::add_segment(shared_ptr<PromptSegment> segment) {
+  segments.push_back(segment);
+}
+
+string Prompt::render(const PromptContext& context) {
+  string result;
+  bool wake = false;
+  {
+    lock_guard<std::mutex> lock(mutex);
+    current_directory = context.directory;
+    uint64_t now = util::monotonic_ns();
+    for(const auto& segment : segments) {
+      string text;
+      if(!segment->is_async()) {
+        text = segment->render(context, nullptr);
+      }
+      else {
+        string key = make_key(segment->get_name(), context.directory);
+        auto it = cache.find(key);
+        if(cache.end() == it) {
+          it = cache.insert(make_pair(
+            key, CachedResult { "", false, false, 0,
+                                Request { segment, context } })).first;
+        }
+        CachedResult& entry = it->second;
+        entry.request = Request { segment, context };
+        bool stale = !entry.fresh || now - entry.computed_ns > MAX_RESULT_AGE_NS;
+        if(stale && !entry.pending) {
+          entry.pending = true;
+          queue.push_back(entry.request);
+          wake = true;
+        }
+        text = entry.text;
+      }
+
+      if(!text.empty()) {
+        result += (result.empty() ? "" : " ") + text;
+      }
+    }
+  }
+
+  if(wake) {
+    start();
+    uint64_t one = 1;
+    if(write(wake_fd, &one, sizeof(one)) < 0) {
+      // The worker is awake anyway.
+    }
+  }
+  return result;
+}
+
+bool Prompt::take_update() {
+  lock_guard<std::mutex> lock(mutex);
+  bool result = updated;
+  updated = false;
+  return result;
+}
+
+void Prompt::start() {
+  if(worker.joinable()) {
+    return;
+  }
+  wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+  worker = thread(&Prompt::run_worker, this);
+}
+
+void Prompt::stop() {
+  if(!worker.joinable()) {
+    return;
+  }
+  {
+    lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  for(const shared_ptr<PromptSegment>& segment : segments) {
+    if(segment->is_async()) {
+      segment->cancel();
+    }
+  }
+  uint64_t one = 1;
+  if(write(wake_fd, &one, sizeof(one)) < 0) {
+    // Nothing else we can do.
+  }
+  worker.join();
+  close(wake_fd);
+  if(-1 != inotify_fd) {
+    close(inotify_fd);
+  }
+}
+
+void Prompt::run_worker() {
+  while(true) {
+    struct pollfd fds[2] = {
+      { wake_fd, POLLIN, 0 },
+      { inotify_fd, POLLIN, 0 }
+    };
+    poll(fds, -1 == inotify_fd ? 1 : 2, -1);
+    if(fds[0].revents & POLLIN) {
+      uint64_t count;
+      if(read(wake_fd, &count, sizeof(count)) < 0) {
+        // Spurious wakeup.
+      }
+    }
+    if(-1 != inotify_fd && (fds[1].revents & POLLIN)) {
+      handle_events();
+    }
+
+    vector<Request> requests;
+    {
+      lock_guard<std::mutex> lock(mutex);
+      if(stopping) {
+        return;
+      }
+      requests.swap(queue);
+    }
+    for(const Request& request : requests) {
+      process(request);
+    }
+  }
+}
+
+void Prompt::process(const Request& request) {
+  vector<string> paths;
+  string text = request.segment->render(request.context, &paths);
+  string key = make_key(request.segment->get_name(),
+                        request.context.directory);
+  for(const string& path : paths) {
+    watch(path, key);
+  }
+
+  lock_guard<std::mutex> lock(mutex);
+  CachedResult& entry = cache[key];
+  if(entry.text != text && request.context.directory == current_directory) {
+    updated = true;
+  }
+  entry.text = text;
+  entry.fresh = true;
+  entry.pending = false;
+  entry.computed_ns = util::monotonic_ns();
+}
+
+void Prompt::watch(const string& path, const string& key) {
+  if(-1 == inotify_fd) {
+    return;
+  }
+  auto it = watch_descriptors.find(path);
+  int wd;
+  if(watch_descriptors.end() != it) {
+    wd = it->second;
+  }
+  else {
+    if(watch_descriptors.size() >= MAX_WATCHES) {
+      return;
+    }
+    wd = inotify_add_watch(inotify_fd, path.c_str(), WATCH_EVENTS);
+    if(-1 == wd) {
+      return;
+    }
+    watch_descriptors[path] = wd;
+  }
+  watched_keys[wd].insert(key);
+}
+
+void Prompt::handle_events() {
+  // Only which watches fired matters, not what happened.
+  set<int> fired;
+  alignas(struct inotify_event) char buffer[4096];
+  ssize_t count;
+  while((count = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+    for(char *p = buffer; p < buffer + count; ) {
+      const struct inotify_event *event =
+        reinterpret_cast<const struct inotify_event*>(p);
+      fired.insert(event->wd);
+      p += sizeof(struct inotify_event) + event->len;
+    }
+  }
+
+  uint64_t now = util::monotonic_ns();
+  lock_guard<std::mutex> lock(mutex);
+  for(int wd : fired) {
+    for(const string& key : watched_keys[wd]) {
+      auto it = cache.find(key);
+      if(cache.end() == it) {
+        continue;
+      }
+      CachedResult& entry = it->second;
+      entry.fresh = false;
+      // Results for the directory the user is in are refreshed right away,
+      // so that the prompt updates while they sit at it.
+      if(!entry.pending && get_key_directory(key) == current_directory
+         && now - entry.computed_ns >= MIN_REFRESH_INTERVAL_NS) {
+        entry.pending = true;
+        queue.push_back(entry.request);
+      }
+    }
+  }
+}
+
+string StatusSegment::get_name() const {
+  return "status";
+}
+
+string StatusSegment::render(const PromptContext& context, vector<string> *) {
+  return 0 == context.last_status
+         ? "" : "[" + to_string(context.last_status) + "]";
+}
+
+string DurationSegment::get_name() const {
+  return "duration";
+}
+
+string DurationSegment::render(const PromptContext& context,
+                               vector<string> *) {
+  if(context.last_duration_ns < MIN_SHOWN_DURATION_NS) {
+    return "";
+  }
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%.1fs", context.last_duration_ns / 1e9);
+  return buffer;
+}
+
+}  // namespace core
+}  // namespace microshell
@@ -0,0 +1,141 @@
+#ifndef MICROSHELL_CORE_PROMPT_H
+#define MICROSHELL_CORE_PROMPT_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace microshell {
+namespace core {
+
+// What prompt segments get to work with.  Asynchronous segments run on
+// another thread, so everything they need is copied in here.
+struct PromptContext {
+  std::string directory;
+  int last_status;
+  uint64_t last_duration_ns;
+};
+
+// A piece of the prompt, e.g. the current git branch.  Modules can provide
+// their own (see `ShellModule::get_prompt_segments()').
+class PromptSegment {
+public:
+  virtual ~PromptSegment() { }
+
+  // Also the key the results of asynchronous segments are cached under,
+  // along with the directory.
+  virtual std::string get_name() const = 0;
+
+  // Asynchronous segments are rendered on the prompt's worker thread, and
+  // must not touch the shell.  Until a result is ready, the segment is left
+  // out (or shows its previous result, if there is one).
+  virtual bool is_async() const {
+    return false;
+  }
+
+  // Returns the segment's text, or "" to leave it out.  Asynchronous
+  // segments may add paths to `watch_paths': the result for the directory
+  // is recomputed as soon as anything in one of them changes.
+  virtual std::string render(const PromptContext& context,
+                             std::vector<std::string> *watch_paths) = 0;
+
+  // Cuts a `render()' in progress short (e.g. by killing a slow external
+  // command), and makes later ones return right away.  Called from the
+  // shell's thread when it exits, so that it doesn't wait for the worker.
+  virtual void cancel() { }
+};
+
+// Builds the dynamic part of the prompt out of segments.  Asynchronous
+// segments are computed by a worker thread and cached per directory; a
+// cached result stays valid until inotify reports a change in one of the
+// paths its segment asked to watch (or it grows old).  The prompt never
+// waits for them: see `take_update()'.
+class Prompt {
+public:
+  Prompt();
+  ~Prompt();
+
+  void add_segment(std::shared_ptr<PromptSegment> segment);
+
+  // Renders all segments, separated by spaces.  Asynchronous segments come
+  // from the cache; missing or stale results are (re)computed in the
+  // background.
+  std::string render(const PromptContext& context);
+
+  // Whether results for the last rendered context arrived since, i.e. the
+  // prompt should be redrawn.  Resets the flag.
+  bool take_update();
+
+  // Stops the worker thread, if it is running.
+  void stop();
+
+private:
+  struct Request {
+    std::shared_ptr<PromptSegment> segment;
+    PromptContext context;
+  };
+
+  struct CachedResult {
+    std::string text;
+    bool fresh;
+    bool pending;
+    uint64_t computed_ns;
+    // How to compute it again.
+    Request request;
+  };
+
+  Prompt(const Prompt&) = delete;
+  Prompt& operator=(const Prompt&) = delete;
+
+  void start();
+  void run_worker();
+  // Computes one request and publishes the result.
+  void process(const Request& request);
+  void watch(const std::string& path, const std::string& key);
+  void handle_events();
+
+  std::vector<std::shared_ptr<PromptSegment>> segments;
+
+  // Everything below is shared with the worker, and guarded by `mutex'.
+  std::mutex mutex;
+  std::map<std::string, CachedResult> cache;
+  std::vector<Request> queue;
+  std::string current_directory;
+  bool updated;
+  bool stopping;
+
+  // Only used by the worker.
+  std::thread worker;
+  int inotify_fd;
+  int wake_fd;
+  std::map<int, std::string> watch_paths;
+  std::map<int, std::set<std::string>> watched_keys;
+  std::map<std::string, int> watch_descriptors;
+};
+
+// The exit status of the last command, if it failed.
+class StatusSegment : public PromptSegment {
+public:
+  std::string get_name() const override;
+  std::string render(const PromptContext& context,
+                     std::vector<std::string> *watch_paths) override;
+};
+
+// How long the last command took, if it was slow enough to notice.
+class DurationSegment : public PromptSegment {
+public:
+  std::string get_name() const override;
+  std::string render(const PromptContext& context,
+                     std::vector<std::string> *watch_paths) override;
+};
+
+}  // namespace core
+}  // namespace microshell
+
+#endif  // MICROSHELL_CORE_PROMPT_H
@@ -0,0 +1,339 @@
+#include "scheduling.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cstdio>
+#include <cstdlib>
+
+#include "admission.h"
+#include "jobserver.h"
+#include "shell.h"
+#include "spawn_policy.h"
+#include "util.h"
+
+namespace microshell {
+namespace modules {
+namespace scheduling {
+
+using namespace microshell::core;
+using namespace std;
+
+void Scheduling::initialize(const Shell&) {
+}
+
+vector<shared_ptr<BuiltinFactory>> Scheduling::get_builtins() {
+  return vector<shared_ptr<BuiltinFactory>> {
+    make_shared<TypedBuiltinFactory<AdmitBuiltin>>(
+      TypedBuiltinFactory<AdmitBuiltin>("admit")
+    ),
+    make_shared<TypedBuiltinFactory<JobserverBuiltin>>(
+      TypedBuiltinFactory<JobserverBuiltin>("jobserver")
+    ),
+    make_shared<TypedBuiltinFactory<SchedBuiltin>>(
+      TypedBuiltinFactory<SchedBuiltin>("sched")
+    )
+  };
+}
+
+namespace {
+
+string format_percent(double value) {
+  if(value < 0) {
+    return "?";
+  }
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%.1f%%", value);
+  return buffer;
+}
+
+string format_threshold(double threshold) {
+  if(threshold <= 0) {
+    return "off";
+  }
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%g%%", threshold);
+  return buffer;
+}
+
+string describe_outcome(AdmissionControl::Decision::Outcome outcome) {
+  switch(outcome) {
+    case AdmissionControl::Decision::Outcome::ADMITTED: return "admitted";
+    case AdmissionControl::Decision::Outcome::DEFERRED: return "deferred";
+    case AdmissionControl::Decision::Outcome::FORCED:   return "forced";
+  }
+  return "?";
+}
+
+// Parses a nonnegative number, e.g. a percentage or a number of seconds.
+bool parse_amount(const string& text, double *value) {
+  char *end;
+  *value = strtod(text.c_str(), &end);
+  return !text.empty() && '\0' == *end && *value >= 0;
+}
+
+}  // namespace
+
+int AdmitBuiltin::invoke(Shell *shell) {
+  typedef AdmissionControl::Decision::Outcome Outcome;
+  AdmissionControl& admission = shell->get_admission_control();
+  AdmissionControl::Thresholds& thresholds = admission.get_thresholds();
+  bool log = false;
+
+  for(size_t i = 1; i < argv.size(); ++i) {
+    const string& opt = argv[i];
+    if("-r" == opt) {
+      admission.reset();
+      continue;
+    }
+    if("-l" == opt) {
+      log = true;
+      continue;
+    }
+    if("-c" != opt && "-m" != opt && "-i" != opt && "-t" != opt) {
+      shell->eout("admit: unknown option: " + opt);
+      return 1;
+    }
+    if(i + 1 >= argv.size()) {
+      shell->eout("admit: option requires an argument: " + opt);
+      return 1;
+    }
+    const string& text = argv[++i];
+    double value;
+    if(!parse_amount(text, &value) || ("-t" != opt && value > 100)) {
+      shell->eout("admit: invalid value for " + opt + ": " + text);
+      return 1;
+    }
+    if("-c" == opt) {
+      thresholds.cpu = value;
+    }
+    else if("-m" == opt) {
+      thresholds.memory = value;
+    }
+    else if("-i" == opt) {
+      thresholds.io = value;
+    }
+    else {
+      admission.set_max_deferral_ns(static_cast<uint64_t>(value * 1e9));
+    }
+  }
+
+  if(log) {
+    uint64_t now = util::monotonic_ns();
+    char line[64];
+    for(const AdmissionControl::Decision& decision
+          : admission.get_decisions()) {
+      snprintf(line, sizeof(line), "%8.1fs ago  %-8s  ",
+               (now - decision.time_ns) / 1e9,
+               describe_outcome(decision.outcome).c_str());
+      shell->out(line + decision.job
+                 + (decision.reason.empty() ? ""
+                                            : " (" + decision.reason + ")"));
+    }
+    return 0;
+  }
+  if(argv.size() > 1) {
+    return 0;
+  }
+
+  const Pressure& pressure = admission.sample();
+  shell->out("pressure:   cpu " + format_percent(pressure.cpu)
+             + "  memory " + format_percent(pressure.memory)
+             + "  io " + format_percent(pressure.io)
+             + (pressure.from_psi ? "  (PSI, last 10s)"
+                                  : "  (estimated from the load average)"));
+  char deferral[32];
+  snprintf(deferral, sizeof(deferral), "%gs",
+           admission.get_max_deferral_ns() / 1e9);
+  shell->out("thresholds: cpu " + format_threshold(thresholds.cpu)
+             + "  memory " + format_threshold(thresholds.memory)
+             + "  io " + format_threshold(thresholds.io)
+             + "  (deferred jobs start anyway after " + deferral + ")");
+  shell->out("decisions:  "
+             + to_string(admission.get_count(Outcome::ADMITTED))
+             + " admitted, "
+             + to_string(admission.get_count(Outcome::DEFERRED))
+             + " deferred, "
+             + to_string(admission.get_count(Outcome::FORCED))
+             + " forced");
+  for(const Job& job : shell->get_jobs().get_jobs()) {
+    if(Job::State::DEFERRED == job.state) {
+      shell->out("deferred:   [" + to_string(job.id) + "] " + job.command);
+    }
+  }
+  return 0;
+}
+
+int JobserverBuiltin::invoke(Shell *shell) {
+  Jobserver& jobserver = shell->get_jobserver();
+  bool serve = false;
+  bool stop = false;
+  size_t slots = 0;
+
+  for(size_t i = 1; i < argv.size(); ++i) {
+    const string& opt = argv[i];
+    if("-x" == opt) {
+      stop = true;
+      continue;
+    }
+    if("-j" != opt) {
+      shell->eout("jobserver: unknown option: " + opt);
+      return 1;
+    }
+    if(i + 1 >= argv.size()) {
+      shell->eout("jobserver: option requires an argument: " + opt);
+      return 1;
+    }
+    const string& text = argv[++i];
+    char *end;
+    long value = strtol(text.c_str(), &end, 10);
+    if(text.empty() || '\0' != *end || value < 1 || value > 4096) {
+      shell->eout("jobserver: invalid value for " + opt + ": " + text);
+      return 1;
+    }
+    serve = true;
+    slots = static_cast<size_t>(value);
+  }
+
+  if(stop) {
+    bool serving = Jobserver::Mode::SERVER == jobserver.get_mode();
+    jobserver.disconnect();
+    // Only ours is taken back: children go on using that of `make'.
+    if(serving) {
+      string makeflags =
+        Jobserver::strip_options(shell->get_variable("MAKEFLAGS"));
+      if(makeflags.empty()) {
+        shell->unset_variable("MAKEFLAGS");
+      }
+      else {
+        shell->set_variable("MAKEFLAGS", makeflags);
+      }
+    }
+  }
+  if(serve) {
+    string makeflags;
+    string error;
+    if(!jobserver.serve(slots, shell->get_variable("MAKEFLAGS"), &makeflags,
+                        &error)) {
+      shell->eout("jobserver: " + error);
+      return 1;
+    }
+    shell->set_variable("MAKEFLAGS", makeflags);
+    shell->export_variable("MAKEFLAGS");
+  }
+  if(argv.size() > 1) {
+    return 0;
+  }
+
+  string taken = to_string(jobserver.get_taken()) + " taken";
+  switch(jobserver.get_mode()) {
+    case Jobserver::Mode::OFF:
+      shell->out("jobserver: off");
+      break;
+    case Jobserver::Mode::CLIENT:
+      shell->out("jobserver: client of " + jobserver.get_description()
+                 + " (" + taken + ")");
+      break;
+    case Jobserver::Mode::SERVER:
+      shell->out("jobserver: serving " + to_string(jobserver.get_slots())
+                 + " slots over " + jobserver.get_description()
+                 + " (" + taken + ")");
+      break;
+  }
+  return 0;
+}
+
+int SchedBuiltin::invoke(Shell *shell) {
+  SpawnPolicy policy = shell->get_spawn_policy();
+  bool changed = false;
+
+  size_t i = 1;
+  for(; i < argv.size(); ++i) {
+    const string& opt = argv[i];
+    if("--" == opt) {
+      ++i;
+      break;
+    }
+    if(opt.empty() || '-' != opt[0]) {
+      break;
+    }
+
+    if("-r" == opt) {
+      policy = SpawnPolicy();
+      changed = true;
+      continue;
+    }
+
+    if(i + 1 >= argv.size()) {
+      shell->eout("sched: option requires an argument: " + opt);
+      return 1;
+    }
+    const string& value = argv[++i];
+    bool ok = true;
+    if("-c" == opt) {
+      ok = SpawnPolicy::parse_cpu_list(value, &policy.cpus);
+    }
+    else if("-n" == opt) {
+      char *end;
+      long nice = strtol(value.c_str(), &end, 10);
+      ok = !value.empty() && '\0' == *end && nice >= -20 && nice <= 19;
+      policy.has_nice = ok;
+      policy.nice = static_cast<int>(nice);
+    }
+    else if("-i" == opt) {
+      ok = SpawnPolicy::parse_io_class(value, &policy.io_class,
+                                       &policy.io_level);
+    }
+    else if("-p" == opt) {
+      ok = SpawnPolicy::parse_sched_policy(value, &policy.sched_policy,
+                                           &policy.sched_priority);
+    }
+    else if("-s" == opt) {
+      ok = SpawnPolicy::parse_spread(value, &policy.spread);
+    }
+    else {
+      shell->eout("sched: unknown option: " + opt);
+      return 1;
+    }
+
+    if(!ok) {
+      shell->eout("sched: invalid value for " + opt + ": " + value);
+      return 1;
+    }
+    changed = true;
+  }
+
+  // No command: act on the shell-wide policy.
+  if(i >= argv.size()) {
+    if(changed) {
+      shell->get_spawn_policy() = policy;
+    }
+    else {
+      shell->out(policy.to_string());
+    }
+    return 0;
+  }
+
+  shared_ptr<Command> command;
+  string error;
+  vector<string> command_argv(argv.begin() + i, argv.end());
+  if(!shell->build_command(command_argv, command, &error)) {
+    shell->eout("sched: " + error);
+    return 1;
+  }
+
+  // Builtins run inside the shell itself, so there is nothing to apply the
+  // policy to.  The round-robin cursor is the shell's, or every command
+  // would be spread to the same place.
+  shared_ptr<DiskCommand> disk_command =
+    dynamic_pointer_cast<DiskCommand>(command);
+  if(disk_command) {
+    disk_command->set_spawn_policy(policy.next(&shell->get_spawn_policy()));
+  }
+  return command->invoke(shell);
+}
+
+}   // namespace scheduling
+}   // namespace modules
+}   // namespace microshell
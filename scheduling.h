@@ -0,0 +1,60 @@
+#ifndef MICROSHELL_MODULES_SCHEDULING_SCHEDULING_H
+#define MICROSHELL_MODULES_SCHEDULING_SCHEDULING_H
+
+#include <memory>
+#include <vector>
+
+#include "command.h"
+#include "shell.h"
+#include "shell_module.h"
+
+namespace microshell {
+namespace modules {
+namespace scheduling {
+
+/**
+ * Controls where and how spawned jobs run: CPU affinity (optionally spread
+ * round-robin over CPUs or NUMA nodes), niceness, I/O priority and
+ * scheduling class.  Everything is applied in the child between `fork' and
+ * `exec'.
+ *
+ * Provides builtins:
+ *    - sched [-c CPUS] [-n NICE] [-i CLASS[:LEVEL]] [-p POLICY[:PRIO]]
+ *            [-s none|cpus|nodes] [-r] [[--] COMMAND [ARGS...]]
+ *
+ *      Without a command, changes the shell-wide policy (or prints it, if no
+ *      options are given).  With a command, runs just that command with the
+ *      shell-wide policy amended by the given options.
+ *    - admit [-c PERCENT] [-m PERCENT] [-i PERCENT] [-t SECONDS] [-r] [-l]
+ *
+ *      Configures admission control (see `AdmissionControl'): background
+ *      jobs started while CPU, memory or I/O pressure is at or above its
+ *      threshold are deferred, and `dag' runs one target at a time.  A
+ *      threshold of 0 turns its check off; `-t' sets how long a job may be
+ *      deferred before it starts anyway, and `-r' restores the defaults.
+ *      Without options, prints the pressure readings, the thresholds and
+ *      the deferred jobs; `-l' prints the latest decisions.
+ *    - jobserver [-j SLOTS] [-x]
+ *
+ *      Shares the limit on parallel jobs with GNU make (see `Jobserver'):
+ *      under `make -j', background jobs and `dag' targets take slots from
+ *      its jobserver, found in `MAKEFLAGS' when the shell starts.  `-j'
+ *      makes the shell the jobserver, with `SLOTS' slots, for itself and
+ *      the `make's it runs (through an exported `MAKEFLAGS'); `-x' stops
+ *      using (or serving) it.  Without options, prints its state.
+ */
+class Scheduling : public microshell::core::ShellModule {
+public:
+  void initialize(const microshell::core::Shell&) override;
+  std::vector<std::shared_ptr<microshell::core::BuiltinFactory>> get_builtins() override;
+};
+
+DECLARE_BUILTIN(Admit);
+DECLARE_BUILTIN(Jobserver);
+DECLARE_BUILTIN(Sched);
+
+}   // namespace scheduling
+}   // namespace modules
+}   // namespace microshell
+
+#endif  // MICROSHELL_MODULES_SCHEDULING_SCHEDULING_H
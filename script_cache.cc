@@ -0,0 +1,523 @@
+#include "script_cache.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "arithmetic.h"
+#include "util.h"
+
+namespace microshell {
+namespace core {
+
+using namespace std;
+
+namespace {
+
+const char MAGIC[4] = { 'U', 'S', 'H', 'C' };
+// Guards against absurd counts in damaged files.
+const int MAX_NESTING = 256;
+
+uint64_t fnv1a(const char *data, size_t length) {
+  uint64_t hash = 14695981039346656037ULL;
+  for(size_t i = 0; i < length; ++i) {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+class Writer {
+public:
+  void put_u8(uint8_t value) {
+    data.push_back(static_cast<char>(value));
+  }
+
+  void put_u32(uint32_t value) {
+    data.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+
+  void put_u64(uint64_t value) {
+    data.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+
+  void put_string(const string& value) {
+    put_u32(static_cast<uint32_t>(value.length()));
+    data.append(value);
+  }
+
+  void put_word(const Word& word) {
+    put_u32(static_cast<uint32_t>(word.parts.size()));
+    for(const WordPart& part : word.parts) {
+      put_u8(static_cast<uint8_t>(part.kind));
+      put_string(part.text);
+      // Parsed arithmetic is stored as text and parsed again on load.
+      put_u8((part.expression ? 1 : 0) | (part.inner ? 2 : 0)
+             | (part.program ? 4 : 0));
+      if(part.inner) {
+        put_word(*part.inner);
+      }
+      if(part.program) {
+        put_program(*part.program);
+      }
+    }
+    put_u8(word.is_constant);
+    put_string(word.literal);
+    put_u8(word.is_plain);
+    put_u32(static_cast<uint32_t>(word.unquoted_prefix));
+    put_u8(word.is_all_positionals);
+  }
+
+  void put_program(const Program& program) {
+    put_u32(static_cast<uint32_t>(program.code.size()));
+    for(const Instruction& insn : program.code) {
+      put_u8(static_cast<uint8_t>(insn.op));
+      put_u32(static_cast<uint32_t>(insn.a));
+      put_u32(static_cast<uint32_t>(insn.b));
+    }
+
+    put_u32(static_cast<uint32_t>(program.commands.size()));
+    for(const SimpleCommandCode& command : program.commands) {
+      put_u32(static_cast<uint32_t>(command.assignments.size()));
+      for(const auto& assignment : command.assignments) {
+        put_string(assignment.first);
+        put_word(assignment.second);
+      }
+      put_u32(static_cast<uint32_t>(command.words.size()));
+      for(const Word& word : command.words) {
+        put_word(word);
+      }
+      put_u32(static_cast<uint32_t>(command.redirections.size()));
+      for(const Redirection& redirection : command.redirections) {
+        put_u8(static_cast<uint8_t>(redirection.kind));
+        put_word(redirection.word);
+      }
+    }
+
+    put_u32(static_cast<uint32_t>(program.word_lists.size()));
+    for(const vector<Word>& words : program.word_lists) {
+      put_u32(static_cast<uint32_t>(words.size()));
+      for(const Word& word : words) {
+        put_word(word);
+      }
+    }
+
+    put_u32(static_cast<uint32_t>(program.names.size()));
+    for(const string& name : program.names) {
+      put_string(name);
+    }
+
+    put_u32(static_cast<uint32_t>(program.functions.size()));
+    for(const auto& function : program.functions) {
+      put_program(*function);
+    }
+    put_u32(static_cast<uint32_t>(program.jobs.size()));
+    for(const auto& job : program.jobs) {
+      put_program(*job);
+    }
+  }
+
+  string data;
+};
+
+// Whether `index' is a valid index into `table'.
+template<class T>
+bool is_index(int32_t index, const vector<T>& table) {
+  return index >= 0 && static_cast<size_t>(index) < table.size();
+}
+
+// Whether every operand of `program' is in range for the VM: table indices
+// within their tables and jump targets within the code (or right past its
+// end).  The checksum only catches accidents, not crafted files.
+bool has_valid_operands(const Program& program) {
+  int32_t end = static_cast<int32_t>(program.code.size());
+  for(const Instruction& insn : program.code) {
+    bool valid = true;
+    switch(insn.op) {
+      case OpCode::RUN:
+        valid = is_index(insn.a, program.commands);
+        break;
+      case OpCode::JUMP:
+      case OpCode::JUMP_IF_FALSE:
+      case OpCode::JUMP_IF_TRUE:
+        valid = insn.a >= 0 && insn.a <= end;
+        break;
+      case OpCode::FOR_BEGIN:
+        valid = -1 == insn.a || is_index(insn.a, program.word_lists);
+        break;
+      case OpCode::FOR_NEXT:
+        valid = is_index(insn.a, program.names) && insn.b >= 0
+          && insn.b <= end;
+        break;
+      case OpCode::DEFINE_FUNCTION:
+        valid = is_index(insn.a, program.names)
+          && is_index(insn.b, program.functions);
+        break;
+      case OpCode::BACKGROUND:
+        valid = is_index(insn.a, program.names)
+          && is_index(insn.b, program.jobs);
+        break;
+      case OpCode::LEAVE:
+        valid = -1 == insn.a || (is_index(insn.a, program.word_lists)
+                                 && !program.word_lists[insn.a].empty());
+        break;
+      case OpCode::NOT:
+      case OpCode::SET_STATUS:
+      case OpCode::FOR_POP:
+        break;
+    }
+    if(!valid) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Walks a serialized program.  Every read is bounds-checked, and so are the
+// operands of the programs read; after the first failure, everything fails.
+class Reader {
+public:
+  Reader(const char *data, size_t length)
+    : data(data), length(length), pos(0), ok(true), depth(0) { }
+
+  bool get_u8(uint8_t *value) {
+    return get_raw(value, sizeof(*value));
+  }
+
+  bool get_u32(uint32_t *value) {
+    return get_raw(value, sizeof(*value));
+  }
+
+  bool get_u64(uint64_t *value) {
+    return get_raw(value, sizeof(*value));
+  }
+
+  bool get_string(string *value) {
+    uint32_t size;
+    if(!get_u32(&size) || !check(size)) {
+      return false;
+    }
+    value->assign(data + pos, size);
+    pos += size;
+    return true;
+  }
+
+  // A count of items, each at least one byte long.
+  bool get_count(uint32_t *count) {
+    return get_u32(count) && check(*count);
+  }
+
+  bool get_word(Word *word) {
+    uint32_t count;
+    if(!get_count(&count) || !enter()) {
+      return false;
+    }
+    word->parts.resize(count);
+    for(WordPart& part : word->parts) {
+      uint8_t kind, flags;
+      if(!get_u8(&kind) || kind > static_cast<uint8_t>(
+           WordPart::Kind::PROCESS_OUTPUT)
+         || !get_string(&part.text) || !get_u8(&flags)) {
+        return fail();
+      }
+      part.kind = static_cast<WordPart::Kind>(kind);
+      if(flags & 1) {
+        string error;
+        part.expression = ArithmeticExpression::parse(part.text, &error);
+        if(!part.expression) {
+          return fail();
+        }
+      }
+      if(flags & 2) {
+        shared_ptr<Word> inner = make_shared<Word>();
+        if(!get_word(inner.get())) {
+          return false;
+        }
+        part.inner = inner;
+      }
+      if(flags & 4) {
+        shared_ptr<Program> program = make_shared<Program>();
+        if(!get_program(program.get())) {
+          return false;
+        }
+        part.program = program;
+      }
+    }
+
+    uint8_t is_constant, is_plain, is_all_positionals;
+    uint32_t unquoted_prefix;
+    if(!get_u8(&is_constant) || !get_string(&word->literal)
+       || !get_u8(&is_plain) || !get_u32(&unquoted_prefix)
+       || !get_u8(&is_all_positionals)) {
+      return false;
+    }
+    word->is_constant = is_constant;
+    word->is_plain = is_plain;
+    word->unquoted_prefix = unquoted_prefix;
+    word->is_all_positionals = is_all_positionals;
+    leave();
+    return true;
+  }
+
+  bool get_words(vector<Word> *words) {
+    uint32_t count;
+    if(!get_count(&count)) {
+      return false;
+    }
+    words->resize(count);
+    for(Word& word : *words) {
+      if(!get_word(&word)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool get_programs(vector<shared_ptr<const Program>> *programs) {
+    uint32_t count;
+    if(!get_count(&count)) {
+      return false;
+    }
+    for(uint32_t i = 0; i < count; ++i) {
+      shared_ptr<Program> program = make_shared<Program>();
+      if(!get_program(program.get())) {
+        return false;
+      }
+      programs->push_back(program);
+    }
+    return true;
+  }
+
+  bool get_program(Program *program) {
+    uint32_t count;
+    if(!get_count(&count) || !enter()) {
+      return false;
+    }
+    program->code.resize(count);
+    for(Instruction& insn : program->code) {
+      uint8_t op;
+      uint32_t a, b;
+      if(!get_u8(&op) || op > static_cast<uint8_t>(OpCode::LEAVE)
+         || !get_u32(&a) || !get_u32(&b)) {
+        return fail();
+      }
+      insn = Instruction { static_cast<OpCode>(op),
+                           static_cast<int32_t>(a), static_cast<int32_t>(b) };
+    }
+
+    if(!get_count(&count)) {
+      return false;
+    }
+    program->commands.resize(count);
+    for(SimpleCommandCode& command : program->commands) {
+      uint32_t assignments;
+      if(!get_count(&assignments)) {
+        return false;
+      }
+      command.assignments.resize(assignments);
+      for(auto& assignment : command.assignments) {
+        if(!get_string(&assignment.first) || !get_word(&assignment.second)) {
+          return false;
+        }
+      }
+      if(!get_words(&command.words)) {
+        return false;
+      }
+      uint32_t redirections;
+      if(!get_count(&redirections)) {
+        return false;
+      }
+      command.redirections.resize(redirections);
+      for(Redirection& redirection : command.redirections) {
+        uint8_t kind;
+        if(!get_u8(&kind) || kind > static_cast<uint8_t>(
+             Redirection::Kind::HERE_STRING)
+           || !get_word(&redirection.word)) {
+          return fail();
+        }
+        redirection.kind = static_cast<Redirection::Kind>(kind);
+      }
+    }
+
+    if(!get_count(&count)) {
+      return false;
+    }
+    program->word_lists.resize(count);
+    for(vector<Word>& words : program->word_lists) {
+      if(!get_words(&words)) {
+        return false;
+      }
+    }
+
+    if(!get_count(&count)) {
+      return false;
+    }
+    program->names.resize(count);
+    for(string& name : program->names) {
+      if(!get_string(&name)) {
+        return false;
+      }
+    }
+
+    if(!get_programs(&program->functions) || !get_programs(&program->jobs)) {
+      return false;
+    }
+    if(!has_valid_operands(*program)) {
+      return fail();
+    }
+    leave();
+    return true;
+  }
+
+  bool at_end() const {
+    return ok && pos == length;
+  }
+
+private:
+  bool get_raw(void *value, size_t size) {
+    if(!check(size)) {
+      return false;
+    }
+    memcpy(value, data + pos, size);
+    pos += size;
+    return true;
+  }
+
+  bool check(size_t size) {
+    if(ok && size > length - pos) {
+      ok = false;
+    }
+    return ok;
+  }
+
+  bool enter() {
+    if(++depth > MAX_NESTING) {
+      return fail();
+    }
+    return ok;
+  }
+
+  void leave() {
+    --depth;
+  }
+
+  bool fail() {
+    ok = false;
+    return false;
+  }
+
+  const char *data;
+  size_t length;
+  size_t pos;
+  bool ok;
+  int depth;
+};
+
+// The header identifies the script version the program was compiled from.
+void put_header(Writer *writer, const string& path, const struct stat& info) {
+  writer->data.append(MAGIC, sizeof(MAGIC));
+  writer->put_u32(BYTECODE_FORMAT_VERSION);
+  writer->put_string(path);
+  writer->put_u64(static_cast<uint64_t>(info.st_size));
+  writer->put_u64(static_cast<uint64_t>(info.st_mtim.tv_sec));
+  writer->put_u64(static_cast<uint64_t>(info.st_mtim.tv_nsec));
+}
+
+}  // namespace
+
+ScriptCache::ScriptCache(const string& directory) : directory(directory) { }
+
+string ScriptCache::get_entry_path(const string& path) const {
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx.ushc",
+           static_cast<unsigned long long>(fnv1a(path.data(),
+                                                 path.length())));
+  return directory + "/" + name;
+}
+
+shared_ptr<Program> ScriptCache::find(const string& path,
+                                      const struct stat& info) const {
+  if(directory.empty()) {
+    return nullptr;
+  }
+  int fd = open(get_entry_path(path).c_str(), O_RDONLY | O_CLOEXEC);
+  if(-1 == fd) {
+    return nullptr;
+  }
+  struct stat entry_info;
+  if(-1 == fstat(fd, &entry_info) || 0 == entry_info.st_size) {
+    close(fd);
+    return nullptr;
+  }
+  size_t size = entry_info.st_size;
+  void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(MAP_FAILED == mapping) {
+    return nullptr;
+  }
+
+  // Header, then the program's length and checksum, then the program.
+  const char *data = static_cast<const char*>(mapping);
+  Writer expected;
+  put_header(&expected, path, info);
+  shared_ptr<Program> program;
+  size_t header = expected.data.length();
+  uint64_t length, checksum;
+  if(size >= header + 2 * sizeof(uint64_t)
+     && 0 == memcmp(data, expected.data.data(), header)) {
+    memcpy(&length, data + header, sizeof(length));
+    memcpy(&checksum, data + header + sizeof(length), sizeof(checksum));
+    const char *body = data + header + 2 * sizeof(uint64_t);
+    size_t available = size - header - 2 * sizeof(uint64_t);
+    if(length == available && checksum == fnv1a(body, available)) {
+      Reader reader(body, available);
+      program = make_shared<Program>();
+      if(!reader.get_program(program.get()) || !reader.at_end()) {
+        program.reset();
+      }
+    }
+  }
+  munmap(mapping, size);
+  return program;
+}
+
+void ScriptCache::insert(const string& path, const struct stat& info,
+                         const Program& program) const {
+  if(directory.empty() || !util::make_directories(directory)) {
+    return;
+  }
+
+  Writer body;
+  body.put_program(program);
+  Writer entry;
+  put_header(&entry, path, info);
+  entry.put_u64(body.data.length());
+  entry.put_u64(fnv1a(body.data.data(), body.data.length()));
+  entry.data += body.data;
+
+  // Written aside and renamed into place, so that concurrent runs of the
+  // script never see half an entry.
+  string entry_path = get_entry_path(path);
+  string temporary = entry_path + ".tmp." + to_string(getpid());
+  int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0644);
+  if(-1 == fd) {
+    return;
+  }
+  bool ok = util::write_all(fd, entry.data);
+  ok = (0 == close(fd)) && ok;
+  if(!ok || -1 == rename(temporary.c_str(), entry_path.c_str())) {
+    unlink(temporary.c_str());
+  }
+}
+
+}  // namespace core
+}  // namespace microshell
@@ -0,0 +1,47 @@
+#ifndef MICROSHELL_CORE_SCRIPT_CACHE_H
+#define MICROSHELL_CORE_SCRIPT_CACHE_H
+
+#include <memory>
+#include <string>
+
+#include <sys/stat.h>
+
+#include "bytecode.h"
+
+namespace microshell {
+namespace core {
+
+// Compiled scripts, kept on disk so that scripts run over and over (e.g.
+// from cron) skip lexing and parsing.
+//
+// Each script gets one file, named after a hash of its path, holding the
+// script's path, size and modification time, the bytecode format version
+// and the serialized `Program'.  The format only uses offsets relative to
+// the data around them, so the file is read by mapping it and walking it
+// once; anything that doesn't match (or doesn't parse) is a miss.
+class ScriptCache {
+public:
+  // An empty `directory' disables the cache.
+  explicit ScriptCache(const std::string& directory);
+
+  // Returns the cached program for the script at `path' (an absolute path)
+  // if it was compiled from the version described by `info', or null.
+  std::shared_ptr<Program> find(const std::string& path,
+                                const struct stat& info) const;
+
+  // Stores `program' as the compiled form of the version of `path'
+  // described by `info'.  Best effort: errors only mean the script gets
+  // compiled again next time.
+  void insert(const std::string& path, const struct stat& info,
+              const Program& program) const;
+
+private:
+  std::string get_entry_path(const std::string& path) const;
+
+  std::string directory;
+};
+
+}  // namespace core
+}  // namespace microshell
+
+#endif  // MICROSHELL_CORE_SCRIPT_CACHE_H
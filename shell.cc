@@ -1,4 +1,6 @@
 // C++ includes
+#include <algorithm>
+#include <fstream>
 #include <iostream>
 #include <map>
 #include <memory>
@@ -6,6 +8,7 @@
 #include <vector>
 
 // C includes
+#include <cerrno>
 #include <cstdlib>
 #include <cstdio>
 #include <cstring>
@@ -13,17 +16,27 @@
 // OS-specific
 #include <readline/readline.h>
 #include <readline/history.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <unistd.h>
 
 #include "builtin_registry.h"
 #include "command.h"
+#include "compiler.h"
+#include "coreutils.h"
+#include "dag.h"
 #include "job_control.h"
+#include "memo.h"
 #include "sample_module.h"
+#include "scheduling.h"
+#include "script_cache.h"
 #include "shell.h"
 #include "util.h"
+#include "vcs.h"
 
 namespace microshell {
 namespace core {
@@ -32,70 +45,296 @@ using namespace std;
 using namespace microshell::modules;
 
 const int SHELL_FATAL = -1;
+// The exit status for scripts which can't be read or compiled.
+const int STATUS_SCRIPT_ERROR = 2;
+// How many compiled commands the shell remembers.
+const size_t COMMAND_CACHE_CAPACITY = 128;
+// Longer texts (e.g. whole scripts) aren't worth keeping around as keys.
+const size_t MAX_CACHED_COMMAND_LENGTH = 4096;
+
+// How many matches `C-r' lets the user step through.
+const size_t FUZZY_SEARCH_RESULTS = 64;
+// How long one Tab may spend listing a directory.
+const uint64_t COMPLETION_BUDGET_NS = 150 * 1000 * 1000;
+// How many background jobs may pile up before they're first reaped.
+const size_t MIN_REAP_THRESHOLD = 64;
 
 // Singleton initialization.
 Shell* Shell::instance = nullptr;
 
-void handle_sigint(int signo) {
+// Set by the signal handlers, and reported by `wait_child' once the child it
+// waits for changes state.  The handlers themselves stick to what is safe
+// in a signal handler (i.e. no stream output), so that a burst of C-c or
+// C-z can't interrupt the shell in the middle of printing.
+volatile sig_atomic_t interrupted_child = 0;
+volatile sig_atomic_t suspended_child = 0;
+
+void handle_sigint(int) {
   // TODO(andrei) This will be invalid for a brief moment between when this
   // signal handler is set up and when the shell initialization finishes.
   Shell *shell = Shell::get();
 
-  if(SIGINT != signo) {
-    // TODO(andrei) Signal2name.
-    shell->fatal("Signal mismatch.  Expecting SIGINT, got " + to_string(signo));
-  }
-
   if(shell->get_waiting_for_child()) {
-    shell->info("C-c while child was running.");
+    interrupted_child = 1;
   }
-  else {
-    shell->info("C-c while NO child was running. Terminating shell.");
+  else if(!shell->is_exit_requested()) {
+    // C-c while NO child was running terminates the shell.
     // TODO(andrei) Ensure that we synchronize properly.
     shell->exit();
   }
 }
 
-void handle_sigtstp(int signo) {
+void handle_sigtstp(int) {
   Shell *shell = Shell::get();
 
-  if(SIGTSTP != signo) {
-    shell->fatal(
-      "Signal mismatch.  Expecting SIGTSTP, got " +
-      string(strsignal(signo)) +
-      "."
-    );
-  }
-
   if(shell->get_waiting_for_child()) {
-    shell->info("Suspending foreground job.  Use `fg' to continue it in the "
-        "foreground, or `bg' to continue it in the background.");
+    suspended_child = 1;
   }
 
   // Otherwise, we just ignore the signal.
 }
 
+// Starts deferred jobs once admission control (and the jobserver) lets
+// them, and gives back the jobserver slots of finished jobs, even while the
+// shell is busy with something else (e.g. waiting for the foreground
+// command).  Keeps going for as long as there is any of that to do.
+class BackgroundJobTender : public EventLoop::Task {
+public:
+  EventLoop::Await resume(Shell *shell, short) override {
+    return shell->tend_background_jobs();
+  }
+};
+
+// Set while `C-r' owns the prompt.
+bool searching_history = false;
+
+// Replaces readline's `C-r' (reverse-i-search) with a fuzzy search over the
+// history; see `HistorySearch'.  Typing refines the query, `C-r' steps to
+// the next match, `C-g' cancels and ESC stops searching, leaving the match
+// up for editing.  Any other key (e.g. RET) stops searching and is then
+// handled as usual.
+int fuzzy_history_search(int, int) {
+  HistorySearch& history = Shell::get()->get_history_search();
+  string original(rl_line_buffer);
+  string query;
+  string shown = original;
+  size_t selected = 0;
+  vector<HistorySearch::Match> matches =
+    history.search(query, FUZZY_SEARCH_RESULTS);
+
+  searching_history = true;
+  rl_save_prompt();
+  while(true) {
+    if(!matches.empty()) {
+      shown = history.get(matches[selected].entry);
+    }
+    rl_replace_line(shown.c_str(), 0);
+    rl_point = rl_end;
+    // `rl_message()' isn't prototyped in C++, so set the prompt directly.
+    string message = string(matches.empty() ? "(failed " : "(")
+      + "fuzzy-search)`" + query + "': ";
+    rl_set_prompt(message.c_str());
+    rl_redisplay();
+
+    int key = rl_read_key();
+    if(CTRL('R') == key) {
+      if(!matches.empty()) {
+        selected = (selected + 1) % matches.size();
+      }
+      continue;
+    }
+    if(RUBOUT == key || CTRL('H') == key) {
+      if(!query.empty()) {
+        query.erase(query.size() - 1);
+        matches = history.search(query, FUZZY_SEARCH_RESULTS);
+        selected = 0;
+      }
+      continue;
+    }
+    if(key >= ' ' && key < RUBOUT) {
+      query.push_back(static_cast<char>(key));
+      matches = history.search(query, FUZZY_SEARCH_RESULTS);
+      selected = 0;
+      continue;
+    }
+
+    searching_history = false;
+    rl_restore_prompt();
+    rl_clear_message();
+    if(CTRL('G') == key) {
+      rl_replace_line(original.c_str(), 0);
+      rl_point = rl_end;
+    }
+    else if(ESC != key) {
+      rl_execute_next(key);
+    }
+    return 0;
+  }
+}
+
+// Returns a `malloc'ed copy of `s', as readline wants its matches.
+char* copy_match(const string& s) {
+  char *copy = static_cast<char*>(malloc(s.size() + 1));
+  memcpy(copy, s.c_str(), s.size() + 1);
+  return copy;
+}
+
+// Tab completion of file names, through `FilenameCompletion' rather than
+// readline's own (which lists the whole directory on every Tab, however
+// large it is).  If the directory can't be listed within the time budget,
+// the matches found so far are shown and nothing is inserted; the next Tab
+// carries on listing.  A key pressed in the meantime cancels the attempt.
+char** complete_filename(const char *text, int, int) {
+  rl_attempted_completion_over = 1;
+  rl_filename_completion_desired = 1;
+
+  Shell *shell = Shell::get();
+  string word(text);
+  size_t slash = word.rfind('/');
+  string head = string::npos == slash ? "" : word.substr(0, slash + 1);
+  string prefix = string::npos == slash ? word : word.substr(slash + 1);
+  string directory = head;
+  if(0 == head.compare(0, 2, "~/")) {
+    directory = shell->get_home_directory() + head.substr(1);
+  }
+  else if(!util::is_absolute_path(head)) {
+    directory = shell->get_working_directory() + "/" + head;
+  }
+
+  vector<string> names;
+  FilenameCompletion& completion = shell->get_filename_completion();
+  FilenameCompletion::Status status =
+    completion.complete(directory, prefix, COMPLETION_BUDGET_NS,
+                        fileno(rl_instream), &names);
+  if(FilenameCompletion::Status::PARTIAL == status) {
+    // Only what's been listed so far is known, so nothing can be inserted
+    // yet; show how far it got instead.
+    vector<string> shown;
+    size_t longest = 0;
+    if(names.size() <= static_cast<size_t>(rl_completion_query_items)) {
+      shown.push_back(word);
+      for(const string& name : names) {
+        shown.push_back(head + name);
+        longest = max(longest, name.size());
+      }
+    }
+    vector<char*> list;
+    for(string& match : shown) {
+      list.push_back(&match[0]);
+    }
+    list.push_back(nullptr);
+    if(!shown.empty()) {
+      rl_display_match_list(list.data(), shown.size() - 1, longest);
+    }
+    else {
+      rl_crlf();
+    }
+    cout << "(still listing: " << names.size() << " matches in the first "
+         << completion.get_listed(directory)
+         << " entries; Tab continues)" << flush;
+    rl_crlf();
+    rl_forced_update_display();
+    return nullptr;
+  }
+  if(FilenameCompletion::Status::COMPLETE != status || names.empty()) {
+    return nullptr;
+  }
+
+  char **matches =
+    static_cast<char**>(malloc((names.size() + 2) * sizeof(char*)));
+  // The first entry is what replaces `text': the longest common prefix.
+  size_t common = names[0].size();
+  for(const string& name : names) {
+    size_t i = 0;
+    while(i < common && i < name.size() && name[i] == names[0][i]) {
+      ++i;
+    }
+    common = i;
+  }
+  size_t count = 0;
+  matches[count++] = copy_match(head + names[0].substr(0, common));
+  if(names.size() > 1) {
+    for(const string& name : names) {
+      matches[count++] = copy_match(head + name);
+    }
+  }
+  matches[count] = nullptr;
+  return matches;
+}
+
+int handle_readline_idle() {
+  Shell *shell = Shell::get();
+  shell->get_event_loop().run_ready();
+  if(!searching_history) {
+    shell->refresh_prompt();
+  }
+  return 0;
+}
+
 Shell::Shell(const vector<string> &) :
     exit_requested(false),
+    working_directory_fd(-1),
     home_directory(util::get_current_home()),
     standard_output(cout),
     error_output(cerr),
     name("ush"),
     username(util::get_current_user()),
+    vm(this),
+    event_loop(this),
+    command_cache(COMMAND_CACHE_CAPACITY),
+    prompt_segments_enabled(isatty(STDIN_FILENO)),
+    last_duration_ns(0),
+    showing_prompt(false),
+    last_background_pid(0),
+    reporting_jobs(false),
+    reap_threshold(MIN_REAP_THRESHOLD),
+    waiting_for_job_slot(false),
+    tending_jobs(false),
+    background_owner(::getpid()),
+    resolution_generation(1),
+    last_status(0),
     waiting_for_child(false) {
   this->load_default_modules();
+  if(prompt_segments_enabled) {
+    prompt_segments.add_segment(make_shared<StatusSegment>());
+    prompt_segments.add_segment(make_shared<DurationSegment>());
+  }
   cout << "Welcome to microshell, " << username << "!" << endl;
-  if(!util::getcwd(&this->working_directory)) {
+  string initial_directory;
+  if(!util::getcwd(&initial_directory)) {
     eout("Failed to get the current working directory.");
-    // TODO(andrei) Display what `~' resolves to between parentheses.  If it
-    // can't be resolved, use `/' instead.
-    eout("Defaulting to `~'.");
-    // TODO(andrei) Use setter and actually resolve $HOME.
-    this->working_directory = "~";
+    eout("Defaulting to `~' (" + home_directory + ").");
+    initial_directory = home_directory;
+  }
+  if(!this->set_working_directory(initial_directory)) {
+    eout("Could not open [" + initial_directory + "]. Defaulting to `/'.");
+    this->set_working_directory("/");
+  }
+
+  // Import the environment as exported shell variables.  This also sets up
+  // `path'.  Entries which aren't valid `NAME=value' pairs are dropped.
+  for(char **env = environ; nullptr != *env; ++env) {
+    string entry(*env);
+    size_t equals = entry.find('=');
+    if(string::npos != equals
+       && Compiler::is_valid_name(entry.substr(0, equals))) {
+      this->set_variable(entry.substr(0, equals), entry.substr(equals + 1));
+      this->export_variable(entry.substr(0, equals));
+    }
+  }
+
+  // Run by `make -j' (with a `+' rule, or `$(MAKE)' in it), share its
+  // limit on parallel jobs.
+  string jobserver_error;
+  if(!jobserver.connect(get_variable("MAKEFLAGS"), &jobserver_error)) {
+    this->warning("Not using the jobserver of `make': " + jobserver_error);
   }
 
-  string envpath = getenv("PATH");
-  this->path = util::split(envpath, ':');
+  rl_add_defun("fuzzy-history-search", fuzzy_history_search, CTRL('R'));
+  rl_attempted_completion_function = complete_filename;
+  if(prompt_segments_enabled) {
+    rl_event_hook = handle_readline_idle;
+  }
 
   this->info("Setting up signal handlers...");
   if(SIG_ERR == signal(SIGINT, handle_sigint)) {
@@ -107,7 +346,10 @@ Shell::Shell(const vector<string> &) :
 }
 
 int Shell::interactive() {
+  reporting_jobs = true;
   while (!exit_requested) {
+    start_deferred_jobs();
+    report_finished_jobs();
     string command_text = read_command();
     if(0 == command_text.length()) {
       cout << endl;
@@ -116,23 +358,130 @@ int Shell::interactive() {
 
     shared_ptr<Command> command;
     string error;
-    if(parse_command(command_text, command, &error)) {
+    bool incomplete = false;
+    bool parsed = parse_command(command_text, command, &error, &incomplete);
+    while(!parsed && incomplete) {
+      string more = read_command(true);
+      if(exit_requested) {
+        break;
+      }
+      command_text += "\n" + more;
+      parsed = parse_command(command_text, command, &error, &incomplete);
+    }
+
+    if(parsed) {
+      uint64_t start = util::monotonic_ns();
       interpret_command(*command);
+      last_duration_ns = util::monotonic_ns() - start;
     }
     else {
       eout(error);
     }
   }
 
+  on_terminate();
   return 0;
 }
 
+int Shell::run_script(const string& path, const vector<string>& args) {
+  shared_ptr<Command> command;
+  string error;
+  if(!load_script(resolve_path(path), command, &error)) {
+    eout(path + ": " + error);
+    return STATUS_SCRIPT_ERROR;
+  }
+
+  set_positional_parameters(args);
+  int status = interpret_command(*command);
+  on_terminate();
+  return status;
+}
+
+bool Shell::load_script(const string& path,
+                        shared_ptr<Command> &command,
+                        string *error) {
+  ifstream in(path);
+  struct stat info;
+  if(!in || -1 == stat(path.c_str(), &info)) {
+    *error = "Could not open script.";
+    return false;
+  }
+
+  ScriptCache cache(get_script_cache_directory());
+  shared_ptr<Program> program = cache.find(path, info);
+  ++(program ? stats.script_cache_hits : stats.script_cache_misses);
+  if(program) {
+    command = make_shared<CompiledCommand>(program);
+    return true;
+  }
+
+  string source((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+  uint64_t start = util::monotonic_ns();
+  Compiler::Result result = Compiler::compile(source, &program, error);
+  ++stats.parses;
+  stats.parse_time.record(util::monotonic_ns() - start);
+  if(Compiler::Result::INCOMPLETE == result) {
+    *error = "syntax error: unexpected end of input";
+    return false;
+  }
+  if(Compiler::Result::ERROR == result) {
+    return false;
+  }
+
+  // Keyed by the file's state from before it was read: if it changed in
+  // between, the next run simply misses.
+  cache.insert(path, info, *program);
+  command = make_shared<CompiledCommand>(program);
+  return true;
+}
+
+string Shell::get_script_cache_directory() const {
+  if("off" == get_variable("USH_SCRIPT_CACHE")) {
+    return "";
+  }
+  string cache = get_variable("XDG_CACHE_HOME");
+  if(cache.empty()) {
+    cache = home_directory + "/.cache";
+  }
+  return cache + "/ush/scripts";
+}
+
+void Shell::on_terminate() {
+  // The shell won't be around to start them later.  They still wait for a
+  // slot, though.
+  while(has_deferred_jobs()) {
+    if(!take_job_slot()) {
+      struct pollfd slot { jobserver.get_fd(), POLLIN, 0 };
+      poll(&slot, 1, AdmissionControl::SAMPLE_INTERVAL_NS / 1000000);
+      continue;
+    }
+    DeferredJob job = deferred_jobs.front();
+    deferred_jobs.pop_front();
+    start_deferred_job(job, AdmissionControl::Decision::Outcome::FORCED,
+                       "shell exiting");
+  }
+  // Nor to give these back once the jobs are done.
+  jobserver.release_all();
+  prompt_segments.stop();
+  if("json" == stats_at_exit_format) {
+    eout(stats.to_json());
+  }
+  else if("text" == stats_at_exit_format) {
+    eout(stats.to_text());
+  }
+}
+
 string Shell::expand(const string& param) const {
   // TODO(andrei) Variable expansions happen first.
 
   if(0 == param.find("~")) {
     string rest = param.substr(1);
-    return util::merge_paths(home_directory, rest);
+    if(rest.empty()) {
+      return home_directory;
+    }
+    if('/' == rest[0]) {
+      return home_directory + rest;
+    }
   }
 
   return param;
@@ -140,28 +489,153 @@ string Shell::expand(const string& param) const {
 
 string Shell::resolve_path(const string& path) const {
   if(util::is_absolute_path(path)) {
-    return path;
+    return util::normalize_path(path);
   }
 
   // The VFS can handle the `..' sequences, but we want to handle them
   // ourselves in order to display the path in a clearer way.
 
-  return util::merge_paths(working_directory, path);
+  return util::normalize_path(util::merge_paths(working_directory, path));
 }
 
 string& Shell::get_working_directory() {
   return working_directory;
 }
 
-void Shell::set_working_directory(const string& directory) {
-  util::setcwd(directory);
-  working_directory = directory;
+bool Shell::set_working_directory(const string& directory) {
+  string full_path = resolve_path(directory);
+  int fd = util::open_directory(full_path);
+  if(-1 == fd) {
+    return false;
+  }
+
+  // Keep the process's own working directory in sync, so that children
+  // inherit it.
+  if(-1 == ::fchdir(fd)) {
+    ::close(fd);
+    return false;
+  }
+
+  if(-1 != working_directory_fd) {
+    ::close(working_directory_fd);
+  }
+  working_directory_fd = fd;
+  working_directory = full_path;
+  invalidate_resolutions();
+  return true;
+}
+
+int Shell::get_working_directory_fd() const {
+  return working_directory_fd;
 }
 
-string Shell::get_working_directory() const {
+const string& Shell::get_working_directory() const {
   return working_directory;
 }
 
+string Shell::get_variable(const string& name) const {
+  if("?" == name) {
+    return to_string(last_status);
+  }
+  if("#" == name) {
+    return to_string(positional_parameters.size());
+  }
+  if("@" == name || "*" == name) {
+    vector<string> parameters = positional_parameters;
+    return util::merge_with(parameters.begin(), parameters.end(), " ");
+  }
+  if("$" == name) {
+    return to_string(::getpid());
+  }
+  if("!" == name) {
+    return 0 == last_background_pid ? "" : to_string(last_background_pid);
+  }
+  if("0" == name) {
+    return this->name;
+  }
+  if(!name.empty() && isdigit(static_cast<unsigned char>(name[0]))) {
+    size_t index = strtoul(name.c_str(), nullptr, 10);
+    if(index >= 1 && index <= positional_parameters.size()) {
+      return positional_parameters[index - 1];
+    }
+    return "";
+  }
+
+  auto it = variables.find(name);
+  return variables.end() == it ? "" : it->second;
+}
+
+void Shell::set_variable(const string& name, const string& value) {
+  this->set_variable(name, value.data(), value.size());
+}
+
+void Shell::set_variable(const string& name, const char *value,
+                         size_t length) {
+  string& slot = variables[name];
+  slot.assign(value, length);
+  if(is_exported(name)) {
+    environment.set(name, slot);
+  }
+  if("PATH" == name) {
+    this->path = util::split(slot, ':');
+    invalidate_resolutions();
+  }
+}
+
+void Shell::unset_variable(const string& name) {
+  variables.erase(name);
+  unexport_variable(name);
+  if("PATH" == name) {
+    this->path.clear();
+    invalidate_resolutions();
+  }
+}
+
+bool Shell::is_variable_set(const string& name) const {
+  return variables.end() != variables.find(name);
+}
+
+void Shell::export_variable(const string& name) {
+  exported_names.insert(name);
+  auto it = variables.find(name);
+  if(variables.end() != it) {
+    environment.set(name, it->second);
+  }
+}
+
+void Shell::unexport_variable(const string& name) {
+  exported_names.erase(name);
+  environment.remove(name);
+}
+
+bool Shell::is_exported(const string& name) const {
+  return exported_names.end() != exported_names.find(name);
+}
+
+Environment& Shell::get_environment() {
+  return environment;
+}
+
+const vector<string>& Shell::get_positional_parameters() const {
+  return positional_parameters;
+}
+
+void Shell::set_positional_parameters(const vector<string>& parameters) {
+  positional_parameters = parameters;
+}
+
+int Shell::get_last_status() const {
+  return last_status;
+}
+
+void Shell::set_last_status(int status) {
+  last_status = status;
+}
+
+const string& Shell::get_home_directory() const {
+  return home_directory;
+}
+
 const Shell* Shell::out(const string& message) {
   this->standard_output << message << endl;
   return this;
@@ -204,6 +678,10 @@ void Shell::exit() {
   this->exit_requested = true;
 }
 
+bool Shell::is_exit_requested() const {
+  return this->exit_requested;
+}
+
 template<class MODULE_TYPE>
 int Shell::load_module(shared_ptr<MODULE_TYPE> module) {
   module->initialize(*this);
@@ -215,16 +693,62 @@ int Shell::load_module(shared_ptr<MODULE_TYPE> module) {
       (*bf)->get_name(), *bf
     );
   }
+  if(prompt_segments_enabled) {
+    for(const auto& segment : module->get_prompt_segments()) {
+      prompt_segments.add_segment(segment);
+    }
+  }
   loaded_modules.push_back(module);
+  invalidate_resolutions();
   return 0;
 }
 
-string Shell::get_prompt() const {
-  return "(" + this->working_directory + ") " + this->prompt;
+string Shell::get_prompt() {
+  string segments;
+  if(prompt_segments_enabled) {
+    segments = prompt_segments.render(
+      PromptContext { working_directory, last_status, last_duration_ns });
+  }
+  string prompt;
+  prompt.reserve(working_directory.length() + segments.length()
+                 + this->prompt.length() + 4);
+  prompt += "(";
+  prompt += working_directory;
+  prompt += ") ";
+  if(!segments.empty()) {
+    prompt += segments;
+    prompt += " ";
+  }
+  prompt += this->prompt;
+  return prompt;
+}
+
+void Shell::refresh_prompt() {
+  if(showing_prompt && prompt_segments.take_update()) {
+    string prompt = get_prompt();
+    rl_set_prompt(prompt.c_str());
+    rl_forced_update_display();
+  }
 }
 
-string Shell::read_command() {
-  unique_ptr<char> line(readline(get_prompt().c_str()));
+string Shell::read_command(bool continuation) {
+  // Once `read' took more than a line from the pipe the commands come
+  // from, they come out of its buffer, until it runs out.
+  if(input_buffer.has_unread(STDIN_FILENO)) {
+    const char *line;
+    size_t length;
+    bool complete;
+    if(!input_buffer.read_line(STDIN_FILENO, &line, &length, &complete)) {
+      this->exit();
+      return "";
+    }
+    return string(line, length);
+  }
+
+  string prompt = continuation ? "> " : get_prompt();
+  showing_prompt = !continuation;
+  unique_ptr<char> line(readline(prompt.c_str()));
+  showing_prompt = false;
 
   // This happens if e.g. the user enters an EOF character (C-D).
   if(!line) {
@@ -235,24 +759,80 @@ string Shell::read_command() {
   string command(line.get());
   if(command.size() > 0) {
     add_history(line.get());
+    history_search.add(command);
   }
   return command;
 }
 
 int Shell::interpret_command(Command &cmd) {
-  return cmd.invoke(this);
+  last_status = cmd.invoke(this);
+  return last_status;
+}
+
+void Shell::report_finished_jobs() {
+  jobs.poll();
+  for(const Job& job : jobs.collect_finished()) {
+    string state = 0 == job.status ? "Done"
+                                   : "Exit " + to_string(job.status);
+    string report = "[" + to_string(job.id) + "] " + state + "\t"
+      + job.command;
+    if(jobs.get_output().get_total(job.id) > 0) {
+      report += "\t(see `jobs -o %" + to_string(job.id) + "')";
+    }
+    out(report);
+  }
 }
 
 bool Shell::parse_command(const string& command_text,
                           shared_ptr<Command> &command,
-                          string *error) const {
-  // TODO(andrei) YACC this.
-  // TODO(andrei) Customizable IFS variable.
-  vector<string> argv = util::split(command_text, ' ');
+                          string *error,
+                          bool *incomplete) const {
+  if(nullptr != incomplete) {
+    *incomplete = false;
+  }
+
+  string key;
+  bool cacheable = command_text.length() <= MAX_CACHED_COMMAND_LENGTH;
+  if(cacheable) {
+    key = CommandCache::normalize(command_text);
+    shared_ptr<const Program> cached = command_cache.find(key);
+    ++(cached ? stats.command_cache_hits : stats.command_cache_misses);
+    if(cached) {
+      command = make_shared<CompiledCommand>(cached);
+      return true;
+    }
+  }
+
+  shared_ptr<Program> program;
+  uint64_t start = util::monotonic_ns();
+  Compiler::Result result = Compiler::compile(command_text, &program, error);
+  ++stats.parses;
+  stats.parse_time.record(util::monotonic_ns() - start);
+  if(nullptr != incomplete) {
+    *incomplete = Compiler::Result::INCOMPLETE == result;
+  }
 
-  // Perform expansion for every parameter.
-  for(string& arg : argv) {
-    arg = expand(arg);
+  if(Compiler::Result::INCOMPLETE == result) {
+    *error = "syntax error: unexpected end of input";
+    return false;
+  }
+  if(Compiler::Result::ERROR == result) {
+    return false;
+  }
+
+  if(cacheable) {
+    command_cache.insert(key, program);
+  }
+  command = make_shared<CompiledCommand>(program);
+  return true;
+}
+
+bool Shell::build_command(vector<string> argv,
+                          shared_ptr<Command> &command,
+                          string *error) const {
+  if(argv.empty()) {
+    *error = "Empty command.";
+    return false;
   }
 
   const string& program_name = argv[0];
@@ -262,8 +842,7 @@ bool Shell::parse_command(const string& command_text,
   }
   else {
     // If the path actually points to a directory, we want to catch that.
-    string full_path = resolve_path(program_name);
-    if (util::is_directory(full_path)) {
+    if (util::is_directory_at(working_directory_fd, program_name)) {
       // TODO(andrei) zsh-like auto-cd functionality could go here.
       *error = "Cannot execute [" + argv[0] + "]. It's a directory.";
       return false;
@@ -272,7 +851,7 @@ bool Shell::parse_command(const string& command_text,
     string binary_path;
     if(resolve_binary_name(argv[0], &binary_path)) {
       argv[0] = binary_path;
-      command = make_shared<DiskCommand>(new DiskCommand(argv));
+      command = make_shared<DiskCommand>(argv);
     } else {
       *error = "Command not found: [" + argv[0] + "]";
       return false;
@@ -283,6 +862,7 @@ bool Shell::parse_command(const string& command_text,
 }
 
 bool Shell::resolve_binary_name(const string& name, string* full_path) const {
+  ++stats.path_lookups;
   // No lookup needed for absolute paths.
   if(util::is_absolute_path(name)) {
     *full_path = name;
@@ -290,17 +870,16 @@ bool Shell::resolve_binary_name(const string& name, string* full_path) const {
   }
 
   // Search in our current directory.
-  {
-    string path = util::merge_paths(working_directory, name);
-    if(util::is_file(path)) {
-      *full_path = path;
-      return true;
-    }
+  ++stats.path_stat_calls;
+  if(util::is_file_at(working_directory_fd, name)) {
+    *full_path = resolve_path(name);
+    return true;
   }
 
   // Search the PATH.
   for(const string& p : this->path) {
     string path = util::merge_paths(p, name);
+    ++stats.path_stat_calls;
     if(util::is_file(path)) {
       *full_path = path;
       return true;
@@ -325,25 +904,259 @@ int Shell::load_default_modules() {
   this->load_module(
     make_shared<job_control::JobControl>(job_control::JobControl())
   );
+  this->load_module(
+    make_shared<scheduling::Scheduling>(scheduling::Scheduling())
+  );
+  this->load_module(
+    make_shared<coreutils::Coreutils>(coreutils::Coreutils())
+  );
+  this->load_module(
+    make_shared<memo::Memo>(memo::Memo())
+  );
+  this->load_module(
+    make_shared<vcs::Vcs>(vcs::Vcs())
+  );
+  this->load_module(
+    make_shared<dag::Dag>(dag::Dag())
+  );
   return 0;
 }
 
+SpawnPolicy& Shell::get_spawn_policy() {
+  return this->spawn_policy;
+}
+
+VirtualMachine& Shell::get_virtual_machine() {
+  return this->vm;
+}
+
+EventLoop& Shell::get_event_loop() {
+  return this->event_loop;
+}
+
+CommandCache& Shell::get_command_cache() {
+  return this->command_cache;
+}
+
+Stats& Shell::get_stats() {
+  return this->stats;
+}
+
+JobTable& Shell::get_jobs() {
+  return this->jobs;
+}
+
+int Shell::add_background_job(pid_t pid, const string& command,
+                              int output) {
+  last_background_pid = pid;
+  // Finished jobs are reaped before each prompt, which scripts never get to.
+  // Reap them here too, whenever the table has doubled in size since the
+  // last time, so that a loop starting jobs doesn't pile up zombies (nor
+  // poll every job for every new one).
+  if(jobs.get_jobs().size() >= reap_threshold) {
+    jobs.poll();
+    if(!reporting_jobs) {
+      jobs.collect_finished();
+    }
+    reap_threshold = max(MIN_REAP_THRESHOLD, 2 * jobs.get_jobs().size());
+  }
+  return jobs.add(pid, command, Job::State::RUNNING, output);
+}
+
+AdmissionControl& Shell::get_admission_control() {
+  return this->admission_control;
+}
+
+int Shell::defer_background_job(shared_ptr<const Program> program,
+                                const string& command,
+                                const string& reason) {
+  int id = jobs.add(0, command, Job::State::DEFERRED);
+  check_background_owner();
+  deferred_jobs.push_back(DeferredJob { id, program, command,
+                                        util::monotonic_ns() });
+  // Until it starts, there is no process for `$!' to name.
+  last_background_pid = 0;
+  admission_control.record(command,
+                           AdmissionControl::Decision::Outcome::DEFERRED,
+                           reason);
+  info("Deferred job [" + to_string(id) + "]: " + reason + ".");
+  tend_jobs_later();
+  return id;
+}
+
+void Shell::start_deferred_jobs() {
+  typedef AdmissionControl::Decision::Outcome Outcome;
+  waiting_for_job_slot = false;
+  while(has_deferred_jobs()) {
+    string reason;
+    Outcome outcome = Outcome::ADMITTED;
+    if(!admission_control.admit(&reason)) {
+      uint64_t waited = util::monotonic_ns()
+        - deferred_jobs.front().deferred_ns;
+      if(waited < admission_control.get_max_deferral_ns()) {
+        break;
+      }
+      outcome = Outcome::FORCED;
+    }
+    // Only admission control gives up on waiting.
+    if(!take_job_slot()) {
+      waiting_for_job_slot = true;
+      break;
+    }
+    DeferredJob job = deferred_jobs.front();
+    deferred_jobs.pop_front();
+    start_deferred_job(job, outcome, reason);
+  }
+}
+
+void Shell::start_deferred_job(const DeferredJob& job,
+                               AdmissionControl::Decision::Outcome outcome,
+                               const string& reason) {
+  int output;
+  pid_t pid = vm.start_background(*job.program, &output);
+  if(-1 == pid) {
+    jobserver.release();
+    jobs.remove(job.id);
+    return;
+  }
+  jobs.start(job.id, pid, output);
+  hold_job_slot(pid);
+  last_background_pid = pid;
+  admission_control.record(job.command, outcome, reason);
+  info("Started deferred job [" + to_string(job.id) + "] "
+       + to_string(pid) + ".");
+}
+
+bool Shell::has_deferred_jobs() {
+  check_background_owner();
+  return !deferred_jobs.empty();
+}
+
+Jobserver& Shell::get_jobserver() {
+  return this->jobserver;
+}
+
+bool Shell::take_job_slot() {
+  if(jobserver.acquire()) {
+    return true;
+  }
+  jobs.poll();
+  release_job_slots();
+  return jobserver.acquire();
+}
+
+void Shell::hold_job_slot(pid_t pid) {
+  if(Jobserver::Mode::OFF == jobserver.get_mode()) {
+    return;
+  }
+  check_background_owner();
+  job_slots.insert(pid);
+  tend_jobs_later();
+}
+
+EventLoop::Await Shell::tend_background_jobs() {
+  check_background_owner();
+  if(!job_slots.empty()) {
+    jobs.poll();
+    release_job_slots();
+  }
+  start_deferred_jobs();
+
+  if(has_deferred_jobs()) {
+    uint64_t next = util::monotonic_ns()
+      + AdmissionControl::SAMPLE_INTERVAL_NS;
+    // Readings don't change any faster, but slots may free up any time.
+    return waiting_for_job_slot
+      ? EventLoop::Await::readable(jobserver.get_fd(), next)
+      : EventLoop::Await::until(next);
+  }
+  if(!job_slots.empty()) {
+    return EventLoop::Await::child(*job_slots.begin());
+  }
+  tending_jobs = false;
+  return EventLoop::Await::finish(0);
+}
+
+void Shell::check_background_owner() {
+  if(::getpid() != background_owner) {
+    deferred_jobs.clear();
+    job_slots.clear();
+    tending_jobs = false;
+    background_owner = ::getpid();
+  }
+}
+
+void Shell::tend_jobs_later() {
+  check_background_owner();
+  if(!tending_jobs) {
+    tending_jobs = true;
+    event_loop.spawn(make_shared<BackgroundJobTender>());
+  }
+}
+
+void Shell::release_job_slots() {
+  for(auto it = job_slots.begin(); it != job_slots.end(); ) {
+    const Job *job = jobs.find_by_pid(*it);
+    if(nullptr == job || Job::State::DONE == job->state) {
+      jobserver.release();
+      it = job_slots.erase(it);
+    }
+    else {
+      ++it;
+    }
+  }
+}
+
+HistorySearch& Shell::get_history_search() {
+  return this->history_search;
+}
+
+FilenameCompletion& Shell::get_filename_completion() {
+  return this->filename_completion;
+}
+
+InputBuffer& Shell::get_input_buffer() {
+  return this->input_buffer;
+}
+
+void Shell::set_stats_at_exit(const string& format) {
+  this->stats_at_exit_format = format;
+}
+
+uint64_t Shell::get_resolution_generation() const {
+  return this->resolution_generation;
+}
+
+void Shell::invalidate_resolutions() {
+  ++this->resolution_generation;
+}
+
 bool Shell::get_waiting_for_child() const {
   return this->waiting_for_child;
 }
 
-// TODO(andrei) Restructure this method.  In many cases a child may not have an
-// exit status, such as in the case when it is killed by a signal (9, force
-// kill or 11, out of memory).
-int Shell::wait_child(int child_pid) {
+void Shell::set_waiting_for_child(bool waiting) {
+  this->waiting_for_child = waiting;
+}
+
+// TODO(andrei) Restructure this method.
+//
+// Children killed or stopped by a signal don't have an exit status, so, like
+// other shells, we report 128 + the signal number for them.
+int Shell::wait_child(int child_pid, const string& command) {
   int child_status;
   int child_exit_code = -1;
   int waitpid_options = WUNTRACED;
 
   this->waiting_for_child = true;
+  uint64_t wait_start = util::monotonic_ns();
   // TODO(andrei) Consider using wait4 and logging rusage data.
   while(true) {
-    pid_t ret = waitpid(child_pid, &child_status, waitpid_options);
+    pid_t ret = event_loop.wait_for(child_pid, &child_status,
+                                    waitpid_options);
+    if(-1 == ret && EINTR == errno) {
+      continue;
+    }
     if(-1 == ret) {
       this->error(strerror(errno));
       this->fatal("`waitpid' has encountered a fatal error.");
@@ -352,6 +1165,15 @@ int Shell::wait_child(int child_pid) {
       this->fatal("waitpid should not return 0");
     }
     this->info("Woken up!");
+    if(interrupted_child) {
+      interrupted_child = 0;
+      this->info("C-c while child was running.");
+    }
+    if(suspended_child) {
+      suspended_child = 0;
+      this->info("Suspending foreground job.  Use `fg' to continue it in the "
+          "foreground, or `bg' to continue it in the background.");
+    }
 
     if(WIFEXITED(child_status)) {
       child_exit_code = WEXITSTATUS(child_status);
@@ -362,6 +1184,7 @@ int Shell::wait_child(int child_pid) {
     }
     else if(WIFSIGNALED(child_status)) {
       int child_murdering_signal = WTERMSIG(child_status);
+      child_exit_code = 128 + child_murdering_signal;
       this->info(strsignal(child_murdering_signal));
       this->info(
         "Child killed by signal " + to_string(child_murdering_signal) + "."
@@ -370,8 +1193,11 @@ int Shell::wait_child(int child_pid) {
     }
     else if(WIFSTOPPED(child_status)) {
       int child_stopper = WSTOPSIG(child_status);
+      child_exit_code = 128 + child_stopper;
       this->info(strsignal(child_stopper));
       this->info("Child stopped by signal " + to_string(child_stopper) + ".");
+      int id = jobs.add(child_pid, command, Job::State::STOPPED);
+      this->out("[" + to_string(id) + "]+ Stopped\t" + command);
       break;
     }
     else {
@@ -379,9 +1205,9 @@ int Shell::wait_child(int child_pid) {
     }
   }
   this->waiting_for_child = false;
+  stats.wait_time.record(util::monotonic_ns() - wait_start);
 
-  // TODO(andrei) This is broken on killed/suspended children.
-  return child_status;
+  return child_exit_code;
 }
 
 }  // namespace core
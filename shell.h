@@ -4,12 +4,27 @@
 #include <iostream>
 #include <map>
 #include <memory>
+#include <deque>
+#include <set>
 #include <string>
 
+#include "admission.h"
 #include "command.h"
+#include "command_cache.h"
+#include "environment.h"
+#include "event_loop.h"
+#include "filename_completion.h"
+#include "history_search.h"
+#include "input_buffer.h"
+#include "job_table.h"
+#include "jobserver.h"
+#include "prompt.h"
 #include "shell.h"
 #include "shell_module.h"
+#include "spawn_policy.h"
+#include "stats.h"
 #include "util.h"
+#include "vm.h"
 
 namespace microshell {
 namespace core {
@@ -36,16 +51,59 @@ public:
   // until the shell terminates.
   int interactive();
 
+  // Run the script at `path' non-interactively, with `args' as its
+  // positional parameters.  Returns the script's exit status.
+  int run_script(const string& path, const vector<string>& args);
+
   // Perform various expansions (tilde, variable (dollar), dollar-brace etc.).
-  // Currently performs just tilde expansion.
+  // Currently performs just tilde expansion.  Compiled code expands its
+  // words through the `VirtualMachine' instead.
   string expand(const string& param) const;
 
-  // Given `path', resolve it based on the current working directory.
+  // Shell variables.  Special parameters (`?', `#', `@', `*', `$', `0' and
+  // the positional parameters) are read-only and computed on the fly.
+  // Unset variables read as the empty string.
+  string get_variable(const string& name) const;
+  void set_variable(const string& name, const string& value);
+  // Same as the above, straight from a buffer (reusing the storage of the
+  // variable's previous value).
+  void set_variable(const string& name, const char *value, size_t length);
+  void unset_variable(const string& name);
+  bool is_variable_set(const string& name) const;
+
+  // Exported variables are passed on to children (see `get_environment()').
+  // A variable may be exported before it is set.
+  void export_variable(const string& name);
+  void unexport_variable(const string& name);
+  bool is_exported(const string& name) const;
+
+  // The environment passed on to spawned children.
+  Environment& get_environment();
+
+  const vector<string>& get_positional_parameters() const;
+  void set_positional_parameters(const vector<string>& parameters);
+
+  // The exit status of the last command (`$?').
+  int get_last_status() const;
+  void set_last_status(int status);
+
+  const string& get_home_directory() const;
+
+  // Given `path', resolve it based on the current working directory.  The
+  // result is always lexically canonical (see `util::normalize_path').
   string resolve_path(const string& path) const;
 
   string& get_working_directory();
-  string get_working_directory() const;
-  void set_working_directory(const string& directory);
+  const string& get_working_directory() const;
+  // Changes the shell's (and the process's) working directory.  `directory'
+  // is resolved and canonicalized first.  Returns false if the directory
+  // could not be opened, in which case nothing changes.
+  bool set_working_directory(const string& directory);
+
+  // An `O_PATH' handle to the current working directory.  Relative lookups
+  // should go through `*at' syscalls on it rather than building and stat'ing
+  // full paths.
+  int get_working_directory_fd() const;
 
   // TODO(andrei) Might be cleaner to replace these with ostream& directly.
   // TODO(andrei) Clear separation between logging and output.
@@ -64,6 +122,8 @@ public:
   // exit immediately, in order to allow the shell to clean up after itself.
   void exit();
 
+  bool is_exit_requested() const;
+
   // Load the specified module and register it (e.g. its hooks or provided
   // commands) in the shell.
   //
@@ -71,25 +131,131 @@ public:
   template<class MODULE_TYPE>
   int load_module(shared_ptr<MODULE_TYPE> module);
 
+  // Builds a command out of an already split and expanded `argv', resolving
+  // builtins and binaries along the way.  Used by the front end, as well as
+  // by prefix builtins which run another command (e.g. `sched').
+  bool build_command(vector<string> argv,
+                     shared_ptr<Command> &command,
+                     string *error) const;
+
+  // The policy (CPU affinity, niceness, etc.) applied to every spawned job
+  // which doesn't specify its own.
+  SpawnPolicy& get_spawn_policy();
+
+  VirtualMachine& get_virtual_machine();
+
+  // Runs builtins which wait for something (see `AsyncBuiltinCommand')
+  // alongside the shell's own background tasks.
+  EventLoop& get_event_loop();
+
+  // Compiled commands, keyed by their text.
+  CommandCache& get_command_cache();
+
+  // Bumped whenever something that affects what a command name resolves to
+  // changes: PATH, the working directory or the set of builtins.  Cached
+  // resolutions stamped with an older generation must be redone.
+  uint64_t get_resolution_generation() const;
+  void invalidate_resolutions();
+
+  // Hot-path counters and latency histograms (see the `stats' builtin).
+  Stats& get_stats();
+
+  // Background and stopped jobs.
+  JobTable& get_jobs();
+
+  // Registers the background job started as `pid' (see `$!'), whose output
+  // comes out of `output' if it's captured.  Returns its job id.
+  int add_background_job(pid_t pid, const string& command, int output = -1);
+
+  // Decides whether new background and parallel jobs may start.
+  AdmissionControl& get_admission_control();
+
+  // Registers the background job `program' (see `add_background_job'),
+  // which admission control held back for `reason', as a deferred job, to
+  // be started later.  Returns its job id.
+  int defer_background_job(shared_ptr<const Program> program,
+                           const string& command, const string& reason);
+
+  // Starts deferred jobs, oldest first, for as long as admission control
+  // lets them (or once they have waited for too long).  Whatever is left is
+  // started later by a task on the event loop.
+  void start_deferred_jobs();
+
+  bool has_deferred_jobs();
+
+  // Shares the limit on parallel jobs with `make' (see `Jobserver').
+  Jobserver& get_jobserver();
+
+  // Takes a jobserver slot for a new background job (or `dag' target),
+  // reaping finished jobs first to give theirs back if none is free.
+  // Always succeeds without a jobserver.
+  bool take_job_slot();
+
+  // Records that the background job started as `pid' holds a slot taken
+  // with `take_job_slot()', to be given back once it's done.
+  void hold_job_slot(pid_t pid);
+
+  // Starts deferred jobs and gives back the slots of finished jobs, for a
+  // task on the event loop (see `defer_background_job').  Returns what to
+  // wait for before doing it again.
+  EventLoop::Await tend_background_jobs();
+
+  // Redraws the prompt if asynchronous prompt segments changed since it was
+  // displayed.  Called by readline while it waits for input.
+  void refresh_prompt();
+
+  // Every command read interactively, for the `C-r' fuzzy search.
+  HistorySearch& get_history_search();
+
+  // Listings of the directories Tab completion looked into.
+  FilenameCompletion& get_filename_completion();
+
+  // What the `read' builtin has read ahead.
+  InputBuffer& get_input_buffer();
+
+  // Dump the stats to standard error when the shell terminates, in the given
+  // format (`text' or `json'); an empty format turns this off.
+  void set_stats_at_exit(const string& format);
+
+  // Looks `name' up in the working directory and then in PATH.
+  bool resolve_binary_name(const string& name, string* full_path) const;
+
   bool get_waiting_for_child() const;
+  // For builtins which wait for children themselves (see `wait_child').
+  void set_waiting_for_child(bool waiting);
 
   // Wait for the given child process to complete, and return its exit code.
-  int wait_child(int child_pid);
+  // If it gets stopped instead, it becomes a job, described by `command'.
+  int wait_child(int child_pid, const string& command = "");
 
 protected:
   Shell(const vector<string>& args);
 
-  string get_prompt() const;
+  // `(cwd) ', then the prompt segments (on terminals only), then `ush >> '.
+  string get_prompt();
 
-  string read_command();
+  // Reads a line of input.  Continuation lines (of e.g. an unfinished
+  // `while' loop) get a shorter prompt.
+  string read_command(bool continuation = false);
 
   int interpret_command(Command &cmd);
 
+  // Reaps finished background jobs and tells the user about them.
+  void report_finished_jobs();
+
+  // Compiles `command_text'.  If it fails because the text ends in the
+  // middle of a construct, `incomplete' (if given) is set, so that the
+  // caller can read more input and try again.
   bool parse_command(const string& command_text,
                      shared_ptr<Command> &command,
-                     string *error) const;
+                     string *error,
+                     bool *incomplete = nullptr) const;
 
-  bool resolve_binary_name(const string& name, string* full_path) const;
+  // Compiles the script at `path' (an absolute path), going through the
+  // on-disk cache of compiled scripts unless `$USH_SCRIPT_CACHE' is `off'.
+  bool load_script(const string& path,
+                   shared_ptr<Command> &command,
+                   string *error);
 
   bool is_builtin(const string& builtin_name) const;
 
@@ -98,14 +264,20 @@ protected:
 private:
   static Shell *instance;
 
+  // Where compiled scripts are kept, or "" if the cache is disabled.
+  string get_script_cache_directory() const;
+
   bool exit_requested;
   std::string prompt = "ush >> ";
 
   // The list of folders found inside the PATH environment variable.
   std::vector<std::string> path;
 
-  // The current working directory of the shell.
+  // The current working directory of the shell, always kept canonical so
+  // that it doesn't grow as the user navigates around.
   std::string working_directory;
+  // Open handle to `working_directory' (or -1 if none could be obtained).
+  int working_directory_fd;
   // The home directory of the active user.
   std::string home_directory;
 
@@ -120,6 +292,86 @@ private:
 
   std::vector<std::shared_ptr<ShellModule>> loaded_modules;
 
+  // See `get_spawn_policy()'.
+  SpawnPolicy spawn_policy;
+
+  // Runs all compiled shell code, and holds the defined functions.
+  VirtualMachine vm;
+
+  EventLoop event_loop;
+
+  mutable CommandCache command_cache;
+  // Mutable, so that const lookups can be counted as well.
+  mutable Stats stats;
+  std::string stats_at_exit_format;
+
+  HistorySearch history_search;
+  FilenameCompletion filename_completion;
+  InputBuffer input_buffer;
+
+  // The segments shown in the prompt, and what they were last rendered for.
+  Prompt prompt_segments;
+  bool prompt_segments_enabled;
+  uint64_t last_duration_ns;
+  // Whether readline currently shows the main prompt (as opposed to e.g. a
+  // continuation prompt).
+  bool showing_prompt;
+
+  JobTable jobs;
+  // The process started for the latest background job (`$!'), or 0.
+  pid_t last_background_pid;
+  // Whether finished jobs are reported (before each prompt).  If not, they
+  // are forgotten as soon as they are reaped.
+  bool reporting_jobs;
+  // How many jobs the table may hold before `add_background_job' reaps.
+  size_t reap_threshold;
+
+  AdmissionControl admission_control;
+  struct DeferredJob {
+    int id;
+    shared_ptr<const Program> program;
+    string command;
+    uint64_t deferred_ns;
+  };
+  // Oldest first.
+  std::deque<DeferredJob> deferred_jobs;
+
+  Jobserver jobserver;
+  // The processes of background jobs holding a jobserver slot.
+  std::multiset<pid_t> job_slots;
+  // Whether deferred jobs wait for a slot (rather than admission control).
+  bool waiting_for_job_slot;
+  // Whether a task tends to the above (see `tend_background_jobs()').
+  bool tending_jobs;
+
+  // The process which deferred the jobs, holds the slots and runs the task.
+  // Forked children (e.g. background jobs) inherit all of it, but mustn't
+  // act on any of it.
+  pid_t background_owner;
+  void check_background_owner();
+
+  // Spawns the task running `tend_background_jobs()', unless it's running.
+  void tend_jobs_later();
+
+  // Gives back the slots of the jobs which are done.
+  void release_job_slots();
+
+  // Called right before `interactive()' or `run_script()' return.
+  void on_terminate();
+
+  void start_deferred_job(const DeferredJob& job,
+                          AdmissionControl::Decision::Outcome outcome,
+                          const string& reason);
+
+  // Starts at 1, so that fresh commands (stamped 0) always resolve.
+  uint64_t resolution_generation;
+
+  std::map<std::string, std::string> variables;
+  std::set<std::string> exported_names;
+  Environment environment;
+  std::vector<std::string> positional_parameters;
+  int last_status;
+
   // This method initializes the shell's core modules (e.g. job control).
   //
   // Returns 0 on success and a nonzero error code on failure.
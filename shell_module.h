@@ -6,6 +6,7 @@
 
 #include "builtin_factory.h"
 #include "command.h"
+#include "prompt.h"
 #include "shell.h"
 
 namespace microshell {
@@ -29,6 +30,14 @@ namespace core {
      * shell initialization or on module load.
      */
     virtual vector<shared_ptr<BuiltinFactory>> get_builtins() = 0;
+
+    /**
+     * Segments this module adds to the interactive prompt (e.g. the state of
+     * the current repository), if any.
+     */
+    virtual vector<shared_ptr<PromptSegment>> get_prompt_segments() {
+      return vector<shared_ptr<PromptSegment>>();
+    }
   };
 }   // namespace core
 }   // namespace microshell
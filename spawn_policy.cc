@@ -0,0 +1,374 @@
+#include "spawn_policy.h"
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <dirent.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "util.h"
+
+namespace microshell {
+namespace core {
+
+using namespace std;
+
+namespace {
+
+// glibc doesn't wrap `ioprio_set', so the constants live here.
+const int IOPRIO_WHO_PROCESS = 1;
+const int IOPRIO_CLASS_SHIFT = 13;
+
+const char *NUMA_NODE_ROOT = "/sys/devices/system/node";
+
+bool parse_int(const string& text, int *value) {
+  if(text.empty()) {
+    return false;
+  }
+  char *end;
+  errno = 0;
+  long result = strtol(text.c_str(), &end, 10);
+  if(0 != errno || '\0' != *end) {
+    return false;
+  }
+  *value = static_cast<int>(result);
+  return true;
+}
+
+// The CPUs the shell itself is allowed to run on.
+vector<int> get_allowed_cpus() {
+  vector<int> cpus;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if(0 == sched_getaffinity(0, sizeof(set), &set)) {
+    for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if(CPU_ISSET(cpu, &set)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+  return cpus;
+}
+
+// The CPUs of every NUMA node on the machine, read once from sysfs.  Machines
+// without NUMA information are treated as a single node.
+const vector<vector<int>>& get_numa_nodes() {
+  static vector<vector<int>> nodes;
+  static bool initialized = false;
+  if(initialized) {
+    return nodes;
+  }
+  initialized = true;
+
+  DIR *dir = opendir(NUMA_NODE_ROOT);
+  if(nullptr != dir) {
+    vector<int> ids;
+    while(struct dirent *entry = readdir(dir)) {
+      int id;
+      if(0 == strncmp(entry->d_name, "node", 4)
+         && parse_int(entry->d_name + 4, &id)) {
+        ids.push_back(id);
+      }
+    }
+    closedir(dir);
+    sort(ids.begin(), ids.end());
+
+    for(int id : ids) {
+      ifstream in(string(NUMA_NODE_ROOT) + "/node" + std::to_string(id)
+                  + "/cpulist");
+      string text;
+      vector<int> cpus;
+      if(getline(in, text) && SpawnPolicy::parse_cpu_list(text, &cpus)
+         && !cpus.empty()) {
+        nodes.push_back(cpus);
+      }
+    }
+  }
+
+  if(nodes.empty()) {
+    nodes.push_back(get_allowed_cpus());
+  }
+  return nodes;
+}
+
+string format_cpu_list(const vector<int>& cpus) {
+  string result;
+  for(size_t i = 0; i < cpus.size(); ) {
+    size_t j = i;
+    while(j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) {
+      ++j;
+    }
+    if(!result.empty()) {
+      result += ",";
+    }
+    result += std::to_string(cpus[i]);
+    if(j > i) {
+      result += "-" + std::to_string(cpus[j]);
+    }
+    i = j + 1;
+  }
+  return result;
+}
+
+}  // namespace
+
+SpawnPolicy::SpawnPolicy() :
+    has_nice(false),
+    nice(0),
+    io_class(-1),
+    io_level(0),
+    sched_policy(-1),
+    sched_priority(0),
+    spread(Spread::NONE),
+    cursor(0) { }
+
+bool SpawnPolicy::empty() const {
+  return cpus.empty() && !has_nice && -1 == io_class && -1 == sched_policy
+      && Spread::NONE == spread;
+}
+
+SpawnPolicy SpawnPolicy::next() {
+  return next(this);
+}
+
+SpawnPolicy SpawnPolicy::next(SpawnPolicy *shared) const {
+  size_t& cursor = shared->cursor;
+  SpawnPolicy result = *this;
+  result.spread = Spread::NONE;
+  if(Spread::NONE == spread) {
+    return result;
+  }
+
+  vector<int> allowed = cpus.empty() ? get_allowed_cpus() : cpus;
+  if(allowed.empty()) {
+    return result;
+  }
+
+  if(Spread::CPUS == spread) {
+    result.cpus = { allowed[cursor++ % allowed.size()] };
+    return result;
+  }
+
+  // Only consider the nodes which have at least one allowed CPU.
+  vector<vector<int>> candidates;
+  for(const vector<int>& node : get_numa_nodes()) {
+    vector<int> usable;
+    for(int cpu : node) {
+      if(find(allowed.begin(), allowed.end(), cpu) != allowed.end()) {
+        usable.push_back(cpu);
+      }
+    }
+    if(!usable.empty()) {
+      candidates.push_back(usable);
+    }
+  }
+  if(!candidates.empty()) {
+    result.cpus = candidates[cursor++ % candidates.size()];
+  }
+  return result;
+}
+
+bool SpawnPolicy::apply(string *error) const {
+  if(!cpus.empty()) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for(int cpu : cpus) {
+      CPU_SET(cpu, &set);
+    }
+    if(-1 == sched_setaffinity(0, sizeof(set), &set)) {
+      *error = "sched_setaffinity: " + string(strerror(errno));
+      return false;
+    }
+  }
+
+  // The scheduling class goes before the niceness, since switching to e.g.
+  // SCHED_IDLE would otherwise be allowed to reset it.
+  if(-1 != sched_policy) {
+    struct sched_param param;
+    param.sched_priority = sched_priority;
+    if(-1 == sched_setscheduler(0, sched_policy, &param)) {
+      *error = "sched_setscheduler: " + string(strerror(errno));
+      return false;
+    }
+  }
+
+  if(has_nice && -1 == setpriority(PRIO_PROCESS, 0, nice)) {
+    *error = "setpriority: " + string(strerror(errno));
+    return false;
+  }
+
+  if(-1 != io_class) {
+    int ioprio = (io_class << IOPRIO_CLASS_SHIFT) | io_level;
+    if(-1 == syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio)) {
+      *error = "ioprio_set: " + string(strerror(errno));
+      return false;
+    }
+  }
+
+  return true;
+}
+
+string SpawnPolicy::to_string() const {
+  static const char *io_class_names[] = { "none", "realtime", "best-effort",
+                                          "idle" };
+  vector<string> parts;
+  if(!cpus.empty()) {
+    parts.push_back("cpus=" + format_cpu_list(cpus));
+  }
+  if(has_nice) {
+    parts.push_back("nice=" + std::to_string(nice));
+  }
+  if(-1 != io_class) {
+    parts.push_back("io=" + string(io_class_names[io_class]) + ":"
+                    + std::to_string(io_level));
+  }
+  switch(sched_policy) {
+    case SCHED_OTHER: parts.push_back("policy=other"); break;
+    case SCHED_BATCH: parts.push_back("policy=batch"); break;
+    case SCHED_IDLE:  parts.push_back("policy=idle"); break;
+    case SCHED_FIFO:
+      parts.push_back("policy=fifo:" + std::to_string(sched_priority));
+      break;
+    case SCHED_RR:
+      parts.push_back("policy=rr:" + std::to_string(sched_priority));
+      break;
+  }
+  if(Spread::CPUS == spread) {
+    parts.push_back("spread=cpus");
+  }
+  else if(Spread::NODES == spread) {
+    parts.push_back("spread=nodes");
+  }
+
+  if(parts.empty()) {
+    return "(default)";
+  }
+  return util::merge_with(parts.begin(), parts.end(), " ");
+}
+
+bool SpawnPolicy::parse_cpu_list(const string& text, vector<int> *cpus) {
+  vector<int> result;
+  for(const string& range : util::split(text, ',')) {
+    size_t dash = range.find('-');
+    int first, last;
+    if(string::npos == dash) {
+      if(!parse_int(range, &first)) {
+        return false;
+      }
+      last = first;
+    }
+    else if(!parse_int(range.substr(0, dash), &first)
+            || !parse_int(range.substr(dash + 1), &last)) {
+      return false;
+    }
+
+    if(first < 0 || last < first || last >= CPU_SETSIZE) {
+      return false;
+    }
+    for(int cpu = first; cpu <= last; ++cpu) {
+      result.push_back(cpu);
+    }
+  }
+
+  sort(result.begin(), result.end());
+  result.erase(unique(result.begin(), result.end()), result.end());
+  *cpus = result;
+  return !result.empty();
+}
+
+bool SpawnPolicy::parse_io_class(const string& text, int *io_class,
+                                 int *io_level) {
+  size_t colon = text.find(':');
+  string name = text.substr(0, colon);
+  int level = 4;
+  if(string::npos != colon && !parse_int(text.substr(colon + 1), &level)) {
+    return false;
+  }
+  if(level < 0 || level > 7) {
+    return false;
+  }
+
+  if("realtime" == name || "rt" == name) {
+    *io_class = 1;
+  }
+  else if("best-effort" == name || "be" == name) {
+    *io_class = 2;
+  }
+  else if("idle" == name) {
+    *io_class = 3;
+    level = 0;
+  }
+  else {
+    return false;
+  }
+  *io_level = level;
+  return true;
+}
+
+bool SpawnPolicy::parse_sched_policy(const string& text, int *policy,
+                                     int *priority) {
+  size_t colon = text.find(':');
+  string name = text.substr(0, colon);
+  int prio = 0;
+  if(string::npos != colon && !parse_int(text.substr(colon + 1), &prio)) {
+    return false;
+  }
+
+  if("other" == name) {
+    *policy = SCHED_OTHER;
+  }
+  else if("batch" == name) {
+    *policy = SCHED_BATCH;
+  }
+  else if("idle" == name) {
+    *policy = SCHED_IDLE;
+  }
+  else if("fifo" == name || "rr" == name) {
+    *policy = "fifo" == name ? SCHED_FIFO : SCHED_RR;
+    if(string::npos == colon) {
+      prio = 1;
+    }
+    if(prio < sched_get_priority_min(*policy)
+       || prio > sched_get_priority_max(*policy)) {
+      return false;
+    }
+  }
+  else {
+    return false;
+  }
+
+  // Only the realtime policies take a static priority.
+  if(SCHED_FIFO != *policy && SCHED_RR != *policy && 0 != prio) {
+    return false;
+  }
+  *priority = prio;
+  return true;
+}
+
+bool SpawnPolicy::parse_spread(const string& text, Spread *spread) {
+  if("none" == text) {
+    *spread = Spread::NONE;
+  }
+  else if("cpus" == text) {
+    *spread = Spread::CPUS;
+  }
+  else if("nodes" == text) {
+    *spread = Spread::NODES;
+  }
+  else {
+    return false;
+  }
+  return true;
+}
+
+}  // namespace core
+}  // namespace microshell
@@ -0,0 +1,82 @@
+#ifndef MICROSHELL_CORE_SPAWN_POLICY_H
+#define MICROSHELL_CORE_SPAWN_POLICY_H
+
+#include <string>
+#include <vector>
+
+namespace microshell {
+namespace core {
+
+// Describes where and how a spawned job should run: CPU affinity, niceness,
+// I/O priority and scheduling class.  The parent picks a concrete policy for
+// every job (see `next()'), and the child applies it between `fork' and
+// `exec' (see `apply()').
+class SpawnPolicy {
+public:
+  // How consecutive jobs are spread over the allowed CPUs.
+  enum class Spread {
+    // Every job may run on any CPU in `cpus'.
+    NONE,
+    // Every job is pinned to a single CPU, picked round-robin.
+    CPUS,
+    // Every job is pinned to all the (allowed) CPUs of a single NUMA node,
+    // picked round-robin.
+    NODES
+  };
+
+  SpawnPolicy();
+
+  // Whether applying this policy would change anything at all.
+  bool empty() const;
+
+  // Returns the concrete policy for the next job, advancing the round-robin
+  // cursor if spreading is enabled.
+  SpawnPolicy next();
+  // Same, but advancing the cursor of `shared' (e.g. the shell-wide policy)
+  // instead, so that commands with a policy of their own (see `sched') take
+  // turns with the others.
+  SpawnPolicy next(SpawnPolicy *shared) const;
+
+  // Applies the policy to the calling process.  Meant to be called in the
+  // child, right before `exec'.  Returns false and fills in `error' on
+  // failure.
+  bool apply(std::string *error) const;
+
+  // Human-readable summary, e.g. `cpus=0-3 nice=10 io=idle'.
+  std::string to_string() const;
+
+  // Parsers for the textual forms used by the `sched' builtin.  They return
+  // false on malformed input.
+  static bool parse_cpu_list(const std::string& text, std::vector<int> *cpus);
+  static bool parse_io_class(const std::string& text, int *io_class,
+                             int *io_level);
+  static bool parse_sched_policy(const std::string& text, int *policy,
+                                 int *priority);
+  static bool parse_spread(const std::string& text, Spread *spread);
+
+  // The CPUs the job may run on.  Empty means ``don't touch the affinity''.
+  std::vector<int> cpus;
+
+  bool has_nice;
+  int nice;
+
+  // One of the IOPRIO_CLASS_* values (1 = realtime, 2 = best-effort,
+  // 3 = idle), or -1 if the I/O priority should be left alone.
+  int io_class;
+  int io_level;
+
+  // One of the SCHED_* policies, or -1 if it should be left alone.
+  int sched_policy;
+  int sched_priority;
+
+  Spread spread;
+
+private:
+  // Where the round-robin spreading currently is.
+  size_t cursor;
+};
+
+}  // namespace core
+}  // namespace microshell
+
+#endif  // MICROSHELL_CORE_SPAWN_POLICY_H
@@ -0,0 +1,222 @@
+#include "stats.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+namespace microshell {
+namespace core {
+
+using namespace std;
+
+namespace {
+
+// Formats nanoseconds with a unit that keeps the number short.
+string format_duration(uint64_t ns) {
+  char buffer[32];
+  if(ns < 1000) {
+    snprintf(buffer, sizeof(buffer), "%lluns",
+             static_cast<unsigned long long>(ns));
+  }
+  else if(ns < 1000 * 1000) {
+    snprintf(buffer, sizeof(buffer), "%.1fus", ns / 1e3);
+  }
+  else if(ns < 1000ULL * 1000 * 1000) {
+    snprintf(buffer, sizeof(buffer), "%.1fms", ns / 1e6);
+  }
+  else {
+    snprintf(buffer, sizeof(buffer), "%.2fs", ns / 1e9);
+  }
+  return buffer;
+}
+
+string pad(const string& text, size_t width) {
+  return text.length() >= width ? text + " "
+                                : text + string(width - text.length(), ' ');
+}
+
+string histogram_line(const string& name, const Histogram& histogram) {
+  if(0 == histogram.get_count()) {
+    return pad(name, 10) + "-\n";
+  }
+  return pad(name, 10)
+      + pad(to_string(histogram.get_count()), 9)
+      + pad(format_duration(histogram.get_sum() / histogram.get_count()), 10)
+      + pad(format_duration(histogram.percentile(50)), 10)
+      + pad(format_duration(histogram.percentile(99)), 10)
+      + format_duration(histogram.get_max()) + "\n";
+}
+
+string histogram_json(const Histogram& histogram) {
+  string json = "{\"count\":" + to_string(histogram.get_count())
+      + ",\"sum_ns\":" + to_string(histogram.get_sum())
+      + ",\"min_ns\":" + to_string(histogram.get_min())
+      + ",\"max_ns\":" + to_string(histogram.get_max())
+      + ",\"p50_ns\":" + to_string(histogram.percentile(50))
+      + ",\"p99_ns\":" + to_string(histogram.percentile(99))
+      + ",\"buckets\":[";
+  // Trailing empty buckets are left out.
+  int last = Histogram::BUCKETS - 1;
+  while(last >= 0 && 0 == histogram.get_buckets()[last]) {
+    --last;
+  }
+  for(int i = 0; i <= last; ++i) {
+    if(i > 0) {
+      json += ",";
+    }
+    json += to_string(histogram.get_buckets()[i]);
+  }
+  return json + "]}";
+}
+
+}  // namespace
+
+Histogram::Histogram() {
+  reset();
+}
+
+void Histogram::record(uint64_t nanoseconds) {
+  int bucket = 0 == nanoseconds ? 0 : 64 - __builtin_clzll(nanoseconds);
+  if(bucket >= BUCKETS) {
+    bucket = BUCKETS - 1;
+  }
+  ++buckets[bucket];
+  ++count;
+  sum += nanoseconds;
+  if(nanoseconds < min) {
+    min = nanoseconds;
+  }
+  if(nanoseconds > max) {
+    max = nanoseconds;
+  }
+}
+
+void Histogram::reset() {
+  for(int i = 0; i < BUCKETS; ++i) {
+    buckets[i] = 0;
+  }
+  count = 0;
+  sum = 0;
+  min = UINT64_MAX;
+  max = 0;
+}
+
+uint64_t Histogram::get_count() const {
+  return count;
+}
+
+uint64_t Histogram::get_sum() const {
+  return sum;
+}
+
+uint64_t Histogram::get_min() const {
+  return 0 == count ? 0 : min;
+}
+
+uint64_t Histogram::get_max() const {
+  return max;
+}
+
+const uint64_t* Histogram::get_buckets() const {
+  return buckets;
+}
+
+uint64_t Histogram::percentile(double p) const {
+  if(0 == count) {
+    return 0;
+  }
+
+  uint64_t rank = static_cast<uint64_t>(p / 100.0 * count);
+  if(rank >= count) {
+    rank = count - 1;
+  }
+  uint64_t seen = 0;
+  for(int i = 0; i < BUCKETS; ++i) {
+    seen += buckets[i];
+    if(seen > rank) {
+      uint64_t upper = 0 == i ? 0 : (1ULL << i) - 1;
+      return upper < max ? upper : max;
+    }
+  }
+  return max;
+}
+
+Stats::Stats() {
+  reset();
+}
+
+void Stats::reset() {
+  commands = 0;
+  builtins = 0;
+  functions = 0;
+  externals = 0;
+  spawn_failures = 0;
+  path_lookups = 0;
+  path_stat_calls = 0;
+  parses = 0;
+  command_cache_hits = 0;
+  command_cache_misses = 0;
+  script_cache_hits = 0;
+  script_cache_misses = 0;
+  environment_rebuilds = 0;
+  parse_time.reset();
+  builtin_time.reset();
+  fork_time.reset();
+  wait_time.reset();
+  command_time.reset();
+}
+
+string Stats::to_text() const {
+  uint64_t lookups = command_cache_hits + command_cache_misses;
+  string text =
+    "commands:      " + to_string(commands) + " (" + to_string(builtins)
+    + " builtins, " + to_string(functions) + " functions, "
+    + to_string(externals) + " external, " + to_string(spawn_failures)
+    + " failed spawns)\n"
+    + "path lookups:  " + to_string(path_lookups) + " ("
+    + to_string(path_stat_calls) + " stat calls)\n"
+    + "parses:        " + to_string(parses) + "\n"
+    + "command cache: " + to_string(command_cache_hits) + " hits, "
+    + to_string(command_cache_misses) + " misses ("
+    + to_string(0 == lookups ? 0 : 100 * command_cache_hits / lookups)
+    + "% hit rate)\n"
+    + "script cache:  " + to_string(script_cache_hits) + " hits, "
+    + to_string(script_cache_misses) + " misses\n"
+    + "env rebuilds:  " + to_string(environment_rebuilds) + "\n"
+    + "\n"
+    + pad("latency", 10) + pad("count", 9) + pad("avg", 10) + pad("p50", 10)
+    + pad("p99", 10) + "max\n"
+    + histogram_line("parse", parse_time)
+    + histogram_line("command", command_time)
+    + histogram_line("builtin", builtin_time)
+    + histogram_line("fork", fork_time)
+    + histogram_line("wait", wait_time);
+  // No trailing newline; callers print line by line.
+  return text.substr(0, text.length() - 1);
+}
+
+string Stats::to_json() const {
+  return "{\"commands\":" + to_string(commands)
+      + ",\"builtins\":" + to_string(builtins)
+      + ",\"functions\":" + to_string(functions)
+      + ",\"externals\":" + to_string(externals)
+      + ",\"spawn_failures\":" + to_string(spawn_failures)
+      + ",\"path_lookups\":" + to_string(path_lookups)
+      + ",\"path_stat_calls\":" + to_string(path_stat_calls)
+      + ",\"parses\":" + to_string(parses)
+      + ",\"command_cache_hits\":" + to_string(command_cache_hits)
+      + ",\"command_cache_misses\":" + to_string(command_cache_misses)
+      + ",\"script_cache_hits\":" + to_string(script_cache_hits)
+      + ",\"script_cache_misses\":" + to_string(script_cache_misses)
+      + ",\"environment_rebuilds\":" + to_string(environment_rebuilds)
+      + ",\"latency\":{"
+      + "\"parse\":" + histogram_json(parse_time)
+      + ",\"command\":" + histogram_json(command_time)
+      + ",\"builtin\":" + histogram_json(builtin_time)
+      + ",\"fork\":" + histogram_json(fork_time)
+      + ",\"wait\":" + histogram_json(wait_time)
+      + "}}";
+}
+
+}  // namespace core
+}  // namespace microshell
@@ -0,0 +1,85 @@
+#ifndef MICROSHELL_CORE_STATS_H
+#define MICROSHELL_CORE_STATS_H
+
+#include <cstdint>
+#include <string>
+
+namespace microshell {
+namespace core {
+
+// A latency histogram with power-of-two nanosecond buckets: bucket `i' holds
+// samples in [2^(i-1), 2^i) ns.  Recording a sample is a handful of
+// instructions, so histograms can stay on all the time.
+class Histogram {
+public:
+  static const int BUCKETS = 64;
+
+  Histogram();
+
+  void record(uint64_t nanoseconds);
+  void reset();
+
+  uint64_t get_count() const;
+  uint64_t get_sum() const;
+  uint64_t get_min() const;
+  uint64_t get_max() const;
+  const uint64_t* get_buckets() const;
+
+  // Approximate percentile (0-100): the upper bound of the bucket it falls
+  // into, capped at the largest sample seen.
+  uint64_t percentile(double p) const;
+
+private:
+  uint64_t buckets[BUCKETS];
+  uint64_t count;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+};
+
+// Cheap, always-on counters and latency histograms for the shell's hot
+// paths, reported by the `stats' builtin.
+struct Stats {
+  Stats();
+
+  void reset();
+
+  std::string to_text() const;
+  std::string to_json() const;
+
+  // What ran.
+  uint64_t commands;
+  uint64_t builtins;
+  uint64_t functions;
+  uint64_t externals;
+  uint64_t spawn_failures;
+
+  // Name resolution.
+  uint64_t path_lookups;
+  uint64_t path_stat_calls;
+
+  // Front end.
+  uint64_t parses;
+  uint64_t command_cache_hits;
+  uint64_t command_cache_misses;
+  uint64_t script_cache_hits;
+  uint64_t script_cache_misses;
+  uint64_t environment_rebuilds;
+
+  // Time spent compiling command text.
+  Histogram parse_time;
+  // Time spent running builtins (in-process).
+  Histogram builtin_time;
+  // Time the parent spends in `fork'.
+  Histogram fork_time;
+  // Time from the end of `fork' until the child is reaped, i.e. exec plus
+  // the child's whole run.
+  Histogram wait_time;
+  // Wall time of every simple command, whatever its kind.
+  Histogram command_time;
+};
+
+}  // namespace core
+}  // namespace microshell
+
+#endif  // MICROSHELL_CORE_STATS_H
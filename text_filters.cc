@@ -0,0 +1,885 @@
+// The line-oriented filters of the `coreutils' module: `grep -F', `wc',
+// `head' and `cut'.  Only their common fixed-string and field cases are
+// handled here; anything else (regular expressions, locale-dependent
+// options, ...) is handed to the real binary.
+//
+// Input is read in large blocks and scanned with `memchr'/`memmem' (and SSE2
+// for counting newlines) instead of line by line, and output is collected
+// into large blocks which are written straight to standard output.
+
+#include "coreutils.h"
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "shell.h"
+#include "util.h"
+
+namespace microshell {
+namespace modules {
+namespace coreutils {
+
+using namespace std;
+using namespace microshell::core;
+
+namespace {
+
+const size_t READ_BLOCK_SIZE = 128 * 1024;
+const size_t WRITE_BLOCK_SIZE = 64 * 1024;
+
+// Runs the real `argv[0]' (from PATH, skipping the builtin), for the cases
+// the builtins don't handle.
+int run_external(Shell *shell, const vector<string>& argv) {
+  string path;
+  if(!shell->resolve_binary_name(argv[0], &path)) {
+    shell->eout(argv[0] + ": unsupported option, and no external "
+                + argv[0] + " to fall back on");
+    return 2;
+  }
+  vector<string> external_argv(argv);
+  external_argv[0] = path;
+  DiskCommand command(external_argv);
+  return command.invoke(shell);
+}
+
+size_t count_newlines(const char *begin, const char *end) {
+  size_t count = 0;
+#ifdef __SSE2__
+  const __m128i newline = _mm_set1_epi8('\n');
+  for(; end - begin >= 16; begin += 16) {
+    __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+    count += __builtin_popcount(
+      _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline)));
+  }
+#endif
+  for(; begin < end; ++begin) {
+    count += '\n' == *begin;
+  }
+  return count;
+}
+
+// Output gathered into large blocks, written straight to standard output.
+class Output {
+public:
+  Output() : failed(false) {
+    // Whatever the shell printed so far goes first.
+    cout.flush();
+    buffer.reserve(WRITE_BLOCK_SIZE);
+  }
+
+  ~Output() {
+    flush();
+  }
+
+  void append(const char *data, size_t length) {
+    buffer.append(data, length);
+    if(buffer.size() >= WRITE_BLOCK_SIZE) {
+      flush();
+    }
+  }
+
+  void append(const string& text) {
+    append(text.data(), text.length());
+  }
+
+  // Appends a line, adding the newline if it's missing (the last line of
+  // some input).
+  void append_line(const char *begin, const char *end) {
+    append(begin, end - begin);
+    if(end == begin || '\n' != end[-1]) {
+      append("\n", 1);
+    }
+  }
+
+  bool flush() {
+    if(!failed && !buffer.empty() && !util::write_all(STDOUT_FILENO, buffer)) {
+      failed = true;
+    }
+    buffer.clear();
+    return !failed;
+  }
+
+  bool has_failed() const {
+    return failed;
+  }
+
+private:
+  string buffer;
+  bool failed;
+};
+
+// Reads like `read', but runs `loop' until `fd' has something to read: the
+// input may be a pipe which one of its tasks feeds (e.g. a long
+// here-document).
+ssize_t read_input(EventLoop *loop, int fd, char *buffer, size_t size) {
+  loop->wait_readable(fd);
+  return read(fd, buffer, size);
+}
+
+// Reads a descriptor in blocks which end on a line boundary (except for the
+// last line, if it has no newline).  Lines longer than a block make the
+// block grow.
+class LineReader {
+public:
+  LineReader(EventLoop *loop, int fd)
+    : loop(loop), fd(fd), buffer(READ_BLOCK_SIZE), start(0), length(0),
+      at_end(false), error(0) { }
+
+  // Points `begin' and `end' at the next block of whole lines.  Returns
+  // false at the end of the input, or on error (see `get_error()').
+  bool next(const char **begin, const char **end) {
+    // Drop what the previous call handed out.
+    memmove(buffer.data(), buffer.data() + start, length - start);
+    length -= start;
+    start = 0;
+
+    while(true) {
+      const char *data = buffer.data();
+      const char *last = length > 0
+        ? static_cast<const char*>(memrchr(data, '\n', length)) : nullptr;
+      if(nullptr != last || (at_end && length > 0)) {
+        start = nullptr != last ? last - data + 1 : length;
+        *begin = data;
+        *end = data + start;
+        return true;
+      }
+      if(at_end) {
+        return false;
+      }
+
+      if(buffer.size() - length < READ_BLOCK_SIZE / 2) {
+        buffer.resize(buffer.size() * 2);
+      }
+      ssize_t count = read_input(loop, fd, buffer.data() + length,
+                                 buffer.size() - length);
+      if(count < 0 && EINTR == errno) {
+        continue;
+      }
+      if(count < 0) {
+        error = errno;
+        return false;
+      }
+      at_end = 0 == count;
+      length += count;
+    }
+  }
+
+  // How much was read past what `next' handed out so far.
+  size_t get_unconsumed() const {
+    return length - start;
+  }
+
+  int get_error() const {
+    return error;
+  }
+
+private:
+  EventLoop *loop;
+  int fd;
+  vector<char> buffer;
+  size_t start;
+  size_t length;
+  bool at_end;
+  int error;
+};
+
+// The inputs of a filter: the named files, or standard input if none (or
+// for `-').
+class Inputs {
+public:
+  Inputs(Shell *shell, const string& tool, const vector<string>& names)
+    : shell(shell), tool(tool), names(names), failed(false) {
+    if(this->names.empty()) {
+      this->names.push_back("-");
+    }
+  }
+
+  size_t size() const {
+    return names.size();
+  }
+
+  const string& get_name(size_t i) const {
+    return names[i];
+  }
+
+  // Opens input `i', reporting errors unless `quiet'.  Returns -1 on error.
+  int open(size_t i, bool quiet = false) {
+    if("-" == names[i]) {
+      return STDIN_FILENO;
+    }
+    int fd = ::open(shell->resolve_path(names[i]).c_str(),
+                    O_RDONLY | O_CLOEXEC);
+    if(-1 == fd) {
+      report(i, errno, quiet);
+    }
+    return fd;
+  }
+
+  void close(int fd) {
+    if(STDIN_FILENO != fd) {
+      ::close(fd);
+    }
+  }
+
+  void report(size_t i, int error, bool quiet = false) {
+    failed = true;
+    if(!quiet) {
+      shell->eout(tool + ": " + names[i] + ": " + strerror(error));
+    }
+  }
+
+  bool has_failed() const {
+    return failed;
+  }
+
+private:
+  Shell *shell;
+  string tool;
+  vector<string> names;
+  bool failed;
+};
+
+// Splits `-abc' style option clusters.  Returns false for long options and
+// anything `accepts' doesn't list, which the caller hands to the external
+// tool.  Options in `with_argument' take the rest of the cluster or the
+// next word as their value.
+class OptionParser {
+public:
+  OptionParser(const vector<string>& argv, const string& accepts,
+               const string& with_argument)
+    : argv(argv), accepts(accepts), with_argument(with_argument), next(1) { }
+
+  // Returns the next option in `*option' (and its value in `*value'), or
+  // false once the operands start.  `*supported' is false if the option
+  // isn't handled in-process.
+  bool get(char *option, string *value, bool *supported) {
+    *supported = true;
+    while(cluster.empty()) {
+      if(next >= argv.size()) {
+        return false;
+      }
+      const string& arg = argv[next];
+      if("--" == arg) {
+        ++next;
+        return false;
+      }
+      if(arg.length() < 2 || '-' != arg[0]) {
+        return false;
+      }
+      if('-' == arg[1]) {
+        *supported = false;
+        return true;
+      }
+      cluster = arg.substr(1);
+      ++next;
+    }
+
+    *option = cluster[0];
+    cluster.erase(0, 1);
+    if(string::npos != with_argument.find(*option)) {
+      if(!cluster.empty()) {
+        *value = cluster;
+        cluster.clear();
+      }
+      else if(next < argv.size()) {
+        *value = argv[next++];
+      }
+      else {
+        *supported = false;
+      }
+    }
+    else if(string::npos == accepts.find(*option)) {
+      *supported = false;
+    }
+    return true;
+  }
+
+  // The words after the options.
+  vector<string> get_operands() const {
+    return vector<string>(argv.begin() + next, argv.end());
+  }
+
+private:
+  const vector<string>& argv;
+  string accepts;
+  string with_argument;
+  size_t next;
+  string cluster;
+};
+
+bool parse_count(const string& text, uint64_t *count) {
+  char *end;
+  errno = 0;
+  unsigned long long value = strtoull(text.c_str(), &end, 10);
+  if(text.empty() || '\0' != *end || 0 != errno || '-' == text[0]) {
+    return false;
+  }
+  *count = value;
+  return true;
+}
+
+// What `grep -F' looks for, and how it reports it.
+struct GrepOptions {
+  string pattern;
+  bool invert = false;
+  bool count = false;
+  bool line_numbers = false;
+  bool quiet = false;
+  bool no_messages = false;
+  // -1: only with several inputs, 0: never (`-h'), 1: always (`-H').
+  int filenames = -1;
+};
+
+// Greps one input.  Returns how many lines were selected, stopping at the
+// first one if `quiet'.
+uint64_t grep_input(EventLoop *loop, int fd, const string& name,
+                    const GrepOptions& options, Output *out, int *error) {
+  string prefix = name.empty() ? "" : name + ":";
+  const char *pattern = options.pattern.data();
+  size_t pattern_length = options.pattern.length();
+  uint64_t selected = 0;
+  uint64_t line = 1;
+  LineReader reader(loop, fd);
+  const char *begin, *end;
+
+  auto emit = [&](const char *line_begin, const char *line_end) {
+    ++selected;
+    if(options.count || options.quiet) {
+      return;
+    }
+    if(!prefix.empty()) {
+      out->append(prefix);
+    }
+    if(options.line_numbers) {
+      out->append(to_string(line) + ":");
+    }
+    out->append_line(line_begin, line_end);
+  };
+
+  while(reader.next(&begin, &end)) {
+    const char *p = begin;
+    if(options.invert) {
+      while(p < end) {
+        const char *newline =
+          static_cast<const char*>(memchr(p, '\n', end - p));
+        const char *line_end = nullptr != newline ? newline + 1 : end;
+        if(nullptr == memmem(p, line_end - p, pattern, pattern_length)) {
+          emit(p, line_end);
+        }
+        p = line_end;
+        ++line;
+      }
+    }
+    else {
+      // Jump from match to match; lines in between are never looked at
+      // (only counted, for `-n').
+      while(p < end) {
+        const char *hit = static_cast<const char*>(
+          memmem(p, end - p, pattern, pattern_length));
+        if(nullptr == hit) {
+          break;
+        }
+        const char *line_begin = static_cast<const char*>(
+          memrchr(p, '\n', hit - p));
+        line_begin = nullptr != line_begin ? line_begin + 1 : p;
+        const char *newline =
+          static_cast<const char*>(memchr(hit, '\n', end - hit));
+        const char *line_end = nullptr != newline ? newline + 1 : end;
+        if(options.line_numbers) {
+          line += count_newlines(p, line_begin);
+        }
+        emit(line_begin, line_end);
+        p = line_end;
+        ++line;
+      }
+      if(options.line_numbers) {
+        line += count_newlines(p, end);
+      }
+    }
+    if(options.quiet && selected > 0) {
+      return selected;
+    }
+  }
+  *error = reader.get_error();
+
+  if(options.count && !options.quiet) {
+    out->append(prefix + to_string(selected) + "\n");
+  }
+  return selected;
+}
+
+// The word, line and byte counts of `wc'.
+struct Counts {
+  uint64_t lines = 0;
+  uint64_t words = 0;
+  uint64_t bytes = 0;
+};
+
+bool count_input(EventLoop *loop, int fd, bool count_words, Counts *counts,
+                 int *error) {
+  // Bytes which separate words, like `isspace' in the C locale.
+  static bool is_space[256];
+  static bool initialized = false;
+  if(!initialized) {
+    for(const char *c = " \t\n\v\f\r"; *c; ++c) {
+      is_space[static_cast<unsigned char>(*c)] = true;
+    }
+    initialized = true;
+  }
+
+  vector<char> buffer(READ_BLOCK_SIZE);
+  bool in_word = false;
+  while(true) {
+    ssize_t length = read_input(loop, fd, buffer.data(), buffer.size());
+    if(length < 0 && EINTR == errno) {
+      continue;
+    }
+    if(length < 0) {
+      *error = errno;
+      return false;
+    }
+    if(0 == length) {
+      return true;
+    }
+    const char *data = buffer.data();
+    counts->bytes += length;
+    counts->lines += count_newlines(data, data + length);
+    if(count_words) {
+      for(ssize_t i = 0; i < length; ++i) {
+        bool space = is_space[static_cast<unsigned char>(data[i])];
+        counts->words += !space && !in_word;
+        in_word = !space;
+      }
+    }
+  }
+}
+
+// A `cut' list (`1,3-5,7-'), as a set of 1-based positions.
+class Selection {
+public:
+  Selection() : open_from(0) { }
+
+  bool parse(const string& text) {
+    for(const string& range : util::split(text, ',')) {
+      size_t dash = range.find('-');
+      uint64_t low = 1, high = 0;
+      bool ok;
+      if(string::npos == dash) {
+        ok = parse_count(range, &low) && low > 0;
+        high = low;
+      }
+      else {
+        string from = range.substr(0, dash);
+        string to = range.substr(dash + 1);
+        ok = (from.empty() || (parse_count(from, &low) && low > 0))
+          && (to.empty() || parse_count(to, &high))
+          && !(from.empty() && to.empty());
+        if(ok && to.empty()) {
+          open_from = 0 == open_from ? low : min(open_from, low);
+          continue;
+        }
+        ok = ok && high >= low;
+      }
+      if(!ok) {
+        return false;
+      }
+      if(selected.size() < high + 1) {
+        selected.resize(high + 1);
+      }
+      fill(selected.begin() + low, selected.begin() + high + 1, true);
+    }
+    return true;
+  }
+
+  bool contains(size_t position) const {
+    return (0 != open_from && position >= open_from)
+      || (position < selected.size() && selected[position]);
+  }
+
+private:
+  vector<bool> selected;
+  // Everything from here on is selected (0 if nothing is).
+  size_t open_from;
+};
+
+void cut_line(const char *begin, const char *end, const Selection& selection,
+              bool by_fields, char delimiter, bool only_delimited,
+              Output *out) {
+  const char *content_end = end > begin && '\n' == end[-1] ? end - 1 : end;
+  if(by_fields && nullptr == memchr(begin, delimiter, content_end - begin)) {
+    if(!only_delimited) {
+      out->append_line(begin, end);
+    }
+    return;
+  }
+
+  // Selected fields (or bytes) next to each other are copied as one run,
+  // delimiters included.
+  const char *run_begin = nullptr;
+  const char *run_end = nullptr;
+  size_t position = 1;
+  for(const char *p = begin; p <= content_end; ++position) {
+    const char *item_end = p + 1;
+    if(by_fields) {
+      item_end = static_cast<const char*>(
+        memchr(p, delimiter, content_end - p));
+      if(nullptr == item_end) {
+        item_end = content_end;
+      }
+    }
+    else if(p == content_end) {
+      break;
+    }
+
+    if(selection.contains(position)) {
+      if(nullptr != run_end && run_end != p - (by_fields ? 1 : 0)) {
+        out->append(run_begin, run_end - run_begin);
+        if(by_fields) {
+          out->append(&delimiter, 1);
+        }
+        run_begin = nullptr;
+      }
+      if(nullptr == run_begin) {
+        run_begin = p;
+      }
+      run_end = item_end;
+    }
+    p = by_fields ? item_end + 1 : item_end;
+  }
+  if(nullptr != run_begin) {
+    out->append(run_begin, run_end - run_begin);
+  }
+  out->append("\n", 1);
+}
+
+}  // namespace
+
+int GrepBuiltin::invoke(Shell *shell) {
+  GrepOptions options;
+  bool fixed = false;
+  OptionParser parser(argv, "FvcnqsHh", "");
+  char option;
+  string value;
+  bool supported;
+  while(parser.get(&option, &value, &supported)) {
+    if(!supported) {
+      return run_external(shell, argv);
+    }
+    switch(option) {
+      case 'F': fixed = true; break;
+      case 'v': options.invert = true; break;
+      case 'c': options.count = true; break;
+      case 'n': options.line_numbers = true; break;
+      case 'q': options.quiet = true; break;
+      case 's': options.no_messages = true; break;
+      case 'H': options.filenames = 1; break;
+      case 'h': options.filenames = 0; break;
+    }
+  }
+
+  vector<string> operands = parser.get_operands();
+  if(operands.empty()) {
+    shell->eout("grep: usage: grep [-FvcnqsHh] PATTERN [FILE...]");
+    return 2;
+  }
+  options.pattern = operands[0];
+  // Patterns without special characters match the same as fixed strings.
+  // Several (newline-separated) patterns are left to the real grep.
+  if(string::npos != options.pattern.find('\n')
+     || (!fixed && string::npos != options.pattern.find_first_of("\\.[]*^$"))) {
+    return run_external(shell, argv);
+  }
+
+  Inputs inputs(shell, "grep", vector<string>(operands.begin() + 1,
+                                              operands.end()));
+  bool with_names = 1 == options.filenames
+    || (-1 == options.filenames && inputs.size() > 1);
+  Output out;
+  uint64_t selected = 0;
+  for(size_t i = 0; i < inputs.size(); ++i) {
+    int fd = inputs.open(i, options.no_messages);
+    if(-1 == fd) {
+      continue;
+    }
+    int error = 0;
+    string name = "-" == inputs.get_name(i) ? "(standard input)"
+                                            : inputs.get_name(i);
+    selected += grep_input(&shell->get_event_loop(), fd,
+                           with_names ? name : "", options, &out, &error);
+    inputs.close(fd);
+    if(0 != error) {
+      inputs.report(i, error, options.no_messages);
+    }
+    if(options.quiet && selected > 0) {
+      return 0;
+    }
+  }
+
+  if(!out.flush()) {
+    shell->eout("grep: write error: " + string(strerror(errno)));
+    return 2;
+  }
+  if(inputs.has_failed()) {
+    return 2;
+  }
+  return selected > 0 ? 0 : 1;
+}
+
+int WcBuiltin::invoke(Shell *shell) {
+  bool lines = false, words = false, bytes = false;
+  OptionParser parser(argv, "lwc", "");
+  char option;
+  string value;
+  bool supported;
+  while(parser.get(&option, &value, &supported)) {
+    if(!supported) {
+      return run_external(shell, argv);
+    }
+    lines |= 'l' == option;
+    words |= 'w' == option;
+    bytes |= 'c' == option;
+  }
+  if(!lines && !words && !bytes) {
+    lines = words = bytes = true;
+  }
+
+  Inputs inputs(shell, "wc", parser.get_operands());
+  vector<Counts> counts(inputs.size());
+  vector<bool> counted(inputs.size());
+  Counts total;
+  // Like GNU wc: counts line up to the width of the total size of the
+  // files, or to 7 columns when reading something else.
+  uint64_t total_size = 0;
+  bool only_files = true;
+  for(size_t i = 0; i < inputs.size(); ++i) {
+    int fd = inputs.open(i);
+    if(-1 == fd) {
+      continue;
+    }
+    struct stat info;
+    bool regular = 0 == fstat(fd, &info) && S_ISREG(info.st_mode);
+    only_files = only_files && regular;
+    total_size += regular ? info.st_size : 0;
+
+    int error = 0;
+    if(!lines && !words && regular && STDIN_FILENO != fd) {
+      // Bytes alone don't need reading.
+      counts[i].bytes = info.st_size;
+    }
+    else if(!count_input(&shell->get_event_loop(), fd, words, &counts[i],
+                         &error)) {
+      inputs.report(i, error);
+    }
+    inputs.close(fd);
+    counted[i] = 0 == error;
+    total.lines += counts[i].lines;
+    total.words += counts[i].words;
+    total.bytes += counts[i].bytes;
+  }
+
+  int columns = lines + words + bytes;
+  int width = 1;
+  if(columns > 1 || inputs.size() > 1) {
+    width = only_files ? to_string(total_size).length() : 7;
+  }
+  auto format = [&](const Counts& c, const string& name) {
+    string line;
+    char field[32];
+    for(int i = 0; i < 3; ++i) {
+      bool shown = 0 == i ? lines : 1 == i ? words : bytes;
+      if(!shown) {
+        continue;
+      }
+      uint64_t value = 0 == i ? c.lines : 1 == i ? c.words : c.bytes;
+      snprintf(field, sizeof(field), "%s%*llu", line.empty() ? "" : " ",
+               width, static_cast<unsigned long long>(value));
+      line += field;
+    }
+    return line + (name.empty() ? "" : " " + name) + "\n";
+  };
+
+  Output out;
+  for(size_t i = 0; i < inputs.size(); ++i) {
+    if(counted[i]) {
+      const string& name = inputs.get_name(i);
+      out.append(format(counts[i], "-" == name && 1 == inputs.size() ? ""
+                                                                    : name));
+    }
+  }
+  if(inputs.size() > 1) {
+    out.append(format(total, "total"));
+  }
+  if(!out.flush()) {
+    shell->eout("wc: write error: " + string(strerror(errno)));
+    return 1;
+  }
+  return inputs.has_failed() ? 1 : 0;
+}
+
+int HeadBuiltin::invoke(Shell *shell) {
+  uint64_t limit = 10;
+  bool by_bytes = false;
+  vector<string> args(argv);
+  // The obsolete `head -N'.
+  if(args.size() > 1 && args[1].length() > 1 && '-' == args[1][0]
+     && parse_count(args[1].substr(1), &limit)) {
+    args[1] = "-n" + args[1].substr(1);
+  }
+
+  OptionParser parser(args, "", "nc");
+  char option;
+  string value;
+  bool supported;
+  while(parser.get(&option, &value, &supported)) {
+    // Suffixes (`1K') and negative counts (all but the last N) are left to
+    // the real head.
+    if(!supported || !parse_count(value, &limit)) {
+      return run_external(shell, argv);
+    }
+    by_bytes = 'c' == option;
+  }
+
+  Inputs inputs(shell, "head", parser.get_operands());
+  Output out;
+  for(size_t i = 0; i < inputs.size(); ++i) {
+    if(inputs.size() > 1) {
+      out.append(string(i > 0 ? "\n" : "") + "==> "
+                 + ("-" == inputs.get_name(i) ? "standard input"
+                                              : inputs.get_name(i))
+                 + " <==\n");
+    }
+    int fd = inputs.open(i);
+    if(-1 == fd) {
+      continue;
+    }
+
+    LineReader reader(&shell->get_event_loop(), fd);
+    uint64_t left = limit;
+    const char *begin, *end;
+    size_t unused = 0;
+    while(left > 0 && reader.next(&begin, &end)) {
+      const char *stop = end;
+      if(by_bytes) {
+        stop = begin + min<uint64_t>(left, end - begin);
+        left -= stop - begin;
+      }
+      else {
+        for(const char *p = begin; left > 0 && p < end; --left) {
+          const char *newline =
+            static_cast<const char*>(memchr(p, '\n', end - p));
+          p = nullptr != newline ? newline + 1 : end;
+          stop = p;
+        }
+      }
+      out.append(begin, stop - begin);
+      unused = end - stop;
+    }
+    if(0 != reader.get_error()) {
+      inputs.report(i, reader.get_error());
+    }
+    // Leave whatever wasn't printed for the next reader of a shared input
+    // (e.g. the rest of a here-document), where it can seek.
+    unused += reader.get_unconsumed();
+    if(unused > 0) {
+      lseek(fd, -static_cast<off_t>(unused), SEEK_CUR);
+    }
+    inputs.close(fd);
+  }
+
+  if(!out.flush()) {
+    shell->eout("head: write error: " + string(strerror(errno)));
+    return 1;
+  }
+  return inputs.has_failed() ? 1 : 0;
+}
+
+int CutBuiltin::invoke(Shell *shell) {
+  Selection selection;
+  bool by_fields = false, by_bytes = false, only_delimited = false;
+  char delimiter = '\t';
+  OptionParser parser(argv, "sn", "fbcd");
+  char option;
+  string value;
+  bool supported;
+  while(parser.get(&option, &value, &supported)) {
+    if(!supported) {
+      return run_external(shell, argv);
+    }
+    switch(option) {
+      case 'f':
+      case 'b':
+      case 'c':
+        if(!selection.parse(value)) {
+          shell->eout("cut: invalid list: " + value);
+          return 1;
+        }
+        ('f' == option ? by_fields : by_bytes) = true;
+        break;
+      case 'd':
+        if(1 != value.length()) {
+          return run_external(shell, argv);
+        }
+        delimiter = value[0];
+        break;
+      case 's':
+        only_delimited = true;
+        break;
+    }
+  }
+  if(by_fields == by_bytes) {
+    shell->eout("cut: you must specify a list of bytes or fields");
+    return 1;
+  }
+
+  Inputs inputs(shell, "cut", parser.get_operands());
+  Output out;
+  for(size_t i = 0; i < inputs.size(); ++i) {
+    int fd = inputs.open(i);
+    if(-1 == fd) {
+      continue;
+    }
+    LineReader reader(&shell->get_event_loop(), fd);
+    const char *begin, *end;
+    while(reader.next(&begin, &end)) {
+      for(const char *p = begin; p < end; ) {
+        const char *newline =
+          static_cast<const char*>(memchr(p, '\n', end - p));
+        const char *line_end = nullptr != newline ? newline + 1 : end;
+        cut_line(p, line_end, selection, by_fields, delimiter,
+                 only_delimited, &out);
+        p = line_end;
+      }
+    }
+    if(0 != reader.get_error()) {
+      inputs.report(i, reader.get_error());
+    }
+    inputs.close(fd);
+  }
+
+  if(!out.flush()) {
+    shell->eout("cut: write error: " + string(strerror(errno)));
+    return 1;
+  }
+  return inputs.has_failed() ? 1 : 0;
+}
+
+}   // namespace coreutils
+}   // namespace modules
+}   // namespace microshell
@@ -1,13 +1,17 @@
 #include <iostream>
-#include <sstream>
 #include <string>
 #include <vector>
 
+#include <cerrno>
 #include <cstring>
 
+#include <fcntl.h>
+
 #include <limits.h>
 #include <pwd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -38,12 +42,61 @@ namespace util {
     return path1 + "/" + path2;
   }
 
+  std::string normalize_path(const std::string& path) {
+    bool absolute = is_absolute_path(path);
+    std::vector<std::string> parts;
+    size_t start = 0;
+    while(start <= path.length()) {
+      size_t end = path.find('/', start);
+      if(std::string::npos == end) {
+        end = path.length();
+      }
+
+      std::string part = path.substr(start, end - start);
+      if(part.empty() || "." == part) {
+        // Nothing to do.
+      }
+      else if(".." == part) {
+        if(!parts.empty() && ".." != parts.back()) {
+          parts.pop_back();
+        }
+        else if(!absolute) {
+          parts.push_back(part);
+        }
+        // `/..' is just `/'.
+      }
+      else {
+        parts.push_back(part);
+      }
+      start = end + 1;
+    }
+
+    std::string result = absolute ? "/" : "";
+    for(size_t i = 0; i < parts.size(); ++i) {
+      if(i > 0) {
+        result += '/';
+      }
+      result += parts[i];
+    }
+
+    if(result.empty()) {
+      return ".";
+    }
+    return result;
+  }
+
+  // Same results as splitting with `getline' (no field after a trailing
+  // delimiter), without a stream's allocations.
   std::vector<std::string> split(const std::string &s, char delim) {
     std::vector<std::string> elems;
-    std::stringstream ss(s);
-    std::string item;
-    while (std::getline(ss, item, delim)) {
-      elems.push_back(item);
+    size_t start = 0;
+    while(start < s.length()) {
+      size_t end = s.find(delim, start);
+      if(std::string::npos == end) {
+        end = s.length();
+      }
+      elems.push_back(s.substr(start, end - start));
+      start = end + 1;
     }
     return elems;
   }
@@ -51,15 +104,21 @@ namespace util {
   std::string merge_with(const std::vector<std::string>::iterator& start,
                          const std::vector<std::string>::iterator& end,
                          const std::string delimitator) {
-    std::stringstream ss;
+    // Sized up front, so that the result is allocated once.
+    size_t length = 0;
+    for(auto it = start; it != end; ++it) {
+      length += it->length() + delimitator.length();
+    }
+
+    std::string merged;
+    merged.reserve(length);
     for(auto it = start; it != end; ++it) {
-      ss << *it;
+      merged += *it;
       if(it + 1 != end) {
-        ss << delimitator;
+        merged += delimitator;
       }
     }
-
-    return ss.str();
+    return merged;
   }
 
   char** get_raw_array(const std::vector<std::string>& v) {
@@ -110,6 +169,79 @@ namespace util {
     return false;
   }
 
+  bool is_file_at(int dirfd, const string& name) {
+    struct stat stat_buf;
+    return 0 == ::fstatat(dirfd, name.c_str(), &stat_buf, 0);
+  }
+
+  bool is_directory_at(int dirfd, const string& name) {
+    struct stat stat_buf;
+    if(0 == ::fstatat(dirfd, name.c_str(), &stat_buf, 0)) {
+      return S_ISDIR(stat_buf.st_mode);
+    }
+
+    return false;
+  }
+
+  bool make_directories(const string& path) {
+    for(size_t slash = path.find('/', 1); ; slash = path.find('/', slash + 1)) {
+      string prefix = path.substr(0, slash);
+      if(!prefix.empty() && -1 == ::mkdir(prefix.c_str(), 0755)
+         && EEXIST != errno) {
+        return false;
+      }
+      if(string::npos == slash) {
+        break;
+      }
+    }
+    if(!is_directory(path)) {
+      errno = ENOTDIR;
+      return false;
+    }
+    return true;
+  }
+
+  int open_memory_file(const string& name, const string& data) {
+    int fd = ::memfd_create(name.c_str(), MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if(-1 == fd) {
+      return -1;
+    }
+    if(!write_all(fd, data) || -1 == ::lseek(fd, 0, SEEK_SET)
+       || -1 == ::fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW
+                                         | F_SEAL_WRITE | F_SEAL_SEAL)) {
+      int saved_errno = errno;
+      ::close(fd);
+      errno = saved_errno;
+      return -1;
+    }
+    return fd;
+  }
+
+  int open_directory(const string& name) {
+    return ::open(name.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+  }
+
+  uint64_t monotonic_ns() {
+    struct timespec now;
+    ::clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000000ULL + now.tv_nsec;
+  }
+
+  bool write_all(int fd, const string& data) {
+    size_t written = 0;
+    while(written < data.length()) {
+      ssize_t ret = ::write(fd, data.data() + written, data.length() - written);
+      if(-1 == ret) {
+        if(EINTR == errno) {
+          continue;
+        }
+        return false;
+      }
+      written += ret;
+    }
+    return true;
+  }
+
   string get_current_home() {
     char* home;
     if(nullptr == (home = ::getenv("HOME"))) {
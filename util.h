@@ -1,6 +1,7 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -16,6 +17,14 @@ namespace util {
 
   std::string merge_paths(const std::string& path1, const std::string& path2);
 
+  // Lexically canonicalizes `path': collapses repeated slashes, drops `.'
+  // components and resolves `..' against the preceding component.  Does not
+  // touch the file system, so symlinks are not followed (this matches the
+  // ``logical'' behavior of `cd' in most shells).  Absolute paths never climb
+  // above `/'; relative paths keep leading `..' components they cannot
+  // resolve.
+  std::string normalize_path(const std::string& path);
+
   std::vector<std::string> split(const std::string &s, char delim);
 
   std::string merge_with(const std::vector<std::string>::iterator& start,
@@ -37,6 +46,33 @@ namespace util {
   bool is_regular_file(const std::string& name);
   bool is_directory(const std::string& name);
 
+  // Same as the above, but relative names are looked up against the
+  // directory referred to by `dirfd' (see `fstatat(2)'), which saves the
+  // kernel from walking the whole path again.
+  bool is_file_at(int dirfd, const std::string& name);
+  bool is_directory_at(int dirfd, const std::string& name);
+
+  // Creates `path' and any missing parents (like `mkdir -p').  Returns false
+  // (with `errno' set) on error.
+  bool make_directories(const std::string& path);
+
+  // Opens a lightweight (`O_PATH') handle to the directory `name'.  Returns
+  // -1 on error, in which case `errno' is set.
+  int open_directory(const std::string& name);
+
+  // Nanoseconds on the monotonic clock.  Only meaningful as a difference.
+  uint64_t monotonic_ns();
+
+  // Writes all of `data' to `fd', retrying on short writes and `EINTR'.
+  // Returns false (with `errno' set) on error.
+  bool write_all(int fd, const std::string& data);
+
+  // Returns a descriptor for a file holding `data', positioned at its start,
+  // or -1 (with `errno' set) on error.  The file lives in memory (see
+  // `memfd_create(2)') and is sealed, so it can't change under whoever
+  // reads it.
+  int open_memory_file(const std::string& name, const std::string& data);
+
   std::string get_current_home();
   std::string get_current_user();
 
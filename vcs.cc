@@ -0,0 +1,236 @@
+#include "vcs.h"
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+namespace microshell {
+namespace modules {
+namespace vcs {
+
+using namespace microshell::core;
+using namespace std;
+
+namespace {
+
+// Branch names, hashes and `gitdir:' links are all short.
+const size_t MAX_SMALL_FILE = 4096;
+
+bool read_small_file(const string& path, string *contents) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if(-1 == fd) {
+    return false;
+  }
+  char buffer[MAX_SMALL_FILE];
+  ssize_t count = read(fd, buffer, sizeof(buffer));
+  close(fd);
+  if(count < 0) {
+    return false;
+  }
+  contents->assign(buffer, count);
+  while(!contents->empty() && ('\n' == contents->back()
+                               || '\r' == contents->back())) {
+    contents->pop_back();
+  }
+  return true;
+}
+
+// Finds the repository containing `directory': its work tree and its
+// `.git' directory (which, for linked work trees and submodules, is
+// elsewhere, and pointed to by a `.git' file).
+bool find_repository(const string& directory, string *work_tree,
+                     string *git_dir) {
+  string current = directory;
+  while(true) {
+    string candidate = ("/" == current ? "" : current) + "/.git";
+    struct stat info;
+    if(0 == stat(candidate.c_str(), &info)) {
+      *work_tree = current;
+      if(S_ISDIR(info.st_mode)) {
+        *git_dir = candidate;
+        return true;
+      }
+      string link;
+      const string prefix = "gitdir: ";
+      if(!read_small_file(candidate, &link) || 0 != link.find(prefix)) {
+        return false;
+      }
+      *git_dir = link.substr(prefix.length());
+      if('/' != (*git_dir)[0]) {
+        *git_dir = current + "/" + *git_dir;
+      }
+      return true;
+    }
+
+    if("/" == current || current.empty()) {
+      return false;
+    }
+    size_t slash = current.rfind('/');
+    current = 0 == slash ? "/" : current.substr(0, slash);
+  }
+}
+
+}  // namespace
+
+void Vcs::initialize(const Shell&) {
+}
+
+vector<shared_ptr<BuiltinFactory>> Vcs::get_builtins() {
+  return vector<shared_ptr<BuiltinFactory>>();
+}
+
+vector<shared_ptr<PromptSegment>> Vcs::get_prompt_segments() {
+  return vector<shared_ptr<PromptSegment>> { make_shared<GitSegment>() };
+}
+
+GitSegment::GitSegment() : git(0), cancelled(false) { }
+
+string GitSegment::get_name() const {
+  return "git";
+}
+
+bool GitSegment::is_async() const {
+  return true;
+}
+
+string GitSegment::render(const PromptContext& context,
+                          vector<string> *watch_paths) {
+  // Entering a repository (e.g. `git init') is a change, too.
+  watch_paths->push_back(context.directory);
+
+  string work_tree, git_dir;
+  if(!find_repository(context.directory, &work_tree, &git_dir)) {
+    return "";
+  }
+  // HEAD and the index live here; commits, checkouts and `git add' all
+  // touch them.
+  watch_paths->push_back(git_dir);
+  if(work_tree != context.directory) {
+    watch_paths->push_back(work_tree);
+  }
+
+  string head;
+  if(!read_small_file(git_dir + "/HEAD", &head)) {
+    return "";
+  }
+  const string prefix = "ref: refs/heads/";
+  string branch = 0 == head.find(prefix) ? head.substr(prefix.length())
+                                         : head.substr(0, 7);
+
+  return "git:" + branch + (is_dirty(work_tree) ? "*" : "");
+}
+
+void GitSegment::cancel() {
+  lock_guard<std::mutex> lock(mutex);
+  cancelled = true;
+  if(0 != git) {
+    kill(-git, SIGKILL);
+  }
+}
+
+bool GitSegment::is_dirty(const string& work_tree) {
+  int ends[2];
+  if(-1 == pipe2(ends, O_CLOEXEC)) {
+    return false;
+  }
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null",
+                                   O_RDONLY, 0);
+  posix_spawn_file_actions_adddup2(&actions, ends[1], STDOUT_FILENO);
+  posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null",
+                                   O_WRONLY, 0);
+
+  // Don't let `git status' refresh the index: that would trigger our own
+  // change notifications, and contend with the user's git commands.
+  vector<string> environment = { "GIT_OPTIONAL_LOCKS=0" };
+  for(char **env = environ; nullptr != *env; ++env) {
+    environment.push_back(*env);
+  }
+  vector<char*> envp;
+  for(string& entry : environment) {
+    envp.push_back(&entry[0]);
+  }
+  envp.push_back(nullptr);
+
+  vector<string> args = { "git", "-C", work_tree, "status", "--porcelain",
+                          "--untracked-files=no",
+                          "--ignore-submodules=dirty" };
+  vector<char*> argv;
+  for(string& arg : args) {
+    argv.push_back(&arg[0]);
+  }
+  argv.push_back(nullptr);
+
+  // In a process group of its own, so that `cancel()' gets whatever it
+  // runs as well (and nothing holds on to the pipe).
+  posix_spawnattr_t attributes;
+  posix_spawnattr_init(&attributes);
+  posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+  posix_spawnattr_setpgroup(&attributes, 0);
+
+  // Spawned with the lock held, so that `cancel()' either comes first or
+  // knows whom to kill.
+  pid_t pid;
+  int error;
+  {
+    lock_guard<std::mutex> lock(mutex);
+    error = cancelled ? ECANCELED
+                      : posix_spawnp(&pid, "git", &actions, &attributes,
+                                     argv.data(), envp.data());
+    if(0 == error) {
+      git = pid;
+    }
+  }
+  posix_spawnattr_destroy(&attributes);
+  posix_spawn_file_actions_destroy(&actions);
+  close(ends[1]);
+  if(0 != error) {
+    close(ends[0]);
+    return false;
+  }
+
+  bool has_output = false;
+  char buffer[4096];
+  ssize_t count;
+  while((count = read(ends[0], buffer, sizeof(buffer))) != 0) {
+    if(-1 == count) {
+      if(EINTR == errno) {
+        continue;
+      }
+      break;
+    }
+    has_output = true;
+  }
+  close(ends[0]);
+
+  // Until it's reaped, the pid can't be reused, so it's safe to kill.
+  {
+    lock_guard<std::mutex> lock(mutex);
+    git = 0;
+  }
+  int status = 0;
+  pid_t result;
+  while(-1 == (result = waitpid(pid, &status, 0)) && EINTR == errno) { }
+  return -1 != result && has_output && WIFEXITED(status)
+    && 0 == WEXITSTATUS(status);
+}
+
+
+}   // namespace vcs
+}   // namespace modules
+}   // namespace microshell
@@ -0,0 +1,61 @@
+#ifndef MICROSHELL_MODULES_VCS_VCS_H
+#define MICROSHELL_MODULES_VCS_VCS_H
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "prompt.h"
+#include "shell.h"
+#include "shell_module.h"
+
+namespace microshell {
+namespace modules {
+namespace vcs {
+
+/**
+ * Shows the state of the version control repository the shell is in.
+ *
+ * Provides prompt segments:
+ *    - git: the current branch (or commit, if detached), followed by `*' if
+ *      there are uncommitted changes to tracked files.
+ */
+class Vcs : public microshell::core::ShellModule {
+public:
+  void initialize(const microshell::core::Shell&) override;
+  std::vector<std::shared_ptr<microshell::core::BuiltinFactory>> get_builtins() override;
+  std::vector<std::shared_ptr<microshell::core::PromptSegment>> get_prompt_segments() override;
+};
+
+// Rendered asynchronously: `git status' can take seconds on a large
+// repository.  The branch comes straight from `.git/HEAD'.
+class GitSegment : public microshell::core::PromptSegment {
+public:
+  GitSegment();
+
+  std::string get_name() const override;
+  bool is_async() const override;
+  std::string render(const microshell::core::PromptContext& context,
+                     std::vector<std::string> *watch_paths) override;
+  // Kills the `git status' running, if any.
+  void cancel() override;
+
+private:
+  // Whether tracked files in `work_tree' have uncommitted changes.
+  bool is_dirty(const std::string& work_tree);
+
+  // Guards the below, which `cancel()' uses from the shell's thread.
+  std::mutex mutex;
+  // The `git status' running (and not reaped yet), or 0.
+  pid_t git;
+  bool cancelled;
+};
+
+}   // namespace vcs
+}   // namespace modules
+}   // namespace microshell
+
+#endif  // MICROSHELL_MODULES_VCS_VCS_H
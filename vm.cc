@@ -0,0 +1,679 @@
+#include "vm.h"
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "arithmetic.h"
+#include "builtin_registry.h"
+#include "shell.h"
+#include "util.h"
+
+namespace microshell {
+namespace core {
+
+using namespace std;
+
+namespace {
+
+// How deeply shell functions may recurse.
+const int MAX_CALL_DEPTH = 1000;
+
+// The exit status used when a command cannot be found or built.
+const int STATUS_NOT_FOUND = 127;
+
+// What a pipe holds without a reader, on Linux.
+const size_t PIPE_CAPACITY = 65536;
+
+// Feeds `data' into the (non-blocking) write end of a pipe from the event
+// loop, as fast as the reader takes it.  The pipe is closed once everything
+// is written or the reader is gone, or with the task (e.g. when a forked
+// child releases the loop).
+class PipeFeeder : public EventLoop::Task {
+public:
+  PipeFeeder(int fd, const string& data) : fd(fd), data(data), written(0) { }
+
+  ~PipeFeeder() {
+    if(-1 != fd) {
+      close(fd);
+    }
+  }
+
+  EventLoop::Await resume(Shell *, short) override {
+    // A reader which stops early (e.g. `head') makes the write fail with
+    // `EPIPE', which mustn't take the shell down along with it.
+    sigset_t pipe_signal, mask;
+    sigemptyset(&pipe_signal);
+    sigaddset(&pipe_signal, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_signal, &mask);
+    ssize_t count = 0;
+    while(written < data.length()) {
+      count = write(fd, data.data() + written, data.length() - written);
+      if(-1 == count && EINTR == errno) {
+        continue;
+      }
+      if(-1 == count) {
+        break;
+      }
+      written += count;
+    }
+    bool blocked = -1 == count && EAGAIN == errno;
+    if(-1 == count && EPIPE == errno && !sigismember(&mask, SIGPIPE)) {
+      struct timespec now { 0, 0 };
+      sigtimedwait(&pipe_signal, nullptr, &now);
+    }
+    pthread_sigmask(SIG_SETMASK, &mask, nullptr);
+
+    if(blocked) {
+      return EventLoop::Await::writable(fd);
+    }
+    close(fd);
+    fd = -1;
+    return EventLoop::Await::finish(written < data.length() ? 1 : 0);
+  }
+
+private:
+  int fd;
+  string data;
+  size_t written;
+};
+
+// Returns a descriptor from which `data' can be read (e.g. a here-document
+// body), or -1.  Normally an in-memory file, which readers can also seek
+// on.  Without `memfd_create', a pipe: filled right away if `data' fits,
+// and fed by a task on `loop' otherwise.
+int open_input(EventLoop *loop, const string& data) {
+  int fd = util::open_memory_file("ush-here-document", data);
+  if(-1 != fd) {
+    return fd;
+  }
+
+  int ends[2];
+  if(-1 == pipe2(ends, O_CLOEXEC)) {
+    return -1;
+  }
+  if(data.length() <= PIPE_CAPACITY) {
+    util::write_all(ends[1], data);
+    close(ends[1]);
+  }
+  else {
+    fcntl(ends[1], F_SETFL, O_NONBLOCK);
+    loop->spawn(make_shared<PipeFeeder>(ends[1], data));
+  }
+  return ends[0];
+}
+
+}  // namespace
+
+VirtualMachine::VirtualMachine(Shell *shell)
+  : shell(shell), expansion_failed(false), exec_in_place(false),
+    call_depth(0) { }
+
+int VirtualMachine::execute(const Program& program) {
+  vector<ForLoop> loops;
+  // Substitutions last as long as the command they were expanded for, or,
+  // outside of commands (e.g. in a `for' list), as the whole program.
+  size_t substitution_count = substitutions.size();
+  size_t pc = 0;
+  while(pc < program.code.size() && !shell->is_exit_requested()) {
+    const Instruction& insn = program.code[pc++];
+    switch(insn.op) {
+      case OpCode::RUN: {
+        if(shell->has_deferred_jobs()) {
+          shell->start_deferred_jobs();
+        }
+        EventLoop& loop = shell->get_event_loop();
+        if(loop.is_busy()) {
+          loop.run_ready();
+        }
+        size_t command_substitution_count = substitutions.size();
+        shell->set_last_status(run_simple_command(program.commands[insn.a]));
+        finish_process_substitutions(command_substitution_count);
+        break;
+      }
+
+      case OpCode::JUMP:
+        pc = insn.a;
+        break;
+
+      case OpCode::JUMP_IF_FALSE:
+        if(0 != shell->get_last_status()) {
+          pc = insn.a;
+        }
+        break;
+
+      case OpCode::JUMP_IF_TRUE:
+        if(0 == shell->get_last_status()) {
+          pc = insn.a;
+        }
+        break;
+
+      case OpCode::NOT:
+        shell->set_last_status(0 == shell->get_last_status() ? 1 : 0);
+        break;
+
+      case OpCode::SET_STATUS:
+        shell->set_last_status(insn.a);
+        break;
+
+      case OpCode::FOR_BEGIN: {
+        ForLoop loop;
+        loop.next = 0;
+        if(-1 == insn.a) {
+          loop.values = shell->get_positional_parameters();
+        }
+        else {
+          expansion_failed = false;
+          for(const Word& word : program.word_lists[insn.a]) {
+            expand_word(word, &loop.values);
+          }
+          if(expansion_failed) {
+            loop.values.clear();
+            shell->set_last_status(1);
+          }
+        }
+        loops.push_back(loop);
+        break;
+      }
+
+      case OpCode::FOR_NEXT: {
+        ForLoop& loop = loops.back();
+        if(loop.next < loop.values.size()) {
+          shell->set_variable(program.names[insn.a],
+                              loop.values[loop.next++]);
+        }
+        else {
+          loops.pop_back();
+          pc = insn.b;
+        }
+        break;
+      }
+
+      case OpCode::FOR_POP:
+        loops.pop_back();
+        break;
+
+      case OpCode::DEFINE_FUNCTION:
+        functions[program.names[insn.a]] = program.functions[insn.b];
+        shell->set_last_status(0);
+        break;
+
+      case OpCode::BACKGROUND:
+        shell->set_last_status(run_background(program.jobs[insn.b],
+                                              program.names[insn.a]));
+        break;
+
+      case OpCode::LEAVE:
+        if(-1 != insn.a) {
+          string value = expand_word(program.word_lists[insn.a][0]);
+          char *end;
+          errno = 0;
+          long status = strtol(value.c_str(), &end, 10);
+          if(value.empty() || '\0' != *end || 0 != errno) {
+            shell->eout("return: numeric argument required: " + value);
+            status = 2;
+          }
+          shell->set_last_status(static_cast<int>(status & 0xFF));
+        }
+        finish_process_substitutions(substitution_count);
+        return shell->get_last_status();
+    }
+  }
+
+  finish_process_substitutions(substitution_count);
+  return shell->get_last_status();
+}
+
+bool VirtualMachine::is_function(const string& name) const {
+  return functions.end() != functions.find(name);
+}
+
+int VirtualMachine::call_function(const vector<string>& argv) {
+  if(call_depth >= MAX_CALL_DEPTH) {
+    shell->eout(argv[0] + ": maximum function nesting level exceeded");
+    return 1;
+  }
+
+  // The body may run several commands.
+  exec_in_place = false;
+
+  // Keep the body alive even if the function redefines itself.
+  shared_ptr<const Program> body = functions[argv[0]];
+  vector<string> caller_parameters = shell->get_positional_parameters();
+  shell->set_positional_parameters(vector<string>(argv.begin() + 1,
+                                                  argv.end()));
+  ++call_depth;
+  int status = execute(*body);
+  --call_depth;
+  shell->set_positional_parameters(caller_parameters);
+  return status;
+}
+
+void VirtualMachine::expand_word(const Word& word,
+                                 vector<string> *fields) const {
+  if(word.is_constant) {
+    fields->push_back(word.literal);
+    return;
+  }
+
+  if(word.is_all_positionals) {
+    const vector<string>& parameters = shell->get_positional_parameters();
+    fields->insert(fields->end(), parameters.begin(), parameters.end());
+    return;
+  }
+
+  fields->push_back(expand_word(word));
+}
+
+string VirtualMachine::expand_word(const Word& word) const {
+  if(word.is_constant) {
+    return word.literal;
+  }
+
+  string result;
+  for(const WordPart& part : word.parts) {
+    switch(part.kind) {
+      case WordPart::Kind::LITERAL:
+        result += part.text;
+        break;
+      case WordPart::Kind::VARIABLE:
+        result += shell->get_variable(part.text);
+        break;
+      case WordPart::Kind::TILDE:
+        result += shell->get_home_directory();
+        break;
+      case WordPart::Kind::ARITHMETIC: {
+        string error;
+        shared_ptr<const ArithmeticExpression> expression = part.expression;
+        if(!expression) {
+          expression = ArithmeticExpression::parse_cached(
+            expand_word(*part.inner), &error);
+        }
+        int64_t value;
+        if(expression && expression->evaluate(shell, &value, &error)) {
+          result += to_string(value);
+        }
+        else {
+          shell->eout("$((" + part.text + ")): " + error);
+          expansion_failed = true;
+        }
+        break;
+      }
+      case WordPart::Kind::PROCESS_INPUT:
+      case WordPart::Kind::PROCESS_OUTPUT:
+        result += start_process_substitution(part);
+        break;
+    }
+  }
+  return result;
+}
+
+string VirtualMachine::start_process_substitution(
+    const WordPart& part) const {
+  bool input = WordPart::Kind::PROCESS_INPUT == part.kind;
+  string source = (input ? "<(" : ">(") + part.text + ")";
+  int ends[2];
+  if(-1 == pipe2(ends, O_CLOEXEC)) {
+    shell->eout(source + ": could not create a pipe: "
+                + string(strerror(errno)));
+    expansion_failed = true;
+    return "";
+  }
+  // The command reads from (or writes to) `ours'; the list gets `theirs' as
+  // standard output (or input).
+  int ours = input ? ends[0] : ends[1];
+  int theirs = input ? ends[1] : ends[0];
+
+  // Don't let the child inherit (and print) buffered output.
+  cout.flush();
+  cerr.flush();
+  pid_t pid = fork();
+  if(-1 == pid) {
+    ++shell->get_stats().spawn_failures;
+    shell->eout(source + ": could not start: " + string(strerror(errno)));
+    close(ours);
+    close(theirs);
+    expansion_failed = true;
+    return "";
+  }
+
+  if(0 == pid) {
+    // Only the command may hold the other ends, or readers would never see
+    // the end of their input.
+    for(const ProcessSubstitution& substitution : substitutions) {
+      close(substitution.fd);
+    }
+    substitutions.clear();
+    // Nor are the other jobs' output and the shell's tasks its business.
+    shell->get_jobs().get_output().release();
+    shell->get_event_loop().release();
+    close(ours);
+    dup2(theirs, input ? STDOUT_FILENO : STDIN_FILENO);
+    close(theirs);
+
+    VirtualMachine& vm = shell->get_virtual_machine();
+    const Program& list = *part.program;
+    // A single command is run through `DiskCommand::exec()', in this very
+    // process.
+    vm.exec_in_place = 2 == list.code.size() && OpCode::RUN == list.code[0].op;
+    int status = vm.execute(list);
+    cout.flush();
+    cerr.flush();
+    _exit(status);
+  }
+
+  close(theirs);
+  // Unlike the shell's other descriptors, this one is for the command
+  // (and its children) to open.
+  fcntl(ours, F_SETFD, 0);
+  substitutions.push_back(ProcessSubstitution { pid, ours });
+  return "/dev/fd/" + to_string(ours);
+}
+
+void VirtualMachine::finish_process_substitutions(size_t count) {
+  JobTable& jobs = shell->get_jobs();
+  while(substitutions.size() > count) {
+    const ProcessSubstitution& substitution = substitutions.back();
+    close(substitution.fd);
+    jobs.adopt(substitution.pid);
+    substitutions.pop_back();
+  }
+}
+
+int VirtualMachine::run_simple_command(const SimpleCommandCode& command) {
+  vector<string> argv;
+  argv.reserve(command.words.size());
+  expansion_failed = false;
+  for(const Word& word : command.words) {
+    expand_word(word, &argv);
+  }
+
+  // Plain assignments take effect one after the other (`a=1 b=$a').
+  if(argv.empty()) {
+    for(const auto& assignment : command.assignments) {
+      string value = expand_word(assignment.second);
+      if(expansion_failed) {
+        return 1;
+      }
+      shell->set_variable(assignment.first, value);
+    }
+    return expansion_failed ? 1 : 0;
+  }
+
+  vector<string> values;
+  for(const auto& assignment : command.assignments) {
+    values.push_back(expand_word(assignment.second));
+  }
+
+  if(expansion_failed) {
+    return 1;
+  }
+
+  if(command.assignments.empty()) {
+    return run_resolved_command(command, argv);
+  }
+
+  // `NAME=value cmd': the assignments are exported for `cmd' only.
+  struct SavedVariable {
+    string name;
+    bool was_set;
+    string value;
+    bool was_exported;
+  };
+  vector<SavedVariable> saved;
+  for(size_t i = 0; i < values.size(); ++i) {
+    const string& name = command.assignments[i].first;
+    saved.push_back(SavedVariable { name, shell->is_variable_set(name),
+                                    shell->get_variable(name),
+                                    shell->is_exported(name) });
+    shell->set_variable(name, values[i]);
+    shell->export_variable(name);
+  }
+
+  int status = run_resolved_command(command, argv);
+
+  for(auto it = saved.rbegin(); it != saved.rend(); ++it) {
+    if(it->was_set) {
+      shell->set_variable(it->name, it->value);
+    }
+    else {
+      shell->unset_variable(it->name);
+    }
+    if(it->was_exported) {
+      shell->export_variable(it->name);
+    }
+    else {
+      shell->unexport_variable(it->name);
+    }
+  }
+  return status;
+}
+
+int VirtualMachine::run_resolved_command(const SimpleCommandCode& command,
+                                         vector<string>& argv) {
+  int saved_input = -1;
+  if(!command.redirections.empty() && !redirect_input(command, &saved_input)) {
+    return 1;
+  }
+
+  Stats& stats = shell->get_stats();
+  ++stats.commands;
+  uint64_t start = util::monotonic_ns();
+  int status = dispatch_command(command, argv);
+  stats.command_time.record(util::monotonic_ns() - start);
+
+  if(-1 != saved_input) {
+    dup2(saved_input, STDIN_FILENO);
+    close(saved_input);
+  }
+  return status;
+}
+
+bool VirtualMachine::redirect_input(const SimpleCommandCode& command,
+                                    int *saved_input) {
+  for(const Redirection& redirection : command.redirections) {
+    string data = expand_word(redirection.word);
+    if(expansion_failed) {
+      break;
+    }
+    if(Redirection::Kind::HERE_STRING == redirection.kind) {
+      data += "\n";
+    }
+
+    int fd = open_input(&shell->get_event_loop(), data);
+    if(-1 == fd) {
+      shell->eout("Could not set up here-document: "
+                  + string(strerror(errno)));
+      expansion_failed = true;
+      break;
+    }
+    if(-1 == *saved_input) {
+      // Children inherit standard input, but not the saved copy.
+      *saved_input = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+    }
+    dup2(fd, STDIN_FILENO);
+    close(fd);
+  }
+
+  if(expansion_failed && -1 != *saved_input) {
+    dup2(*saved_input, STDIN_FILENO);
+    close(*saved_input);
+    *saved_input = -1;
+  }
+  return !expansion_failed;
+}
+
+int VirtualMachine::run_background(shared_ptr<const Program> job,
+                                   const string& command) {
+  // Jobs deferred earlier go first.
+  if(shell->has_deferred_jobs()) {
+    shell->start_deferred_jobs();
+  }
+  AdmissionControl& admission = shell->get_admission_control();
+  string reason;
+  if(shell->has_deferred_jobs()) {
+    reason = "behind earlier deferred jobs";
+  }
+  if(reason.empty() && admission.admit(&reason) && !shell->take_job_slot()) {
+    reason = "waiting for a jobserver slot";
+  }
+  if(!reason.empty()) {
+    shell->defer_background_job(job, command, reason);
+    return 0;
+  }
+
+  int output;
+  pid_t pid = start_background(*job, &output);
+  if(-1 == pid) {
+    shell->get_jobserver().release();
+    return 1;
+  }
+  int id = shell->add_background_job(pid, command, output);
+  shell->hold_job_slot(pid);
+  admission.record(command, AdmissionControl::Decision::Outcome::ADMITTED,
+                   "");
+  shell->info("Started job [" + to_string(id) + "] " + to_string(pid) + ".");
+  return 0;
+}
+
+pid_t VirtualMachine::start_background(const Program& job, int *output) {
+  *output = -1;
+  int ends[2] = { -1, -1 };
+  if("capture" == shell->get_variable("USH_JOB_OUTPUT")
+     && -1 == pipe2(ends, O_CLOEXEC)) {
+    shell->eout("Could not capture job output (writing to the terminal "
+                "instead): " + string(strerror(errno)));
+  }
+
+  // Picked here rather than by the commands the child runs, so that
+  // round-robin spreading advances from one job to the next.
+  SpawnPolicy policy = shell->get_spawn_policy().next();
+
+  // Don't let the child inherit (and print) buffered output.
+  cout.flush();
+  cerr.flush();
+  pid_t pid = fork();
+  if(-1 == pid) {
+    ++shell->get_stats().spawn_failures;
+    shell->eout("Could not start background job: " + string(strerror(errno)));
+    if(-1 != ends[0]) {
+      close(ends[0]);
+      close(ends[1]);
+    }
+    return -1;
+  }
+
+  if(0 == pid) {
+    // A process group of its own keeps it out of the way of C-c and C-z
+    // meant for the foreground.
+    setpgid(0, 0);
+    // The substitutions of the command starting it aren't the job's, and
+    // neither is the other jobs' output.
+    for(const ProcessSubstitution& substitution : substitutions) {
+      close(substitution.fd);
+    }
+    substitutions.clear();
+    shell->get_jobs().get_output().release();
+    shell->get_event_loop().release();
+    shell->get_spawn_policy() = policy;
+    if(-1 != ends[0]) {
+      dup2(ends[1], STDOUT_FILENO);
+      dup2(ends[1], STDERR_FILENO);
+      close(ends[0]);
+      close(ends[1]);
+    }
+    exec_in_place = 2 == job.code.size() && OpCode::RUN == job.code[0].op;
+    int status = execute(job);
+    cout.flush();
+    cerr.flush();
+    // Whatever the job started in the background is on its own now.
+    shell->get_jobserver().release_all();
+    _exit(status);
+  }
+
+  // Also done here, so that the group exists by the time anyone (e.g.
+  // `jobs -l') looks for it.
+  setpgid(pid, pid);
+  if(-1 != ends[0]) {
+    close(ends[1]);
+    *output = ends[0];
+  }
+  return pid;
+}
+
+int VirtualMachine::run_builtin(BuiltinCommand& builtin) {
+  Stats& stats = shell->get_stats();
+  ++stats.builtins;
+  uint64_t start = util::monotonic_ns();
+  int status = builtin.invoke(shell);
+  stats.builtin_time.record(util::monotonic_ns() - start);
+  return status;
+}
+
+int VirtualMachine::dispatch_command(const SimpleCommandCode& command,
+                                     vector<string>& argv) {
+  if(is_function(argv[0])) {
+    ++shell->get_stats().functions;
+    return call_function(argv);
+  }
+
+  if(command.words[0].is_constant) {
+    uint64_t generation = shell->get_resolution_generation();
+    if(command.resolved_generation != generation) {
+      command.builtin = BuiltinRegistry::instance()->get_factory(argv[0]);
+      command.binary_path.clear();
+      if(!command.builtin && !util::is_directory_at(
+             shell->get_working_directory_fd(), argv[0])) {
+        shell->resolve_binary_name(argv[0], &command.binary_path);
+      }
+      command.resolved_generation = generation;
+    }
+
+    if(command.builtin) {
+      return run_builtin(*command.builtin->build(argv));
+    }
+    if(!command.binary_path.empty()) {
+      argv[0] = command.binary_path;
+      DiskCommand disk_command(argv);
+      if(exec_in_place) {
+        disk_command.exec(shell);
+      }
+      return disk_command.invoke(shell);
+    }
+  }
+
+  shared_ptr<Command> built;
+  string error;
+  if(!shell->build_command(argv, built, &error)) {
+    shell->eout(error);
+    return STATUS_NOT_FOUND;
+  }
+
+  BuiltinCommand *builtin = dynamic_cast<BuiltinCommand*>(built.get());
+  if(nullptr != builtin) {
+    return run_builtin(*builtin);
+  }
+  DiskCommand *disk_command = dynamic_cast<DiskCommand*>(built.get());
+  if(nullptr != disk_command && exec_in_place) {
+    disk_command->exec(shell);
+  }
+  return built->invoke(shell);
+}
+
+int CompiledCommand::invoke(Shell *shell) {
+  return shell->get_virtual_machine().execute(*program);
+}
+
+}  // namespace core
+}  // namespace microshell
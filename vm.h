@@ -0,0 +1,113 @@
+#ifndef MICROSHELL_CORE_VM_H
+#define MICROSHELL_CORE_VM_H
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "bytecode.h"
+#include "command.h"
+
+namespace microshell {
+namespace core {
+
+class Shell;
+
+// Runs compiled `Program's.  Words are expanded straight from their
+// pre-lexed form, constant words are never re-expanded, and builtins are
+// dispatched in-process through a per-command cache.
+class VirtualMachine {
+public:
+  VirtualMachine(Shell *shell);
+
+  // Runs `program' to completion (or until the shell is asked to exit) and
+  // returns the final exit status.
+  int execute(const Program& program);
+
+  bool is_function(const string& name) const;
+
+  // Calls the shell function `argv[0]' with the rest of `argv' as its
+  // positional parameters, and returns its exit status.
+  int call_function(const vector<string>& argv);
+
+  // Expands `word' and appends the resulting field(s) to `fields': one per
+  // positional parameter for `"$@"', and exactly one otherwise.  Unquoted
+  // expansions aren't split on `IFS', so e.g. `$x' is always one argument.
+  void expand_word(const Word& word, vector<string> *fields) const;
+
+  // Forks off `job' in a process group of its own, and returns its pid (or
+  // -1, having said why).  With `USH_JOB_OUTPUT=capture', the job writes
+  // its output to a pipe, whose read end is returned in `output' (-1
+  // otherwise).
+  pid_t start_background(const Program& job, int *output);
+
+  // Expands `word' into a single string.
+  //
+  // Expansions which fail (e.g. arithmetic errors) print a message and set
+  // `expansion_failed', so that the command using them isn't run.
+  string expand_word(const Word& word) const;
+
+private:
+  struct ForLoop {
+    vector<string> values;
+    size_t next;
+  };
+
+  // A running process substitution: its process, and the shell's end of
+  // the pipe to it, which the command it was expanded for inherits.
+  struct ProcessSubstitution {
+    pid_t pid;
+    int fd;
+  };
+
+  int run_simple_command(const SimpleCommandCode& command);
+  // Runs `argv' as a function, builtin or binary, in that order, and
+  // accounts for it in the shell's stats.
+  int run_resolved_command(const SimpleCommandCode& command,
+                           vector<string>& argv);
+  int dispatch_command(const SimpleCommandCode& command,
+                       vector<string>& argv);
+  // Points standard input at the command's here-documents or -strings (the
+  // last one wins).  The original is saved in `saved_input', for restoring
+  // it afterwards.
+  bool redirect_input(const SimpleCommandCode& command, int *saved_input);
+  int run_builtin(BuiltinCommand& builtin);
+  // Starts `job' as a background job, or defers it if admission control
+  // says the host is too busy.  Returns 0 once it is started or deferred.
+  int run_background(shared_ptr<const Program> job, const string& command);
+  // Starts the list of a PROCESS_INPUT or PROCESS_OUTPUT part, and returns
+  // the `/dev/fd' path of the shell's end of the pipe to it.
+  string start_process_substitution(const WordPart& part) const;
+  // Closes the pipes of the substitutions started since there were
+  // `count', and leaves their processes to the job table to reap.
+  void finish_process_substitutions(size_t count);
+
+  Shell *shell;
+  map<string, shared_ptr<const Program>> functions;
+  mutable bool expansion_failed;
+  // Innermost last.
+  mutable vector<ProcessSubstitution> substitutions;
+  // Set in background jobs consisting of a single command: there is no
+  // need to fork again to run it.
+  bool exec_in_place;
+  // Used to stop runaway recursion before it smashes the stack.
+  int call_depth;
+};
+
+// A command which runs compiled shell code on the shell's virtual machine.
+class CompiledCommand : public Command {
+public:
+  CompiledCommand(shared_ptr<const Program> program) : program(program) { }
+  int invoke(Shell *shell) override;
+
+private:
+  shared_ptr<const Program> program;
+};
+
+}  // namespace core
+}  // namespace microshell
+
+#endif  // MICROSHELL_CORE_VM_H